@@ -0,0 +1,701 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Data-plane benchmark of the VPN stream channel. The channel runs as is on top of the mock stream
+ * (dap_stream_ch_vpn_bench_mock.c) and the loopback tun backend, no root and no network needed.
+ *
+ * vpn_send   - client's VPN_SEND packets through ch_sf_packet_in() till they come out of the tun
+ * vpn_recv   - packets written into the tun till ch_sf_packet_out() hands them to the stream
+ * proxy_send - client's SEND packets through the CONNECTed proxy socket till the local sink gets them
+ *
+ * Results go as JSON, one object per path, packet size and clients count.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn.h"
+#include "dap_stream_ch_vpn_bench_mock.h"
+
+#define LOG_TAG "stream_ch_vpn_bench"
+
+#define BENCH_VPN_ADDR       "10.99.0.0"
+#define BENCH_VPN_MASK       "255.255.0.0"
+#define BENCH_REMOTE_ADDR    "198.18.0.1" // Benchmarking range, outside of the VPN network
+
+#define BENCH_CLIENTS_MAX    256
+#define BENCH_SINK_CONNS     1024
+#define BENCH_PKT_MIN        ( 20 + 8 + 8 ) // IPv4, UDP and the timestamp
+#define BENCH_PKT_MAX        65535
+#define BENCH_TS_OFFSET      28
+#define BENCH_IDLE_NS        1000000000ull  // Nothing more comes after that long, the rest is lost
+
+#define BENCH_PACKETS        100000
+#define BENCH_SIZES          "64,512,1400"
+#define BENCH_CLIENTS        "1,8,64"
+
+typedef struct bench_result {
+
+  const char *path;
+  uint32_t size;
+  uint32_t clients;
+
+  uint64_t packets;
+  uint64_t delivered;
+  double seconds;
+  double p50_us, p99_us;
+  double allocs_per_pkt; // -1 if not counted
+
+} bench_result_t;
+
+// Channel's threads run while it's set, the host application keeps it up
+extern bool bQuitSignal;
+
+static bench_client_t *s_clients[ BENCH_CLIENTS_MAX ];
+static uint32_t s_clients_count = 0;
+
+static uint64_t s_rate = 0;     // Offered load, packets per second, 0 is as fast as possible
+
+static int s_peer_fd = -1;
+static uint32_t s_remote_addr;
+
+static uint64_t *s_lat = NULL;   // Latency samples of the run, ns
+static size_t s_lat_cap = 0;
+static atomic_size_t s_lat_count;
+
+static atomic_uint_fast64_t s_delivered;
+static atomic_uint_fast64_t s_last_ns;   // When the last packet was delivered
+static atomic_bool s_sending_done;
+
+static atomic_uint_fast64_t s_allocs;
+static bool s_allocs_counted = false;
+
+static int s_sink_listen = -1;
+static uint16_t s_sink_port = 0;
+static atomic_uint_fast64_t s_sink_bytes;
+
+#ifdef DAP_STREAM_CH_VPN_BENCH_ALLOCS
+
+// Linked with -Wl,--wrap, every allocation of the channel and the libraries is counted
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t nmemb, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+
+void *__wrap_malloc( size_t size )
+{
+  atomic_fetch_add_explicit( &s_allocs, 1, memory_order_relaxed );
+  return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t nmemb, size_t size )
+{
+  atomic_fetch_add_explicit( &s_allocs, 1, memory_order_relaxed );
+  return __real_calloc( nmemb, size );
+}
+
+void *__wrap_realloc( void *ptr, size_t size )
+{
+  atomic_fetch_add_explicit( &s_allocs, 1, memory_order_relaxed );
+  return __real_realloc( ptr, size );
+}
+
+#endif
+
+// Hold the sender to the offered load
+static inline uint64_t bench_pace( uint64_t t0, uint64_t i )
+{
+  uint64_t now = bench_now( );
+
+  if ( s_rate ) {
+    uint64_t at = t0 + i * 1000000000ull / s_rate;
+
+    while ( now < at ) {
+      sched_yield( );
+      now = bench_now( );
+    }
+  }
+
+  return now;
+}
+
+static inline void bench_delivered( uint64_t ts )
+{
+  uint64_t now = bench_now( );
+  size_t i = atomic_fetch_add_explicit( &s_lat_count, 1, memory_order_relaxed );
+
+  if ( i < s_lat_cap )
+    s_lat[i] = now - ts;
+
+  atomic_fetch_add_explicit( &s_delivered, 1, memory_order_relaxed );
+  atomic_store_explicit( &s_last_ns, now, memory_order_relaxed );
+}
+
+static uint16_t bench_csum( const uint8_t *data, size_t len )
+{
+  uint32_t sum = 0;
+
+  for ( size_t i = 0; i + 1 < len; i += 2 )
+    sum += (uint32_t)( (data[i] << 8) | data[i + 1] );
+
+  while ( sum >> 16 )
+    sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+  return (uint16_t)~sum;
+}
+
+/**
+ * @brief bench_ip_build IPv4/UDP packet with the room for the timestamp
+ * @param pkt
+ * @param size
+ * @param saddr Network byte order
+ * @param daddr
+ */
+static void bench_ip_build( uint8_t *pkt, uint32_t size, uint32_t saddr, uint32_t daddr )
+{
+  uint16_t udp_len = (uint16_t)( size - 20 );
+
+  memset( pkt, 0, size );
+
+  pkt[0] = 0x45;
+  pkt[2] = (uint8_t)( size >> 8 );
+  pkt[3] = (uint8_t)size;
+  pkt[8] = 64;
+  pkt[9] = 17;
+  memcpy( pkt + 12, &saddr, 4 );
+  memcpy( pkt + 16, &daddr, 4 );
+
+  uint16_t csum = bench_csum( pkt, 20 );
+  pkt[10] = (uint8_t)( csum >> 8 );
+  pkt[11] = (uint8_t)csum;
+
+  pkt[20] = 0x9c; // 40000
+  pkt[21] = 0x40;
+  pkt[23] = 9;    // discard
+  pkt[24] = (uint8_t)( udp_len >> 8 );
+  pkt[25] = (uint8_t)udp_len;
+}
+
+static void bench_on_write( bench_client_t *client, uint8_t type, const uint8_t *data, size_t data_size )
+{
+  const bench_vpn_hdr_t *hdr = (const bench_vpn_hdr_t *)data;
+  uint64_t ts;
+
+  (void)type;
+
+  if ( data_size < sizeof(bench_vpn_hdr_t) )
+    return;
+
+  switch ( hdr->op_code ) {
+    case BENCH_OP_VPN_RECV:
+      if ( data_size >= sizeof(bench_vpn_hdr_t) + BENCH_PKT_MIN ) {
+        memcpy( &ts, data + sizeof(bench_vpn_hdr_t) + BENCH_TS_OFFSET, sizeof(ts) );
+        bench_delivered( ts );
+      }
+    break;
+    case BENCH_OP_CONNECTED:
+      atomic_store( &client->proxy_handle, hdr->sock_id );
+    break;
+    default:
+    break;
+  }
+}
+
+static void bench_run_begin( uint64_t packets )
+{
+  atomic_store( &s_lat_count, 0 );
+  atomic_store( &s_delivered, 0 );
+  atomic_store( &s_last_ns, bench_now() );
+  atomic_store( &s_sending_done, false );
+
+  if ( packets > s_lat_cap ) {
+    free( s_lat );
+    s_lat = malloc( packets * sizeof(uint64_t) );
+    s_lat_cap = s_lat ? packets : 0;
+  }
+
+  atomic_store( &s_allocs, 0 );
+}
+
+static bool bench_idle( uint64_t packets )
+{
+  return atomic_load(&s_delivered) >= packets ||
+         ( atomic_load(&s_sending_done) && bench_now() - atomic_load(&s_last_ns) > BENCH_IDLE_NS );
+}
+
+static int bench_u64_cmp( const void *a, const void *b )
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return ( x > y ) - ( x < y );
+}
+
+static void bench_run_end( bench_result_t *res, uint64_t t0, uint64_t t1 )
+{
+  size_t n = atomic_load( &s_lat_count );
+
+  if ( n > s_lat_cap )
+    n = s_lat_cap;
+
+  res->delivered = atomic_load( &s_delivered );
+  res->seconds = (double)( t1 > t0 ? t1 - t0 : 1 ) / 1e9;
+  res->allocs_per_pkt = ( s_allocs_counted && res->packets ) ? (double)atomic_load( &s_allocs ) / (double)res->packets : -1.0;
+  res->p50_us = res->p99_us = 0;
+
+  if ( n ) {
+    qsort( s_lat, n, sizeof(uint64_t), bench_u64_cmp );
+    res->p50_us = (double)s_lat[ n / 2 ] / 1e3;
+    res->p99_us = (double)s_lat[ (n * 99) / 100 < n ? (n * 99) / 100 : n - 1 ] / 1e3;
+  }
+}
+
+/**
+ * @brief bench_tun_reader Network side of vpn_send: takes the packets out of the tun
+ * @param arg Packets to wait for
+ * @return
+ */
+static void *bench_tun_reader( void *arg )
+{
+  uint64_t packets = *(uint64_t *)arg;
+  uint8_t *buf = malloc( BENCH_PKT_MAX );
+  struct pollfd pfd = { .fd = s_peer_fd, .events = POLLIN };
+
+  while ( buf && !bench_idle(packets) ) {
+
+    if ( poll(&pfd, 1, 100) <= 0 )
+      continue;
+
+    ssize_t ret;
+    uint64_t ts;
+
+    while ( (ret = recv(s_peer_fd, buf, BENCH_PKT_MAX, MSG_DONTWAIT)) > 0 ) {
+      if ( ret >= BENCH_PKT_MIN ) {
+        memcpy( &ts, buf + BENCH_TS_OFFSET, sizeof(ts) );
+        bench_delivered( ts );
+      }
+    }
+  }
+
+  free( buf );
+  return NULL;
+}
+
+static void bench_vpn_send( bench_result_t *res )
+{
+  dap_stream_ch_pkt_t *pkts[ BENCH_CLIENTS_MAX ];
+  pthread_t reader;
+  uint64_t t0, ts;
+
+  for ( uint32_t c = 0; c < res->clients; c ++ ) {
+    pkts[c] = bench_ch_pkt_new( BENCH_OP_VPN_SEND, 0, res->size );
+    bench_ip_build( pkts[c]->data + sizeof(bench_vpn_hdr_t), res->size,
+                    s_clients[c]->session.tun_client_addr.s_addr, s_remote_addr );
+  }
+
+  bench_run_begin( res->packets );
+  pthread_create( &reader, NULL, bench_tun_reader, &res->packets );
+
+  t0 = bench_now( );
+
+  for ( uint64_t i = 0; i < res->packets; i ++ ) {
+    uint32_t c = (uint32_t)( i % res->clients );
+
+    ts = bench_pace( t0, i );
+    memcpy( pkts[c]->data + sizeof(bench_vpn_hdr_t) + BENCH_TS_OFFSET, &ts, sizeof(ts) );
+    bench_mock_proc()->packet_in_callback( &s_clients[c]->ch, pkts[c] );
+  }
+
+  atomic_store( &s_sending_done, true );
+  pthread_join( reader, NULL );
+
+  bench_run_end( res, t0, atomic_load(&s_last_ns) );
+
+  for ( uint32_t c = 0; c < res->clients; c ++ )
+    free( pkts[c] );
+}
+
+/**
+ * @brief bench_tun_writer Network side of vpn_recv: puts the packets for the clients into the tun
+ * @param arg
+ * @return
+ */
+static void *bench_tun_writer( void *arg )
+{
+  bench_result_t *res = (bench_result_t *)arg;
+  uint8_t *pkts = malloc( (size_t)res->clients * res->size );
+  uint64_t t0 = bench_now( ), ts;
+
+  if ( pkts ) {
+    for ( uint32_t c = 0; c < res->clients; c ++ )
+      bench_ip_build( pkts + (size_t)c * res->size, res->size, s_remote_addr, s_clients[c]->session.tun_client_addr.s_addr );
+
+    // Blocking peer end, the channel's raw thread sets the pace
+    for ( uint64_t i = 0; i < res->packets; i ++ ) {
+      uint8_t *pkt = pkts + (size_t)( i % res->clients ) * res->size;
+
+      ts = bench_pace( t0, i );
+      memcpy( pkt + BENCH_TS_OFFSET, &ts, sizeof(ts) );
+
+      if ( send(s_peer_fd, pkt, res->size, MSG_NOSIGNAL) < 0 && errno != EINTR )
+        break;
+    }
+  }
+
+  free( pkts );
+  atomic_store( &s_sending_done, true );
+
+  return NULL;
+}
+
+static void bench_vpn_recv( bench_result_t *res )
+{
+  pthread_t writer;
+  uint64_t t0;
+
+  bench_run_begin( res->packets );
+
+  t0 = bench_now( );
+  pthread_create( &writer, NULL, bench_tun_writer, res );
+
+  // Stream worker: packet_out for every channel that asked for it
+  while ( !bench_idle(res->packets) ) {
+
+    bool any = false;
+
+    for ( uint32_t c = 0; c < res->clients; c ++ ) {
+      if ( atomic_load_explicit(&s_clients[c]->ready, memory_order_acquire) ) {
+        bench_mock_proc()->packet_out_callback( &s_clients[c]->ch, NULL );
+        any = true;
+      }
+    }
+
+    if ( !any )
+      sched_yield( );
+  }
+
+  pthread_join( writer, NULL );
+
+  bench_run_end( res, t0, atomic_load(&s_last_ns) );
+}
+
+/**
+ * @brief bench_sink_thread Remote host of the proxied sockets, counts what comes
+ * @param arg
+ * @return
+ */
+static void *bench_sink_thread( void *arg )
+{
+  static struct pollfd pfds[ BENCH_SINK_CONNS ];
+  uint32_t count = 1;
+  uint8_t *buf = malloc( BENCH_PKT_MAX );
+
+  (void)arg;
+
+  pfds[0].fd = s_sink_listen;
+  pfds[0].events = POLLIN;
+
+  while ( buf ) {
+
+    if ( poll(pfds, count, -1) <= 0 )
+      continue;
+
+    for ( uint32_t i = 1; i < count; i ++ ) {
+
+      if ( !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) )
+        continue;
+
+      ssize_t ret = recv( pfds[i].fd, buf, BENCH_PKT_MAX, MSG_DONTWAIT );
+
+      if ( ret > 0 ) {
+        atomic_fetch_add_explicit( &s_sink_bytes, (uint64_t)ret, memory_order_relaxed );
+        atomic_store_explicit( &s_last_ns, bench_now(), memory_order_relaxed );
+      }
+      else if ( !ret || (errno != EAGAIN && errno != EINTR) ) {
+        close( pfds[i].fd );
+        pfds[i --] = pfds[-- count];
+      }
+    }
+
+    if ( (pfds[0].revents & POLLIN) && count < BENCH_SINK_CONNS ) {
+      int s = accept( s_sink_listen, NULL, NULL );
+      if ( s >= 0 ) {
+        pfds[count].fd = s;
+        pfds[count].events = POLLIN;
+        pfds[count ++].revents = 0;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int bench_sink_start( void )
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t addr_len = sizeof(addr);
+  pthread_t sink;
+
+  if ( (s_sink_listen = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+       bind(s_sink_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(s_sink_listen, BENCH_CLIENTS_MAX) < 0 ||
+       getsockname(s_sink_listen, (struct sockaddr *)&addr, &addr_len) < 0 ) {
+    log_it( L_ERROR, "Can't start the proxy sink: '%s'", strerror(errno) );
+    return -1;
+  }
+
+  s_sink_port = ntohs( addr.sin_port );
+
+  pthread_create( &sink, NULL, bench_sink_thread, NULL );
+  pthread_detach( sink );
+
+  return 0;
+}
+
+/**
+ * @brief bench_proxy_connect CONNECT the clients to the sink. Every run has its own sockets, the channel
+ *        closes the one that failed to send
+ * @param clients
+ * @return 0 if ok
+ */
+static int bench_proxy_connect( uint32_t clients )
+{
+  const char *host = "127.0.0.1";
+
+  for ( uint32_t c = 0; c < clients; c ++ ) {
+
+    dap_stream_ch_pkt_t *pkt = bench_ch_pkt_new( BENCH_OP_CONNECT, 1, (uint32_t)strlen(host) );
+    bench_vpn_hdr_t *hdr = (bench_vpn_hdr_t *)pkt->data;
+
+    hdr->op_connect.addr_size = (uint32_t)strlen( host );
+    hdr->op_connect.port = s_sink_port;
+    memcpy( pkt->data + sizeof(bench_vpn_hdr_t), host, strlen(host) );
+
+    atomic_store( &s_clients[c]->proxy_handle, -1 );
+    bench_mock_proc()->packet_in_callback( &s_clients[c]->ch, pkt );
+    free( pkt );
+
+    if ( atomic_load(&s_clients[c]->proxy_handle) < 0 ) {
+      log_it( L_ERROR, "Client %u can't CONNECT to the sink", c );
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void bench_proxy_disconnect( uint32_t clients )
+{
+  for ( uint32_t c = 0; c < clients; c ++ ) {
+
+    dap_stream_ch_pkt_t *pkt = bench_ch_pkt_new( BENCH_OP_DISCONNECT, atomic_load(&s_clients[c]->proxy_handle), 0 );
+
+    if ( pkt ) {
+      bench_mock_proc()->packet_in_callback( &s_clients[c]->ch, pkt );
+      free( pkt );
+    }
+  }
+}
+
+static void bench_proxy_send( bench_result_t *res )
+{
+  dap_stream_ch_pkt_t *pkts[ BENCH_CLIENTS_MAX ];
+  uint64_t bytes_expected = res->packets * res->size;
+  uint64_t bytes0, t0, ts;
+
+  if ( bench_proxy_connect(res->clients) )
+    return;
+
+  for ( uint32_t c = 0; c < res->clients; c ++ )
+    pkts[c] = bench_ch_pkt_new( BENCH_OP_SEND, atomic_load(&s_clients[c]->proxy_handle), res->size );
+
+  bench_run_begin( res->packets );
+
+  bytes0 = atomic_load( &s_sink_bytes );
+  t0 = bench_now( );
+
+  // Remote end is a byte stream, latency is what packet_in takes
+  for ( uint64_t i = 0; i < res->packets; i ++ ) {
+    ts = bench_pace( t0, i );
+    bench_mock_proc()->packet_in_callback( &s_clients[i % res->clients]->ch, pkts[i % res->clients] );
+
+    size_t n = atomic_fetch_add_explicit( &s_lat_count, 1, memory_order_relaxed );
+    if ( n < s_lat_cap )
+      s_lat[n] = bench_now() - ts;
+  }
+
+  atomic_store( &s_sending_done, true );
+
+  while ( atomic_load(&s_sink_bytes) - bytes0 < bytes_expected && bench_now() - atomic_load(&s_last_ns) <= BENCH_IDLE_NS )
+    usleep( 1000 );
+
+  bench_run_end( res, t0, atomic_load(&s_last_ns) );
+  res->delivered = ( atomic_load(&s_sink_bytes) - bytes0 ) / res->size;
+
+  bench_proxy_disconnect( res->clients );
+
+  for ( uint32_t c = 0; c < res->clients; c ++ )
+    free( pkts[c] );
+}
+
+static void bench_result_print( FILE *out, const bench_result_t *res, bool first )
+{
+  double gbps = (double)res->delivered * res->size * 8 / res->seconds / 1e9;
+
+  fprintf( out, "%s\n    {\"path\": \"%s\", \"size\": %u, \"clients\": %u, \"packets\": %llu, \"delivered\": %llu, "
+                "\"lost\": %llu, \"seconds\": %.6f, \"pps\": %.0f, \"gbps\": %.4f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                "\"allocs_per_pkt\": %.3f}",
+           first ? "" : ",", res->path, res->size, res->clients,
+           (unsigned long long)res->packets, (unsigned long long)res->delivered,
+           (unsigned long long)( res->packets > res->delivered ? res->packets - res->delivered : 0 ),
+           res->seconds, (double)res->delivered / res->seconds, gbps, res->p50_us, res->p99_us, res->allocs_per_pkt );
+  fflush( out );
+}
+
+static void bench_usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s [-n packets] [-r pps] [-s sizes] [-c clients] [-o file.json]\n"
+                   "  -n  packets per run, %u by default\n"
+                   "  -r  offered load, packets per second, as fast as possible by default\n"
+                   "  -s  IP packet sizes, \"%s\" by default\n"
+                   "  -c  clients counts, \"%s\" by default, up to %u\n"
+                   "  -o  JSON output, stdout by default\n",
+           name, BENCH_PACKETS, BENCH_SIZES, BENCH_CLIENTS, BENCH_CLIENTS_MAX );
+}
+
+int main( int argc, char **argv )
+{
+  static const struct {
+    const char *name;
+    void (*run)( bench_result_t *res );
+  } paths[] = {
+    { "vpn_send",   bench_vpn_send },
+    { "vpn_recv",   bench_vpn_recv },
+    { "proxy_send", bench_proxy_send }
+  };
+
+  uint64_t packets = BENCH_PACKETS;
+  const char *sizes_str = BENCH_SIZES, *clients_str = BENCH_CLIENTS, *out_path = NULL;
+  uint32_t sizes[ 32 ], clients[ 32 ];
+  uint32_t sizes_count, clients_count;
+  FILE *out = stdout;
+  int opt;
+
+  while ( (opt = getopt(argc, argv, "n:r:s:c:o:h")) != -1 ) {
+    switch ( opt ) {
+      case 'n': packets = strtoull( optarg, NULL, 10 ); break;
+      case 'r': s_rate = strtoull( optarg, NULL, 10 ); break;
+      case 's': sizes_str = optarg; break;
+      case 'c': clients_str = optarg; break;
+      case 'o': out_path = optarg; break;
+      default:
+        bench_usage( argv[0] );
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  sizes_count = bench_list_parse( sizes_str, sizes, 32, BENCH_PKT_MIN, 1500 );
+  clients_count = bench_list_parse( clients_str, clients, 32, 1, BENCH_CLIENTS_MAX );
+
+  if ( !packets || !sizes_count || !clients_count ) {
+    bench_usage( argv[0] );
+    return 1;
+  }
+
+  for ( uint32_t i = 0; i < clients_count; i ++ )
+    if ( clients[i] > s_clients_count )
+      s_clients_count = clients[i];
+
+  if ( out_path && !(out = fopen(out_path, "w")) ) {
+    fprintf( stderr, "Can't open %s: %s\n", out_path, strerror(errno) );
+    return 1;
+  }
+
+  #ifdef DAP_STREAM_CH_VPN_BENCH_ALLOCS
+    s_allocs_counted = true;
+  #endif
+
+  // Per packet logging would be measured instead of the channel
+  dap_log_level_set( L_ERROR );
+
+  s_remote_addr = inet_addr( BENCH_REMOTE_ADDR );
+  bench_mock_init( bench_on_write );
+
+  bQuitSignal = true;
+
+  if ( dap_stream_ch_vpn_set_tun_backend(DAP_STREAM_CH_VPN_TUN_LOOPBACK) ||
+       dap_stream_ch_vpn_init(BENCH_VPN_ADDR, BENCH_VPN_MASK) ||
+       (s_peer_fd = dap_stream_ch_vpn_get_loopback_fd()) < 0 ) {
+    fprintf( stderr, "Can't start the VPN channel on the loopback tun\n" );
+    return 1;
+  }
+
+  if ( bench_clients_lease(s_clients, s_clients_count) ) {
+    fprintf( stderr, "Can't lease the clients' addresses\n" );
+    return 1;
+  }
+
+  if ( bench_sink_start() ) {
+    fprintf( stderr, "Can't start the proxy sink\n" );
+    return 1;
+  }
+
+  fprintf( out, "{\n  \"bench\": \"dap_stream_ch_vpn\",\n  \"backend\": \"loopback\",\n  \"rate_pps\": %llu,\n  \"results\": [",
+           (unsigned long long)s_rate );
+
+  bool first = true;
+
+  for ( size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p ++ ) {
+    for ( uint32_t c = 0; c < clients_count; c ++ ) {
+      for ( uint32_t s = 0; s < sizes_count; s ++ ) {
+
+        bench_result_t res = { .path = paths[p].name, .size = sizes[s], .clients = clients[c], .packets = packets };
+
+        paths[p].run( &res );
+        bench_result_print( out, &res, first );
+        first = false;
+      }
+    }
+  }
+
+  fprintf( out, "\n  ]\n}\n" );
+
+  if ( out != stdout )
+    fclose( out );
+
+  // Channel's threads don't stop, the process ends here
+  return 0;
+}
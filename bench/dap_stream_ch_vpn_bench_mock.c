@@ -0,0 +1,237 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_proc.h"
+
+#include "dap_stream_ch_vpn_bench_mock.h"
+
+#define LOG_TAG "stream_ch_vpn_bench"
+
+// Stand-ins for the libdap stream and server calls the channel makes, dap_core is the real one
+
+static dap_stream_ch_proc_t s_proc;
+static bench_mock_write_callback_t s_write_callback = NULL;
+
+void dap_stream_ch_proc_add( uint8_t id, dap_stream_ch_callback_t new_callback, dap_stream_ch_callback_t delete_callback,
+                             dap_stream_ch_callback_t packet_in_callback, dap_stream_ch_callback_t packet_out_callback )
+{
+  memset( &s_proc, 0, sizeof(s_proc) );
+
+  s_proc.id = id;
+  s_proc.new_callback = new_callback;
+  s_proc.delete_callback = delete_callback;
+  s_proc.packet_in_callback = packet_in_callback;
+  s_proc.packet_out_callback = packet_out_callback;
+}
+
+dap_stream_ch_proc_t *dap_stream_ch_proc_find( uint8_t id )
+{
+  return s_proc.id == id ? &s_proc : NULL;
+}
+
+size_t dap_stream_ch_pkt_write( dap_stream_ch_t *ch, uint8_t type, const void *data, size_t data_size )
+{
+  bench_client_t *client = (bench_client_t *)ch->stream->conn;
+
+  if ( s_write_callback )
+    s_write_callback( client, type, (const uint8_t *)data, data_size );
+
+  return data_size;
+}
+
+size_t dap_stream_ch_pkt_write_f( dap_stream_ch_t *ch, uint8_t type, const char *str, ... )
+{
+  char buf[ 512 ];
+  va_list ap;
+
+  va_start( ap, str );
+  int len = vsnprintf( buf, sizeof(buf), str, ap );
+  va_end( ap );
+
+  if ( len < 0 )
+    return 0;
+
+  return dap_stream_ch_pkt_write( ch, type, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1 );
+}
+
+void dap_client_remote_ready_to_write( dap_client_remote_t *sc, bool is_ready )
+{
+  atomic_store( &((bench_client_t *)sc)->ready, is_ready );
+}
+
+/**
+ * @brief bench_mock_init
+ * @param callback Gets the packets the channel writes to the clients
+ */
+void bench_mock_init( bench_mock_write_callback_t callback )
+{
+  s_write_callback = callback;
+}
+
+dap_stream_ch_proc_t *bench_mock_proc( void )
+{
+  return &s_proc;
+}
+
+/**
+ * @brief bench_client_new Make the channel as the stream does for the connected client
+ * @return NULL on error
+ */
+bench_client_t *bench_client_new( void )
+{
+  bench_client_t *client = calloc( 1, sizeof(bench_client_t) );
+
+  if ( !client )
+    return NULL;
+
+  client->conn.socket = -1;
+  dap_snprintf( client->conn.hostaddr, sizeof(client->conn.hostaddr), "bench-%p", (void *)client );
+
+  client->stream.conn = &client->conn;
+  client->stream.conn_http = &client->conn_http;
+  client->stream.session = &client->session;
+
+  client->ch.stream = &client->stream;
+  client->ch.proc = &s_proc;
+  pthread_mutex_init( &client->ch.mutex, NULL );
+
+  atomic_init( &client->ready, false );
+  atomic_init( &client->proxy_handle, -1 );
+
+  s_proc.new_callback( &client->ch, NULL );
+
+  return client;
+}
+
+void bench_client_delete( bench_client_t *client )
+{
+  s_proc.delete_callback( &client->ch, NULL );
+  pthread_mutex_destroy( &client->ch.mutex );
+  free( client );
+}
+
+static void *bench_lease_thread( void *arg )
+{
+  bench_client_t *client = (bench_client_t *)arg;
+  dap_stream_ch_pkt_t *pkt = bench_ch_pkt_new( BENCH_OP_VPN_ADDR_REQUEST, 0, 0 );
+
+  if ( pkt ) {
+    s_proc.packet_in_callback( &client->ch, pkt );
+    free( pkt );
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief bench_clients_lease Make the clients and get them their VPN addresses
+ * @param clients Filled with the new clients
+ * @param count
+ * @return 0 if all of them got an address
+ */
+int bench_clients_lease( bench_client_t **clients, uint32_t count )
+{
+  pthread_t *lease = calloc( count, sizeof(pthread_t) );
+  int ret = 0;
+
+  if ( !lease )
+    return -1;
+
+  // Channel takes its time after every lease, the clients ask at once
+  for ( uint32_t c = 0; c < count; c ++ ) {
+    if ( !(clients[c] = bench_client_new()) ) {
+      count = c;
+      ret = -1;
+      break;
+    }
+    pthread_create( &lease[c], NULL, bench_lease_thread, clients[c] );
+  }
+
+  for ( uint32_t c = 0; c < count; c ++ ) {
+    pthread_join( lease[c], NULL );
+    if ( !clients[c]->session.tun_client_addr.s_addr ) {
+      log_it( L_ERROR, "Client %u got no address", c );
+      ret = -1;
+    }
+  }
+
+  free( lease );
+  return ret;
+}
+
+/**
+ * @brief bench_ch_pkt_new Channel packet as the stream gives it to packet_in
+ * @param op_code
+ * @param sock_id
+ * @param data_size Room after the VPN header
+ * @return NULL on error
+ */
+dap_stream_ch_pkt_t *bench_ch_pkt_new( uint32_t op_code, int32_t sock_id, uint32_t data_size )
+{
+  dap_stream_ch_pkt_t *pkt = calloc( 1, sizeof(dap_stream_ch_pkt_t) + sizeof(bench_vpn_hdr_t) + data_size );
+
+  if ( !pkt )
+    return NULL;
+
+  bench_vpn_hdr_t *hdr = (bench_vpn_hdr_t *)pkt->data;
+
+  pkt->hdr.size = (uint32_t)( sizeof(bench_vpn_hdr_t) + data_size );
+  hdr->sock_id = sock_id;
+  hdr->op_code = op_code;
+  hdr->op_data.data_size = data_size;
+
+  return pkt;
+}
+
+/**
+ * @brief bench_list_parse Comma separated numbers of the command line, clamped to [min, max]
+ * @param str
+ * @param list
+ * @param list_max
+ * @param min
+ * @param max
+ * @return Numbers parsed
+ */
+uint32_t bench_list_parse( const char *str, uint32_t *list, uint32_t list_max, uint32_t min, uint32_t max )
+{
+  uint32_t count = 0;
+  char *end;
+
+  while ( *str && count < list_max ) {
+
+    unsigned long v = strtoul( str, &end, 10 );
+
+    if ( end == str )
+      break;
+
+    list[count ++] = v < min ? min : ( v > max ? max : (uint32_t)v );
+    str = *end == ',' ? end + 1 : end;
+  }
+
+  return count;
+}
@@ -0,0 +1,106 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_BENCH_MOCK_H_
+#define _STREAM_SF_BENCH_MOCK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "dap_client_remote.h"
+#include "dap_http_client.h"
+#include "dap_stream.h"
+#include "dap_stream_ch.h"
+#include "dap_stream_ch_pkt.h"
+
+#include "dap_stream_ch_vpn_clock.h"
+
+// Mirrors ch_vpn_pkt_t header, the wire format of the channel
+#define BENCH_OP_CONNECTED         0xa9
+#define BENCH_OP_CONNECT           0xaa
+#define BENCH_OP_DISCONNECT        0xab
+#define BENCH_OP_SEND              0xac
+#define BENCH_OP_VPN_ADDR_REQUEST  0xb2
+#define BENCH_OP_VPN_SEND          0xbc
+#define BENCH_OP_VPN_RECV          0xbd
+
+typedef struct bench_vpn_hdr {
+
+  int32_t  sock_id;
+  uint32_t op_code;
+
+  union {
+    struct {
+      uint32_t addr_size;
+      uint16_t port;
+      uint16_t padding;
+    } op_connect;
+
+    struct {
+      uint32_t data_size;
+      uint32_t padding;
+    } op_data;
+  };
+
+} __attribute__((packed)) bench_vpn_hdr_t;
+
+/**
+  * @struct bench_client
+  * @brief Stream channel of one client with everything it hangs on, no socket behind it
+  *
+  **/
+typedef struct bench_client {
+
+  dap_client_remote_t conn; // First, dap_client_remote_ready_to_write() finds the client by it
+  dap_http_client_t conn_http;
+  dap_stream_session_t session;
+  dap_stream_t stream;
+  dap_stream_ch_t ch;
+
+  atomic_bool ready;        // Channel asked for packet_out
+  atomic_int proxy_handle;  // Handle of the proxied socket from CONNECTED, -1 if none
+
+} bench_client_t;
+
+// Called for every packet the channel writes to the client, from the thread that runs packet_out
+// or packet_in. Data is the VPN packet with its header
+typedef void (*bench_mock_write_callback_t)( bench_client_t *client, uint8_t type, const uint8_t *data, size_t data_size );
+
+void bench_mock_init( bench_mock_write_callback_t callback );
+
+dap_stream_ch_proc_t *bench_mock_proc( void );
+
+bench_client_t *bench_client_new( void );
+void bench_client_delete( bench_client_t *client );
+int bench_clients_lease( bench_client_t **clients, uint32_t count );
+
+dap_stream_ch_pkt_t *bench_ch_pkt_new( uint32_t op_code, int32_t sock_id, uint32_t data_size );
+
+uint32_t bench_list_parse( const char *str, uint32_t *list, uint32_t list_max, uint32_t min, uint32_t max );
+
+// Monotonic nanoseconds, the channel's clock
+static inline uint64_t bench_now( void )
+{
+  return vpn_clock_ns( );
+}
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmarks of the channel's hot primitives under contention of 1..N threads:
+ *
+ * ring   - client's lanes, ch_sf_raw_enqueue() producers as the raw threads against the ch_sf_packet_out() consumer
+ * calloc - per packet calloc()/free() as the raw paths do it, pool - vpn_pkt_pool_get()/put() for comparison
+ * lease  - ch_sf_addr_lease() of the fresh addresses, lease_reuse - of the released ones from the pool
+ * lookup - HASH_FIND_INT() on the instance's clients under clients_mutex as ch_sf_tun_recv() does it
+ *
+ * The channel's file is compiled in to reach its internals, no threads of its own are started.
+ * Results go as JSON with ns/op and, where perf_event_open() is allowed, cache misses per op.
+ */
+
+#include "dap_stream_ch_vpn.c"
+#include "dap_stream_ch_vpn_bench_mock.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#undef LOG_TAG
+#define LOG_TAG "stream_ch_vpn_micro"
+
+#define MICRO_VPN_ADDR       "10.96.0.0"
+#define MICRO_VPN_MASK       "255.248.0.0"
+
+#define MICRO_THREADS_MAX    64
+#define MICRO_OPS            200000
+#define MICRO_THREADS        "1,2,4,8"
+#define MICRO_CLIENTS        "10,1000,100000"
+#define MICRO_CLIENTS_MAX    500000
+#define MICRO_PKT_SIZE       1400
+#define MICRO_WINDOW         64 // Packets alive at once in the allocator runs
+
+typedef struct micro_thread {
+
+  pthread_t tid;
+  uint32_t index;
+  uint32_t threads;
+  void (*fn)( struct micro_thread *t );
+
+  uint64_t ops;
+  uint64_t failed;
+  uint64_t t0, t1;
+  int64_t misses; // -1 if not counted
+
+} micro_thread_t;
+
+typedef struct micro_result {
+
+  const char *bench;
+  uint32_t threads;
+  uint32_t clients; // 0 if doesn't apply
+
+  uint64_t ops;
+  uint64_t failed;
+  double ns_per_op;  // Thread time per op
+  double mops;       // All threads together, millions of ops per second
+  double misses_per_op; // -1 if not counted
+
+} micro_result_t;
+
+typedef void (*micro_fn_t)( micro_thread_t *t );
+
+
+static pthread_barrier_t s_barrier;
+static uint64_t s_ops = MICRO_OPS;
+
+static dap_stream_ch_vpn_inst_t *s_inst = NULL;
+static dap_stream_ch_vpn_remote_single_t *s_clients = NULL;
+static in_addr_t *s_addrs = NULL;
+static uint32_t s_clients_count = 0;  // Of the current run
+static uint32_t s_clients_max = 0;
+
+static atomic_bool s_producing;
+static dap_stream_ch_t s_ring_ch; // Channel the ring runs feed, no stream behind
+
+/**
+ * @brief micro_perf_open Cache misses counter of the calling thread, user space only
+ * @return Counter's fd, -1 if there is no perf events here or they aren't allowed
+ */
+static int micro_perf_open( void )
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset( &attr, 0, sizeof(attr) );
+
+  attr.size = sizeof( attr );
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+#else
+  return -1;
+#endif
+}
+
+static void *micro_thread( void *arg )
+{
+  micro_thread_t *t = (micro_thread_t *)arg;
+  int perf_fd = micro_perf_open( );
+
+  pthread_barrier_wait( &s_barrier );
+
+#ifdef __linux__
+  if ( perf_fd >= 0 ) {
+    ioctl( perf_fd, PERF_EVENT_IOC_RESET, 0 );
+    ioctl( perf_fd, PERF_EVENT_IOC_ENABLE, 0 );
+  }
+#endif
+
+  t->t0 = bench_now( );
+  t->fn( t );
+  t->t1 = bench_now( );
+
+  t->misses = -1;
+
+#ifdef __linux__
+  if ( perf_fd >= 0 ) {
+    uint64_t misses;
+
+    ioctl( perf_fd, PERF_EVENT_IOC_DISABLE, 0 );
+    if ( read(perf_fd, &misses, sizeof(misses)) == sizeof(misses) )
+      t->misses = (int64_t)misses;
+    close( perf_fd );
+  }
+#endif
+
+  return NULL;
+}
+
+/**
+ * @brief micro_run Run fn on the threads at once and sum them up
+ * @param res
+ * @param fn
+ */
+static void micro_run( micro_result_t *res, micro_fn_t fn )
+{
+  micro_thread_t threads[ MICRO_THREADS_MAX ];
+
+  uint64_t misses = 0, ns = 0;
+  uint64_t t0 = UINT64_MAX, t1 = 0;
+  bool counted = true;
+
+  memset( threads, 0, sizeof(threads) );
+  pthread_barrier_init( &s_barrier, NULL, res->threads + 1 );
+
+  for ( uint32_t i = 0; i < res->threads; i ++ ) {
+    threads[i].index = i;
+    threads[i].threads = res->threads;
+    threads[i].fn = fn;
+    pthread_create( &threads[i].tid, NULL, micro_thread, &threads[i] );
+  }
+
+  pthread_barrier_wait( &s_barrier );
+
+  for ( uint32_t i = 0; i < res->threads; i ++ )
+    pthread_join( threads[i].tid, NULL );
+
+  pthread_barrier_destroy( &s_barrier );
+
+  res->ops = res->failed = 0;
+
+  for ( uint32_t i = 0; i < res->threads; i ++ ) {
+    res->ops += threads[i].ops;
+    res->failed += threads[i].failed;
+    ns += threads[i].t1 - threads[i].t0;
+
+    // Wall time is from the first thread's start to the last one's end
+    if ( threads[i].t0 < t0 )
+      t0 = threads[i].t0;
+    if ( threads[i].t1 > t1 )
+      t1 = threads[i].t1;
+
+    if ( threads[i].misses < 0 )
+      counted = false;
+    else
+      misses += (uint64_t)threads[i].misses;
+  }
+
+  res->ns_per_op = res->ops ? (double)ns / (double)res->ops : 0;
+  res->mops = (double)res->ops / (double)( t1 > t0 ? t1 - t0 : 1 ) * 1e3;
+  res->misses_per_op = ( counted && res->ops ) ? (double)misses / (double)res->ops : -1.0;
+}
+
+/**
+ * @brief micro_setup Instance addressed as dap_stream_ch_vpn_inst_start() does it, without the tun and the threads
+ */
+static void micro_setup( void )
+{
+  s_inst = dap_stream_ch_vpn_inst_new( 's' );
+
+  inet_aton( MICRO_VPN_ADDR, &s_inst->client_addr );
+  inet_aton( MICRO_VPN_MASK, &s_inst->client_addr_mask );
+
+  ch_sf_shards_plan( s_inst );
+
+  // Channel's state as ch_sf_client_new() makes it
+  dap_stream_ch_vpn_t *sf = calloc( 1, sizeof(dap_stream_ch_vpn_t) );
+
+  s_ring_ch.internal = sf;
+  sf->ch = &s_ring_ch;
+  sf->inst = s_inst;
+  pthread_mutex_init( &sf->mutex, NULL );
+  sf->raw_src.type = VPN_OUT_SOURCE_RAW;
+}
+
+// Empty clients table and addresses pool
+static void micro_clients_reset( void )
+{
+  dap_stream_ch_vpn_remote_single_t *cur, *tmp;
+  list_addr_element *el;
+
+  HASH_ITER( hh, s_inst->clients, cur, tmp )
+    HASH_DEL( s_inst->clients, cur );
+
+  for ( uint32_t i = 0; i < s_inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *shard = &s_inst->shards[i];
+
+    while ( (el = shard->list_addr_head) != NULL ) {
+      LL_DELETE( shard->list_addr_head, el );
+      free( el );
+    }
+
+    shard->addr_released = 0;
+    shard->leases = 0;
+    shard->addr_last.s_addr = shard->addr_host.s_addr;
+  }
+
+  memset( s_clients, 0, (size_t)s_clients_max * sizeof(*s_clients) );
+}
+
+// What ch_sf_delete() does with the client's address
+static void micro_addr_release( dap_stream_ch_vpn_remote_single_t *client )
+{
+  pthread_mutex_lock( &s_inst->clients_mutex );
+  ch_sf_addr_release( s_inst, client->addr );
+  HASH_DEL( s_inst->clients, client );
+  pthread_mutex_unlock( &s_inst->clients_mutex );
+}
+
+static void micro_ring_producer( micro_thread_t *t )
+{
+  for ( uint64_t i = 0; i < s_ops; i ++ ) {
+    ch_vpn_pkt_t *pkt = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt->header) + 64 );
+
+    pkt->header.op_code = VPN_PACKET_OP_CODE_VPN_RECV;
+    pkt->header.op_data.data_size = 64;
+    pkt->data[0] = 0x45;
+
+    if ( ch_sf_raw_enqueue(&s_ring_ch, pkt) < 0 ) {
+      free( pkt );
+      t->failed ++;
+    }
+    t->ops ++;
+  }
+}
+
+/**
+ * @brief micro_ring_consumer The stream worker's side: takes the raw source off the ready list and drains the lanes
+ *        as ch_sf_packet_out() does it
+ * @param arg
+ * @return Packets read
+ */
+static void *micro_ring_consumer( void *arg )
+{
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( &s_ring_ch );
+  uint64_t *read_count = (uint64_t *)arg;
+
+  for ( ;; ) {
+
+    bool producing = atomic_load( &s_producing );
+    uint64_t got = 0;
+    ch_vpn_pkt_t *pkt;
+
+    if ( stream_sf_ready_pop(sf) ) {
+      atomic_store( &sf->raw_scheduled, false );
+      atomic_thread_fence( memory_order_seq_cst );
+    }
+
+    for ( int lane = 0; lane < VPN_LANES; lane ++ ) {
+      while ( (pkt = vpn_pkt_spsc_pop(&sf->raw_lanes[lane].q)) != NULL ) {
+        free( pkt );
+        got ++;
+      }
+    }
+
+    *read_count += got;
+
+    if ( !got ) {
+      if ( !producing )
+        break;
+      sched_yield( );
+    }
+  }
+
+  return NULL;
+}
+
+static void micro_ring( micro_result_t *res )
+{
+  pthread_t consumer;
+  uint64_t read_count = 0;
+
+  atomic_store( &s_producing, true );
+  pthread_create( &consumer, NULL, micro_ring_consumer, &read_count );
+
+  micro_run( res, micro_ring_producer );
+
+  atomic_store( &s_producing, false );
+  pthread_join( consumer, NULL );
+}
+
+static void micro_calloc_fn( micro_thread_t *t )
+{
+  ch_vpn_pkt_t *window[ MICRO_WINDOW ] = { NULL };
+
+  for ( uint64_t i = 0; i < s_ops; i ++ ) {
+
+    ch_vpn_pkt_t **slot = &window[ i % MICRO_WINDOW ];
+
+    free( *slot );
+
+    if ( (*slot = calloc(1, sizeof((*slot)->header) + MICRO_PKT_SIZE)) )
+      ( *slot )->header.op_data.data_size = MICRO_PKT_SIZE;
+    else
+      t->failed ++;
+
+    t->ops ++;
+  }
+
+  for ( int i = 0; i < MICRO_WINDOW; i ++ )
+    free( window[i] );
+}
+
+static void micro_pool_fn( micro_thread_t *t )
+{
+  ch_vpn_pkt_t *window[ MICRO_WINDOW ] = { NULL };
+
+  for ( uint64_t i = 0; i < s_ops; i ++ ) {
+
+    ch_vpn_pkt_t **slot = &window[ i % MICRO_WINDOW ];
+
+    vpn_pkt_pool_put( *slot );
+
+    if ( (*slot = vpn_pkt_pool_get()) )
+      ( *slot )->header.op_data.data_size = MICRO_PKT_SIZE;
+    else
+      t->failed ++;
+
+    t->ops ++;
+  }
+
+  for ( int i = 0; i < MICRO_WINDOW; i ++ )
+    vpn_pkt_pool_put( window[i] );
+}
+
+static void micro_calloc( micro_result_t *res )
+{
+  micro_run( res, micro_calloc_fn );
+}
+
+static void micro_pool( micro_result_t *res )
+{
+  micro_run( res, micro_pool_fn );
+  vpn_pkt_pool_clear( );
+}
+
+static void micro_lease_fn( micro_thread_t *t )
+{
+  for ( uint32_t i = t->index; i < s_clients_count; i += t->threads ) {
+    if ( s_clients[i].addr )
+      continue;
+    s_addrs[i] = ch_sf_addr_lease( s_inst, &s_clients[i] );
+    t->ops ++;
+  }
+}
+
+static void micro_lease( micro_result_t *res )
+{
+  micro_clients_reset( );
+  micro_run( res, micro_lease_fn );
+}
+
+static void micro_lease_reuse( micro_result_t *res )
+{
+  micro_clients_reset( );
+
+  for ( uint32_t i = 0; i < res->clients; i ++ )
+    s_addrs[i] = ch_sf_addr_lease( s_inst, &s_clients[i] );
+
+  // Every other client goes away, the rest of them are leased again from the pool
+  for ( uint32_t i = 0; i < res->clients; i += 2 ) {
+    micro_addr_release( &s_clients[i] );
+    s_clients[i].addr = 0;
+  }
+
+  micro_run( res, micro_lease_fn );
+}
+
+static void micro_lookup_fn( micro_thread_t *t )
+{
+  uint32_t x = 0x9e3779b9u * ( t->index + 1 );
+
+  for ( uint64_t i = 0; i < s_ops; i ++ ) {
+
+    dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+    in_addr_t addr;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    addr = s_addrs[ x % s_clients_count ];
+
+    pthread_mutex_lock( &s_inst->clients_mutex );
+    HASH_FIND_INT( s_inst->clients, &addr, raw_client );
+    pthread_mutex_unlock( &s_inst->clients_mutex );
+
+    if ( !raw_client )
+      t->failed ++;
+
+    t->ops ++;
+  }
+}
+
+static void micro_lookup( micro_result_t *res )
+{
+  micro_clients_reset( );
+
+  for ( uint32_t i = 0; i < s_clients_count; i ++ )
+    s_addrs[i] = ch_sf_addr_lease( s_inst, &s_clients[i] );
+
+  micro_run( res, micro_lookup_fn );
+}
+
+static bool micro_selected( const char *list, const char *name )
+{
+  size_t len = strlen( name );
+
+  for ( const char *p = list; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL )
+    if ( !strncmp(p, name, len) && (p[len] == ',' || !p[len]) )
+      return true;
+
+  return false;
+}
+
+static void micro_result_print( FILE *out, const micro_result_t *res, bool first )
+{
+  fprintf( out, "%s\n    {\"bench\": \"%s\", \"threads\": %u, \"clients\": %u, \"ops\": %llu, \"failed\": %llu, "
+                "\"ns_per_op\": %.2f, \"mops\": %.3f, \"cache_misses_per_op\": ",
+           first ? "" : ",", res->bench, res->threads, res->clients,
+           (unsigned long long)res->ops, (unsigned long long)res->failed, res->ns_per_op, res->mops );
+
+  if ( res->misses_per_op < 0 )
+    fprintf( out, "null}" );
+  else
+    fprintf( out, "%.3f}", res->misses_per_op );
+
+  fflush( out );
+}
+
+static void micro_usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s [-n ops] [-t threads] [-c clients] [-b benches] [-o file.json]\n"
+                   "  -n  ops per thread, %u by default, lease runs take every client once\n"
+                   "  -t  threads counts, \"%s\" by default, up to %u\n"
+                   "  -c  clients counts for lease and lookup, \"%s\" by default, up to %u\n"
+                   "  -b  ring,calloc,pool,lease,lease_reuse,lookup, all by default\n"
+                   "  -o  JSON output, stdout by default\n",
+           name, MICRO_OPS, MICRO_THREADS, MICRO_THREADS_MAX, MICRO_CLIENTS, MICRO_CLIENTS_MAX );
+}
+
+int main( int argc, char **argv )
+{
+  static const struct {
+    const char *name;
+    void (*run)( micro_result_t *res );
+    bool clients;
+  } benches[] = {
+    { "ring",   micro_ring,   false },
+    { "calloc", micro_calloc, false },
+    { "pool",   micro_pool,   false },
+    { "lease",  micro_lease,  true },
+    { "lease_reuse", micro_lease_reuse, true },
+    { "lookup", micro_lookup, true }
+  };
+
+  const char *threads_str = MICRO_THREADS, *clients_str = MICRO_CLIENTS, *benches_str = NULL, *out_path = NULL;
+  uint32_t threads[ 32 ], clients[ 32 ];
+  uint32_t threads_count, clients_count;
+  FILE *out = stdout;
+  bool first = true;
+  int opt;
+
+  while ( (opt = getopt(argc, argv, "n:t:c:b:o:h")) != -1 ) {
+    switch ( opt ) {
+      case 'n': s_ops = strtoull( optarg, NULL, 10 ); break;
+      case 't': threads_str = optarg; break;
+      case 'c': clients_str = optarg; break;
+      case 'b': benches_str = optarg; break;
+      case 'o': out_path = optarg; break;
+      default:
+        micro_usage( argv[0] );
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  threads_count = bench_list_parse( threads_str, threads, 32, 1, MICRO_THREADS_MAX );
+  clients_count = bench_list_parse( clients_str, clients, 32, 1, MICRO_CLIENTS_MAX );
+
+  if ( !s_ops || !threads_count || !clients_count ) {
+    micro_usage( argv[0] );
+    return 1;
+  }
+
+  for ( uint32_t i = 0; i < clients_count; i ++ )
+    if ( clients[i] > s_clients_max )
+      s_clients_max = clients[i];
+
+  s_clients = calloc( s_clients_max, sizeof(*s_clients) );
+  s_addrs = calloc( s_clients_max, sizeof(*s_addrs) );
+
+  if ( !s_clients || !s_addrs ) {
+    fprintf( stderr, "Out of memory\n" );
+    return 1;
+  }
+
+  if ( out_path && !(out = fopen(out_path, "w")) ) {
+    fprintf( stderr, "Can't open %s: %s\n", out_path, strerror(errno) );
+    return 1;
+  }
+
+  // Overflow warnings would be measured instead of the ring
+  dap_log_level_set( L_ERROR );
+
+  micro_setup( );
+
+  fprintf( out, "{\n  \"bench\": \"dap_stream_ch_vpn_micro\",\n  \"results\": [" );
+
+  for ( size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b ++ ) {
+
+    if ( benches_str && !micro_selected(benches_str, benches[b].name) )
+      continue;
+
+    for ( uint32_t c = 0; c < ( benches[b].clients ? clients_count : 1 ); c ++ ) {
+      for ( uint32_t t = 0; t < threads_count; t ++ ) {
+
+        micro_result_t res = { .bench = benches[b].name, .threads = threads[t], .clients = benches[b].clients ? clients[c] : 0 };
+
+        s_clients_count = res.clients;
+        benches[b].run( &res );
+
+        micro_result_print( out, &res, first );
+        first = false;
+      }
+    }
+  }
+
+  fprintf( out, "\n  ]\n}\n" );
+
+  if ( out != stdout )
+    fclose( out );
+
+  return 0;
+}
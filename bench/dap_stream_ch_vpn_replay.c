@@ -0,0 +1,960 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays a pcap or pcapng capture through the VPN stream channel, on the mock stream and the loopback
+ * tun backend like the benchmark.
+ *
+ * Every host that opens flows in the capture (or every host of -C network) becomes one of the leased
+ * clients, its packets go upstream as VPN_SEND, the packets to it are written into the tun and taken
+ * by ch_sf_packet_out(). Stages are counted on the way, with the channel's own drop counters.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn.h"
+#include "dap_stream_ch_vpn_bench_mock.h"
+
+#define LOG_TAG "stream_ch_vpn_replay"
+
+#define REPLAY_VPN_ADDR        "198.19.0.0"  // Benchmarking range, unlikely to be in the capture
+#define REPLAY_VPN_MASK        "255.255.0.0"
+
+#define REPLAY_CLIENTS         64
+#define REPLAY_CLIENTS_MAX     1024
+#define REPLAY_IFACES_MAX      64
+#define REPLAY_PKT_MAX         65535
+#define REPLAY_SERVICE_EVERY   8               // Packets replayed between packet_out passes
+#define REPLAY_IDLE_NS         1000000000ull   // Nothing more comes after that long, the rest is lost
+
+#define PCAP_MAGIC_US          0xa1b2c3d4
+#define PCAP_MAGIC_NS          0xa1b23c4d
+#define PCAPNG_SHB             0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER      0x1a2b3c4d
+#define PCAPNG_IDB             1
+#define PCAPNG_PB              2
+#define PCAPNG_SPB             3
+#define PCAPNG_EPB             6
+
+#define DLT_NULL_              0
+#define DLT_EN10MB_            1
+#define DLT_RAW_               101
+#define DLT_LOOP_              108
+#define DLT_LINUX_SLL_         113
+#define DLT_IPV4_              228
+#define DLT_LINUX_SLL2_        276
+
+enum {
+  REPLAY_UP = 0,  // Client to the network, VPN_SEND
+  REPLAY_DOWN     // Network to the client, through the tun
+};
+
+typedef struct replay_pkt {
+
+  uint64_t ts;        // Capture time, ns
+  const uint8_t *ip;  // IPv4 packet inside the mapped capture
+  uint32_t size;
+  uint32_t host;      // Client host of the capture it's mapped by
+  uint8_t dir;
+
+  dap_stream_ch_pkt_t *ch_pkt; // Rewritten packet behind the VPN header, built after the leases
+
+} replay_pkt_t;
+
+typedef struct replay_flow {
+
+  uint32_t addr_lo, addr_hi;
+  uint16_t port_lo, port_hi;
+  uint8_t proto;
+  bool used;
+
+  uint32_t init_addr;  // Who opened the flow
+  uint16_t init_port;
+
+} replay_flow_t;
+
+typedef struct replay_host {
+
+  uint32_t addr;
+  uint32_t index;
+  bool used;
+
+} replay_host_t;
+
+typedef struct replay_stage {
+
+  const char *name;
+  atomic_uint_fast64_t packets, bytes;
+  atomic_uint_fast64_t first_ns, last_ns;
+
+} replay_stage_t;
+
+// Channel's threads run while it's set, the host application keeps it up
+extern bool bQuitSignal;
+
+static replay_pkt_t *s_pkts = NULL;
+static size_t s_pkts_count = 0, s_pkts_cap = 0;
+
+static struct {
+  uint64_t frames, ipv4, up, down;
+  uint64_t non_ipv4, truncated, unmapped;
+} s_capture;
+
+static replay_host_t *s_hosts = NULL;    // Capture's client addresses, in order of appearance
+static size_t s_hosts_mask = 0;
+static uint32_t s_hosts_count = 0;
+
+static bench_client_t **s_clients = NULL;
+static uint32_t s_clients_count = 0;
+
+static bool s_client_net_set = false;
+static uint32_t s_client_net, s_client_mask;  // Host byte order
+
+static int s_peer_fd = -1;
+static atomic_bool s_done;
+static atomic_uint_fast64_t s_last_ns;
+
+static replay_stage_t s_stage_send = { .name = "vpn_send" };     // Given to packet_in
+static replay_stage_t s_stage_tun_out = { .name = "tun_out" };   // Came out of the tun
+static replay_stage_t s_stage_tun_in = { .name = "tun_in" };     // Written into the tun
+static replay_stage_t s_stage_stream = { .name = "stream_out" }; // Written to the clients' streams
+
+static const char *s_reject_names[ DAP_STREAM_CH_VPN_REJECT_REASONS ] = {
+  "none", "truncated", "version", "ihl", "length", "saddr", "acl"
+};
+
+static void replay_stage_mark( replay_stage_t *stage, size_t bytes )
+{
+  uint64_t now = bench_now( ), zero = 0;
+
+  atomic_fetch_add_explicit( &stage->packets, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &stage->bytes, bytes, memory_order_relaxed );
+  atomic_compare_exchange_strong( &stage->first_ns, &zero, now );
+  atomic_store_explicit( &stage->last_ns, now, memory_order_relaxed );
+  atomic_store_explicit( &s_last_ns, now, memory_order_relaxed );
+}
+
+static inline uint16_t rd16( const uint8_t *p, bool swap )
+{
+  uint16_t v;
+
+  memcpy( &v, p, sizeof(v) );
+
+  return swap ? __builtin_bswap16( v ) : v;
+}
+
+static inline uint32_t rd32( const uint8_t *p, bool swap )
+{
+  uint32_t v;
+
+  memcpy( &v, p, sizeof(v) );
+
+  return swap ? __builtin_bswap32( v ) : v;
+}
+
+static inline uint32_t replay_hash( uint32_t v )
+{
+  v ^= v >> 16;
+  v *= 0x7feb352d;
+  v ^= v >> 15;
+  v *= 0x846ca68b;
+  v ^= v >> 16;
+
+  return v;
+}
+
+/**
+ * @brief replay_host_index Number of the capture's client host, new hosts are numbered as they come
+ * @param addr Network byte order
+ * @return
+ */
+static uint32_t replay_host_index( uint32_t addr )
+{
+  size_t i = replay_hash( addr ) & s_hosts_mask;
+
+  while ( s_hosts[i].used && s_hosts[i].addr != addr )
+    i = ( i + 1 ) & s_hosts_mask;
+
+  if ( !s_hosts[i].used ) {
+    s_hosts[i].used = true;
+    s_hosts[i].addr = addr;
+    s_hosts[i].index = s_hosts_count ++;
+  }
+
+  return s_hosts[i].index;
+}
+
+/**
+ * @brief replay_link_ip Strip the link layer
+ * @param linktype
+ * @param data
+ * @param size In - frame size, out - what's left
+ * @return IPv4 packet, NULL if the frame has no IPv4 in it
+ */
+static const uint8_t *replay_link_ip( uint32_t linktype, const uint8_t *data, size_t *size )
+{
+  size_t off = 0;
+  uint16_t proto;
+
+  switch ( linktype ) {
+    case DLT_NULL_:
+    case DLT_LOOP_:
+      if ( *size < 4 )
+        return NULL;
+      // Family in the byte order of the host that captured it
+      if ( rd32(data, false) != AF_INET && rd32(data, true) != AF_INET )
+        return NULL;
+      off = 4;
+    break;
+
+    case DLT_EN10MB_:
+      off = 12;
+      do {
+        if ( *size < off + 2 )
+          return NULL;
+        proto = (uint16_t)( (data[off] << 8) | data[off + 1] );
+        off += ( proto == 0x8100 || proto == 0x88a8 ) ? 4 : 2;
+      } while ( proto == 0x8100 || proto == 0x88a8 );
+
+      if ( proto != 0x0800 )
+        return NULL;
+    break;
+
+    case DLT_LINUX_SLL_:
+      if ( *size < 16 || data[14] != 0x08 || data[15] != 0x00 )
+        return NULL;
+      off = 16;
+    break;
+
+    case DLT_LINUX_SLL2_:
+      if ( *size < 20 || data[0] != 0x08 || data[1] != 0x00 )
+        return NULL;
+      off = 20;
+    break;
+
+    case DLT_RAW_:
+    case DLT_IPV4_:
+    break;
+
+    default:
+      return NULL;
+  }
+
+  if ( *size <= off || (data[off] >> 4) != 4 )
+    return NULL;
+
+  *size -= off;
+
+  return data + off;
+}
+
+/**
+ * @brief replay_frame Take one captured frame
+ * @param linktype
+ * @param ts Capture time, ns
+ * @param data
+ * @param caplen
+ * @param len Size on the wire
+ */
+static void replay_frame( uint32_t linktype, uint64_t ts, const uint8_t *data, size_t caplen, size_t len )
+{
+  size_t size = caplen;
+  const uint8_t *ip = replay_link_ip( linktype, data, &size );
+
+  s_capture.frames ++;
+
+  if ( !ip ) {
+    s_capture.non_ipv4 ++;
+    return;
+  }
+
+  size_t ihl = ( ip[0] & 0x0f ) * 4u;
+  size_t tot_len = size >= 4 ? (size_t)( (ip[2] << 8) | ip[3] ) : 0;
+
+  // Cut by the snap length, the channel would take it as malformed
+  if ( caplen < len || size < 20 || ihl < 20 || tot_len < ihl || tot_len > size ) {
+    s_capture.truncated ++;
+    return;
+  }
+
+  if ( s_pkts_count == s_pkts_cap ) {
+    size_t cap = s_pkts_cap ? s_pkts_cap * 2 : 4096;
+    replay_pkt_t *pkts = realloc( s_pkts, cap * sizeof(replay_pkt_t) );
+
+    if ( !pkts )
+      return;
+
+    s_pkts = pkts;
+    s_pkts_cap = cap;
+  }
+
+  // Ethernet padding goes away
+  s_pkts[ s_pkts_count ++ ] = (replay_pkt_t){ .ts = ts, .ip = ip, .size = (uint32_t)tot_len };
+  s_capture.ipv4 ++;
+}
+
+static int replay_pcap_load( const uint8_t *data, size_t size )
+{
+  uint32_t magic = rd32( data, false );
+  bool swap = ( magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS );
+  bool nsec;
+  uint32_t linktype;
+
+  magic = rd32( data, swap );
+
+  if ( size < 24 || (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) )
+    return -1;
+
+  nsec = ( magic == PCAP_MAGIC_NS );
+  linktype = rd32( data + 20, swap ) & 0x0fffffff; // Upper bits are FCS flags
+
+  for ( size_t off = 24; off + 16 <= size; ) {
+
+    uint64_t sec = rd32( data + off, swap ), frac = rd32( data + off + 4, swap );
+    uint32_t caplen = rd32( data + off + 8, swap ), len = rd32( data + off + 12, swap );
+
+    off += 16;
+
+    if ( caplen > size - off ) {
+      log_it( L_WARNING, "Capture is cut short" );
+      break;
+    }
+
+    replay_frame( linktype, sec * 1000000000ull + ( nsec ? frac : frac * 1000 ), data + off, caplen, len );
+    off += caplen;
+  }
+
+  return 0;
+}
+
+static int replay_pcapng_load( const uint8_t *data, size_t size )
+{
+  struct {
+    uint32_t linktype;
+    uint64_t units;  // Timestamp units per second
+  } ifaces[ REPLAY_IFACES_MAX ];
+
+  uint32_t ifaces_count = 0;
+  bool swap = false;
+
+  for ( size_t off = 0; off + 12 <= size; ) {
+
+    uint32_t type = rd32( data + off, swap );
+
+    if ( type == PCAPNG_SHB ) {
+      if ( off + 16 > size )
+        break;
+      // New section, its own byte order and interfaces
+      swap = ( rd32(data + off + 8, false) != PCAPNG_BYTE_ORDER );
+      if ( rd32(data + off + 8, swap) != PCAPNG_BYTE_ORDER )
+        return -1;
+      ifaces_count = 0;
+    }
+
+    uint32_t block_len = rd32( data + off + 4, swap );
+
+    if ( block_len < 12 || (block_len & 3) || block_len > size - off ) {
+      log_it( L_WARNING, "Capture is cut short" );
+      break;
+    }
+
+    const uint8_t *body = data + off + 8;
+    size_t body_len = block_len - 12;
+
+    switch ( type ) {
+      case PCAPNG_IDB:
+        if ( body_len >= 8 && ifaces_count < REPLAY_IFACES_MAX ) {
+          uint64_t units = 1000000;
+
+          // Options, if_tsresol is the one that matters
+          for ( size_t o = 8; o + 4 <= body_len; ) {
+            uint16_t code = rd16( body + o, swap ), len = rd16( body + o + 2, swap );
+
+            if ( !code || o + 4 + len > body_len )
+              break;
+
+            if ( code == 9 && len >= 1 ) {
+              uint8_t res = body[o + 4];
+              units = 1;
+              for ( uint8_t i = 0; i < ( res & 0x7f ) && units < 1000000000000000000ull; i ++ )
+                units *= ( res & 0x80 ) ? 2 : 10;
+            }
+
+            o += 4 + ( ((size_t)len + 3) & ~(size_t)3 );
+          }
+
+          ifaces[ifaces_count].linktype = rd16( body, swap );
+          ifaces[ifaces_count ++].units = units;
+        }
+      break;
+
+      case PCAPNG_EPB:
+      case PCAPNG_PB:
+        if ( body_len >= 20 ) {
+          uint32_t iface = ( type == PCAPNG_EPB ) ? rd32( body, swap ) : rd16( body, swap );
+          uint64_t ts = ( (uint64_t)rd32(body + 4, swap) << 32 ) | rd32( body + 8, swap );
+          uint32_t caplen = rd32( body + 12, swap ), len = rd32( body + 16, swap );
+
+          if ( iface >= ifaces_count || caplen > body_len - 20 )
+            break;
+
+          uint64_t units = ifaces[iface].units;
+          uint64_t ns = ( ts / units ) * 1000000000ull + ( ts % units ) * 1000000000ull / units;
+
+          replay_frame( ifaces[iface].linktype, ns, body + 20, caplen, len );
+        }
+      break;
+
+      case PCAPNG_SPB:
+        if ( body_len >= 4 && ifaces_count ) {
+          uint32_t len = rd32( body, swap );
+          uint32_t caplen = len < body_len - 4 ? len : (uint32_t)( body_len - 4 );
+
+          // No timestamp, goes right after the previous one
+          replay_frame( ifaces[0].linktype, s_pkts_count ? s_pkts[s_pkts_count - 1].ts : 0, body + 4, caplen, len );
+        }
+      break;
+
+      default:
+      break;
+    }
+
+    off += block_len;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief replay_classify Tell which end of every packet is the client and number the client hosts
+ * @return 0 if ok
+ */
+static int replay_classify( void )
+{
+  size_t flows_mask = 1;
+  replay_flow_t *flows;
+
+  while ( flows_mask < s_pkts_count * 2 )
+    flows_mask <<= 1;
+
+  flows = calloc( flows_mask, sizeof(replay_flow_t) );
+  s_hosts = calloc( flows_mask, sizeof(replay_host_t) );
+
+  if ( !flows || !s_hosts ) {
+    free( flows );
+    return -1;
+  }
+
+  flows_mask --;
+  s_hosts_mask = flows_mask;
+
+  for ( size_t i = 0; i < s_pkts_count; i ++ ) {
+
+    replay_pkt_t *pkt = &s_pkts[i];
+    const uint8_t *ip = pkt->ip;
+    size_t ihl = ( ip[0] & 0x0f ) * 4u;
+    uint32_t saddr, daddr;
+    uint16_t sport = 0, dport = 0;
+    uint8_t proto = ip[9];
+    bool fragment = ( (ip[6] & 0x3f) | ip[7] ) != 0;
+    bool synack = false;
+
+    memcpy( &saddr, ip + 12, 4 );
+    memcpy( &daddr, ip + 16, 4 );
+
+    if ( !fragment && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && pkt->size >= ihl + 4 ) {
+      sport = (uint16_t)( (ip[ihl] << 8) | ip[ihl + 1] );
+      dport = (uint16_t)( (ip[ihl + 2] << 8) | ip[ihl + 3] );
+      synack = ( proto == IPPROTO_TCP && pkt->size >= ihl + 14 && (ip[ihl + 13] & 0x12) == 0x12 );
+    }
+
+    if ( s_client_net_set ) {
+
+      if ( (ntohl(saddr) & s_client_mask) == s_client_net )
+        pkt->dir = REPLAY_UP;
+      else if ( (ntohl(daddr) & s_client_mask) == s_client_net )
+        pkt->dir = REPLAY_DOWN;
+      else {
+        pkt->host = UINT32_MAX;
+        s_capture.unmapped ++;
+        continue;
+      }
+    }
+    else {
+
+      bool lo = ( saddr < daddr ) || ( saddr == daddr && sport <= dport );
+      replay_flow_t key = {
+        .addr_lo = lo ? saddr : daddr, .addr_hi = lo ? daddr : saddr,
+        .port_lo = lo ? sport : dport, .port_hi = lo ? dport : sport,
+        .proto = proto
+      };
+      size_t h = replay_hash( key.addr_lo ^ replay_hash(key.addr_hi ^ replay_hash(
+                              ((uint32_t)key.port_lo << 16 | key.port_hi) ^ proto)) ) & flows_mask;
+      replay_flow_t *flow;
+
+      while ( (flow = &flows[h])->used &&
+              (flow->addr_lo != key.addr_lo || flow->addr_hi != key.addr_hi ||
+               flow->port_lo != key.port_lo || flow->port_hi != key.port_hi || flow->proto != key.proto) )
+        h = ( h + 1 ) & flows_mask;
+
+      // Flow's first packet is the opener's, unless it's the answer to the SYN captured before
+      if ( !flow->used ) {
+        *flow = key;
+        flow->used = true;
+        flow->init_addr = synack ? daddr : saddr;
+        flow->init_port = synack ? dport : sport;
+      }
+
+      pkt->dir = ( flow->init_addr == saddr && flow->init_port == sport ) ? REPLAY_UP : REPLAY_DOWN;
+    }
+
+    pkt->host = replay_host_index( pkt->dir == REPLAY_UP ? saddr : daddr );
+
+    if ( pkt->dir == REPLAY_UP )
+      s_capture.up ++;
+    else
+      s_capture.down ++;
+  }
+
+  free( flows );
+  return 0;
+}
+
+// RFC 1624 update of the checksum at p for the address change
+static void replay_csum_fix( uint8_t *p, uint32_t from, uint32_t to, bool udp )
+{
+  const uint8_t *f = (const uint8_t *)&from, *t = (const uint8_t *)&to;
+  uint32_t sum = ~(uint32_t)( (p[0] << 8) | p[1] ) & 0xffff;
+
+  for ( int i = 0; i < 4; i += 2 ) {
+    sum += ~(uint32_t)( (f[i] << 8) | f[i + 1] ) & 0xffff;
+    sum += (uint32_t)( (t[i] << 8) | t[i + 1] );
+  }
+
+  while ( sum >> 16 )
+    sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+  sum = ~sum & 0xffff;
+
+  if ( udp && !sum )
+    sum = 0xffff;
+
+  p[0] = (uint8_t)( sum >> 8 );
+  p[1] = (uint8_t)sum;
+}
+
+/**
+ * @brief replay_addr_set Put the leased address in place of the capture's one, checksums kept right
+ * @param ip
+ * @param size
+ * @param off 12 for the source, 16 for the destination
+ * @param addr Network byte order
+ */
+static void replay_addr_set( uint8_t *ip, size_t size, size_t off, uint32_t addr )
+{
+  size_t ihl = ( ip[0] & 0x0f ) * 4u;
+  uint32_t old;
+
+  memcpy( &old, ip + off, 4 );
+  memcpy( ip + off, &addr, 4 );
+
+  replay_csum_fix( ip + 10, old, addr, false );
+
+  // Pseudo header of the transport is only in the first fragment
+  if ( (ip[6] & 0x1f) | ip[7] )
+    return;
+
+  if ( ip[9] == IPPROTO_TCP && size >= ihl + 18 )
+    replay_csum_fix( ip + ihl + 16, old, addr, false );
+  else if ( ip[9] == IPPROTO_UDP && size >= ihl + 8 && (ip[ihl + 6] | ip[ihl + 7]) )
+    replay_csum_fix( ip + ihl + 6, old, addr, true );
+}
+
+/**
+ * @brief replay_build Make the channel packets with the capture's hosts turned into the leased clients
+ * @return 0 if ok
+ */
+static int replay_build( void )
+{
+  for ( size_t i = 0; i < s_pkts_count; i ++ ) {
+
+    replay_pkt_t *pkt = &s_pkts[i];
+
+    if ( pkt->host == UINT32_MAX )
+      continue;
+
+    bench_client_t *client = s_clients[ pkt->host % s_clients_count ];
+
+    // Downstream ones are written into the tun from behind the header
+    if ( !(pkt->ch_pkt = bench_ch_pkt_new(BENCH_OP_VPN_SEND, 0, pkt->size)) )
+      return -1;
+
+    uint8_t *ip = pkt->ch_pkt->data + sizeof(bench_vpn_hdr_t);
+
+    memcpy( ip, pkt->ip, pkt->size );
+    replay_addr_set( ip, pkt->size, pkt->dir == REPLAY_UP ? 12 : 16, client->session.tun_client_addr.s_addr );
+  }
+
+  return 0;
+}
+
+static void replay_on_write( bench_client_t *client, uint8_t type, const uint8_t *data, size_t data_size )
+{
+  const bench_vpn_hdr_t *hdr = (const bench_vpn_hdr_t *)data;
+
+  (void)client;
+  (void)type;
+
+  if ( data_size >= sizeof(bench_vpn_hdr_t) && hdr->op_code == BENCH_OP_VPN_RECV )
+    replay_stage_mark( &s_stage_stream, data_size - sizeof(bench_vpn_hdr_t) );
+}
+
+// Stream worker: packet_out for every channel that asked for it
+static bool replay_service( void )
+{
+  bool any = false;
+
+  for ( uint32_t c = 0; c < s_clients_count; c ++ ) {
+    if ( atomic_load_explicit(&s_clients[c]->ready, memory_order_acquire) ) {
+      bench_mock_proc()->packet_out_callback( &s_clients[c]->ch, NULL );
+      any = true;
+    }
+  }
+
+  return any;
+}
+
+/**
+ * @brief replay_tun_reader Network side of the upstream: takes the packets out of the tun
+ * @param arg
+ * @return
+ */
+static void *replay_tun_reader( void *arg )
+{
+  uint8_t *buf = malloc( REPLAY_PKT_MAX );
+  struct pollfd pfd = { .fd = s_peer_fd, .events = POLLIN };
+
+  (void)arg;
+
+  while ( buf && !atomic_load(&s_done) ) {
+
+    if ( poll(&pfd, 1, 100) <= 0 )
+      continue;
+
+    ssize_t ret;
+
+    while ( (ret = recv(s_peer_fd, buf, REPLAY_PKT_MAX, MSG_DONTWAIT)) > 0 )
+      replay_stage_mark( &s_stage_tun_out, (size_t)ret );
+  }
+
+  free( buf );
+  return NULL;
+}
+
+static void replay_tun_write( const uint8_t *ip, size_t size )
+{
+  struct pollfd pfd = { .fd = s_peer_fd, .events = POLLOUT };
+
+  // Full tun is the channel lagging behind, its clients still have to be served
+  while ( send(s_peer_fd, ip, size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+
+    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+      log_it( L_ERROR, "Can't write into the tun: '%s'", strerror(errno) );
+      return;
+    }
+
+    replay_service( );
+    poll( &pfd, 1, 1 );
+  }
+
+  replay_stage_mark( &s_stage_tun_in, size );
+}
+
+/**
+ * @brief replay_run Play the capture
+ * @param loops Times to play it
+ * @param speed Recorded timing multiplier, 0 is as fast as possible
+ */
+static void replay_run( uint32_t loops, double speed )
+{
+  uint64_t ts0 = s_pkts[0].ts, span = s_pkts[s_pkts_count - 1].ts - ts0;
+  uint64_t t0 = bench_now( ), n = 0;
+
+  for ( uint32_t loop = 0; loop < loops; loop ++ ) {
+    for ( size_t i = 0; i < s_pkts_count; i ++ ) {
+
+      replay_pkt_t *pkt = &s_pkts[i];
+
+      if ( !pkt->ch_pkt )
+        continue;
+
+      if ( speed > 0 ) {
+        // Capture may go back in time a bit, merged files do
+        uint64_t rel = pkt->ts > ts0 ? pkt->ts - ts0 : 0;
+        uint64_t at = t0 + (uint64_t)( (double)( (uint64_t)loop * span + rel ) / speed );
+
+        while ( bench_now() < at ) {
+          if ( !replay_service() )
+            sched_yield( );
+        }
+      }
+
+      if ( pkt->dir == REPLAY_UP ) {
+        replay_stage_mark( &s_stage_send, pkt->size );
+        bench_mock_proc()->packet_in_callback( &s_clients[pkt->host % s_clients_count]->ch, pkt->ch_pkt );
+      }
+      else
+        replay_tun_write( pkt->ch_pkt->data + sizeof(bench_vpn_hdr_t), pkt->size );
+
+      if ( !(++ n % REPLAY_SERVICE_EVERY) )
+        replay_service( );
+    }
+  }
+
+  // What's still in the channel's queues
+  while ( bench_now() - atomic_load(&s_last_ns) <= REPLAY_IDLE_NS ) {
+    if ( !replay_service() )
+      usleep( 100 );
+  }
+
+  atomic_store( &s_done, true );
+}
+
+static void replay_stage_print( FILE *out, replay_stage_t *stage, bool last )
+{
+  uint64_t packets = atomic_load( &stage->packets ), bytes = atomic_load( &stage->bytes );
+  uint64_t first = atomic_load( &stage->first_ns ), end = atomic_load( &stage->last_ns );
+  double seconds = (double)( end > first ? end - first : 1 ) / 1e9;
+
+  fprintf( out, "    {\"stage\": \"%s\", \"packets\": %llu, \"bytes\": %llu, \"seconds\": %.6f, \"pps\": %.0f, \"gbps\": %.4f}%s\n",
+           stage->name, (unsigned long long)packets, (unsigned long long)bytes, seconds,
+           (double)packets / seconds, (double)bytes * 8 / seconds / 1e9, last ? "" : "," );
+}
+
+static inline unsigned long long replay_left( uint64_t total, uint64_t accounted )
+{
+  return total > accounted ? (unsigned long long)( total - accounted ) : 0;
+}
+
+static void replay_report( FILE *out, const char *path, uint32_t loops, double speed )
+{
+  dap_stream_ch_vpn_stats_t stats;
+  dap_stream_ch_vpn_client_stats_t cs;
+  uint64_t rejected = 0, shaper = 0, queue = 0, codel = 0;
+  uint64_t sent = atomic_load( &s_stage_send.packets ), tun_out = atomic_load( &s_stage_tun_out.packets );
+  uint64_t tun_in = atomic_load( &s_stage_tun_in.packets ), stream = atomic_load( &s_stage_stream.packets );
+
+  dap_stream_ch_vpn_get_stats( &stats );
+
+  for ( int r = 1; r < DAP_STREAM_CH_VPN_REJECT_REASONS; r ++ )
+    rejected += stats.rejects[r];
+
+  for ( uint32_t c = 0; c < s_clients_count; c ++ ) {
+    if ( dap_stream_ch_vpn_get_client_stats(s_clients[c]->session.tun_client_addr.s_addr, &cs) )
+      continue;
+    shaper += cs.up_dropped;
+    queue += cs.queue_drops;
+    codel += cs.codel_drops;
+  }
+
+  fprintf( out, "{\n  \"replay\": \"%s\",\n  \"backend\": \"loopback\",\n  \"timing\": \"%s\",\n  \"speed\": %.3f,\n"
+                "  \"loops\": %u,\n  \"hosts\": %u,\n  \"clients\": %u,\n",
+           path, speed > 0 ? "recorded" : "max", speed, loops, s_hosts_count, s_clients_count );
+
+  fprintf( out, "  \"capture\": {\"frames\": %llu, \"ipv4\": %llu, \"upstream\": %llu, \"downstream\": %llu, "
+                "\"skipped_non_ipv4\": %llu, \"skipped_truncated\": %llu, \"skipped_unmapped\": %llu},\n",
+           (unsigned long long)s_capture.frames, (unsigned long long)s_capture.ipv4,
+           (unsigned long long)s_capture.up, (unsigned long long)s_capture.down,
+           (unsigned long long)s_capture.non_ipv4, (unsigned long long)s_capture.truncated,
+           (unsigned long long)s_capture.unmapped );
+
+  fprintf( out, "  \"stages\": [\n" );
+  replay_stage_print( out, &s_stage_send, false );
+  replay_stage_print( out, &s_stage_tun_out, false );
+  replay_stage_print( out, &s_stage_tun_in, false );
+  replay_stage_print( out, &s_stage_stream, true );
+  fprintf( out, "  ],\n" );
+
+  // Hairpinned packets are delivered to the clients instead of the tun
+  fprintf( out, "  \"drops\": {\n    \"upstream\": {\"rejected\": %llu, \"reasons\": {", (unsigned long long)rejected );
+  for ( int r = 1; r < DAP_STREAM_CH_VPN_REJECT_REASONS; r ++ )
+    fprintf( out, "%s\"%s\": %llu", r > 1 ? ", " : "", s_reject_names[r], (unsigned long long)stats.rejects[r] );
+  fprintf( out, "}, \"shaper\": %llu, \"hairpinned\": %llu, \"hairpin_dropped\": %llu, \"unaccounted\": %llu},\n",
+           (unsigned long long)shaper, (unsigned long long)stats.hairpin_forwarded, (unsigned long long)stats.hairpin_dropped,
+           replay_left( sent, rejected + shaper + stats.hairpin_forwarded + stats.hairpin_dropped + tun_out ) );
+  fprintf( out, "    \"downstream\": {\"queue\": %llu, \"codel\": %llu, \"unaccounted\": %llu}\n  }\n}\n",
+           (unsigned long long)queue, (unsigned long long)codel,
+           replay_left( tun_in + stats.hairpin_forwarded, queue + codel + stream ) );
+}
+
+static void replay_usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s [-t] [-x speed] [-l loops] [-c clients] [-C net/prefix] [-o file.json] capture.pcap\n"
+                   "  -t  recorded timing, as fast as possible by default\n"
+                   "  -x  recorded timing sped up that many times, implies -t\n"
+                   "  -l  times to play the capture, 1 by default\n"
+                   "  -c  leased clients, the capture's hosts share them, up to %u of them by default\n"
+                   "  -C  capture's client network, the hosts that open the flows by default\n"
+                   "  -o  JSON output, stdout by default\n",
+           name, REPLAY_CLIENTS );
+}
+
+static int replay_net_parse( const char *str )
+{
+  char buf[ 32 ], *slash;
+  struct in_addr addr;
+  unsigned long prefix = 32;
+
+  dap_snprintf( buf, sizeof(buf), "%s", str );
+
+  if ( (slash = strchr(buf, '/')) ) {
+    *slash = 0;
+    prefix = strtoul( slash + 1, NULL, 10 );
+  }
+
+  if ( prefix > 32 || !inet_aton(buf, &addr) )
+    return -1;
+
+  s_client_mask = prefix ? 0xffffffffu << ( 32 - prefix ) : 0;
+  s_client_net = ntohl( addr.s_addr ) & s_client_mask;
+  s_client_net_set = true;
+
+  return 0;
+}
+
+int main( int argc, char **argv )
+{
+  uint32_t loops = 1, clients = 0;
+  double speed = 0;
+  const char *out_path = NULL;
+  FILE *out = stdout;
+  pthread_t reader;
+  struct stat st;
+  uint8_t *data;
+  int opt, fd;
+
+  while ( (opt = getopt(argc, argv, "tx:l:c:C:o:h")) != -1 ) {
+    switch ( opt ) {
+      case 't': if ( speed <= 0 ) speed = 1; break;
+      case 'x': speed = strtod( optarg, NULL ); break;
+      case 'l': loops = (uint32_t)strtoul( optarg, NULL, 10 ); break;
+      case 'c': clients = (uint32_t)strtoul( optarg, NULL, 10 ); break;
+      case 'C':
+        if ( replay_net_parse(optarg) ) {
+          fprintf( stderr, "Bad network %s\n", optarg );
+          return 1;
+        }
+      break;
+      case 'o': out_path = optarg; break;
+      default:
+        replay_usage( argv[0] );
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if ( optind != argc - 1 || !loops || speed < 0 || clients > REPLAY_CLIENTS_MAX ) {
+    replay_usage( argv[0] );
+    return 1;
+  }
+
+  errno = 0;
+
+  if ( (fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size < 24 ||
+       (data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ) {
+    fprintf( stderr, "Can't read %s: %s\n", argv[optind], errno ? strerror(errno) : "too short" );
+    return 1;
+  }
+
+  if ( (rd32(data, false) == PCAPNG_SHB ? replay_pcapng_load(data, (size_t)st.st_size)
+                                        : replay_pcap_load(data, (size_t)st.st_size)) ) {
+    fprintf( stderr, "%s is neither pcap nor pcapng\n", argv[optind] );
+    return 1;
+  }
+
+  if ( !s_pkts_count || replay_classify() || !s_hosts_count ) {
+    fprintf( stderr, "No IPv4 packets to replay in %s\n", argv[optind] );
+    return 1;
+  }
+
+  if ( !clients )
+    clients = s_hosts_count < REPLAY_CLIENTS ? s_hosts_count : REPLAY_CLIENTS;
+
+  s_clients_count = clients < s_hosts_count ? clients : s_hosts_count;
+
+  if ( out_path && !(out = fopen(out_path, "w")) ) {
+    fprintf( stderr, "Can't open %s: %s\n", out_path, strerror(errno) );
+    return 1;
+  }
+
+  // Per packet logging would be replayed instead of the channel
+  dap_log_level_set( L_ERROR );
+
+  bench_mock_init( replay_on_write );
+
+  bQuitSignal = true;
+
+  if ( dap_stream_ch_vpn_set_tun_backend(DAP_STREAM_CH_VPN_TUN_LOOPBACK) ||
+       dap_stream_ch_vpn_init(REPLAY_VPN_ADDR, REPLAY_VPN_MASK) ||
+       (s_peer_fd = dap_stream_ch_vpn_get_loopback_fd()) < 0 ) {
+    fprintf( stderr, "Can't start the VPN channel on the loopback tun\n" );
+    return 1;
+  }
+
+  if ( !(s_clients = calloc(s_clients_count, sizeof(bench_client_t *))) ||
+       bench_clients_lease(s_clients, s_clients_count) || replay_build() ) {
+    fprintf( stderr, "Can't lease the clients' addresses\n" );
+    return 1;
+  }
+
+  atomic_store( &s_done, false );
+  atomic_store( &s_last_ns, bench_now() );
+  pthread_create( &reader, NULL, replay_tun_reader, NULL );
+
+  replay_run( loops, speed );
+  pthread_join( reader, NULL );
+
+  replay_report( out, argv[optind], loops, speed );
+
+  if ( out != stdout )
+    fclose( out );
+
+  // Channel's threads don't stop, the process ends here
+  return 0;
+}
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #ifndef _WIN32
 #include <sys/select.h>
@@ -42,9 +43,6 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
-
-#include <linux/if.h>
-#include <linux/if_tun.h>
 #else
 #include <winsock2.h>
 #include <windows.h>
@@ -71,6 +69,20 @@
 #include "dap_stream_ch_proc.h"
 #include "dap_stream_ch_pkt.h"
 
+#include "dap_stream_ch_vpn.h"
+#include "dap_stream_ch_vpn_clock.h"
+#include "dap_stream_ch_vpn_codel.h"
+#include "dap_stream_ch_vpn_shaper.h"
+#include "dap_stream_ch_vpn_lanes.h"
+#include "dap_stream_ch_vpn_validate.h"
+#include "dap_stream_ch_vpn_nat.h"
+#include "dap_stream_ch_vpn_acl.h"
+#include "dap_stream_ch_vpn_dns.h"
+#include "dap_stream_ch_vpn_tun.h"
+#include "dap_stream_ch_vpn_capture.h"
+#include "dap_stream_ch_vpn_netlink.h"
+#include "dap_stream_ch_vpn_affinity.h"
+
 #define LOG_TAG "stream_ch_vpn"
 
 #define VPN_PACKET_OP_CODE_CONNECTED        0x000000a9
@@ -98,32 +110,6 @@
 
   typedef uint32_t in_addr_t;
 
-  #define _TAP_IOCTL(nr) CTL_CODE(FILE_DEVICE_UNKNOWN, nr, METHOD_BUFFERED, \
-        FILE_ANY_ACCESS)
-
-  #define TAP_IOCTL_GET_MAC               _TAP_IOCTL(1)
-  #define TAP_IOCTL_GET_VERSION           _TAP_IOCTL(2)
-  #define TAP_IOCTL_GET_MTU               _TAP_IOCTL(3)
-  #define TAP_IOCTL_GET_INFO              _TAP_IOCTL(4)
-  #define TAP_IOCTL_CONFIG_POINT_TO_POINT _TAP_IOCTL(5)
-  #define TAP_IOCTL_SET_MEDIA_STATUS      _TAP_IOCTL(6)
-  #define TAP_IOCTL_CONFIG_DHCP_MASQ      _TAP_IOCTL(7)
-  #define TAP_IOCTL_GET_LOG_LINE          _TAP_IOCTL(8)
-  #define TAP_IOCTL_CONFIG_DHCP_SET_OPT   _TAP_IOCTL(9)
-  #define TAP_IOCTL_CONFIG_TUN            _TAP_IOCTL(10)
-
-  #define TAP_COMPONENT_ID "tap0901"
-
-  #define DEVTEMPLATE "\\\\.\\Global\\%s.tap"
-
-  #define NETDEV_GUID "{4D36E972-E325-11CE-BFC1-08002BE10318}"
-  #define CONTROL_KEY "SYSTEM\\CurrentControlSet\\Control\\"
-
-  #define ADAPTERS_KEY CONTROL_KEY "Class\\" NETDEV_GUID
-  #define CONNECTIONS_KEY CONTROL_KEY "Network\\" NETDEV_GUID
-
-  typedef intptr_t (tap_callback)( char *idxname, char *name );
-
 #endif
 
 typedef struct ch_vpn_pkt {
@@ -163,6 +149,81 @@ typedef struct ch_vpn_pkt {
 
 }  __attribute__((packed)) ch_vpn_pkt_t;
 
+/**
+  * @struct vpn_out_source
+  * @brief Outbound packets source of the channel (raw VPN queue or proxy socket) scheduled by
+  *        deficit round-robin in ch_sf_packet_out()
+  *
+  **/
+
+#define VPN_OUT_SOURCE_RAW    0
+#define VPN_OUT_SOURCE_PROXY  1
+
+typedef struct vpn_out_source {
+
+  struct vpn_out_source *next; // Channel's ready list, guarded by dap_stream_ch_vpn_t mutex
+  bool in_ready;
+  bool resume;                 // Interrupted by full stream buffer, continue with the remaining deficit
+  uint8_t type;
+  uint32_t deficit;
+
+} vpn_out_source_t;
+
+// Raw VPN packets queued for one client, power of two
+#define VPN_RAW_PKT_BUFFER_SIZE 256
+#define VPN_RAW_PKT_BUFFER_MASK ( VPN_RAW_PKT_BUFFER_SIZE - 1 )
+
+#define VPN_CACHE_LINE_SIZE    64
+
+/**
+  * @struct vpn_pkt_spsc
+  * @brief Bounded single producer / single consumer packets queue. Producer and consumer indexes
+  *        are on their own cache lines, consumer publishes its index once per drained batch
+  *
+  **/
+typedef struct vpn_pkt_spsc {
+
+  atomic_size_t head; // Consumer
+  uint8_t padding1[ VPN_CACHE_LINE_SIZE - sizeof(atomic_size_t) ];
+  atomic_size_t tail; // Producer
+  uint8_t padding2[ VPN_CACHE_LINE_SIZE - sizeof(atomic_size_t) ];
+  ch_vpn_pkt_t *pkts[ VPN_RAW_PKT_BUFFER_SIZE ];
+  uint64_t ts[ VPN_RAW_PKT_BUFFER_SIZE ]; // Enqueue time, for sojourn time of AQM
+
+} vpn_pkt_spsc_t;
+
+static inline bool vpn_pkt_spsc_push( vpn_pkt_spsc_t *q, ch_vpn_pkt_t *pkt, uint64_t ts )
+{
+  size_t tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+
+  if ( tail - atomic_load_explicit(&q->head, memory_order_acquire) >= VPN_RAW_PKT_BUFFER_SIZE )
+    return false;
+
+  q->pkts[tail & VPN_RAW_PKT_BUFFER_MASK] = pkt;
+  q->ts[tail & VPN_RAW_PKT_BUFFER_MASK] = ts;
+  atomic_store_explicit( &q->tail, tail + 1, memory_order_release );
+
+  return true;
+}
+
+static inline ch_vpn_pkt_t *vpn_pkt_spsc_pop( vpn_pkt_spsc_t *q )
+{
+  size_t head = atomic_load_explicit( &q->head, memory_order_relaxed );
+
+  if ( head == atomic_load_explicit(&q->tail, memory_order_acquire) )
+    return NULL;
+
+  ch_vpn_pkt_t *pkt = q->pkts[head & VPN_RAW_PKT_BUFFER_MASK];
+  atomic_store_explicit( &q->head, head + 1, memory_order_release );
+
+  return pkt;
+}
+
+static inline bool vpn_pkt_spsc_is_empty( vpn_pkt_spsc_t *q )
+{
+  return atomic_load_explicit( &q->head, memory_order_relaxed ) == atomic_load_explicit( &q->tail, memory_order_acquire );
+}
+
 /**
   * @struct ch_vpn_socket_proxy
   * @brief Internal data storage for single socket proxy functions. Usualy helpfull for\
@@ -172,33 +233,114 @@ typedef struct ch_vpn_pkt {
 
 #define PROXY_PKT_BUFFER_SIZE 100
 
+#ifndef STREAM_BUF_SIZE_MAX
+#define STREAM_BUF_SIZE_MAX 20480
+#endif
+
+// Room left in the stream buffer for the stream packet header and encryption overhead
+#define VPN_STREAM_FRAME_RESERVE 256
+
+// Biggest ch_vpn_pkt_t the stream layer frames in one packet, proxy receive buffers are of this size
+#define VPN_POOL_PKT_SIZE      ( STREAM_BUF_SIZE_MAX - sizeof(dap_stream_ch_pkt_hdr_t) - VPN_STREAM_FRAME_RESERVE )
+#define VPN_POOL_PKT_DATA_MAX  ( VPN_POOL_PKT_SIZE - sizeof(((ch_vpn_pkt_t *)0)->header) )
+#define VPN_POOL_FREE_MAX      256
+
+// Bytes read from one proxy socket per readiness event
+#define PROXY_RECV_BUDGET      ( 256 * 1024 )
+
+
+// Default deficit round-robin quanta, bytes per turn
+#define VPN_OUT_QUANTUM_RAW    8192
+#define VPN_OUT_QUANTUM_PROXY  8192
+
+#define VPN_OUT_SOURCE_SOCK(a) ((ch_vpn_socket_proxy_t *)((uint8_t *)(a) - offsetof(ch_vpn_socket_proxy_t, out_src)))
+
 typedef struct ch_vpn_socket_proxy {
 
-  int id;
+  int id;        // Server assigned handle, see ch_vpn_sock_slot_t
+  int client_id; // Socket id chosen by the client in CONNECT request
   int sock;
 
+  atomic_int refs;      // Channel table reference + epoll reference
+  atomic_bool polled;   // Registered in the instance's epoll fd, epoll holds a reference
+  atomic_bool closed;   // Closed, events still pending in epoll batch must be ignored
+  struct ch_vpn_socket_proxy *graveyard_next;
+
   struct in_addr client_addr; // Used in raw L3 connections
+  struct sockaddr_in remote_addr; // Where it's connected to, the capture frames the stream with it
 
   pthread_mutex_t mutex;
   dap_stream_ch_t *ch;
+  dap_stream_ch_vpn_inst_t *inst;
 
   bool signal_to_delete;
 
-  ch_vpn_pkt_t *pkt_out[ PROXY_PKT_BUFFER_SIZE ];
+  ch_vpn_pkt_t *pkt_out[ PROXY_PKT_BUFFER_SIZE ]; // Ring, pkt_out_size packets starting from pkt_out_rindex
+  size_t pkt_out_rindex;
   size_t pkt_out_size;
 
+  vpn_out_source_t out_src; // Ready list holds a reference on the socket
+
   uint64_t bytes_sent;
   uint64_t bytes_recieved;
 
   time_t time_created;
   time_t time_lastused;
 
-  UT_hash_handle hh;
-  UT_hash_handle hh2;
-  UT_hash_handle hh_sock;
-
 } ch_vpn_socket_proxy_t;
 
+/**
+  * @struct ch_vpn_sock_slot
+  * @brief Slot of per channel proxy sockets table. Socket handle sent to the client in CONNECTED reply is
+  *        ( generation << VPN_SOCK_SLOT_INDEX_BITS ) | index, so lookup is array indexing and handles of
+  *        the closed sockets are rejected by generation mismatch.
+  *
+  **/
+
+#define VPN_SOCK_SLOT_INDEX_BITS 16
+#define VPN_SOCK_SLOT_INDEX_MASK ( (1u << VPN_SOCK_SLOT_INDEX_BITS) - 1 )
+#define VPN_SOCK_SLOT_GEN_MASK   0x7fffu // Keeps handle positive
+#define VPN_SOCK_SLOTS_MAX       ( 1u << VPN_SOCK_SLOT_INDEX_BITS )
+#define VPN_SOCK_SLOTS_INIT      16
+#define VPN_SOCK_SLOT_NONE       UINT32_MAX
+
+typedef struct ch_vpn_sock_slot {
+
+  ch_vpn_socket_proxy_t *sock;
+  uint32_t gen;
+  uint32_t next_free;
+
+} ch_vpn_sock_slot_t;
+
+/**
+  * @struct vpn_raw_lane
+  * @brief One priority lane of the client's raw downstream queue
+  *
+  **/
+typedef struct vpn_raw_lane {
+
+  vpn_pkt_spsc_t q;
+
+  // Serializes producers: ch_sf_thread_raw() and the hairpin path of other clients' workers
+  atomic_bool push_busy;
+
+  vpn_codel_t codel; // Consumer side AQM state
+
+  // Single writer counters: enqueue and drops are counted under push_busy, CoDel ones by the consumer
+  atomic_uint_fast64_t enqueued;
+  atomic_uint_fast64_t drops;
+  atomic_uint_fast64_t codel_drops;
+  atomic_uint_fast64_t codel_marks;
+  atomic_uint_fast64_t sojourn_last_ns;
+
+} vpn_raw_lane_t;
+
+// Upstream packets of one client waiting for tokens
+#define VPN_UP_BACKLOG_SIZE    128
+
+// Longest sleep of the shaper thread while there are throttled channels
+#define VPN_SHAPER_TICK_NS     1000000
+
 /**
   * @struct dap_stream_ch_vpn
   * @brief Object that creates for every remote channel client
@@ -206,8 +348,51 @@ typedef struct ch_vpn_socket_proxy {
   **/
 typedef struct dap_stream_ch_vpn {
 
-  pthread_mutex_t mutex;
-  ch_vpn_socket_proxy_t *socks;
+  dap_stream_ch_t *ch;
+  dap_stream_ch_vpn_inst_t *inst;
+  struct vpn_tun_shard *shard; // Tun/tap of the leased address, NULL till the lease
+
+  pthread_mutex_t mutex; // Guards the ready list
+
+  atomic_bool dirty; // Ready to write is requested and ch_sf_packet_out() hasn't run since
+
+  // Sources with packets to send, in round-robin order
+  vpn_out_source_t *ready_head;
+  vpn_out_source_t *ready_tail;
+
+  // Raw VPN packets for the client, ch_sf_thread_raw() is the producer and channel's worker is the consumer
+  vpn_out_source_t raw_src;
+  atomic_bool raw_scheduled; // raw_src is on the ready list or being served by ch_sf_packet_out()
+  vpn_raw_lane_t raw_lanes[ VPN_LANES ];
+  atomic_uint_fast64_t raw_sojourn_last_ns;
+
+  // Lease rate limits, tokens are spent on the channel's worker thread only
+  vpn_tbf_t up_tbf;
+  vpn_tbf_t down_tbf;
+
+  ch_vpn_pkt_t *up_backlog[ VPN_UP_BACKLOG_SIZE ]; // Shaped upstream packets, worker thread only
+  size_t up_backlog_rindex;
+  size_t up_backlog_size;
+
+  atomic_uint_fast64_t up_shaped;
+  atomic_uint_fast64_t up_dropped;
+  atomic_uint_fast64_t down_throttled;
+
+  atomic_uint_fast64_t rejects[ DAP_STREAM_CH_VPN_REJECT_REASONS ]; // Worker thread is the only writer
+
+  atomic_uint acl_policy; // Destination ACL policy id, 0 for unrestricted
+
+  // Throttled channel waits in shaper list, guarded by vpn_shaper_mutex
+  struct dap_stream_ch_vpn *shaper_next;
+  uint64_t shaper_wake_at;
+  bool shaper_queued;
+  bool raw_parked; // raw_src is out of ready list till the shaper wakes it up
+
+  // Proxy sockets table, touched only from the channel's callbacks
+  ch_vpn_sock_slot_t *sock_slots;
+  uint32_t sock_slots_count;
+  uint32_t sock_slots_free;
+
   int raw_l3_sock;
 
 } dap_stream_ch_vpn_t;
@@ -231,70 +416,153 @@ typedef struct dap_stream_ch_vpn_remote_single {
 //  typedef int t_tun;
 //# endif
 
-#define VPN_PKT_BUFFER_SIZE 400
+typedef struct list_addr_element {
+
+  struct in_addr addr;
+  struct list_addr_element *next;
+
+} list_addr_element;
+
+/**
+  * @struct vpn_tun_shard
+  * @brief One tun/tap of the instance: its slice of the VPN network, its raw thread and its load counters
+  *
+  **/
+typedef struct vpn_tun_shard {
+
+  dap_stream_ch_vpn_inst_t *inst;
+  uint32_t index;
+
+  vpn_tun_t tun;
+
+  // Slice of the address pool, guarded by inst->clients_mutex
+  struct in_addr addr_host;          // Shard's own address on the tun, the gateway of its clients
+  struct in_addr addr_last;          // Last fresh address leased
+  struct in_addr addr_end;           // Last address of the slice, the broadcast one is not leased
+  list_addr_element *list_addr_head; // Released addresses, leased again first
+  uint32_t addr_released;            // Length of list_addr_head
+  uint32_t leases;                   // Addresses taken, the lease goes to the shard with the fewest
+
+  pthread_t raw_pid;
+  bool raw_started;
+  vpn_affinity_thread_t raw_thread;
+
+  // Reads are counted by the raw thread, writes by it and by the channels' workers
+  atomic_uint_fast64_t rx_packets;
+  atomic_uint_fast64_t rx_bytes;
+  atomic_uint_fast64_t rx_batches;
+  atomic_uint_fast64_t tx_packets;
+  atomic_uint_fast64_t tx_bytes;
+  atomic_uint_fast64_t tx_errors;
+
+} vpn_tun_shard_t;
+
+/**
+  * @struct dap_stream_ch_vpn_inst
+  * @brief One VPN network served on its own stream channel id: the tun/tap, the addresses, the threads,
+  *        the settings and the counters. Channels find it in their proc's internal pointer
+  *
+  **/
+struct dap_stream_ch_vpn_inst {
+
+  uint8_t ch_id;
+  bool started;        // dap_stream_ch_vpn_inst_start() is done, the settings made before it are fixed
+  atomic_bool running; // Threads go on while it's set, and while bQuitSignal is
 
-typedef struct vpn_local_network {
+  const char *vpn_addr, *vpn_mask;
 
-  struct in_addr client_addr_last;
   struct in_addr client_addr_mask;
   struct in_addr client_addr_host;
   struct in_addr client_addr;
 
-  int tun_ctl_fd;
+  vpn_tun_shard_t *shards; // Tun/tap interfaces sharing the network, the only one in the client mode
+  uint32_t shards_count;
+  uint32_t shard_shift;    // Host bits of a shard's slice, ch_sf_shard_of() finds the slice of the address
+
+  dap_stream_ch_vpn_remote_single_t *clients; // Remote clients identified by destination address
+
+  pthread_mutex_t clients_mutex;
+
+  // Proxied sockets
+  pthread_mutex_t socks_mutex;
+  EPOLL_HANDLE socks_epoll_fd;
+  ch_vpn_socket_proxy_t *socks_graveyard; // Unpolled sockets waiting for the end of epoll batch
+
+  pthread_t socks_pid;
+  bool socks_started;
+  vpn_affinity_thread_t socks_thread;
 
   #ifndef _WIN32
-    int tun_fd;
+    int stop_wake[ 2 ]; // Written once on delete, wakes the raw and the epoll threads
   #else
-    HANDLE tun_fd;
-    OVERLAPPED tun_read_overlap, tun_write_overlap;
-    int tun_index, tun_read_pending;
+    HANDLE hTerminateEvent;
   #endif
 
-  int flags;
+  pthread_mutex_t      shaper_mutex;
+  pthread_cond_t       shaper_cond;
+  pthread_t            shaper_pid;
+  dap_stream_ch_vpn_t *shaper_list;
+  bool                 shaper_running;
+  vpn_affinity_thread_t shaper_thread;
 
-  #ifndef _WIN32
-    struct ifreq ifr;
-  #endif
+  // Placement of the threads by kind, taken by each thread when it starts
+  dap_stream_ch_vpn_thread_config_t thread_config[ DAP_STREAM_CH_VPN_THREADS ];
 
-  dap_stream_ch_vpn_remote_single_t *clients; // Remote clients identified by destination address
+  atomic_uint_fast64_t notify_issued;    // dap_client_remote_ready_to_write() calls made
+  atomic_uint_fast64_t notify_coalesced; // Requests absorbed by already dirty channel
+  atomic_uint_fast64_t hairpin_forwarded;
+  atomic_uint_fast64_t hairpin_denied;
+  atomic_uint_fast64_t hairpin_dropped;
+  atomic_uint_fast64_t rejects[ DAP_STREAM_CH_VPN_REJECT_REASONS ];
 
-  ch_vpn_pkt_t *pkt_out[ VPN_PKT_BUFFER_SIZE ];
+  vpn_codel_params_t codel_params;
+  dap_stream_ch_vpn_rate_t rate_default;
+  dap_stream_ch_vpn_hairpin_t hairpin_policy;
 
-  size_t pkt_out_size;
-  size_t pkt_out_rindex;
-  size_t pkt_out_windex;
+  dap_stream_ch_vpn_nat_config_t nat_config;
+  bool nat_enabled;
+  vpn_nat_t *nat;
 
-  pthread_mutex_t pkt_out_mutex;
-  pthread_mutex_t clients_mutex;
+  _Atomic(vpn_acl_t *) acl;
 
-} vpn_local_network_t;
+  const vpn_tun_ops_t *tun_ops;
+  uint32_t tun_mtu;    // Kernel interface's link settings, 0 keeps the default
+  uint32_t tun_txqlen;
 
-typedef struct list_addr_element {
+  dap_stream_ch_vpn_dns_config_t dns_config;
+  bool dns_enabled;
+  vpn_dns_cache_t *dns;
+  dap_stream_ch_vpn_lease_callback_t lease_callback;
 
-  struct in_addr addr;
-  struct list_addr_element *next;
+  // Client mode: the first shard's tun is ours, client_addr is the leased address and client_addr_host the gateway,
+  // the only entry of clients is the lease so the tun packets find the channel by the source address
+  bool client_mode;
+  dap_stream_ch_vpn_client_config_t client_config;
+  char client_mask[ 16 ];
 
-} list_addr_element;
+  bool client_connected;
 
-static list_addr_element *list_addr_head = NULL;
+  uint32_t out_quantum_raw;
+  uint32_t out_quantum_proxy;
 
-static ch_vpn_socket_proxy_t *sf_socks = NULL;
-static ch_vpn_socket_proxy_t *sf_socks_client = NULL;
+};
 
-static pthread_mutex_t sf_socks_mutex;
-static pthread_cond_t  sf_socks_cond;
+typedef struct vpn_pkt_pool_item {
 
-static EPOLL_HANDLE sf_socks_epoll_fd;
+  struct vpn_pkt_pool_item *next;
 
-static pthread_t sf_socks_pid;
-static pthread_t sf_socks_raw_pid;
+} vpn_pkt_pool_item_t;
 
-static vpn_local_network_t *raw_server;
+// Proxy packets buffers are shared by all the instances
+static pthread_mutex_t      vpn_pkt_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vpn_pkt_pool_item_t *vpn_pkt_pool_free = NULL;
+static size_t               vpn_pkt_pool_free_count = 0;
 
-#ifdef _WIN32
-  HANDLE hTerminateEvent = NULL;
-  HANDLE hTunWriteEvent  = NULL;
-#endif
+// Instance of the dap_stream_ch_vpn_* calls without one, on channel 's'. Made by init or by the setting
+// before it, only deinit takes it away
+static pthread_mutex_t vpn_inst_default_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(dap_stream_ch_vpn_inst_t *) vpn_inst_default = NULL;
+static atomic_uint vpn_inst_count = 0;
 
 bool   bQuitSignal = false;
 
@@ -302,9 +570,21 @@ bool   bQuitSignal = false;
 
 void  *ch_sf_thread( void *arg );
 void  *ch_sf_thread_raw( void *arg );
-
-void  ch_sf_tun_create( );
-void  ch_sf_tun_destroy( );
+static void *ch_sf_thread_shaper( void *arg );
+static void  ch_sf_shaper_remove( dap_stream_ch_vpn_t *sf );
+static void  ch_sf_dns_deliver( void *arg, uint32_t client_addr, const uint8_t *ip_pkt, size_t ip_pkt_size );
+
+int   ch_sf_tun_create( dap_stream_ch_vpn_inst_t *inst );
+void  ch_sf_tun_destroy( vpn_tun_shard_t *shard );
+
+static int   ch_sf_tun_link_up( dap_stream_ch_vpn_inst_t *inst, vpn_tun_t *tun );
+static int   ch_sf_shards_alloc( dap_stream_ch_vpn_inst_t *inst, uint32_t count );
+static void  ch_sf_shards_free( dap_stream_ch_vpn_inst_t *inst );
+static int   ch_sf_shards_plan( dap_stream_ch_vpn_inst_t *inst );
+static int   ch_sf_server_init( dap_stream_ch_vpn_inst_t *inst, const char *vpn_addr, const char *vpn_mask );
+static void  ch_sf_server_fini( dap_stream_ch_vpn_inst_t *inst );
+static void  ch_sf_client_release( dap_stream_ch_t *ch );
+static void  ch_sf_addr_release( dap_stream_ch_vpn_inst_t *inst, in_addr_t addr );
 
 void  ch_sf_client_new( dap_stream_ch_t *ch , void *arg );
 void  ch_sf_delete( dap_stream_ch_t *ch , void *arg );
@@ -312,392 +592,496 @@ void  ch_sf_delete( dap_stream_ch_t *ch , void *arg );
 void  ch_sf_packet_in( dap_stream_ch_t *ch , void *arg );
 void  ch_sf_packet_out( dap_stream_ch_t *ch , void *arg );
 
-int   ch_sf_raw_write( uint8_t op_code, const void *data, size_t data_size );
+int   ch_sf_raw_enqueue( dap_stream_ch_t *ch, ch_vpn_pkt_t *pkt );
 void  stream_sf_disconnect( ch_vpn_socket_proxy_t *sf_sock );
 
-static const char *l_vpn_addr, *l_vpn_mask;
+void  stream_sf_socket_unref( ch_vpn_socket_proxy_t *sf_sock );
+void  stream_sf_socket_close( dap_stream_ch_t *ch, ch_vpn_socket_proxy_t *sf_sock );
+static void stream_sf_socks_graveyard_flush( dap_stream_ch_vpn_inst_t *inst );
+static vpn_out_source_t *stream_sf_ready_pop( dap_stream_ch_vpn_t *sf );
+static void stream_sf_out_source_release( vpn_out_source_t *src );
+
+ch_vpn_pkt_t *vpn_pkt_pool_get( void );
+void  vpn_pkt_pool_put( ch_vpn_pkt_t *pkt );
+static void vpn_pkt_pool_clear( void );
 
 /**
- * @brief dap_stream_ch_vpn_init Init actions for VPN stream channel
- * @param vpn_addr Zero if only client mode. Address if the node shares its local VPN
- * @param vpn_mask Zero if only client mode. Mask if the node shares its local VPN
- * @return 0 if everything is okay, lesser then zero if errors
+ * @brief dap_stream_ch_vpn_inst_new Make the VPN instance with the default settings. It's configured with
+ *        dap_stream_ch_vpn_inst_set_*() and serves its channel after dap_stream_ch_vpn_inst_start()
+ * @param ch_id Stream channel id, every instance of the process needs its own
+ * @return Instance or NULL on error
  */
-int dap_stream_ch_vpn_init( const char *vpn_addr, const char *vpn_mask )
+dap_stream_ch_vpn_inst_t *dap_stream_ch_vpn_inst_new( uint8_t ch_id )
 {
-  if ( !vpn_addr || !vpn_mask ) {
-    return 0;
-  }
-
-  l_vpn_addr = strdup( vpn_addr );
-  l_vpn_mask = strdup( vpn_mask );
-
-  raw_server = calloc( 1, sizeof(vpn_local_network_t) );
+  dap_stream_ch_vpn_inst_t *inst = calloc( 1, sizeof(dap_stream_ch_vpn_inst_t) );
 
-  pthread_mutex_init( &raw_server->clients_mutex, NULL );
-  pthread_mutex_init( &raw_server->pkt_out_mutex, NULL );
-
-  pthread_mutex_init( &sf_socks_mutex, NULL );
-  pthread_cond_init(  &sf_socks_cond, NULL );
+  if ( !inst )
+    return NULL;
 
-  pthread_create( &sf_socks_raw_pid, NULL, ch_sf_thread_raw, NULL );
-  pthread_create( &sf_socks_pid,     NULL, ch_sf_thread,     NULL );
+  inst->ch_id = ch_id;
+  inst->socks_epoll_fd = (EPOLL_HANDLE)-1;
 
-  dap_stream_ch_proc_add( 's', ch_sf_client_new,
-                               ch_sf_delete, 
-                               ch_sf_packet_in, 
-                               ch_sf_packet_out 
-  );
+  inst->codel_params.target_ns   = VPN_CODEL_TARGET_US * 1000ull;
+  inst->codel_params.interval_ns = VPN_CODEL_INTERVAL_US * 1000ull;
+  inst->codel_params.ecn         = true;
 
-  #ifdef _WIN32
-    hTerminateEvent = CreateEventA( NULL, true, false, NULL );
-    hTunWriteEvent  = CreateEventA( NULL, false, false, NULL );
-  #endif
+  inst->hairpin_policy    = DAP_STREAM_CH_VPN_HAIRPIN_FAST;
+  inst->tun_ops           = &vpn_tun_kernel_ops;
+  inst->out_quantum_raw   = VPN_OUT_QUANTUM_RAW;
+  inst->out_quantum_proxy = VPN_OUT_QUANTUM_PROXY;
 
-  return 0;
-}
+  pthread_mutex_init( &inst->clients_mutex, NULL );
+  pthread_mutex_init( &inst->socks_mutex, NULL );
+  pthread_mutex_init( &inst->shaper_mutex, NULL );
+  pthread_cond_init(  &inst->shaper_cond, NULL );
 
+  atomic_fetch_add( &vpn_inst_count, 1 );
 
-/**
- * @brief ch_sf_deinit
- */
-void dap_stream_ch_vpn_deinit( )
-{
-  #ifdef _WIN32
-    if ( hTunWriteEvent )
-      CloseHandle( hTunWriteEvent );
+  #ifndef _WIN32
+    inst->stop_wake[0] = inst->stop_wake[1] = -1;
 
-    if ( hTerminateEvent )
-      CloseHandle( hTerminateEvent );
+    if ( pipe(inst->stop_wake) ) {
+      log_it( L_CRITICAL, "Can't make the stop pipe: %s", strerror(errno) );
+      dap_stream_ch_vpn_inst_delete( inst );
+      return NULL;
+    }
+  #else
+    inst->hTerminateEvent = CreateEventA( NULL, true, false, NULL );
   #endif
 
-  pthread_mutex_destroy( &sf_socks_mutex );
-  pthread_cond_destroy( &sf_socks_cond );
-
-  free( (char*)l_vpn_addr );
-  free( (char*)l_vpn_mask );
+  if ( ch_sf_shards_alloc(inst, 1) ) {
+    dap_stream_ch_vpn_inst_delete( inst );
+    return NULL;
+  }
 
-  if ( raw_server )
-    free( raw_server );
+  return inst;
 }
 
-#ifdef _WIN32
-
-static intptr_t SearchTapsWIN32( tap_callback *cb, int all )
+/**
+ * @brief dap_stream_ch_vpn_inst_start Bring the instance's network up and serve its stream channel
+ * @param inst
+ * @param vpn_addr NULL for the client mode. Address if the node shares its local VPN
+ * @param vpn_mask NULL for the client mode. Mask if the node shares its local VPN
+ * @return 0 if everything is okay, lesser then zero if errors
+ */
+int dap_stream_ch_vpn_inst_start( dap_stream_ch_vpn_inst_t *inst, const char *vpn_addr, const char *vpn_mask )
 {
-  LONG status;
-  HKEY adapters_key, hkey;
-  DWORD len, type;
-  char buf[40];
-//  wchar_t name[40];
-  char name[128];
-  char keyname[strlen(CONNECTIONS_KEY) + sizeof(buf) + 1 + strlen("\\Connection")];
-  int i = 0, found = 0;
-  intptr_t ret = -1;
+  dap_stream_ch_proc_t *proc;
 
-  status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, ADAPTERS_KEY, 0,
-             KEY_READ, &adapters_key );
-
-  if ( status ) {
-    log_it( L_ERROR,"Error accessing registry key for network adapters" );
+  if ( inst->started ) {
+    log_it( L_ERROR, "VPN instance of channel '%c' is started already", inst->ch_id );
     return -1;
   }
 
-  while ( 1 ) {
+  inst->client_mode = !vpn_addr || !vpn_mask;
+  atomic_store( &inst->running, true );
 
-    len = sizeof( buf );
-    status = RegEnumKeyExA( adapters_key, i++, buf, &len, NULL, NULL, NULL, NULL );
-    if ( status ) {
-      if ( status != ERROR_NO_MORE_ITEMS )
-        ret = -1;
-      break;
+  // Tun comes up with the lease, the raw thread starts then
+  if ( inst->client_mode ) {
+    if ( inst->shards_count > 1 ) {
+      log_it( L_WARNING, "Client mode has one tun/tap, %u shards are not used", inst->shards_count );
+      if ( ch_sf_shards_alloc(inst, 1) ) {
+        atomic_store( &inst->running, false );
+        return -1;
+      }
     }
 
-    dap_snprintf( keyname, sizeof(keyname), "%s\\%s", ADAPTERS_KEY, buf );
-
-    status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hkey );
-    if ( status )
-      continue;
+    vpn_tun_init( &inst->shards[0].tun, inst->tun_ops );
+    log_it( L_NOTICE, "VPN channel '%c' is in the client mode", inst->ch_id );
+  }
+  else if ( ch_sf_server_init(inst, vpn_addr, vpn_mask) ) {
+    atomic_store( &inst->running, false ); // Nothing is started yet, the settings may be fixed and start retried
+    return -1;
+  }
 
-    len = sizeof( buf) ;
-    status = RegQueryValueExA( hkey, "ComponentId", NULL, &type, (unsigned char *)buf, &len );
-    if ( status || type != REG_SZ || strcmp(buf, TAP_COMPONENT_ID) ) {
-      RegCloseKey( hkey );
-      continue;
-    }
+  inst->started = true;
 
-    len = sizeof( buf );
-    status = RegQueryValueExA( hkey, "NetCfgInstanceId", NULL, &type, (unsigned char *)buf, &len );
-    RegCloseKey( hkey );
-    if ( status || type != REG_SZ )
-      continue;
+  dap_stream_ch_proc_add( inst->ch_id, ch_sf_client_new,
+                                       ch_sf_delete,
+                                       ch_sf_packet_in,
+                                       ch_sf_packet_out
+  );
 
-    dap_snprintf( keyname, sizeof(keyname), "%s\\%s\\Connection", CONNECTIONS_KEY, buf );
+  // Channels of the id find the instance here
+  if ( (proc = dap_stream_ch_proc_find(inst->ch_id)) != NULL )
+    proc->internal = inst;
 
-    status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hkey );
-    if ( status )
-      continue;
+  return 0;
+}
 
-    len = sizeof( name );
-    status = RegQueryValueExW( hkey, L"Name", NULL, &type, (unsigned char *)name, &len );
-    RegCloseKey( hkey );
-    if ( status || type != REG_SZ )
-      continue;
+/**
+ * @brief ch_sf_server_init Start the shared VPN network: tun/tap, NAT, DNS cache and the threads
+ * @param inst
+ * @param vpn_addr
+ * @param vpn_mask
+ * @return 0 if ok
+ */
+static int ch_sf_server_init( dap_stream_ch_vpn_inst_t *inst, const char *vpn_addr, const char *vpn_mask )
+{
+  free( (char*)inst->vpn_addr );
+  free( (char*)inst->vpn_mask );
 
-    ++ found;
+  inst->vpn_addr = strdup( vpn_addr );
+  inst->vpn_mask = strdup( vpn_mask );
 
-    ret = cb( buf, name );
+  #ifndef _WIN32
+    inet_aton( inst->vpn_addr, &inst->client_addr );
+    inet_aton( inst->vpn_mask, &inst->client_addr_mask );
+  #else
+    inst->client_addr.s_addr = inet_addr( inst->vpn_addr );
+    inst->client_addr_mask.s_addr = inet_addr( inst->vpn_mask );
+  #endif
 
-    if ( !all )
-      break;
-  }
+  if ( ch_sf_shards_plan(inst) )
+    return -1;
 
-  RegCloseKey( adapters_key );
+  // Made before the first CONNECT can come
+  inst->socks_epoll_fd = epoll_create( SF_MAX_EVENTS );
 
-  if ( !found ) {
-    log_it( L_ERROR,"Not found Windows-TAP adapters. Is the driver installed?" );
+  if ( (intptr_t)inst->socks_epoll_fd == -1 ) {
+    log_it( L_CRITICAL, "Can't create the epoll fd: %s", strerror(errno) );
+    return -1;
   }
 
-  return ret;
-}
+  #ifndef _WIN32
+  {
+    // No socket behind, ch_sf_thread() takes it as the stop request
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
 
-static intptr_t tun_create_WIN32( char *guid, char *name )
-{
-  char devname[80];
-  HANDLE tun_fd;
-  ULONG data[3];
-  uint8_t cdata[64];
-  DWORD len;
+    epoll_ctl( inst->socks_epoll_fd, EPOLL_CTL_ADD, inst->stop_wake[0], &ev );
+  }
+  #endif
 
-  dap_snprintf( devname, sizeof(devname), DEVTEMPLATE, guid );
+  if ( inst->nat_enabled && !(inst->nat = vpn_nat_new(&inst->nat_config)) )
+    log_it( L_ERROR, "Can't start NAT, clients' traffic goes to the tun/tap as is" );
 
-  tun_fd = CreateFileA( devname, GENERIC_WRITE | GENERIC_READ, 0, 0,
-           OPEN_EXISTING, FILE_ATTRIBUTE_SYSTEM | FILE_FLAG_OVERLAPPED, 0 );
+  if ( inst->dns_enabled && !(inst->dns = vpn_dns_new(&inst->dns_config, ch_sf_dns_deliver, inst)) )
+    log_it( L_ERROR, "Can't start DNS cache, queries go to the resolver as is" );
 
-  if (tun_fd == INVALID_HANDLE_VALUE) {
-    log_it( L_ERROR,"Failed to open %s", devname );
+  // Up before the threads, the network is known when the first client asks for the address
+  if ( ch_sf_tun_create(inst) ) {
+    ch_sf_server_fini( inst );
     return -1;
   }
 
-  log_it( L_INFO,"opened tun device %s", devname);
+  inst->shaper_running = true;
 
-  if ( !DeviceIoControl(tun_fd, TAP_IOCTL_GET_VERSION,
-           data, sizeof(&data), data, sizeof(data), &len, NULL)) {
+  for ( uint32_t i = 0; i < inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
 
-    log_it( L_ERROR,"Failed to obtain TAP driver version" );
-    return -1;
-  }
-  if ( data[0] < 9 || (data[0] == 9 && data[1] < 9) ) {
-    log_it( L_ERROR,"TAP-Windows driver v9.9 or greater is required (found %ld.%ld)", data[0], data[1] );
-    return -1;
+    if ( shard->tun.fd != -1 )
+      shard->raw_started = !pthread_create( &shard->raw_pid, NULL, ch_sf_thread_raw, shard );
   }
 
-  log_it( L_INFO,"TAP Windows driver v%ld.%ld (%ld)", data[0], data[1], data[2] );
+  inst->socks_started = !pthread_create( &inst->socks_pid,  NULL, ch_sf_thread,        inst );
 
-  uint32_t  MTU;
-  if ( !DeviceIoControl(tun_fd, TAP_IOCTL_GET_MTU,
-           &MTU, sizeof(MTU), &MTU, sizeof(MTU), &len, NULL)) {
+  if ( pthread_create(&inst->shaper_pid, NULL, ch_sf_thread_shaper, inst) )
+    inst->shaper_running = false;
 
-    log_it( L_WARNING,"Failed to obtain TAP MTU" );
-  }
+  return 0;
+}
 
-  log_it( L_INFO,"TAP-Windows MTU = %u ", MTU );
+/**
+ * @brief ch_sf_server_fini Undo ch_sf_server_init() before the threads are started, start may be retried then.
+ *        Closes the shards opened already
+ * @param inst
+ */
+static void ch_sf_server_fini( dap_stream_ch_vpn_inst_t *inst )
+{
+  for ( uint32_t i = 0; i < inst->shards_count; i ++ )
+    ch_sf_tun_destroy( &inst->shards[i] );
 
-  if ( !DeviceIoControl( tun_fd, TAP_IOCTL_GET_MAC,
-           cdata, sizeof(cdata), cdata, sizeof(cdata), &len, NULL) ) {
+  vpn_dns_delete( inst->dns );
+  inst->dns = NULL;
 
-    log_it( L_ERROR, "Failed to get MAC" );
-    return -1;
-  }
+  vpn_nat_delete( inst->nat );
+  inst->nat = NULL;
 
-  log_it( L_INFO,"TAP MAC addr %X-%X-%X-%X-%X-%X ", cdata[0], cdata[1], cdata[2], cdata[3], cdata[4], cdata[5] );
+  #ifndef _WIN32
+    close( inst->socks_epoll_fd );
+  #else
+    epoll_close( inst->socks_epoll_fd );
+  #endif
+  inst->socks_epoll_fd = (EPOLL_HANDLE)-1;
+}
 
-//  #define TAP_IOCTL_GET_MAC               _TAP_IOCTL(1)
-//  #define TAP_IOCTL_GET_VERSION           _TAP_IOCTL(2)
-//  #define TAP_IOCTL_GET_MTU               _TAP_IOCTL(3)
-//  #define TAP_IOCTL_GET_INFO              _TAP_IOCTL(4)
-//  #define TAP_IOCTL_CONFIG_POINT_TO_POINT _TAP_IOCTL(5)
-//  #define TAP_IOCTL_SET_MEDIA_STATUS      _TAP_IOCTL(6)
-//  #define TAP_IOCTL_CONFIG_DHCP_MASQ      _TAP_IOCTL(7)
-//  #define TAP_IOCTL_GET_LOG_LINE          _TAP_IOCTL(8)
-//  #define TAP_IOCTL_CONFIG_DHCP_SET_OPT   _TAP_IOCTL(9)
-//  #define TAP_IOCTL_CONFIG_TUN            _TAP_IOCTL(10)
+/**
+ * @brief dap_stream_ch_vpn_inst_delete Stop the instance's threads and free it. Its channel must have
+ *        no streams left
+ * @param inst
+ */
+void dap_stream_ch_vpn_inst_delete( dap_stream_ch_vpn_inst_t *inst )
+{
+  dap_stream_ch_proc_t *proc;
 
-//  data[0] = inet_addr( "0.0.0.0" );
+  if ( !inst )
+    return;
 
-  log_it( L_INFO, "l_vpn_addr = %s, l_vpn_mask = %s", l_vpn_addr, l_vpn_mask );
+  if ( inst->started && (proc = dap_stream_ch_proc_find(inst->ch_id)) != NULL && proc->internal == inst )
+    proc->internal = NULL;
 
-  data[0] = inet_addr( l_vpn_addr );
-  data[1] = 0;
-  data[2] = 0;
+  atomic_store( &inst->running, false );
 
-  if ( !DeviceIoControl( tun_fd, TAP_IOCTL_CONFIG_TUN,
-           data, sizeof(data), data, sizeof(data), &len, NULL) ) {
+  #ifndef _WIN32
+    if ( inst->stop_wake[1] != -1 && write(inst->stop_wake[1], "", 1) < 0 )
+      log_it( L_WARNING, "Can't wake up the threads: %s", strerror(errno) );
+  #else
+    if ( inst->hTerminateEvent )
+      SetEvent( inst->hTerminateEvent );
+  #endif
 
-    log_it( L_ERROR, "Failed to set TAP IP addresses" );
-    return -1;
+  // Raw thread takes the tun down on exit
+  for ( uint32_t i = 0; inst->shards && i < inst->shards_count; i ++ ) {
+    if ( inst->shards[i].raw_started )
+      pthread_join( inst->shards[i].raw_pid, NULL );
+    else
+      ch_sf_tun_destroy( &inst->shards[i] );
   }
 
+  if ( inst->socks_started )
+    pthread_join( inst->socks_pid, NULL );
 
-  data[0] = 1;
-  if ( !DeviceIoControl(tun_fd, TAP_IOCTL_SET_MEDIA_STATUS,
-           data, sizeof(data[0]), data, sizeof(data[0]),
-           &len, NULL) ) {
-
-    log_it( L_ERROR, "Failed to set TAP media status" );
-    return -1;
+  if ( inst->shaper_running ) {
+    pthread_mutex_lock( &inst->shaper_mutex );
+    inst->shaper_running = false;
+    pthread_cond_signal( &inst->shaper_cond );
+    pthread_mutex_unlock( &inst->shaper_mutex );
+    pthread_join( inst->shaper_pid, NULL );
   }
 
-  {
-  ULONG data;
-  DWORD len;
+  stream_sf_socks_graveyard_flush( inst );
 
-  for ( data = 0; data <= 1; data ++ ) {
-    if ( !DeviceIoControl((HANDLE)tun_fd, TAP_IOCTL_SET_MEDIA_STATUS,
-          &data, sizeof(data), &data, sizeof(data), &len, NULL) ) {
-      log_it( L_ERROR, "Failed to set TAP media status" );
-      return -1;
-    }
+  if ( (intptr_t)inst->socks_epoll_fd != -1 ) {
+    #ifndef _WIN32
+      close( inst->socks_epoll_fd );
+    #else
+      epoll_close( inst->socks_epoll_fd );
+    #endif
   }
+
+  vpn_nat_delete( inst->nat );
+  vpn_dns_delete( inst->dns );
+  vpn_acl_free( atomic_exchange(&inst->acl, NULL) );
+
+  // Tables retired by the other instances may still be read by their workers
+  if ( atomic_fetch_sub(&vpn_inst_count, 1) == 1 ) {
+    vpn_acl_reclaim( true );
+    vpn_pkt_pool_clear( );
   }
 
-  raw_server->tun_fd = (HANDLE)tun_fd;
-  raw_server->tun_read_overlap.hEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+  ch_sf_shards_free( inst );
+
+  #ifndef _WIN32
+    for ( int i = 0; i < 2; i ++ ) {
+      if ( inst->stop_wake[i] != -1 )
+        close( inst->stop_wake[i] );
+    }
+  #else
+    if ( inst->hTerminateEvent )
+      CloseHandle( inst->hTerminateEvent );
+  #endif
+
+  pthread_mutex_destroy( &inst->clients_mutex );
+  pthread_mutex_destroy( &inst->socks_mutex );
+  pthread_mutex_destroy( &inst->shaper_mutex );
+  pthread_cond_destroy( &inst->shaper_cond );
+
+  for ( int i = 0; i < DAP_STREAM_CH_VPN_THREADS; i ++ )
+    vpn_affinity_config_free( &inst->thread_config[i] );
 
-  return (intptr_t)tun_fd;
+  free( (char*)inst->vpn_addr );
+  free( (char*)inst->vpn_mask );
+
+  free( inst );
 }
 
-int win32_read_tun( uint8_t *buffer, uint32_t size )
+/**
+ * @brief dap_stream_ch_vpn_get_inst Instance the channel belongs to, for the callbacks
+ * @param ch
+ * @return Instance or NULL if the channel is not a VPN one
+ */
+dap_stream_ch_vpn_inst_t *dap_stream_ch_vpn_get_inst( dap_stream_ch_t *ch )
 {
-  DWORD pkt_size;
-
- reread:
+  return ( ch && ch->internal && ch->proc && ch->proc->new_callback == ch_sf_client_new ) ? DAP_STREAM_CH_VPN( ch )->inst : NULL;
+}
 
-  if ( !raw_server->tun_read_pending && 
-       !ReadFile(raw_server->tun_fd, buffer, size, &pkt_size,
-          &raw_server->tun_read_overlap)) {
-    DWORD err = GetLastError();
+/**
+ * @brief ch_sf_shards_alloc Make count shards without the tun/tap and the addresses, the old ones are freed.
+ *        Their raw threads must be stopped
+ * @param inst
+ * @param count
+ * @return 0 if ok
+ */
+static int ch_sf_shards_alloc( dap_stream_ch_vpn_inst_t *inst, uint32_t count )
+{
+  ch_sf_shards_free( inst );
 
-    if ( err == ERROR_IO_PENDING )
-      raw_server->tun_read_pending = 1;
-    else if (err == ERROR_OPERATION_ABORTED) {
-      log_it( L_ERROR, "TAP device not active. Disconnecting.");
-      return -1;
-    } else {
-      log_it( L_ERROR, "TAP device: read failed");
-    }
+  if ( !(inst->shards = (vpn_tun_shard_t *)calloc(count, sizeof(vpn_tun_shard_t))) )
     return -1;
-  }
 
-  if ( !GetOverlappedResult(raw_server->tun_fd,
-          &raw_server->tun_read_overlap, &pkt_size,
-          FALSE)) {
-    DWORD err = GetLastError();
+  inst->shards_count = count;
 
-    if ( err != ERROR_IO_INCOMPLETE ) {
-      raw_server->tun_read_pending = 0;
-      log_it( L_ERROR, "TAP device: complete read failed");
-      goto reread;
-    }
-    return -1;
+  for ( uint32_t i = 0; i < count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
+
+    shard->inst = inst;
+    shard->index = i;
+
+    vpn_tun_init( &shard->tun, inst->tun_ops );
   }
 
-  raw_server->tun_read_pending = 0;
-  
-  return pkt_size;
+  return 0;
 }
 
-int win32_write_tun( uint8_t *buffer, uint32_t size )
+/**
+ * @brief ch_sf_shards_free Free the shards, their raw threads are stopped and their tun/tap closed already
+ * @param inst
+ */
+static void ch_sf_shards_free( dap_stream_ch_vpn_inst_t *inst )
 {
-  DWORD pkt_size = 0;
-  DWORD err;
-
-  if ( WriteFile(raw_server->tun_fd, buffer, size, &pkt_size, &raw_server->tun_write_overlap) ) {
-    log_it( L_INFO, "TAP device: wrote %u bytes", pkt_size );
-    return pkt_size;
-  }
+  list_addr_element *el;
 
-  err = GetLastError();
-  if ( err == ERROR_IO_PENDING ) {
-    log_it( L_INFO, "TAP device: Waiting for write" );
+  for ( uint32_t i = 0; inst->shards && i < inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
 
-    if ( GetOverlappedResult(raw_server->tun_fd, &raw_server->tun_write_overlap, &pkt_size, TRUE) ) {
-      log_it( L_INFO, "TAP device: wrote %u bytes after waiting", pkt_size );
-      return pkt_size;
+    while ( (el = shard->list_addr_head) != NULL ) {
+      LL_DELETE( shard->list_addr_head, el );
+      free( el );
     }
-//    err = GetLastError();
   }
 
-  log_it( L_ERROR, "TAP device: Failed to write" );
-
-  return -1;
+  free( inst->shards );
+  inst->shards = NULL;
+  inst->shards_count = 0;
 }
 
-#endif
-
-void ch_sf_tun_create()
+/**
+ * @brief ch_sf_shards_plan Split the VPN network into equal slices, one per shard. The first address of
+ *        the slice is the shard's own, so the first shard keeps the gateway the network always had
+ * @param inst
+ * @return 0 if ok, -1 if the network is too small for the shards
+ */
+static int ch_sf_shards_plan( dap_stream_ch_vpn_inst_t *inst )
 {
-  #ifndef _WIN32
-    inet_aton( l_vpn_addr, &raw_server->client_addr );
-    inet_aton( l_vpn_mask, &raw_server->client_addr_mask );
-  #else
-    raw_server->client_addr.s_addr = inet_addr( l_vpn_addr );
-    raw_server->client_addr_mask.s_addr = inet_addr( l_vpn_mask );
-  #endif
-
-  raw_server->client_addr_host.s_addr = (raw_server->client_addr.s_addr | 0x01000000); // grow up some shit here!
-  raw_server->client_addr_last.s_addr = raw_server->client_addr_host.s_addr;
+  uint32_t net = ntohl( inst->client_addr.s_addr & inst->client_addr_mask.s_addr );
+  uint32_t prefix_len = vpn_netlink_prefix_len( inst->client_addr_mask.s_addr );
+  uint32_t bits = 0;
 
-  #ifndef _WIN32
+  while ( (1u << bits) < inst->shards_count )
+    bits ++;
 
-  if( (raw_server->tun_ctl_fd = open("/dev/net/tun", O_RDWR)) < 0 ) {
-    log_it( L_ERROR,"Opening /dev/net/tun error: '%s'", strerror(errno) );
-    return;
+  // Slice needs the shard's address, at least one client's and the broadcast
+  if ( prefix_len + bits > 30 ) {
+    log_it( L_CRITICAL, "VPN network /%u is too small for %u tun/tap shards", prefix_len, inst->shards_count );
+    return -1;
   }
 
-  int err;
-  memset( &raw_server->ifr, 0, sizeof(raw_server->ifr) );
+  inst->shard_shift = 32 - prefix_len - bits;
 
-  raw_server->ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  for ( uint32_t i = 0; i < inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
+    uint32_t base = net + (uint32_t)( (uint64_t)i << inst->shard_shift );
 
-  if( (err = ioctl(raw_server->tun_ctl_fd, TUNSETIFF, (void *)&raw_server->ifr)) < 0 ) {
-    log_it(L_CRITICAL, "ioctl(TUNSETIFF) error: '%s' ",strerror(errno));
-    close(raw_server->tun_ctl_fd);
-    raw_server->tun_ctl_fd = -1;
+    shard->addr_host.s_addr = htonl( base + 1 );
+    shard->addr_last.s_addr = shard->addr_host.s_addr;
+    shard->addr_end.s_addr  = htonl( base + (uint32_t)((1ull << inst->shard_shift) - 2) );
   }
-  else {
-    char buf[256];
-    log_it( L_NOTICE,"Bringed up %s virtual network interface (%s/%s)", raw_server->ifr.ifr_name,inet_ntoa(raw_server->client_addr_host), l_vpn_mask );
-    raw_server->tun_fd = raw_server->tun_ctl_fd; // Looks yes, its so
 
-    dap_snprintf( buf, sizeof(buf), "ip link set %s up", raw_server->ifr.ifr_name );
-    system( buf );
-    dap_snprintf( buf, sizeof(buf),"ip addr add %s/%s dev %s ", inet_ntoa(raw_server->client_addr_host),l_vpn_mask, raw_server->ifr.ifr_name );
-    system( buf );
-  }
-  #else
+  inst->client_addr_host = inst->shards[0].addr_host;
 
-  raw_server->tun_fd = (HANDLE)SearchTapsWIN32( tun_create_WIN32, 0 );
+  return 0;
+}
 
-  #endif
+/**
+ * @brief ch_sf_shard_of Shard the address belongs to
+ * @param inst
+ * @param addr
+ * @return Shard or NULL if the address is not in the VPN network
+ */
+static inline vpn_tun_shard_t *ch_sf_shard_of( dap_stream_ch_vpn_inst_t *inst, in_addr_t addr )
+{
+  uint64_t index = (uint64_t)( ntohl(addr) - ntohl(inst->client_addr.s_addr & inst->client_addr_mask.s_addr) ) >> inst->shard_shift;
+
+  return index < inst->shards_count ? &inst->shards[index] : NULL;
 }
 
-#ifndef _WIN32
-void ch_sf_tun_destroy( )
+/**
+ * @brief ch_sf_shard Tun/tap the channel's packets go to, the first one till the address is leased
+ * @param sf
+ * @return
+ */
+static inline vpn_tun_shard_t *ch_sf_shard( dap_stream_ch_vpn_t *sf )
 {
-//  close( raw_server->tun_fd );
-  raw_server->tun_fd = -1;
+  return sf->shard ? sf->shard : &sf->inst->shards[0];
 }
-#else
-void ch_sf_tun_destroy( void )
+
+/**
+ * @brief ch_sf_tun_create Bring up the shards' tun/tap, the kernel interfaces are addressed with their slices
+ * @param inst
+ * @return 0 if ok, -1 if any shard's tun/tap can't be opened or configured
+ */
+int ch_sf_tun_create( dap_stream_ch_vpn_inst_t *inst )
+{
+  uint8_t prefix_len = (uint8_t)( 32 - inst->shard_shift );
+
+  for ( uint32_t i = 0; i < inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
+
+    vpn_tun_init( &shard->tun, inst->tun_ops );
+
+    if ( vpn_tun_open(&shard->tun, inst->vpn_addr, inst->vpn_mask) ) {
+      log_it( L_CRITICAL, "Can't bring up %s tun/tap backend for shard %u", inst->tun_ops->name, i );
+      return -1; // Lease would hand out the shard's slice with nothing behind it
+    }
+
+    log_it( L_NOTICE, "Tun/tap backend %s is up, MTU %u", inst->tun_ops->name, shard->tun.mtu );
+
+    // Kernel interface is addressed by us, the rest of the backends have nothing to configure
+    if ( shard->tun.ifname[0] ) {
+      uint64_t started = vpn_clock_ns( );
+      int ret = ch_sf_tun_link_up( inst, &shard->tun );
+
+      if ( !ret )
+        ret = vpn_netlink_addr_add( shard->tun.ifname, shard->addr_host.s_addr, prefix_len, 0 );
+
+      // Replies to the masqueraded clients come back through the first tun/tap
+      if ( !ret && inst->nat && i == 0 )
+        ret = vpn_netlink_route_add( shard->tun.ifname, inst->nat_config.nat_addr, 32 );
+
+      if ( ret ) {
+        log_it( L_CRITICAL, "Can't configure %s, clients won't reach the network", shard->tun.ifname );
+        return -1;
+      }
+
+      log_it( L_NOTICE,"Bringed up %s virtual network interface (%s/%u) in %llu us", shard->tun.ifname,
+              inet_ntoa(shard->addr_host), prefix_len, (unsigned long long)((vpn_clock_ns() - started) / 1000) );
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief ch_sf_tun_link_up Bring the kernel interface up with the link settings of dap_stream_ch_vpn_inst_set_tun_link()
+ * @param inst
+ * @param tun
+ * @return 0 if ok
+ */
+static int ch_sf_tun_link_up( dap_stream_ch_vpn_inst_t *inst, vpn_tun_t *tun )
 {
-  CloseHandle( raw_server->tun_fd );
-  raw_server->tun_fd = NULL;
+  if ( vpn_netlink_link_up(tun->ifname, inst->tun_mtu, inst->tun_txqlen) )
+    return -1;
 
-  CloseHandle( raw_server->tun_read_overlap.hEvent );
-  raw_server->tun_read_overlap.hEvent = NULL;
+  if ( inst->tun_mtu )
+    tun->mtu = inst->tun_mtu;
+
+  return 0;
+}
+
+void ch_sf_tun_destroy( vpn_tun_shard_t *shard )
+{
+  vpn_tun_close( &shard->tun );
 }
-#endif
 
 /**
  * @brief stream_sf_new Callback to constructor of object of Ch
@@ -706,13 +1090,25 @@ void ch_sf_tun_destroy( void )
  */
 void ch_sf_client_new( dap_stream_ch_t *ch , void *arg )
 {
+  dap_stream_ch_vpn_inst_t *inst = (dap_stream_ch_vpn_inst_t *)ch->proc->internal;
+
+  if ( !inst ) {
+    log_it( L_ERROR, "No VPN instance serves channel '%c'", ch->proc->id );
+    return;
+  }
+
   dap_stream_ch_vpn_t *sf = calloc( 1, sizeof(dap_stream_ch_vpn_t) );
 
   ch->internal = sf;
+  sf->ch = ch;
+  sf->inst = inst;
 
   pthread_mutex_init( &sf->mutex, NULL );
+  sf->sock_slots_free = VPN_SOCK_SLOT_NONE;
+  sf->raw_src.type = VPN_OUT_SOURCE_RAW;
 
-  sf->raw_l3_sock = socket( PF_INET, SOCK_RAW, IPPROTO_RAW );
+  // Proxying is the server's job
+  sf->raw_l3_sock = inst->client_mode ? -1 : socket( PF_INET, SOCK_RAW, IPPROTO_RAW );
 }
 
 /**
@@ -722,32 +1118,45 @@ void ch_sf_client_new( dap_stream_ch_t *ch , void *arg )
  */
 void ch_sf_delete( dap_stream_ch_t *ch , void *arg )
 {
+  if ( !DAP_STREAM_CH_VPN(ch) )
+    return;
+
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+
   log_it( L_DEBUG, "ch_sf_delete() for %s", ch->stream->conn->hostaddr );
 
-  ch_vpn_socket_proxy_t *cur, *tmp;
   dap_stream_ch_vpn_remote_single_t *raw_client = 0;
 
+  ch_sf_shaper_remove( DAP_STREAM_CH_VPN(ch) );
+
+  while ( DAP_STREAM_CH_VPN(ch)->up_backlog_size ) {
+    free( DAP_STREAM_CH_VPN(ch)->up_backlog[DAP_STREAM_CH_VPN(ch)->up_backlog_rindex] );
+    DAP_STREAM_CH_VPN(ch)->up_backlog_rindex = (DAP_STREAM_CH_VPN(ch)->up_backlog_rindex + 1) % VPN_UP_BACKLOG_SIZE;
+    DAP_STREAM_CH_VPN(ch)->up_backlog_size --;
+  }
+
+  if ( inst->client_mode )
+    ch_sf_client_release( ch );
+
   // in_addr_t raw_client_addr = DAP_STREAM_CH_VPN(ch)->tun_client_addr.s_addr;
-  in_addr_t raw_client_addr = ch->stream->session->tun_client_addr.s_addr;
+  in_addr_t raw_client_addr = inst->client_mode ? 0 : ch->stream->session->tun_client_addr.s_addr;
 
   if ( raw_client_addr ) {
 
     log_it( L_DEBUG,"ch_sf_delete() %s searching in hash table",
             inet_ntoa( ch->stream->session->tun_client_addr) );
 
-    list_addr_element *el = (list_addr_element*)malloc( sizeof(list_addr_element) );
+    pthread_mutex_lock( &inst->clients_mutex );
 
-    //el->addr = DAP_STREAM_CH_VPN(ch)->tun_client_addr;
-    el->addr = ch->stream->session->tun_client_addr;
-    LL_APPEND( list_addr_head, el );
-    //LL_FOREACH(list_addr_head,el) log_it(L_INFO,"addr = %s", inet_ntoa(el->addr));
+    ch_sf_addr_release( inst, raw_client_addr );
 
-    pthread_mutex_lock( &raw_server->clients_mutex );
+    HASH_FIND_INT( inst->clients, &raw_client_addr, raw_client );
 
-    HASH_FIND_INT( raw_server->clients, &raw_client_addr, raw_client );
+    if ( inst->nat )
+      vpn_nat_client_release( inst->nat, raw_client_addr );
 
     if ( raw_client ) {
-      HASH_DEL( raw_server->clients, raw_client );
+      HASH_DEL( inst->clients, raw_client );
       log_it( L_DEBUG, "ch_sf_delete() %s removed from hash table",
                    inet_ntoa(ch->stream->session->tun_client_addr));
       free( raw_client );
@@ -756,990 +1165,2944 @@ void ch_sf_delete( dap_stream_ch_t *ch , void *arg )
       log_it( L_DEBUG,"ch_sf_delete() %s is not present in raw sockets hash table",
               inet_ntoa(ch->stream->session->tun_client_addr) );
 
-    pthread_mutex_unlock(& raw_server->clients_mutex );
+    pthread_mutex_unlock(& inst->clients_mutex );
   }
 
-  HASH_ITER( hh, DAP_STREAM_CH_VPN(ch)->socks ,cur, tmp ) {
+  for ( uint32_t i = 0; i < DAP_STREAM_CH_VPN(ch)->sock_slots_count; i ++ ) {
+    ch_vpn_socket_proxy_t *cur = DAP_STREAM_CH_VPN(ch)->sock_slots[i].sock;
+    if ( !cur )
+      continue;
     log_it( L_DEBUG, "delete socket: %i", cur->sock );
-    HASH_DEL( DAP_STREAM_CH_VPN(ch)->socks, cur );
-    if( cur )
-      free( cur );
+    stream_sf_socket_close( ch, cur );
+  }
+
+  vpn_out_source_t *ready;
+  while ( (ready = stream_sf_ready_pop(DAP_STREAM_CH_VPN(ch))) != NULL )
+    stream_sf_out_source_release( ready );
+
+  // Client is out of inst->clients already, so ch_sf_thread_raw() can't add more
+  ch_vpn_pkt_t *raw_pkt;
+  for ( int lane = 0; lane < VPN_LANES; lane ++ ) {
+    while ( (raw_pkt = vpn_pkt_spsc_pop(&DAP_STREAM_CH_VPN(ch)->raw_lanes[lane].q)) != NULL )
+      free( raw_pkt );
   }
 
-  pthread_mutex_unlock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
+  free( DAP_STREAM_CH_VPN(ch)->sock_slots );
+  DAP_STREAM_CH_VPN(ch)->sock_slots = NULL;
+  DAP_STREAM_CH_VPN(ch)->sock_slots_count = 0;
 
-  if ( DAP_STREAM_CH_VPN(ch)->raw_l3_sock )
+  if ( DAP_STREAM_CH_VPN(ch)->raw_l3_sock >= 0 )
     close( DAP_STREAM_CH_VPN(ch)->raw_l3_sock );
 }
 
-void stream_sf_socket_delete( ch_vpn_socket_proxy_t *sf )
+/**
+ * @brief stream_sf_slot_alloc Put the socket into the channel's table
+ * @param sf
+ * @param sf_sock
+ * @return Handle for the socket or -1 if the table is full
+ */
+static int stream_sf_slot_alloc( dap_stream_ch_vpn_t *sf, ch_vpn_socket_proxy_t *sf_sock )
 {
-  if( !sf ) return;
+  if ( sf->sock_slots_free == VPN_SOCK_SLOT_NONE ) {
 
-  if ( sf->sock > 0 )
-    close( sf->sock );
+    uint32_t count = sf->sock_slots_count ? sf->sock_slots_count * 2 : VPN_SOCK_SLOTS_INIT;
+    if ( count > VPN_SOCK_SLOTS_MAX )
+      count = VPN_SOCK_SLOTS_MAX;
+    if ( count == sf->sock_slots_count )
+      return -1;
 
-  pthread_mutex_destroy( &sf->mutex );
+    ch_vpn_sock_slot_t *slots = (ch_vpn_sock_slot_t *)realloc( sf->sock_slots, count * sizeof(ch_vpn_sock_slot_t) );
+    if ( !slots )
+      return -1;
 
-  free( sf );
+    for ( uint32_t i = sf->sock_slots_count; i < count; i ++ ) {
+      slots[i].sock = NULL;
+      slots[i].gen = 1;
+      slots[i].next_free = (i + 1 < count) ? i + 1 : VPN_SOCK_SLOT_NONE;
+    }
+
+    sf->sock_slots_free = sf->sock_slots_count;
+    sf->sock_slots = slots;
+    sf->sock_slots_count = count;
+  }
+
+  uint32_t idx = sf->sock_slots_free;
+  ch_vpn_sock_slot_t *slot = &sf->sock_slots[idx];
+
+  sf->sock_slots_free = slot->next_free;
+  slot->sock = sf_sock;
+
+  return (int)( (slot->gen << VPN_SOCK_SLOT_INDEX_BITS) | idx );
 }
 
-void stream_sf_socket_ready_to_write( dap_stream_ch_t *ch, bool is_ready )
+/**
+ * @brief stream_sf_slot_find Resolve socket handle received from the client
+ * @param sf
+ * @param sock_id
+ * @return Socket or NULL if handle is out of range or stale
+ */
+static inline ch_vpn_socket_proxy_t *stream_sf_slot_find( dap_stream_ch_vpn_t *sf, int sock_id )
 {
-  pthread_mutex_lock( &ch->mutex );
+  uint32_t idx = (uint32_t)sock_id & VPN_SOCK_SLOT_INDEX_MASK;
+  uint32_t gen = (uint32_t)sock_id >> VPN_SOCK_SLOT_INDEX_BITS;
 
-  ch->ready_to_write = is_ready;
+  if ( idx >= sf->sock_slots_count || sf->sock_slots[idx].gen != gen )
+    return NULL;
 
-  if ( is_ready )
-    ch->stream->conn_http->state_write = DAP_HTTP_CLIENT_STATE_DATA;
+  return sf->sock_slots[idx].sock;
+}
 
-  dap_client_remote_ready_to_write( ch->stream->conn, is_ready );
+/**
+ * @brief stream_sf_slot_free Release the slot, bumping generation invalidates the handle
+ * @param sf
+ * @param sock_id
+ */
+static void stream_sf_slot_free( dap_stream_ch_vpn_t *sf, int sock_id )
+{
+  uint32_t idx = (uint32_t)sock_id & VPN_SOCK_SLOT_INDEX_MASK;
+  ch_vpn_sock_slot_t *slot;
 
-  pthread_mutex_unlock( &ch->mutex );
+  if ( stream_sf_slot_find(sf, sock_id) == NULL )
+    return;
+
+  slot = &sf->sock_slots[idx];
+  slot->sock = NULL;
+  slot->gen = (slot->gen + 1) & VPN_SOCK_SLOT_GEN_MASK;
+  if ( !slot->gen )
+    slot->gen = 1;
+
+  slot->next_free = sf->sock_slots_free;
+  sf->sock_slots_free = idx;
 }
 
-ch_vpn_pkt_t *ch_sf_raw_read( )
+void stream_sf_socket_delete( ch_vpn_socket_proxy_t *sf )
 {
-  ch_vpn_pkt_t *ret = NULL;
+  if( !sf ) return;
+
+  if ( sf->sock > 0 )
+    close( sf->sock );
 
-  pthread_mutex_lock( &raw_server->pkt_out_mutex );
+  for ( size_t i = 0; i < sf->pkt_out_size; i ++ )
+    vpn_pkt_pool_put( sf->pkt_out[(sf->pkt_out_rindex + i) % PROXY_PKT_BUFFER_SIZE] );
 
-  if ( raw_server->pkt_out_rindex >= VPN_PKT_BUFFER_SIZE ) {
-    raw_server->pkt_out_rindex = 0; // ring the buffer!
-  }
+  pthread_mutex_destroy( &sf->mutex );
 
-  if ( (raw_server->pkt_out_rindex != raw_server->pkt_out_windex) || (raw_server->pkt_out_size == 0) ) {
-    ret = raw_server->pkt_out[raw_server->pkt_out_rindex];
-    raw_server->pkt_out_rindex ++;
-    raw_server->pkt_out_size --;
-  }
-  else
-    log_it( L_WARNING,"ch_sf_raw_read: Packet drop, ring buffer is full" );
+  free( sf );
+}
 
-  pthread_mutex_unlock( &raw_server->pkt_out_mutex );
+/**
+ * @brief stream_sf_socket_ref Take one more reference on the proxy socket
+ * @param sf_sock
+ */
+static inline void stream_sf_socket_ref( ch_vpn_socket_proxy_t *sf_sock )
+{
+  atomic_fetch_add_explicit( &sf_sock->refs, 1, memory_order_relaxed );
+}
 
-  return ret;
+static inline void stream_sf_pkt_out_push( ch_vpn_socket_proxy_t *sf_sock, ch_vpn_pkt_t *pkt )
+{
+  sf_sock->pkt_out[(sf_sock->pkt_out_rindex + sf_sock->pkt_out_size) % PROXY_PKT_BUFFER_SIZE] = pkt;
+  sf_sock->pkt_out_size ++;
 }
 
-int ch_sf_raw_write( uint8_t op_code, const void *data, size_t data_size )
+/**
+ * @brief stream_sf_socket_unref Drop the reference, the last one closes the socket and frees the object
+ * @param sf_sock
+ */
+void stream_sf_socket_unref( ch_vpn_socket_proxy_t *sf_sock )
 {
-  pthread_mutex_lock( &raw_server->pkt_out_mutex );
+  if ( atomic_fetch_sub_explicit( &sf_sock->refs, 1, memory_order_acq_rel ) == 1 )
+    stream_sf_socket_delete( sf_sock );
+}
 
-  if ( raw_server->pkt_out_windex >= VPN_PKT_BUFFER_SIZE )
-    raw_server->pkt_out_windex = 0; // ring the buffer!
+/**
+ * @brief stream_sf_socket_unpoll Remove the socket from epoll set. The epoll reference is not dropped here:
+ *        the event could be already fetched by ch_sf_thread() in the current batch, so the socket goes to
+ *        the graveyard and ch_sf_thread() releases it between two epoll_wait() calls.
+ * @param sf_sock
+ */
+static void stream_sf_socket_unpoll( ch_vpn_socket_proxy_t *sf_sock )
+{
+  dap_stream_ch_vpn_inst_t *inst = sf_sock->inst;
 
-  if ( (raw_server->pkt_out_windex < raw_server->pkt_out_rindex) || !raw_server->pkt_out_size ) {
+  if ( !atomic_exchange( &sf_sock->polled, false ) )
+    return;
 
-    ch_vpn_pkt_t *pkt = (ch_vpn_pkt_t *)calloc( 1, data_size + sizeof(pkt->header) );
+  struct epoll_event ev = { 0 };
 
-    pkt->header.op_code = op_code;
-    pkt->header.sock_id = (int32_t)raw_server->tun_fd;
+  if ( epoll_ctl(inst->socks_epoll_fd, EPOLL_CTL_DEL, sf_sock->sock, &ev) < 0 )
+    log_it( L_ERROR, "Can't remove sock_id %d from the epoll fd", sf_sock->id );
+  else
+    log_it( L_NOTICE, "Removed sock_id %d from the epoll fd", sf_sock->id );
 
-    if ( data_size > 0 ) {
-      pkt->header.op_data.data_size = data_size;
-      memcpy( pkt->data, data, data_size );
-    }
+  pthread_mutex_lock( &inst->socks_mutex );
+  sf_sock->graveyard_next = inst->socks_graveyard;
+  inst->socks_graveyard = sf_sock;
+  pthread_mutex_unlock( &inst->socks_mutex );
+}
 
-    raw_server->pkt_out[raw_server->pkt_out_windex] = pkt;
-    raw_server->pkt_out_windex ++;
-    raw_server->pkt_out_size ++;
+/**
+ * @brief stream_sf_socks_graveyard_flush Release epoll references of the unpolled sockets
+ * @param inst
+ */
+static void stream_sf_socks_graveyard_flush( dap_stream_ch_vpn_inst_t *inst )
+{
+  ch_vpn_socket_proxy_t *cur;
 
-    pthread_mutex_unlock( &raw_server->pkt_out_mutex );
-    #ifndef _WIN32
-      send_select_break( );
-    #else
-      SetEvent( hTunWriteEvent );
-    #endif
+  pthread_mutex_lock( &inst->socks_mutex );
+  cur = inst->socks_graveyard;
+  inst->socks_graveyard = NULL;
+  pthread_mutex_unlock( &inst->socks_mutex );
 
-    return raw_server->pkt_out_windex;
-  }
-  else {
-    pthread_mutex_unlock( &raw_server->pkt_out_mutex );
-    log_it( L_WARNING, "ch_sf_raw_write: Raw socket buffer overflow" );
-    return -1;
+  while ( cur ) {
+    ch_vpn_socket_proxy_t *next = cur->graveyard_next;
+    stream_sf_socket_unref( cur );
+    cur = next;
   }
 }
 
-int stream_sf_socket_write( ch_vpn_socket_proxy_t *sf, uint8_t op_code, const void *data, size_t data_size )
+/**
+ * @brief stream_sf_ready_push Put the source at the tail of its channel's ready list, if it's not there yet
+ * @param sf
+ * @param src
+ */
+static void stream_sf_ready_push( dap_stream_ch_vpn_t *sf, vpn_out_source_t *src )
 {
-  if ( sf->pkt_out_size >= PROXY_PKT_BUFFER_SIZE ) {
-    return -1;
-  }
+  pthread_mutex_lock( &sf->mutex );
 
-  ch_vpn_pkt_t *pkt =(ch_vpn_pkt_t *)calloc( 1, data_size + sizeof(pkt->header) );
+  if ( !src->in_ready ) {
 
-  pkt->header.op_code = op_code;
-  pkt->header.sock_id = sf->id;
+    if ( src->type == VPN_OUT_SOURCE_PROXY )
+      stream_sf_socket_ref( VPN_OUT_SOURCE_SOCK(src) );
 
-  switch ( op_code ) {
+    src->in_ready = true;
+    src->next = NULL;
 
-    case VPN_PACKET_OP_CODE_RECV:
-    {
-      pkt->header.op_data.data_size = data_size;
-      memcpy( pkt->data, data, data_size );
-    }
-    break;
-    default:
-    {
-      log_it( L_ERROR, "Unprocessed opcode %u for write to sf socket", op_code );
-      free( pkt );
-      return -2;
-    }
+    if ( sf->ready_tail )
+      sf->ready_tail->next = src;
+    else
+      sf->ready_head = src;
+    sf->ready_tail = src;
   }
 
-  sf->pkt_out[sf->pkt_out_size] = pkt;
-  sf->pkt_out_size ++;
-
-  return sf->pkt_out_size;
+  pthread_mutex_unlock( &sf->mutex );
 }
 
-static bool client_connected = false;
-
-//  VPN_PACKET_OP_CODE_VPN_ADDR_REQUEST:
-static inline void  ch_sf_packet_ADDR_REQUEST( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt )
+/**
+ * @brief stream_sf_ready_pop Take the source from the head of the ready list
+ * @param sf
+ * @return Source with the list's reference passed to the caller, or NULL if list is empty
+ */
+static vpn_out_source_t *stream_sf_ready_pop( dap_stream_ch_vpn_t *sf )
 {
-  int remote_sock_id = sf_pkt->header.sock_id;
-  struct in_addr n_addr;
+  vpn_out_source_t *src;
 
-  log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST dap_stream_ch_t *ch = %X ch_vpn_pkt_t *sf_pkt = %X ", ch, sf_pkt );
-
-  n_addr.s_addr = 0;
-
-  log_it( L_DEBUG, "Got SF packet with id %d op_code 0x%02x", remote_sock_id, sf_pkt->header.op_code );
+  pthread_mutex_lock( &sf->mutex );
 
-  if ( n_addr.s_addr ) { // wtf ?
+  src = sf->ready_head;
+  if ( src ) {
+    sf->ready_head = src->next;
+    if ( !sf->ready_head )
+      sf->ready_tail = NULL;
+    src->next = NULL;
+    src->in_ready = false;
+  }
 
-    log_it( L_WARNING, "All the network is filled with clients, can't lease a new address" );
+  pthread_mutex_unlock( &sf->mutex );
 
-    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) );
+  return src;
+}
 
-    pkt_out->header.sock_id = (int32_t)raw_server->tun_fd;
-    pkt_out->header.op_code = VPN_PACKET_OP_CODE_PROBLEM;
-    pkt_out->header.op_problem.code = VPN_PROBLEM_CODE_NO_FREE_ADDR;
+/**
+ * @brief stream_sf_out_source_release Drop the ready list's reference taken on the source
+ * @param src
+ */
+static void stream_sf_out_source_release( vpn_out_source_t *src )
+{
+  if ( src->type == VPN_OUT_SOURCE_PROXY )
+    stream_sf_socket_unref( VPN_OUT_SOURCE_SOCK(src) );
+}
 
-    dap_stream_ch_pkt_write( ch, 'd', pkt_out,pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
-    stream_sf_socket_ready_to_write( ch, true );
+/**
+ * @brief stream_sf_ready_return Return popped source back to the ready list
+ * @param sf
+ * @param src Source with the reference taken by stream_sf_ready_pop()
+ * @param to_head Put at the head to let it continue next time, otherwise at the tail
+ */
+static void stream_sf_ready_return( dap_stream_ch_vpn_t *sf, vpn_out_source_t *src, bool to_head )
+{
+  pthread_mutex_lock( &sf->mutex );
 
+  if ( src->in_ready ) { // Already pushed back by the producer
+    pthread_mutex_unlock( &sf->mutex );
+    stream_sf_out_source_release( src );
     return;
   }
 
-  dap_stream_ch_vpn_remote_single_t *n_client = (dap_stream_ch_vpn_remote_single_t *)calloc( 1, sizeof(dap_stream_ch_vpn_remote_single_t) );
-  if ( !n_client ) {
+  src->in_ready = true;
 
-    log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST: out of memory" );
-    return;
+  if ( to_head ) {
+    src->next = sf->ready_head;
+    sf->ready_head = src;
+    if ( !sf->ready_tail )
+      sf->ready_tail = src;
+  }
+  else {
+    src->next = NULL;
+    if ( sf->ready_tail )
+      sf->ready_tail->next = src;
+    else
+      sf->ready_head = src;
+    sf->ready_tail = src;
   }
 
-  n_client->ch = ch;
+  pthread_mutex_unlock( &sf->mutex );
+}
 
-  pthread_mutex_lock( &raw_server->clients_mutex );
+/**
+ * @brief stream_sf_socket_close Detach the socket from the channel and from epoll, drop the channel's reference.
+ *        Must be called from the channel's callbacks without sf_sock->mutex held
+ * @param ch
+ * @param sf_sock
+ */
+void stream_sf_socket_close( dap_stream_ch_t *ch, ch_vpn_socket_proxy_t *sf_sock )
+{
+  // Under the mutex, so ch_sf_thread() is either done with the channel or sees the socket closed
+  pthread_mutex_lock( &sf_sock->mutex );
+  bool was_closed = atomic_exchange( &sf_sock->closed, true );
+  pthread_mutex_unlock( &sf_sock->mutex );
 
-  int count_free_addr = -1;
+  if ( was_closed )
+    return;
 
-  list_addr_element *el;
-  LL_COUNT( list_addr_head, el, count_free_addr );
+  stream_sf_slot_free( DAP_STREAM_CH_VPN(ch), sf_sock->id );
 
-  if ( count_free_addr > 0 ) {
-    n_addr.s_addr = list_addr_head->addr.s_addr;
-    LL_DELETE( list_addr_head, list_addr_head );
-  }
-  else {
-    n_addr.s_addr = ntohl( raw_server->client_addr_last.s_addr );
-    n_addr.s_addr ++;
-    n_addr.s_addr = ntohl( n_addr.s_addr );
+  stream_sf_socket_unpoll( sf_sock );
+  stream_sf_socket_unref( sf_sock );
+}
+
+/**
+ * @brief stream_sf_socket_ready_to_write Request output for the channel. Marks the channel dirty and touches
+ *        the client connection only on clean to dirty transition, ch_sf_packet_out() makes the channel clean
+ * @param ch
+ * @param is_ready
+ */
+void stream_sf_socket_ready_to_write( dap_stream_ch_t *ch, bool is_ready )
+{
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+
+  if ( is_ready && atomic_exchange(&DAP_STREAM_CH_VPN(ch)->dirty, true) ) {
+    atomic_fetch_add_explicit( &inst->notify_coalesced, 1, memory_order_relaxed );
+    return;
   }
 
-  n_client->addr = n_addr.s_addr;
-  raw_server->client_addr_last.s_addr = n_addr.s_addr;
+  atomic_fetch_add_explicit( &inst->notify_issued, 1, memory_order_relaxed );
 
-  ch->stream->session->tun_client_addr.s_addr = n_addr.s_addr;
+  pthread_mutex_lock( &ch->mutex );
 
-  HASH_ADD_INT( raw_server->clients, addr, n_client );
-  pthread_mutex_unlock( &raw_server->clients_mutex );
+  ch->ready_to_write = is_ready;
 
-  log_it( L_NOTICE, "VPN client address %s leased", inet_ntoa(n_addr) );
-  log_it( L_INFO, "\tgateway %s", inet_ntoa(raw_server->client_addr_host) );
-  log_it( L_INFO, "\tmask %s", inet_ntoa(raw_server->client_addr_mask) );
-  log_it( L_INFO, "\taddr %s", inet_ntoa(raw_server->client_addr) );
-  log_it( L_INFO, "\tlast_addr %s", inet_ntoa(raw_server->client_addr_last) );
+  if ( is_ready )
+    ch->stream->conn_http->state_write = DAP_HTTP_CLIENT_STATE_DATA;
 
-  ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t*) calloc( 1, sizeof(pkt_out->header) + sizeof(n_addr) + sizeof(raw_server->client_addr_host) );
+  dap_client_remote_ready_to_write( ch->stream->conn, is_ready );
 
-  pkt_out->header.sock_id = (int32_t)raw_server->tun_fd;
-  pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_ADDR_REPLY;
-  pkt_out->header.op_data.data_size = sizeof(n_addr) + sizeof( raw_server->client_addr_host );
+  pthread_mutex_unlock( &ch->mutex );
+}
 
-  memcpy( pkt_out->data, &n_addr, sizeof(n_addr) );
-  memcpy( pkt_out->data + sizeof(n_addr), &raw_server->client_addr_host, sizeof(raw_server->client_addr_host) );
+/**
+ * @brief vpn_pkt_pool_get Get VPN_POOL_PKT_SIZE bytes buffer for the outgoing proxy packet
+ * @return Packet with uninitialized header and data
+ */
+ch_vpn_pkt_t *vpn_pkt_pool_get( void )
+{
+  vpn_pkt_pool_item_t *item;
 
-  dap_stream_ch_pkt_write( ch, 'd', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
-  stream_sf_socket_ready_to_write( ch, true );
+  pthread_mutex_lock( &vpn_pkt_pool_mutex );
+  item = vpn_pkt_pool_free;
+  if ( item ) {
+    vpn_pkt_pool_free = item->next;
+    vpn_pkt_pool_free_count --;
+  }
+  pthread_mutex_unlock( &vpn_pkt_pool_mutex );
 
-  log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST ok" );
-#ifdef _WIN32
-  Sleep( 3000 );
-#else
-  sleep( 3 );
-#endif
+  if ( !item )
+    item = (vpn_pkt_pool_item_t *)malloc( VPN_POOL_PKT_SIZE );
 
-  return;
+  return (ch_vpn_pkt_t *)item;
 }
 
-//  VPN_PACKET_OP_CODE_VPN_SEND:
-static inline void  ch_sf_packet_VPN_SEND( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt )
+/**
+ * @brief vpn_pkt_pool_put Return the packet to the pool
+ * @param pkt Packet obtained with vpn_pkt_pool_get(), NULL is ignored
+ */
+void vpn_pkt_pool_put( ch_vpn_pkt_t *pkt )
 {
-//  int remote_sock_id = sf_pkt->header.sock_id;
-  struct in_addr in_saddr, in_daddr;
+  void *mem = pkt;
+  vpn_pkt_pool_item_t *item = mem;
 
-  in_saddr.s_addr = ((struct iphdr*) sf_pkt->data)->saddr;
-  in_daddr.s_addr = ((struct iphdr*) sf_pkt->data)->daddr;
+  if ( !item )
+    return;
 
-  char str_daddr[42], str_saddr[42];
-
-  strncpy( str_saddr, inet_ntoa(in_saddr), sizeof(str_saddr) );
-  strncpy( str_daddr, inet_ntoa(in_daddr), sizeof(str_daddr) );
+  pthread_mutex_lock( &vpn_pkt_pool_mutex );
+  if ( vpn_pkt_pool_free_count < VPN_POOL_FREE_MAX ) {
+    item->next = vpn_pkt_pool_free;
+    vpn_pkt_pool_free = item;
+    vpn_pkt_pool_free_count ++;
+    item = NULL;
+  }
+  pthread_mutex_unlock( &vpn_pkt_pool_mutex );
 
-  int ret;
-  //if( ch_sf_raw_write(STREAM_SF_PACKET_OP_CODE_RAW_SEND, sf_pkt->data, sf_pkt->op_data.data_size)<0){
+  if ( item )
+    free( item );
+}
 
-  struct sockaddr_in sin = { 0 };
-  sin.sin_family = AF_INET;
-  sin.sin_port = 0;
-  sin.sin_addr.s_addr = in_daddr.s_addr;
+static void vpn_pkt_pool_clear( void )
+{
+  pthread_mutex_lock( &vpn_pkt_pool_mutex );
+  while ( vpn_pkt_pool_free ) {
+    vpn_pkt_pool_item_t *next = vpn_pkt_pool_free->next;
+    free( vpn_pkt_pool_free );
+    vpn_pkt_pool_free = next;
+  }
+  vpn_pkt_pool_free_count = 0;
+  pthread_mutex_unlock( &vpn_pkt_pool_mutex );
+}
 
-  //if((ret=sendto(DAP_STREAM_CH_VPN(ch)->raw_l3_sock , sf_pkt->data,sf_pkt->header.op_data.data_size,0,(struct sockaddr *) &sin, sizeof (sin)))<0){
+// Counter with the single writer, readers may be on other threads
+static inline void vpn_counter_inc( atomic_uint_fast64_t *counter )
+{
+  atomic_store_explicit( counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed );
+}
 
-  #ifndef _WIN32
-    ret = write( raw_server->tun_fd, sf_pkt->data, sf_pkt->header.op_data.data_size );
+static inline bool stream_sf_recv_would_block( void )
+{
+  #ifdef _WIN32
+    return WSAGetLastError( ) == WSAEWOULDBLOCK;
   #else
-    ret = win32_write_tun( sf_pkt->data, sf_pkt->header.op_data.data_size );
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
   #endif
+}
 
-  if ( ret < 0 ) {
-    log_it( L_ERROR,"write() returned error %d : '%s'",ret, strerror(errno) );
-    //log_it(L_ERROR,"raw socket ring buffer overflowed");
+static bool ch_sf_raw_lanes_empty( dap_stream_ch_vpn_t *sf )
+{
+  for ( int lane = 0; lane < VPN_LANES; lane ++ ) {
+    if ( !vpn_pkt_spsc_is_empty(&sf->raw_lanes[lane].q) )
+      return false;
+  }
 
-    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) );
+  return true;
+}
 
-    pkt_out->header.op_code = VPN_PACKET_OP_CODE_PROBLEM;
-    pkt_out->header.op_problem.code = VPN_PROBLEM_CODE_PACKET_LOST;
-    pkt_out->header.sock_id = (int32_t)raw_server->tun_fd;
+/**
+ * @brief ch_sf_raw_enqueue Classify raw VPN packet into the client's priority lane, ch_sf_packet_out() sends it in DRR order.
+ *        Called by ch_sf_thread_raw() and by the hairpin path, always under inst->clients_mutex.
+ *        The channel is flagged only when its raw queue gets scheduled
+ * @param ch
+ * @param pkt Packet allocated with malloc(), owned by the queue on success
+ * @return 1 if the channel must be flagged ready to write, 0 if it's already, -1 if the client's lane is full
+ */
+int ch_sf_raw_enqueue( dap_stream_ch_t *ch, ch_vpn_pkt_t *pkt )
+{
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+  vpn_raw_lane_t *lane = &sf->raw_lanes[ vpn_lane_classify(pkt->data, pkt->header.op_data.data_size) ];
+  bool pushed;
 
-    dap_stream_ch_pkt_write( ch, 'd', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
-    stream_sf_socket_ready_to_write( ch, true );
+  // Producers almost never meet, the consumer side stays lock free
+  while ( atomic_exchange_explicit(&lane->push_busy, true, memory_order_acquire) )
+    ;
 
-    return;
+  pushed = vpn_pkt_spsc_push( &lane->q, pkt, vpn_clock_ns() );
+  vpn_counter_inc( pushed ? &lane->enqueued : &lane->drops );
+
+  atomic_store_explicit( &lane->push_busy, false, memory_order_release );
+
+  if ( !pushed ) {
+    log_it( L_WARNING, "ch_sf_raw_enqueue: client queue is full, packet dropped" );
+    return -1;
   }
 
-  log_it( L_DEBUG, "Raw IP packet daddr:%s saddr:%s  %u from %d bytes sent to tun/tap interface",
-          str_saddr, str_daddr, sf_pkt->header.op_data.data_size, ret );
-  log_it( L_DEBUG,"Raw IP sent %u bytes ", ret );
+  // Pairs with the fence in ch_sf_packet_out(): either it sees the packet or we see raw_scheduled cleared
+  atomic_thread_fence( memory_order_seq_cst );
 
-  return;
-}
+  if ( atomic_exchange(&sf->raw_scheduled, true) )
+    return 0;
 
+  stream_sf_ready_push( sf, &sf->raw_src );
 
-//  VPN_PACKET_OP_CODE_SEND:
-static inline void  ch_sf_packet_SEND( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, ch_vpn_socket_proxy_t *sf_sock )
+  return 1;
+}
+
+int stream_sf_socket_write( ch_vpn_socket_proxy_t *sf, uint8_t op_code, const void *data, size_t data_size )
 {
-  int remote_sock_id = sf_pkt->header.sock_id;
+  if ( sf->pkt_out_size >= PROXY_PKT_BUFFER_SIZE || data_size > VPN_POOL_PKT_DATA_MAX ) {
+    return -1;
+  }
 
-  if ( !client_connected ) {
-    log_it( L_WARNING, "Drop Packet! User not connected!" ); // Client need send
-    pthread_mutex_unlock( &sf_socks_mutex );
-    return;
+  ch_vpn_pkt_t *pkt = vpn_pkt_pool_get( );
+
+  if ( !pkt ) {
+    log_it( L_ERROR, "Can't allocate packet for sock_id %d", sf->id );
+    return -1;
   }
 
-  int ret = send( sf_sock->sock, (char *)&sf_pkt->data[0], sf_pkt->header.op_data.data_size, 0 );
+  memset( &pkt->header, 0, sizeof(pkt->header) );
 
-  if ( ret < 0 ) {
+  pkt->header.op_code = op_code;
+  pkt->header.sock_id = sf->id;
 
-    log_it( L_INFO, "Disconnected from the remote host" );
+  switch ( op_code ) {
 
-    pthread_mutex_unlock( &sf_sock->mutex );
+    case VPN_PACKET_OP_CODE_RECV:
+    {
+      pkt->header.op_data.data_size = data_size;
+      memcpy( pkt->data, data, data_size );
+    }
+    break;
+    default:
+    {
+      log_it( L_ERROR, "Unprocessed opcode %u for write to sf socket", op_code );
+      vpn_pkt_pool_put( pkt );
+      return -2;
+    }
+  }
+
+  stream_sf_pkt_out_push( sf, pkt );
+  stream_sf_ready_push( DAP_STREAM_CH_VPN(sf->ch), &sf->out_src );
+
+  return sf->pkt_out_size;
+}
+
+/**
+ * @brief ch_sf_addr_lease Take the address for the client from the shard with the fewest leases, released
+ *        ones first, and put it into inst->clients
+ * @param inst
+ * @param n_client
+ * @return Leased address or 0 if the network is full
+ */
+static in_addr_t ch_sf_addr_lease( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_remote_single_t *n_client )
+{
+  vpn_tun_shard_t *shard = NULL;
+  struct in_addr n_addr = { 0 };
 
-    pthread_mutex_lock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
-    HASH_DEL( DAP_STREAM_CH_VPN(ch)->socks, sf_sock );
-    pthread_mutex_unlock(& ( DAP_STREAM_CH_VPN(ch)->mutex ));
+  pthread_mutex_lock( &inst->clients_mutex );
 
-    pthread_mutex_lock( & sf_socks_mutex );
+  for ( uint32_t i = 0; i < inst->shards_count; i ++ ) {
+    vpn_tun_shard_t *cur = &inst->shards[i];
 
-    HASH_DELETE( hh2, sf_socks, sf_sock );
-    HASH_DELETE( hh_sock, sf_socks_client, sf_sock );
+    if ( !cur->list_addr_head && cur->addr_last.s_addr == cur->addr_end.s_addr )
+      continue; // Slice is used up
+
+    if ( !shard || cur->leases < shard->leases )
+      shard = cur;
+  }
 
-    struct epoll_event ev;
+  if ( shard ) {
 
-    ev.data.fd = sf_sock->sock;
-    ev.events = EPOLLIN;
+    if ( shard->list_addr_head ) {
+      list_addr_element *el = shard->list_addr_head;
 
-    if ( epoll_ctl( sf_socks_epoll_fd, EPOLL_CTL_DEL, sf_sock->sock, &ev) < 0 ) {
-      log_it( L_ERROR, "Can't remove sock_id %d from the epoll fd", remote_sock_id );
-      //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=0x%02x result=-2",sf_pkt->sock_id, sf_pkt->op_code);
+      n_addr.s_addr = el->addr.s_addr;
+      LL_DELETE( shard->list_addr_head, el );
+      shard->addr_released --;
+      free( el );
     }
     else {
-      log_it( L_NOTICE, "Removed sock_id %d from the the epoll fd", remote_sock_id );
-      //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=0x%02x result=0",sf_pkt->sock_id, sf_pkt->op_code);
+      n_addr.s_addr = htonl( ntohl(shard->addr_last.s_addr) + 1 );
+      shard->addr_last.s_addr = n_addr.s_addr;
     }
 
-    pthread_mutex_unlock( &sf_socks_mutex );
-    stream_sf_socket_delete( sf_sock );
+    shard->leases ++;
 
-    return;
+    n_client->addr = n_addr.s_addr;
+    HASH_ADD_INT( inst->clients, addr, n_client );
   }
 
-  sf_sock->bytes_sent += ret;
-  pthread_mutex_unlock( &sf_sock->mutex );
-
-//  log_it( L_INFO, "Send action from %d sock_id (sf_packet size %lu,  ch packet size %lu, have sent %d)",
-//                   sf_sock->id, sf_pkt->header.op_data.data_size, pkt->hdr.size, ret );
-  log_it( L_INFO, "Send action from %d sock_id (sf_packet size %lu,  ch packet size ?, have sent %d)",
-                   sf_sock->id, sf_pkt->header.op_data.data_size, ret );
-
-//dap_stream_ch_pkt_t *pkt
+  pthread_mutex_unlock( &inst->clients_mutex );
 
-  return;
+  return n_addr.s_addr;
 }
 
-//  VPN_PACKET_OP_CODE_DISCONNECT:
-static inline void  ch_sf_packet_DISCONNECT( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, ch_vpn_socket_proxy_t *sf_sock )
+/**
+ * @brief ch_sf_addr_release Return the address to its shard's pool, called under inst->clients_mutex
+ * @param inst
+ * @param addr
+ */
+static void ch_sf_addr_release( dap_stream_ch_vpn_inst_t *inst, in_addr_t addr )
 {
-  int remote_sock_id = sf_pkt->header.sock_id;
-
-  log_it( L_INFO, "Disconnect action from %d sock_id", sf_sock->id );
-
-  pthread_mutex_lock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
-  HASH_DEL(DAP_STREAM_CH_VPN(ch)->socks,sf_sock);
-  pthread_mutex_unlock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
-
-  pthread_mutex_lock( &sf_socks_mutex );
-  HASH_DELETE( hh2, sf_socks, sf_sock );
-  HASH_DELETE( hh_sock, sf_socks_client, sf_sock );
-
-  struct epoll_event ev;
-  ev.data.fd = sf_sock->sock;
-  ev.events = EPOLLIN;
-
-  if ( epoll_ctl(sf_socks_epoll_fd, EPOLL_CTL_DEL, sf_sock->sock, &ev) < 0 ) {
-    log_it( L_ERROR, "Can't remove sock_id %d to the epoll fd", remote_sock_id );
-    //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=%uc result=-2",sf_pkt->sock_id, sf_pkt->op_code);
-  }
-  else {
-    log_it( L_NOTICE, "Removed sock_id %d from the epoll fd", remote_sock_id );
-    //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=%uc result=0",sf_pkt->sock_id, sf_pkt->op_code);
-  }
+  vpn_tun_shard_t *shard = ch_sf_shard_of( inst, addr );
+  list_addr_element *el;
 
-  pthread_mutex_unlock( &sf_socks_mutex );
-  pthread_mutex_unlock( &sf_sock->mutex );
+  if ( !shard || !(el = (list_addr_element *)malloc(sizeof(list_addr_element))) )
+    return;
 
-  stream_sf_socket_delete( sf_sock );
+  el->addr.s_addr = addr;
+  LL_APPEND( shard->list_addr_head, el );
 
-  return;
+  shard->addr_released ++;
+  if ( shard->leases )
+    shard->leases --;
 }
 
-//  VPN_PACKET_OP_CODE_CONNECT:
-static inline void  ch_sf_packet_CONNECT( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt )
+//  VPN_PACKET_OP_CODE_VPN_ADDR_REQUEST:
+static inline void  ch_sf_packet_ADDR_REQUEST( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt )
 {
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
   int remote_sock_id = sf_pkt->header.sock_id;
-  ch_vpn_socket_proxy_t *sf_sock = NULL;
+  vpn_tun_shard_t *shard;
+  struct in_addr n_addr;
+
+  log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST dap_stream_ch_t *ch = %X ch_vpn_pkt_t *sf_pkt = %X ", ch, sf_pkt );
+
+  log_it( L_DEBUG, "Got SF packet with id %d op_code 0x%02x", remote_sock_id, sf_pkt->header.op_code );
 
-  HASH_FIND_INT( DAP_STREAM_CH_VPN(ch)->socks, &remote_sock_id, sf_sock );
+  dap_stream_ch_vpn_remote_single_t *n_client = (dap_stream_ch_vpn_remote_single_t *)calloc( 1, sizeof(dap_stream_ch_vpn_remote_single_t) );
+  if ( !n_client ) {
 
-  if ( sf_sock ) {
-    log_it( L_WARNING, "Socket id %d is already used, take another number for socket id", remote_sock_id );
+    log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST: out of memory" );
     return;
   }
 
-  struct sockaddr_in remote_addr;
-  char addr_str[1024];
+  n_client->ch = ch;
+  n_addr.s_addr = ch_sf_addr_lease( inst, n_client );
 
-  size_t addr_str_size = (sf_pkt->header.op_connect.addr_size > (sizeof(addr_str)-1)) ? (sizeof(addr_str)-1):
-                             sf_pkt->header.op_connect.addr_size;
+  if ( !n_addr.s_addr ) {
 
-  memset( &remote_addr, 0, sizeof(remote_addr));
-  remote_addr.sin_family = AF_INET;
-  remote_addr.sin_port = htons( sf_pkt->header.op_connect.port );
+    log_it( L_WARNING, "All the network is filled with clients, can't lease a new address" );
+    free( n_client );
 
-  memcpy( addr_str, sf_pkt->data, addr_str_size );
-  addr_str[addr_str_size] = 0;
+    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) );
 
-  log_it( L_DEBUG, "Connect action to %s:%u (addr_size %lu)", addr_str, sf_pkt->header.op_connect.port,
-          sf_pkt->header.op_connect.addr_size );
+    pkt_out->header.sock_id = (int32_t)inst->shards[0].tun.fd;
+    pkt_out->header.op_code = VPN_PACKET_OP_CODE_PROBLEM;
+    pkt_out->header.op_problem.code = VPN_PROBLEM_CODE_NO_FREE_ADDR;
 
-  if ( inet_pton(AF_INET,addr_str, &remote_addr.sin_addr) < 0 ) {
+    dap_stream_ch_pkt_write( ch, 'd', pkt_out,pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
+    stream_sf_socket_ready_to_write( ch, true );
+    free( pkt_out );
 
-    log_it( L_ERROR, "Wrong remote address '%s:%u'", addr_str, sf_pkt->header.op_connect.port );
     return;
   }
 
-  int s = socket( AF_INET, SOCK_STREAM, 0 );
+  shard = ch_sf_shard_of( inst, n_addr.s_addr );
+  DAP_STREAM_CH_VPN(ch)->shard = shard;
 
-  if ( s < 0 ) {
-    log_it( L_ERROR, "Can't create the socket" );
-    return;
-  }
+  ch->stream->session->tun_client_addr.s_addr = n_addr.s_addr;
 
-  log_it( L_DEBUG, "Socket is created (%d)", s );
+  dap_stream_ch_vpn_rate_t rate = inst->rate_default;
 
-  if ( connect(s, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0 ) {
+  if ( inst->lease_callback )
+    inst->lease_callback( ch, n_addr.s_addr, &rate );
 
-    log_it( L_INFO, "Can't connect to the remote server %s", addr_str );
+  vpn_tbf_set( &DAP_STREAM_CH_VPN(ch)->up_tbf, rate.up_bps, rate.burst_bytes );
+  vpn_tbf_set( &DAP_STREAM_CH_VPN(ch)->down_tbf, rate.down_bps, rate.burst_bytes );
 
-    dap_stream_ch_pkt_write_f( ch, 'i', "sock_id=%d op_code=%c result=-1", sf_pkt->header.sock_id, sf_pkt->header.op_code );
-    stream_sf_socket_ready_to_write( ch, true );
+  log_it( L_NOTICE, "VPN client address %s leased", inet_ntoa(n_addr) );
+  log_it( L_INFO, "\tgateway %s", inet_ntoa(shard->addr_host) );
+  log_it( L_INFO, "\tmask %s", inet_ntoa(inst->client_addr_mask) );
+  log_it( L_INFO, "\taddr %s", inet_ntoa(inst->client_addr) );
+  log_it( L_INFO, "\tshard %u, %u leases", shard->index, shard->leases );
 
-    close( s );
-    return;
-  }
+  ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t*) calloc( 1, sizeof(pkt_out->header) + sizeof(n_addr) + sizeof(shard->addr_host) );
 
-  #ifdef _WIN32
-    unsigned long arg = 1;
-    ioctlsocket( s, FIONBIO, &arg );
-  #else
-    fcntl( s, F_SETFL, O_NONBLOCK );
-  #endif
+  pkt_out->header.sock_id = (int32_t)shard->tun.fd;
+  pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_ADDR_REPLY;
+  pkt_out->header.op_data.data_size = sizeof(n_addr) + sizeof( shard->addr_host );
 
-  log_it( L_INFO, "Remote address connected (%s:%u) with sock_id %d", addr_str, sf_pkt->header.op_connect.port, remote_sock_id );
+  memcpy( pkt_out->data, &n_addr, sizeof(n_addr) );
+  memcpy( pkt_out->data + sizeof(n_addr), &shard->addr_host, sizeof(shard->addr_host) );
 
-//  ch_vpn_socket_proxy_t *sf_sock = NULL;
+  dap_stream_ch_pkt_write( ch, 'd', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
+  stream_sf_socket_ready_to_write( ch, true );
+  free( pkt_out );
 
-  sf_sock = DAP_NEW_Z( ch_vpn_socket_proxy_t );
+  log_it( L_WARNING, "ch_sf_packet_ADDR_REQUEST ok" );
+#ifdef _WIN32
+  Sleep( 3000 );
+#else
+  sleep( 3 );
+#endif
 
-  sf_sock->id = remote_sock_id;
-  sf_sock->sock = s;
-  sf_sock->ch = ch;
+  return;
+}
 
-  pthread_mutex_init( &sf_sock->mutex, NULL );
+/**
+ * @brief ch_sf_tun_send Write client's IP packet to the tun/tap interface, report the loss to the client on error
+ * @param ch
+ * @param data
+ * @param data_size
+ * @return Bytes written or -1
+ */
+static int ch_sf_tun_send( dap_stream_ch_t *ch, const uint8_t *data, uint32_t data_size )
+{
+  vpn_tun_shard_t *shard = ch_sf_shard( DAP_STREAM_CH_VPN(ch) );
+  int ret;
 
-  pthread_mutex_lock( &sf_socks_mutex );
-  pthread_mutex_lock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
+  ret = vpn_tun_write( &shard->tun, data, data_size );
 
-  HASH_ADD_INT( DAP_STREAM_CH_VPN(ch)->socks, id, sf_sock );
-  log_it( L_DEBUG, "Added %d sock_id with sock %d to the hash table", sf_sock->id, sf_sock->sock );
+  if ( ret < 0 ) {
+    atomic_fetch_add_explicit( &shard->tx_errors, 1, memory_order_relaxed );
 
-  HASH_ADD( hh2, sf_socks, id,sizeof(sf_sock->id), sf_sock );
-  log_it( L_DEBUG, "Added %d sock_id with sock %d to the hash table", sf_sock->id, sf_sock->sock );
+    log_it( L_ERROR,"write() returned error %d : '%s'",ret, strerror(errno) );
+    //log_it(L_ERROR,"raw socket ring buffer overflowed");
 
-  HASH_ADD( hh_sock, sf_socks_client, sock,sizeof(int), sf_sock );
-  //log_it(L_DEBUG,"Added %d sock_id with sock %d to the socks hash table",sf->id,sf->sock);
+    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) );
 
-  pthread_mutex_unlock( &sf_socks_mutex );
-  pthread_mutex_unlock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
+    pkt_out->header.op_code = VPN_PACKET_OP_CODE_PROBLEM;
+    pkt_out->header.op_problem.code = VPN_PROBLEM_CODE_PACKET_LOST;
+    pkt_out->header.sock_id = (int32_t)shard->tun.fd;
 
-  struct epoll_event ev;
-  ev.data.fd = s;
-  ev.events = EPOLLIN | EPOLLERR;
+    dap_stream_ch_pkt_write( ch, 'd', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
+    stream_sf_socket_ready_to_write( ch, true );
+    free( pkt_out );
 
-  if ( epoll_ctl(sf_socks_epoll_fd, EPOLL_CTL_ADD, s, &ev) == -1 ) {
-    log_it( L_ERROR, "Can't add sock_id %d to the epoll fd", remote_sock_id );
-    //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=%uc result=-2",sf_pkt->sock_id, sf_pkt->op_code);
+    return -1;
   }
-  else {
-    log_it( L_NOTICE, "Added sock_id %d  with sock %d to the epoll fd", remote_sock_id, s );
-    log_it( L_NOTICE, "Send Connected packet to User" );
 
-    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t*) calloc( 1, sizeof(pkt_out->header) );
+  atomic_fetch_add_explicit( &shard->tx_packets, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &shard->tx_bytes, data_size, memory_order_relaxed );
 
-    pkt_out->header.sock_id = remote_sock_id;
-    pkt_out->header.op_code = VPN_PACKET_OP_CODE_CONNECTED;
-    dap_stream_ch_pkt_write( ch,'s', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
+  struct in_addr in_saddr, in_daddr;
 
-    free( pkt_out );
-    client_connected = true;
-  }
+  in_saddr.s_addr = ((const struct iphdr*) data)->saddr;
+  in_daddr.s_addr = ((const struct iphdr*) data)->daddr;
 
-  stream_sf_socket_ready_to_write( ch, true );
+  char str_daddr[42], str_saddr[42];
 
-  return;
-}
+  strncpy( str_saddr, inet_ntoa(in_saddr), sizeof(str_saddr) );
+  strncpy( str_daddr, inet_ntoa(in_daddr), sizeof(str_daddr) );
+
+  log_it( L_DEBUG, "Raw IP packet daddr:%s saddr:%s  %u from %d bytes sent to tun/tap interface",
+          str_saddr, str_daddr, data_size, ret );
 
+  return ret;
+}
 
 /**
- * @brief stream_sf_packet_in
+ * @brief ch_sf_ip_forward Route client's IP packet: straight to another client's downstream queue
+ *        if the destination is leased by us, to the tun/tap interface otherwise, masqueraded if NAT is on
  * @param ch
- * @param arg
+ * @param data Validated IPv4 packet, NAT rewrites it in place
+ * @param data_size
  */
-void ch_sf_packet_in( dap_stream_ch_t *ch, void *arg )
+static void ch_sf_ip_forward( dap_stream_ch_t *ch, uint8_t *data, uint32_t data_size )
 {
-  dap_stream_ch_pkt_t *pkt = (dap_stream_ch_pkt_t *)arg;
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+  in_addr_t daddr = ((const struct iphdr *)data)->daddr;
 
-  // log_it(L_DEBUG,"stream_sf_packet_in:  channel packet hdr size %lu ( last bytes 0x%02x 0x%02x 0x%02x 0x%02x ) ", pkt->hdr.size,
-  //        *((uint8_t *)pkt->data + pkt->hdr.size-4),*((uint8_t *)pkt->data + pkt->hdr.size-3)
-  //        ,*((uint8_t *)pkt->data + pkt->hdr.size-2),*((uint8_t *)pkt->data + pkt->hdr.size-1)
-  //        );
+  // Cheap subnet test first, most of the traffic goes outside
+  bool in_subnet = (daddr & inst->client_addr_mask.s_addr) == (inst->client_addr.s_addr & inst->client_addr_mask.s_addr);
 
-  ch_vpn_pkt_t *sf_pkt = (ch_vpn_pkt_t *)pkt->data;
+  if ( in_subnet && inst->hairpin_policy != DAP_STREAM_CH_VPN_HAIRPIN_KERNEL ) {
 
-  int remote_sock_id = sf_pkt->header.sock_id;
+    dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
 
-  //log_it(L_DEBUG,"Got SF packet with id %d op_code 0x%02x",remote_sock_id, sf_pkt->header.op_code );
+    pthread_mutex_lock( &inst->clients_mutex );
+    HASH_FIND_INT( inst->clients, &daddr, raw_client );
 
-  if ( sf_pkt->header.op_code >= 0xb0 ) { // Raw packets
+    if ( raw_client ) {
 
-    switch( sf_pkt->header.op_code ) {
-    case VPN_PACKET_OP_CODE_VPN_ADDR_REQUEST: 
-      ch_sf_packet_ADDR_REQUEST( ch, sf_pkt );
-    break;
-    case VPN_PACKET_OP_CODE_VPN_SEND:
-      ch_sf_packet_VPN_SEND( ch, sf_pkt );
-    break;
-    default:
-      log_it( L_WARNING, "Can't process SF type 0x%02x", sf_pkt->header.op_code );
-    break;
-    }
+      if ( inst->hairpin_policy == DAP_STREAM_CH_VPN_HAIRPIN_DENY ) {
+        pthread_mutex_unlock( &inst->clients_mutex );
+        atomic_fetch_add_explicit( &inst->hairpin_denied, 1, memory_order_relaxed );
+        return;
+      }
 
-    return;
-  }
+      ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)malloc( sizeof(pkt_out->header) + data_size );
+      int enqueue_ret = -1;
 
-  if ( sf_pkt->header.op_code == VPN_PACKET_OP_CODE_CONNECT ) {
+      if ( pkt_out ) {
+        memset( &pkt_out->header, 0, sizeof(pkt_out->header) );
+        pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_RECV;
+        pkt_out->header.sock_id = (int32_t)ch_sf_shard( DAP_STREAM_CH_VPN(raw_client->ch) )->tun.fd;
+        pkt_out->header.op_data.data_size = data_size;
+        memcpy( pkt_out->data, data, data_size );
 
-    ch_sf_packet_CONNECT( ch, sf_pkt );
-    return;
-  }
+        enqueue_ret = ch_sf_raw_enqueue( raw_client->ch, pkt_out );
 
-  ch_vpn_socket_proxy_t *sf_sock = NULL;
+        if ( enqueue_ret > 0 )
+          stream_sf_socket_ready_to_write( raw_client->ch, true );
+        else if ( enqueue_ret < 0 )
+          free( pkt_out );
+      }
 
-  pthread_mutex_lock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
-  //log_it(L_DEBUG,"Looking in hash table with %d",remote_sock_id);
-  HASH_FIND_INT( (DAP_STREAM_CH_VPN(ch)->socks), &remote_sock_id, sf_sock );
-  pthread_mutex_unlock( &(DAP_STREAM_CH_VPN(ch)->mutex) );
+      pthread_mutex_unlock( &inst->clients_mutex );
+      atomic_fetch_add_explicit( enqueue_ret < 0 ? &inst->hairpin_dropped : &inst->hairpin_forwarded, 1, memory_order_relaxed );
+      return;
+    }
 
-  if ( !sf_sock ) {
+    pthread_mutex_unlock( &inst->clients_mutex );
+  }
 
-    log_it( L_WARNING, "Packet input: packet with sock_id %d thats not present in current stream channel", remote_sock_id );
+  if ( inst->nat && !in_subnet && !vpn_nat_out(inst->nat, data, data_size) )
     return;
-  }
 
-  pthread_mutex_lock( &sf_sock->mutex ); // Unlock it in your case as soon as possible to reduce lock time
-  sf_sock->time_lastused = time( NULL );
+  ch_sf_tun_send( ch, data, data_size );
+}
 
-  switch( sf_pkt->header.op_code ) {
+/**
+ * @brief ch_sf_dns_deliver Put DNS answer made by the cache into the client's downstream queue
+ * @param arg Instance
+ * @param client_addr
+ * @param ip_pkt
+ * @param ip_pkt_size
+ */
+static void ch_sf_dns_deliver( void *arg, uint32_t client_addr, const uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  dap_stream_ch_vpn_inst_t *inst = (dap_stream_ch_vpn_inst_t *)arg;
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)malloc( sizeof(pkt_out->header) + ip_pkt_size );
 
-  case VPN_PACKET_OP_CODE_SEND:
-    ch_sf_packet_SEND( ch, sf_pkt, sf_sock );
-  break;
+  if ( !pkt_out )
+    return;
 
-  case VPN_PACKET_OP_CODE_DISCONNECT:
-    ch_sf_packet_DISCONNECT( ch, sf_pkt, sf_sock );
-  break;
-  default: {
-    log_it( L_WARNING, "Unprocessed op code 0x%02x", sf_pkt->header.op_code );
-    pthread_mutex_unlock( &sf_sock->mutex );
-  }
-  }
+  memset( &pkt_out->header, 0, sizeof(pkt_out->header) );
+  pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_RECV;
+  pkt_out->header.sock_id = (int32_t)inst->shards[0].tun.fd;
+  pkt_out->header.op_data.data_size = (uint32_t)ip_pkt_size;
+  memcpy( pkt_out->data, ip_pkt, ip_pkt_size );
 
-  return;
-}
+  pthread_mutex_lock( &inst->clients_mutex );
+  HASH_FIND_INT( inst->clients, &client_addr, raw_client );
+
+  int enqueue_ret = raw_client ? ch_sf_raw_enqueue( raw_client->ch, pkt_out ) : -1;
 
+  if ( enqueue_ret > 0 )
+    stream_sf_socket_ready_to_write( raw_client->ch, true );
+  else if ( enqueue_ret < 0 )
+    free( pkt_out );
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+}
 
 /**
- * @brief stream_sf_disconnect
+ * @brief ch_sf_shaper_wake Ask the shaper thread to flag the channel after the delay
  * @param sf
+ * @param delay_ns
+ * @param park_raw Raw queue is throttled, shaper returns it to the ready list
  */
-void stream_sf_disconnect( ch_vpn_socket_proxy_t *sf_sock )
+static void ch_sf_shaper_wake( dap_stream_ch_vpn_t *sf, uint64_t delay_ns, bool park_raw )
 {
-  struct epoll_event ev;
+  dap_stream_ch_vpn_inst_t *inst = sf->inst;
+  uint64_t wake_at = vpn_clock_ns( ) + delay_ns;
 
-  ev.data.fd = sf_sock->sock;
-  ev.events = EPOLLIN | EPOLLERR;
+  pthread_mutex_lock( &inst->shaper_mutex );
 
-  if ( epoll_ctl(sf_socks_epoll_fd, EPOLL_CTL_DEL, sf_sock->sock, &ev) == -1 ) {
-    log_it(L_ERROR,"Can't del sock_id %d from the epoll fd",sf_sock->id);
-      //stream_ch_pkt_write_f(sf->ch,'i',"sock_id=%d op_code=%uc result=-1",sf->id, STREAM_SF_PACKET_OP_CODE_RECV);
-  }
-  else {
-        log_it(L_ERROR,"Removed sock_id %d from the epoll fd",sf_sock->id);
-      //stream_ch_pkt_write_f(sf->ch,'i',"sock_id=%d op_code=%uc result=0",sf->id, STREAM_SF_PACKET_OP_CODE_RECV);
+  if ( park_raw )
+    sf->raw_parked = true;
+
+  if ( !sf->shaper_queued ) {
+    sf->shaper_queued = true;
+    sf->shaper_wake_at = wake_at;
+    sf->shaper_next = inst->shaper_list;
+    inst->shaper_list = sf;
+    pthread_cond_signal( &inst->shaper_cond );
   }
+  else if ( wake_at < sf->shaper_wake_at )
+    sf->shaper_wake_at = wake_at;
 
-    // Compise signal to disconnect to another side, with special opcode STREAM_SF_PACKET_OP_CODE_DISCONNECT
-  ch_vpn_pkt_t * pkt_out;
+  pthread_mutex_unlock( &inst->shaper_mutex );
+}
 
-  pkt_out = (ch_vpn_pkt_t*) calloc( 1, sizeof(pkt_out->header) + 1 );
+static void ch_sf_shaper_remove( dap_stream_ch_vpn_t *sf )
+{
+  dap_stream_ch_vpn_inst_t *inst = sf->inst;
 
-  pkt_out->header.op_code = VPN_PACKET_OP_CODE_DISCONNECT;
-  pkt_out->header.sock_id = sf_sock->id;
-  sf_sock->pkt_out[sf_sock->pkt_out_size] = pkt_out;
-  sf_sock->pkt_out_size ++;
-  sf_sock->signal_to_delete = true;
-}
+  if ( !inst->shaper_running )
+    return;
 
+  pthread_mutex_lock( &inst->shaper_mutex );
 
-/**
+  if ( sf->shaper_queued ) {
+    dap_stream_ch_vpn_t **cur = &inst->shaper_list;
+    while ( *cur && *cur != sf )
+      cur = &(*cur)->shaper_next;
+    if ( *cur )
+      *cur = sf->shaper_next;
+    sf->shaper_queued = false;
+  }
 
-Socket forward
-**/
+  pthread_mutex_unlock( &inst->shaper_mutex );
+}
 
-void *ch_sf_thread(void * arg)
+/**
+ * @brief ch_sf_thread_shaper Flags throttled channels when their token buckets refill
+ * @param arg Instance
+ * @return
+ */
+static void *ch_sf_thread_shaper( void *arg )
 {
-  uint32_t  numfails = 0;
-  struct epoll_event ev, events[SF_MAX_EVENTS];
-  //pthread_mutex_lock(&sf_socks_mutex);
+  dap_stream_ch_vpn_inst_t *inst = (dap_stream_ch_vpn_inst_t *)arg;
 
-  memset( &events[0], 0, sizeof(struct epoll_event) * SF_MAX_EVENTS );
+  vpn_affinity_apply( &inst->shaper_thread, &inst->thread_config[DAP_STREAM_CH_VPN_THREAD_SHAPER], -1, "Shaper thread" );
 
-  sf_socks_epoll_fd = epoll_create( SF_MAX_EVENTS );
+  pthread_mutex_lock( &inst->shaper_mutex );
 
-  if ( (intptr_t)sf_socks_epoll_fd == -1 ) {
+  while ( inst->shaper_running ) {
 
-    log_it( L_ERROR, "epoll_create return -1" );
-    return (void *)-1;
-  }
+    if ( !inst->shaper_list ) {
+      pthread_cond_wait( &inst->shaper_cond, &inst->shaper_mutex );
+      continue;
+    }
 
-  #ifndef _WIN32
-    sigset_t sf_sigmask;
-    sigemptyset( &sf_sigmask );
-    sigaddset( &sf_sigmask, SIGUSR2 );
-  #endif
+    uint64_t now = vpn_clock_ns( );
+    uint64_t next_wake = now + VPN_SHAPER_TICK_NS;
+    dap_stream_ch_vpn_t **cur = &inst->shaper_list;
 
-  while( bQuitSignal ) {
-    /*pthread_mutex_lock(&sf_socks_mutex);
-    if(sf_socks==NULL)
-      pthread_cond_wait(&sf_socks_cond,&sf_socks_mutex);
-    pthread_mutex_unlock(&sf_socks_mutex);*/
+    while ( *cur ) {
 
-    #ifndef _WIN32
-      int nfds = epoll_pwait( sf_socks_epoll_fd, events, SF_MAX_EVENTS, 10000, &sf_sigmask );
-      #else
-      int nfds = epoll_wait( sf_socks_epoll_fd, events, SF_MAX_EVENTS, 1000 );
-    #endif
+      dap_stream_ch_vpn_t *sf = *cur;
 
-    if ( nfds < 0 ) {
-      log_it( L_CRITICAL,"Can't run epoll_wait: %s", strerror(errno) );
-      #ifdef _WIN32
-        Sleep( 10000 );
-      #else
-        sleep( 10 );
-      #endif
-      if ( numfails ++ >= 3 ) {
-        log_it( L_NOTICE, "ch_sf_thread: exit" );
-        break;
+      if ( sf->shaper_wake_at > now ) {
+        if ( sf->shaper_wake_at < next_wake )
+          next_wake = sf->shaper_wake_at;
+        cur = &sf->shaper_next;
+        continue;
       }
-      continue;
-    }
-
-    if( nfds > 0 )
-      log_it( L_DEBUG,"Epolled %d fd", nfds );
-
-    int n;
 
-    for ( n = 0; n < nfds; ++ n ) {
+      *cur = sf->shaper_next;
+      sf->shaper_queued = false;
 
-      int s = events[n].data.fd;
+      if ( sf->raw_parked ) {
+        sf->raw_parked = false;
+        stream_sf_ready_push( sf, &sf->raw_src );
+      }
 
-      ch_vpn_socket_proxy_t *sf = NULL;
+      stream_sf_socket_ready_to_write( sf->ch, true );
+    }
 
-      pthread_mutex_lock( &sf_socks_mutex );
-      HASH_FIND( hh_sock, sf_socks_client ,&s, sizeof(s), sf );
-      pthread_mutex_unlock( &sf_socks_mutex );
+    pthread_mutex_unlock( &inst->shaper_mutex );
 
-      if ( !sf ) {
+    #ifndef _WIN32
+      struct timespec ts = { 0, (long)(next_wake - now) };
+      nanosleep( &ts, NULL );
+    #else
+      Sleep( 1 );
+    #endif
 
-        if ( epoll_ctl(sf_socks_epoll_fd, EPOLL_CTL_DEL, s, &ev) < 0 )
-          log_it(L_ERROR,"Can't remove sock_id %d to the epoll fd",s);
-         else
-           log_it(L_NOTICE,"Socket id %d is removed from the list",s);
+    pthread_mutex_lock( &inst->shaper_mutex );
+  }
 
-        continue;
-      }
+  pthread_mutex_unlock( &inst->shaper_mutex );
 
-      if ( events[n].events & EPOLLERR ) {
+  vpn_affinity_leave( &inst->shaper_thread );
+  return NULL;
+}
 
-          log_it(L_NOTICE,"Socket id %d has EPOLLERR flag on",s);
-          pthread_mutex_lock(& (sf->mutex) );
-          stream_sf_disconnect(sf);
-          pthread_mutex_unlock(& (sf->mutex) );
+/**
+ * @brief ch_sf_up_backlog_flush Send shaped upstream packets the bucket allows now
+ * @param ch
+ * @return True if the backlog is empty
+ */
+static bool ch_sf_up_backlog_flush( dap_stream_ch_t *ch )
+{
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+  uint64_t now;
 
-      } else if ( events[n].events & EPOLLIN ) {
+  if ( !sf->up_backlog_size )
+    return true;
 
-        char buf[1024 * 512];
-        size_t buf_size;
-        ssize_t ret;
+  now = vpn_clock_ns( );
 
-        pthread_mutex_lock( &(sf->mutex) );
+  while ( sf->up_backlog_size ) {
 
-        if ( sf->pkt_out_size >= PROXY_PKT_BUFFER_SIZE - 1 ) {
-          log_it( L_WARNING, "Can't receive data, full of stack" );
-          pthread_mutex_unlock( &(sf->mutex) );
-          continue;
-        }
+    ch_vpn_pkt_t *pkt = sf->up_backlog[sf->up_backlog_rindex];
 
-        ret = recv( sf->sock, buf, sizeof(buf), 0 );
-         //log_it(L_DEBUG,"recv() returned %d",ret);
+    if ( !vpn_tbf_consume(&sf->up_tbf, now, pkt->header.op_data.data_size) ) {
+      ch_sf_shaper_wake( sf, vpn_tbf_wait_ns(&sf->up_tbf), false );
+      return false;
+    }
 
-        if ( ret > 0 ) {
+    ch_sf_ip_forward( ch, pkt->data, pkt->header.op_data.data_size );
+    free( pkt );
 
-          buf_size = ret;
-          ch_vpn_pkt_t *pout;
+    sf->up_backlog_rindex = (sf->up_backlog_rindex + 1) % VPN_UP_BACKLOG_SIZE;
+    sf->up_backlog_size --;
+  }
 
-          pout = sf->pkt_out[sf->pkt_out_size] = (ch_vpn_pkt_t *)calloc( 1, buf_size + sizeof(pout->header) );
-          pout->header.op_code = VPN_PACKET_OP_CODE_RECV;
-          pout->header.sock_id = sf->id;
-          pout->header.op_data.data_size = buf_size;
+  return true;
+}
 
-          memcpy( pout->data, buf, buf_size );
-          sf->pkt_out_size ++;
+//  VPN_PACKET_OP_CODE_VPN_SEND:
+static inline void  ch_sf_packet_VPN_SEND( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, size_t pkt_size )
+{
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+  dap_stream_ch_vpn_inst_t *inst = sf->inst;
+  uint32_t data_size = sf_pkt->header.op_data.data_size;
+  const uint8_t *data = sf_pkt->data;
+  uint8_t verdict;
+
+  // Claimed size that doesn't fit the channel packet is reported as truncated
+  uint32_t checked_size = ( pkt_size >= sizeof(sf_pkt->header) && data_size <= pkt_size - sizeof(sf_pkt->header) ) ? data_size : 0;
+
+  if ( !vpn_ip_validate_batch(&data, &checked_size, 1, ch->stream->session->tun_client_addr.s_addr, &verdict) ) {
+    vpn_counter_inc( &sf->rejects[verdict] );
+    atomic_fetch_add_explicit( &inst->rejects[verdict], 1, memory_order_relaxed );
+    // As much of it as there is in the channel packet
+    VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_REJECT, verdict, ch->stream->session->tun_client_addr.s_addr, sf_pkt->data,
+                 checked_size ? checked_size : ( pkt_size > sizeof(sf_pkt->header) ? pkt_size - sizeof(sf_pkt->header) : 0 ) );
+    return;
+  }
 
-          pthread_mutex_unlock(& (sf->mutex) );
-          stream_sf_socket_ready_to_write( sf->ch, true );
+  uint32_t acl_policy = atomic_load_explicit( &sf->acl_policy, memory_order_relaxed );
 
-        } else {
-          log_it( L_NOTICE, "Socket id %d returned error on recv() function - may be host has disconnected", s );
-          pthread_mutex_unlock(& (sf->mutex) );
-          stream_sf_socket_ready_to_write( sf->ch, true );
-          stream_sf_disconnect( sf );
-        }
-      } // epoll in
-      else {
-        log_it(L_WARNING,"Unprocessed flags 0x%08X",events[n].events);
-      }
-    } // for nfds
+  if ( acl_policy ) {
+    unsigned acl_phase = vpn_acl_read_lock( );
+    vpn_acl_t *acl = atomic_load( &inst->acl );
+    bool acl_allow = !acl || vpn_acl_allow( acl, acl_policy, ((const struct iphdr *)data)->daddr );
 
-   //pthread_mutex_unlock(&sf_socks_mutex);
-  } // while
+    vpn_acl_read_unlock( acl_phase );
 
-  return 0;
-}
+    if ( !acl_allow ) {
+      vpn_counter_inc( &sf->rejects[DAP_STREAM_CH_VPN_REJECT_ACL] );
+      atomic_fetch_add_explicit( &inst->rejects[DAP_STREAM_CH_VPN_REJECT_ACL], 1, memory_order_relaxed );
+      VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_REJECT, DAP_STREAM_CH_VPN_REJECT_ACL, ch->stream->session->tun_client_addr.s_addr,
+                   data, data_size );
+      return;
+    }
+  }
 
+  VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_VPN_SEND, 0, ch->stream->session->tun_client_addr.s_addr, data, data_size );
 
-/**
- *
- *
- **/
-void *ch_sf_thread_raw( void *arg )
-{
-  ch_sf_tun_create( );
+  // Cached and in flight DNS answers don't need the trip upstream
+  if ( inst->dns ) {
+    vpn_dns_verdict_t verdict = vpn_dns_query( inst->dns, data, data_size );
 
-  if ( raw_server->tun_fd <= 0 ) {
-    log_it( L_CRITICAL,"Tun/tap file descriptor is not initialized" );
-    return NULL;
+    if ( verdict == VPN_DNS_ANSWERED || verdict == VPN_DNS_COALESCED )
+      return;
   }
 
-  /*    if (fcntl(raw_server->tun_fd, F_SETFL, O_NONBLOCK) < 0){ ;
-          log_it(L_CRITICAL,"Can't switch tun/tap socket into the non-block mode");
-          return NULL;
-      }
-      if (fcntl(raw_server->tun_fd, F_SETFD, FD_CLOEXEC) < 0){;
-          log_it(L_CRITICAL,"Can't switch tun/tap socket to not be passed across execs");
-          return NULL;
-      }
-  */
+  // Shape, keeping the order behind already delayed packets
+  if ( !ch_sf_up_backlog_flush(ch) || !vpn_tbf_consume(&sf->up_tbf, vpn_clock_ns(), data_size) ) {
 
-  uint8_t *tmp_buf;
-  ssize_t tmp_buf_size ;
-  static int tun_MTU = 100000; /// TODO Replace with detection of MTU size
+    if ( sf->up_backlog_size >= VPN_UP_BACKLOG_SIZE ) {
+      vpn_counter_inc( &sf->up_dropped );
+      VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_UP_DROP, VPN_CAPTURE_DROP_BACKLOG, ch->stream->session->tun_client_addr.s_addr,
+                   data, data_size );
+      return;
+    }
 
-  tmp_buf = (uint8_t *)calloc( 1, tun_MTU );
-  tmp_buf_size = 0;
-  log_it( L_INFO,"Tun/tap thread starts with MTU = %d", tun_MTU );
+    ch_vpn_pkt_t *pkt = (ch_vpn_pkt_t *)malloc( sizeof(pkt->header) + data_size );
+    if ( !pkt )
+      return;
 
-  #ifndef _WIN32
-    fd_set fds_read, fds_read_active;
+    memcpy( pkt, sf_pkt, sizeof(pkt->header) + data_size );
 
-    FD_ZERO( &fds_read );
-    FD_SET( raw_server->tun_fd, &fds_read );
-    FD_SET( get_select_breaker(), &fds_read );
-  #else
+    sf->up_backlog[(sf->up_backlog_rindex + sf->up_backlog_size) % VPN_UP_BACKLOG_SIZE] = pkt;
+    sf->up_backlog_size ++;
+    vpn_counter_inc( &sf->up_shaped );
 
-    HANDLE events[3];
-    int num_events = 2;
+    ch_sf_shaper_wake( sf, vpn_tbf_wait_ns(&sf->up_tbf), false );
+    return;
+  }
 
-    events[0] = raw_server->tun_read_overlap.hEvent;
-    events[1] = hTunWriteEvent;
-    events[2] = hTerminateEvent;
+  ch_sf_ip_forward( ch, sf_pkt->data, data_size );
 
-  #endif
+  return;
+}
 
-  /// Main cycle
-  do {
+/**
+ * @brief ch_sf_client_tun_up Client mode: open the tun on the first lease and put the leased address on it
+ * @param inst
+ * @return 0 if ok
+ */
+static int ch_sf_client_tun_up( dap_stream_ch_vpn_inst_t *inst )
+{
+  vpn_tun_shard_t *shard = &inst->shards[0];
+  char addr[ 16 ], gateway[ 16 ];
+  bool opened = false;
+  int ret = 0;
 
-    #ifndef _WIN32
-      fds_read_active = fds_read;
-      int ret = select( FD_SETSIZE, &fds_read_active, NULL, NULL, NULL );
-    #else
-      int ret = WaitForMultipleObjects( num_events, events, FALSE, INFINITE );
-    #endif
+  dap_snprintf( addr, sizeof(addr), "%s", inet_ntoa(inst->client_addr) );
+  dap_snprintf( gateway, sizeof(gateway), "%s", inet_ntoa(inst->client_addr_host) );
 
-    if ( ret <= 0 ) {
-      log_it( L_CRITICAL, "Select returned %d", ret );
-      break;
+  if ( shard->tun.fd == -1 ) {
+
+    if ( vpn_tun_open(&shard->tun, addr, inst->client_config.mask ? inst->client_config.mask : "255.255.255.255") ) {
+      log_it( L_CRITICAL, "Can't bring up %s tun/tap backend", inst->tun_ops->name );
+      return -1;
     }
 
-    #ifndef _WIN32
-      if ( FD_ISSET(get_select_breaker(), &fds_read_active) ) { // Smth to send
-    #else
-      if ( ret == WAIT_OBJECT_0 + 1 ) {
-    #endif
+    log_it( L_NOTICE, "Tun/tap backend %s is up, MTU %u", inst->tun_ops->name, shard->tun.mtu );
+    opened = true;
+  }
 
-      ch_vpn_pkt_t *pkt = ch_sf_raw_read( );
+  // Kernel interface is addressed by us, the lease may change on reconnect
+  if ( shard->tun.ifname[0] ) {
+    struct in_addr mask = { 0 };
 
-      if ( pkt ) {
-        #ifndef _WIN32
-          int write_ret = write( raw_server->tun_fd, pkt->data, pkt->header.op_data.data_size );
-        #else
-          int write_ret = win32_write_tun( pkt->data, pkt->header.op_data.data_size );
-        #endif
+    if ( inst->client_config.mask )
+      inet_aton( inst->client_config.mask, &mask );
 
-        if ( write_ret > 0 )
-          log_it( L_DEBUG, "Wrote out %d bytes to the tun/tap interface", write_ret );
-        else
-          log_it( L_ERROR,"Tun/tap write %u bytes returned '%s' error, code (%d)", pkt->header.op_data.data_size, strerror(errno), write_ret ) ;
-      }
+    if ( ch_sf_tun_link_up(inst, &shard->tun) || vpn_netlink_addr_flush(shard->tun.ifname) ||
+         vpn_netlink_addr_add(shard->tun.ifname, inst->client_addr.s_addr, vpn_netlink_prefix_len(mask.s_addr),
+                              inst->client_config.mask ? 0 : inst->client_addr_host.s_addr) ) {
+      log_it( L_CRITICAL, "Can't configure %s for the lease", shard->tun.ifname );
+      ret = -1;
     }
+    else
+      log_it( L_NOTICE, "Bringed up %s virtual network interface (%s, gateway %s)", shard->tun.ifname, addr, gateway );
+  }
 
-    #ifndef _WIN32
-      if ( FD_ISSET(raw_server->tun_fd, &fds_read_active) ) {
-    #else
-      if ( ret == WAIT_OBJECT_0 ) {
-    #endif
-
-      #ifndef _WIN32
-        int read_ret = read( raw_server->tun_fd, tmp_buf, tun_MTU );
-      #else
-        int read_ret = win32_read_tun( tmp_buf, tun_MTU );
-      #endif
+  // Configured or not, the tun is open and the next lease retries on it
+  if ( opened )
+    shard->raw_started = !pthread_create( &shard->raw_pid, NULL, ch_sf_thread_raw, shard );
 
-      if ( read_ret < 0 ) {
-        log_it( L_CRITICAL, "Tun/tap read returned '%s' error, code (%d)", strerror(errno), read_ret ) ;
-        break;
-      }
+  return ret;
+}
 
-      struct iphdr *iph = (struct iphdr* ) tmp_buf;
-      struct in_addr in_daddr, in_saddr;
+//  VPN_PACKET_OP_CODE_VPN_ADDR_REPLY, client mode
+static void ch_sf_packet_ADDR_REPLY( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, size_t pkt_size )
+{
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+  dap_stream_ch_vpn_remote_single_t *n_client, *old_client = NULL;
+  struct in_addr addr, gateway;
 
-      in_daddr.s_addr = iph->daddr;
-      in_saddr.s_addr = iph->saddr;
+  if ( pkt_size < sizeof(sf_pkt->header) + sizeof(addr) + sizeof(gateway) ||
+       sf_pkt->header.op_data.data_size < sizeof(addr) + sizeof(gateway) ) {
+    log_it( L_WARNING, "Address reply of %zu bytes is too short", pkt_size );
+    return;
+  }
 
-      char str_daddr[42],str_saddr[42];
-      strncpy( str_saddr, inet_ntoa(in_saddr), sizeof(str_saddr) );
-      strncpy( str_daddr, inet_ntoa(in_daddr), sizeof(str_daddr) );
+  memcpy( &addr, sf_pkt->data, sizeof(addr) );
+  memcpy( &gateway, sf_pkt->data + sizeof(addr), sizeof(gateway) );
 
-        /*if(iph->tot_len > (uint16_t) read_ret ){
-            log_it(L_INFO,"Tun/Tap interface returned only the fragment (tot_len =%u  read_ret=%d) ",
-                iph->tot_len,read_ret);
-          }*/
-        /*if(iph->tot_len < (uint16_t) read_ret ){
-            log_it(L_WARNING,"Tun/Tap interface returned more then one packet (tot_len =%u  read_ret=%d) ",
-                  iph->tot_len,read_ret);
-        }*/
+  if ( !(n_client = (dap_stream_ch_vpn_remote_single_t *)calloc(1, sizeof(dap_stream_ch_vpn_remote_single_t))) ) {
+    log_it( L_WARNING, "ch_sf_packet_ADDR_REPLY: out of memory" );
+    return;
+  }
 
-        //log_it(L_DEBUG,"Read IP packet from tun/tap interface daddr=%s saddr=%s total_size = %d "
-        //  ,str_daddr,str_saddr,read_ret);
+  n_client->addr = addr.s_addr;
+  n_client->ch = ch;
 
-      dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
-      pthread_mutex_lock( &raw_server->clients_mutex );
-      HASH_FIND_INT( raw_server->clients, &in_daddr.s_addr, raw_client );
+  // Previous lease is replaced, the tun stays
+  pthread_mutex_lock( &inst->clients_mutex );
 
-      //                  HASH_ADD_INT(DAP_STREAM_CH_VPN(ch)->socks, id, sf_sock );
-      //                  HASH_DEL(DAP_STREAM_CH_VPN(ch)->socks,sf_sock);
+  HASH_FIND_INT( inst->clients, &inst->client_addr.s_addr, old_client );
+  if ( old_client )
+    HASH_DEL( inst->clients, old_client );
 
-      if ( raw_client ) { // Is present in hash table such destination address
+  inst->client_addr = addr;
+  inst->client_addr_host = gateway;
+  HASH_ADD_INT( inst->clients, addr, n_client );
 
-        ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) + read_ret );
+  pthread_mutex_unlock( &inst->clients_mutex );
 
-        pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_RECV;
-        pkt_out->header.sock_id = (int32_t)raw_server->tun_fd;
-        pkt_out->header.op_data.data_size = read_ret;
+  free( old_client );
 
-        memcpy( pkt_out->data, tmp_buf, read_ret );
+  log_it( L_NOTICE, "VPN address %s leased", inet_ntoa(addr) );
+  log_it( L_INFO, "\tgateway %s", inet_ntoa(gateway) );
 
-        dap_stream_ch_pkt_write( raw_client->ch, 'd', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
-        stream_sf_socket_ready_to_write( raw_client->ch, true );
+  if ( ch_sf_client_tun_up(inst) )
+    return;
 
-      }
-      else {
-          // log_it(L_DEBUG,"No remote client for income IP packet with addr %s",inet_ntoa(in_daddr));
-      }
-        
-      pthread_mutex_unlock(& raw_server->clients_mutex );
-    } // fds_read_active
-    #ifdef _WIN32
-      else if ( ret == WAIT_OBJECT_0 + 2 ) break;
-    #endif
+  if ( inst->client_config.callback ) {
+    dap_stream_ch_vpn_client_lease_t lease = {
+      .addr    = addr.s_addr,
+      .gateway = gateway.s_addr,
+      .ifname  = inst->shards[0].tun.ifname
+    };
 
-  } while( bQuitSignal );
+    inst->client_config.callback( ch, &lease );
+  }
+}
 
-  log_it( L_NOTICE, "Raw sockets listen thread is stopped" );
+//  VPN_PACKET_OP_CODE_VPN_RECV, client mode
+static inline void  ch_sf_packet_VPN_RECV( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, size_t pkt_size )
+{
+  vpn_tun_shard_t *shard = &DAP_STREAM_CH_VPN(ch)->inst->shards[0];
+  uint32_t data_size = sf_pkt->header.op_data.data_size;
 
-  ch_sf_tun_destroy( );
-  return NULL;
-}
+  if ( pkt_size < sizeof(sf_pkt->header) || data_size > pkt_size - sizeof(sf_pkt->header) || data_size < sizeof(struct iphdr) ) {
+    vpn_counter_inc( &DAP_STREAM_CH_VPN(ch)->rejects[DAP_STREAM_CH_VPN_REJECT_TRUNCATED] );
+    return;
+  }
 
+  if ( shard->tun.fd == -1 || vpn_tun_write(&shard->tun, sf_pkt->data, data_size) < 0 ) {
+    atomic_fetch_add_explicit( &shard->tx_errors, 1, memory_order_relaxed );
+    log_it( L_ERROR, "Tun/tap write %u bytes returned '%s' error", data_size, strerror(errno) );
+    return;
+  }
 
+  atomic_fetch_add_explicit( &shard->tx_packets, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &shard->tx_bytes, data_size, memory_order_relaxed );
+}
 
 /**
- * @brief stream_sf_packet_out Packet Out Ch callback
+ * @brief ch_sf_client_release Client mode: forget the lease of the closed channel, the tun stays for the next one
  * @param ch
- * @param arg
  */
-void ch_sf_packet_out( dap_stream_ch_t *ch , void *arg )
+static void ch_sf_client_release( dap_stream_ch_t *ch )
 {
-  ch_vpn_socket_proxy_t * cur, *tmp;
-  bool isSmthOut = false;
-//    log_it(L_DEBUG,"Socket forwarding packet out callback: %u sockets in hashtable", HASH_COUNT(DAP_STREAM_CH_VPN(ch)->socks) );
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
 
-  HASH_ITER( hh, DAP_STREAM_CH_VPN(ch)->socks , cur, tmp ) {
+  pthread_mutex_lock( &inst->clients_mutex );
 
-    bool signalToBreak = false;
+  HASH_FIND_INT( inst->clients, &inst->client_addr.s_addr, raw_client );
 
-    int i;
-    pthread_mutex_lock( &cur->mutex );
+  if ( raw_client && raw_client->ch == ch )
+    HASH_DEL( inst->clients, raw_client );
+  else
+    raw_client = NULL;
 
-    log_it(L_DEBUG,"Socket with id %d has %u packets in output buffer", cur->id, cur->pkt_out_size );
+  pthread_mutex_unlock( &inst->clients_mutex );
 
-    if ( cur->pkt_out_size ) {
+  free( raw_client );
+}
 
-      for( i = 0; i < cur->pkt_out_size; i ++ ) {
-        ch_vpn_pkt_t *pout = cur->pkt_out[i];
+//  VPN_PACKET_OP_CODE_SEND:
+static inline void  ch_sf_packet_SEND( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt, ch_vpn_socket_proxy_t *sf_sock )
+{
+  if ( !sf_sock->inst->client_connected ) {
+    log_it( L_WARNING, "Drop Packet! User not connected!" ); // Client need send
+    pthread_mutex_unlock( &sf_sock->mutex );
+    return;
+  }
 
-        if ( !pout ) 
-          continue; 
+  int ret = send( sf_sock->sock, (char *)&sf_pkt->data[0], sf_pkt->header.op_data.data_size, 0 );
 
-        if ( dap_stream_ch_pkt_write(ch,'d',pout,pout->header.op_data.data_size+sizeof(pout->header)) ) {
-          isSmthOut = true;
-          free(pout);
-          cur->pkt_out[i]=NULL;
-        }
-        else {
-          log_it(L_WARNING, "Buffer is overflowed, breaking cycle to let the upper level cycle drop data to the output socket");
-          isSmthOut=true;
-          signalToBreak=true;
-          break;
-        }
-      }
-    }
+  if ( ret < 0 ) {
 
-    if ( signalToBreak ) {
-      pthread_mutex_unlock( &cur->mutex );
-      break;
-    }
+    log_it( L_INFO, "Disconnected from the remote host" );
 
-    cur->pkt_out_size = 0;
+    pthread_mutex_unlock( &sf_sock->mutex );
+    stream_sf_socket_close( ch, sf_sock );
 
-    if ( cur->signal_to_delete ) {
+    return;
+  }
 
-      log_it( L_NOTICE,"Socket id %d got signal to be deleted", cur->id );
+  sf_sock->bytes_sent += ret;
 
-      pthread_mutex_lock( &( DAP_STREAM_CH_VPN(ch)->mutex ) );
-      HASH_DEL( DAP_STREAM_CH_VPN(ch)->socks, cur );
-      pthread_mutex_unlock(&( DAP_STREAM_CH_VPN(ch)->mutex ));
+  VPN_CAPTURE_STREAM( DAP_STREAM_CH_VPN_CAPTURE_PROXY_OUT, ch->stream->session->tun_client_addr.s_addr, htons((uint16_t)sf_sock->id),
+                      sf_sock->remote_addr.sin_addr.s_addr, sf_sock->remote_addr.sin_port, sf_pkt->data, (size_t)ret );
 
-      pthread_mutex_lock(&(sf_socks_mutex));
-      HASH_DELETE(hh2,sf_socks,cur);
-      HASH_DELETE(hh_sock,sf_socks_client,cur);
-      pthread_mutex_unlock(&(sf_socks_mutex));
+  pthread_mutex_unlock( &sf_sock->mutex );
 
-      pthread_mutex_unlock(&(cur->mutex));
-      stream_sf_socket_delete(cur);
-    }
-    else
-      pthread_mutex_unlock(&(cur->mutex));
-  }
+//  log_it( L_INFO, "Send action from %d sock_id (sf_packet size %lu,  ch packet size %lu, have sent %d)",
+//                   sf_sock->id, sf_pkt->header.op_data.data_size, pkt->hdr.size, ret );
+  log_it( L_INFO, "Send action from %d sock_id (sf_packet size %lu,  ch packet size ?, have sent %d)",
+                   sf_sock->id, sf_pkt->header.op_data.data_size, ret );
 
-  ch->ready_to_write = isSmthOut;
+//dap_stream_ch_pkt_t *pkt
 
-  if ( isSmthOut ) {
-    ch->stream->conn_http->state_write=DAP_HTTP_CLIENT_STATE_DATA;
-  }
+  return;
+}
 
-  dap_client_remote_ready_to_write( ch->stream->conn, isSmthOut );
+//  VPN_PACKET_OP_CODE_DISCONNECT:
+static inline void  ch_sf_packet_DISCONNECT( dap_stream_ch_t *ch, ch_vpn_socket_proxy_t *sf_sock )
+{
+  log_it( L_INFO, "Disconnect action from %d sock_id", sf_sock->id );
+
+  pthread_mutex_unlock( &sf_sock->mutex );
+  stream_sf_socket_close( ch, sf_sock );
+
+  return;
+}
+
+//  VPN_PACKET_OP_CODE_CONNECT:
+static inline void  ch_sf_packet_CONNECT( dap_stream_ch_t *ch, ch_vpn_pkt_t *sf_pkt )
+{
+  dap_stream_ch_vpn_inst_t *inst = DAP_STREAM_CH_VPN(ch)->inst;
+  int remote_sock_id = sf_pkt->header.sock_id;
+  ch_vpn_socket_proxy_t *sf_sock = NULL;
+
+  struct sockaddr_in remote_addr;
+  char addr_str[1024];
+
+  size_t addr_str_size = (sf_pkt->header.op_connect.addr_size > (sizeof(addr_str)-1)) ? (sizeof(addr_str)-1):
+                             sf_pkt->header.op_connect.addr_size;
+
+  memset( &remote_addr, 0, sizeof(remote_addr));
+  remote_addr.sin_family = AF_INET;
+  remote_addr.sin_port = htons( sf_pkt->header.op_connect.port );
+
+  memcpy( addr_str, sf_pkt->data, addr_str_size );
+  addr_str[addr_str_size] = 0;
+
+  log_it( L_DEBUG, "Connect action to %s:%u (addr_size %lu)", addr_str, sf_pkt->header.op_connect.port,
+          sf_pkt->header.op_connect.addr_size );
+
+  if ( inet_pton(AF_INET,addr_str, &remote_addr.sin_addr) < 0 ) {
+
+    log_it( L_ERROR, "Wrong remote address '%s:%u'", addr_str, sf_pkt->header.op_connect.port );
+    return;
+  }
+
+  int s = socket( AF_INET, SOCK_STREAM, 0 );
+
+  if ( s < 0 ) {
+    log_it( L_ERROR, "Can't create the socket" );
+    return;
+  }
+
+  log_it( L_DEBUG, "Socket is created (%d)", s );
+
+  if ( connect(s, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0 ) {
+
+    log_it( L_INFO, "Can't connect to the remote server %s", addr_str );
+
+    dap_stream_ch_pkt_write_f( ch, 'i', "sock_id=%d op_code=%c result=-1", sf_pkt->header.sock_id, sf_pkt->header.op_code );
+    stream_sf_socket_ready_to_write( ch, true );
+
+    close( s );
+    return;
+  }
+
+  #ifdef _WIN32
+    unsigned long arg = 1;
+    ioctlsocket( s, FIONBIO, &arg );
+  #else
+    fcntl( s, F_SETFL, O_NONBLOCK );
+  #endif
+
+  log_it( L_INFO, "Remote address connected (%s:%u) with sock_id %d", addr_str, sf_pkt->header.op_connect.port, remote_sock_id );
+
+//  ch_vpn_socket_proxy_t *sf_sock = NULL;
+
+  sf_sock = DAP_NEW_Z( ch_vpn_socket_proxy_t );
+
+  sf_sock->client_id = remote_sock_id;
+  sf_sock->sock = s;
+  sf_sock->ch = ch;
+  sf_sock->inst = inst;
+  sf_sock->remote_addr = remote_addr;
+
+  pthread_mutex_init( &sf_sock->mutex, NULL );
+  atomic_init( &sf_sock->refs, 1 ); // Channel's table reference
+  atomic_init( &sf_sock->polled, false );
+  atomic_init( &sf_sock->closed, false );
+  sf_sock->out_src.type = VPN_OUT_SOURCE_PROXY;
+
+  sf_sock->id = stream_sf_slot_alloc( DAP_STREAM_CH_VPN(ch), sf_sock );
+
+  if ( sf_sock->id < 0 ) {
+    log_it( L_WARNING, "Too many proxy sockets in the channel, can't add sock_id %d", remote_sock_id );
+    dap_stream_ch_pkt_write_f( ch, 'i', "sock_id=%d op_code=%c result=-1", sf_pkt->header.sock_id, sf_pkt->header.op_code );
+    stream_sf_socket_ready_to_write( ch, true );
+    atomic_store( &sf_sock->closed, true );
+    stream_sf_socket_unref( sf_sock );
+    return;
+  }
+
+  log_it( L_DEBUG, "Added %d sock_id as handle 0x%08x with sock %d to the channel table", remote_sock_id, sf_sock->id, sf_sock->sock );
+
+  struct epoll_event ev;
+  ev.data.ptr = sf_sock;
+  ev.events = EPOLLIN | EPOLLERR;
+
+  stream_sf_socket_ref( sf_sock ); // Epoll's reference
+  atomic_store( &sf_sock->polled, true );
+
+  if ( epoll_ctl(inst->socks_epoll_fd, EPOLL_CTL_ADD, s, &ev) == -1 ) {
+    log_it( L_ERROR, "Can't add sock_id %d to the epoll fd", remote_sock_id );
+    atomic_store( &sf_sock->polled, false );
+    stream_sf_socket_unref( sf_sock );
+    //stream_ch_pkt_write_f(ch,'i',"sock_id=%d op_code=%uc result=-2",sf_pkt->sock_id, sf_pkt->op_code);
+  }
+  else {
+    log_it( L_NOTICE, "Added sock_id %d  with sock %d to the epoll fd", remote_sock_id, s );
+    log_it( L_NOTICE, "Send Connected packet to User" );
+
+    // Handle goes in header, client's own id in data to let it match the reply with the request
+    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t*) calloc( 1, sizeof(pkt_out->header) + sizeof(int32_t) );
+
+    pkt_out->header.sock_id = sf_sock->id;
+    pkt_out->header.op_code = VPN_PACKET_OP_CODE_CONNECTED;
+    pkt_out->header.op_data.data_size = sizeof(int32_t);
+    memcpy( pkt_out->data, &remote_sock_id, sizeof(int32_t) );
+    dap_stream_ch_pkt_write( ch,'s', pkt_out, pkt_out->header.op_data.data_size + sizeof(pkt_out->header) );
+
+    free( pkt_out );
+    inst->client_connected = true;
+  }
+
+  stream_sf_socket_ready_to_write( ch, true );
+
+  return;
+}
+
+
+/**
+ * @brief stream_sf_packet_in
+ * @param ch
+ * @param arg
+ */
+void ch_sf_packet_in( dap_stream_ch_t *ch, void *arg )
+{
+  dap_stream_ch_pkt_t *pkt = (dap_stream_ch_pkt_t *)arg;
+
+  if ( !DAP_STREAM_CH_VPN(ch) )
+    return;
+
+  // log_it(L_DEBUG,"stream_sf_packet_in:  channel packet hdr size %lu ( last bytes 0x%02x 0x%02x 0x%02x 0x%02x ) ", pkt->hdr.size,
+  //        *((uint8_t *)pkt->data + pkt->hdr.size-4),*((uint8_t *)pkt->data + pkt->hdr.size-3)
+  //        ,*((uint8_t *)pkt->data + pkt->hdr.size-2),*((uint8_t *)pkt->data + pkt->hdr.size-1)
+  //        );
+
+  ch_vpn_pkt_t *sf_pkt = (ch_vpn_pkt_t *)pkt->data;
+
+  int remote_sock_id = sf_pkt->header.sock_id;
+
+  //log_it(L_DEBUG,"Got SF packet with id %d op_code 0x%02x",remote_sock_id, sf_pkt->header.op_code );
+
+  if ( DAP_STREAM_CH_VPN(ch)->inst->client_mode ) {
+
+    switch( sf_pkt->header.op_code ) {
+    case VPN_PACKET_OP_CODE_VPN_ADDR_REPLY:
+      ch_sf_packet_ADDR_REPLY( ch, sf_pkt, pkt->hdr.size );
+    break;
+    case VPN_PACKET_OP_CODE_VPN_RECV:
+      ch_sf_packet_VPN_RECV( ch, sf_pkt, pkt->hdr.size );
+    break;
+    case VPN_PACKET_OP_CODE_PROBLEM:
+      log_it( L_WARNING, "Server reports problem code %u", sf_pkt->header.op_problem.code );
+    break;
+    default:
+      log_it( L_WARNING, "Can't process SF type 0x%02x in the client mode", sf_pkt->header.op_code );
+    break;
+    }
+
+    return;
+  }
+
+  if ( sf_pkt->header.op_code >= 0xb0 ) { // Raw packets
+
+    switch( sf_pkt->header.op_code ) {
+    case VPN_PACKET_OP_CODE_VPN_ADDR_REQUEST: 
+      ch_sf_packet_ADDR_REQUEST( ch, sf_pkt );
+    break;
+    case VPN_PACKET_OP_CODE_VPN_SEND:
+      ch_sf_packet_VPN_SEND( ch, sf_pkt, pkt->hdr.size );
+    break;
+    default:
+      log_it( L_WARNING, "Can't process SF type 0x%02x", sf_pkt->header.op_code );
+    break;
+    }
+
+    return;
+  }
+
+  if ( sf_pkt->header.op_code == VPN_PACKET_OP_CODE_CONNECT ) {
+
+    ch_sf_packet_CONNECT( ch, sf_pkt );
+    return;
+  }
+
+  ch_vpn_socket_proxy_t *sf_sock = stream_sf_slot_find( DAP_STREAM_CH_VPN(ch), remote_sock_id );
+
+  if ( !sf_sock ) {
+
+    log_it( L_WARNING, "Packet input: packet with sock_id %d thats not present in current stream channel", remote_sock_id );
+    return;
+  }
+
+  pthread_mutex_lock( &sf_sock->mutex ); // Unlock it in your case as soon as possible to reduce lock time
+  sf_sock->time_lastused = time( NULL );
+
+  switch( sf_pkt->header.op_code ) {
+
+  case VPN_PACKET_OP_CODE_SEND:
+    ch_sf_packet_SEND( ch, sf_pkt, sf_sock );
+  break;
+
+  case VPN_PACKET_OP_CODE_DISCONNECT:
+    ch_sf_packet_DISCONNECT( ch, sf_sock );
+  break;
+  default: {
+    log_it( L_WARNING, "Unprocessed op code 0x%02x", sf_pkt->header.op_code );
+    pthread_mutex_unlock( &sf_sock->mutex );
+  }
+  }
+
+  return;
+}
+
+
+/**
+ * @brief stream_sf_disconnect
+ * @param sf
+ */
+void stream_sf_disconnect( ch_vpn_socket_proxy_t *sf_sock )
+{
+  stream_sf_socket_unpoll( sf_sock );
+
+    // Compise signal to disconnect to another side, with special opcode STREAM_SF_PACKET_OP_CODE_DISCONNECT
+  ch_vpn_pkt_t * pkt_out;
+
+  sf_sock->signal_to_delete = true;
+
+  if ( sf_sock->pkt_out_size >= PROXY_PKT_BUFFER_SIZE ) {
+    log_it( L_WARNING, "No room for disconnect packet of sock_id %d", sf_sock->id );
+    return;
+  }
+
+  pkt_out = vpn_pkt_pool_get( );
+
+  if ( !pkt_out ) {
+    log_it( L_ERROR, "Can't allocate disconnect packet for sock_id %d", sf_sock->id );
+    return;
+  }
+
+  memset( &pkt_out->header, 0, sizeof(pkt_out->header) );
+
+  pkt_out->header.op_code = VPN_PACKET_OP_CODE_DISCONNECT;
+  pkt_out->header.sock_id = sf_sock->id;
+  stream_sf_pkt_out_push( sf_sock, pkt_out );
+}
+
+
+/**
+
+Socket forward
+**/
+
+void *ch_sf_thread(void * arg)
+{
+  dap_stream_ch_vpn_inst_t *inst = (dap_stream_ch_vpn_inst_t *)arg;
+  uint32_t  numfails = 0;
+  struct epoll_event events[SF_MAX_EVENTS];
+  //pthread_mutex_lock(&inst->socks_mutex);
+
+  memset( &events[0], 0, sizeof(struct epoll_event) * SF_MAX_EVENTS );
+
+  vpn_affinity_apply( &inst->socks_thread, &inst->thread_config[DAP_STREAM_CH_VPN_THREAD_SOCKS], -1, "Proxied sockets thread" );
+
+  #ifndef _WIN32
+    sigset_t sf_sigmask;
+    sigemptyset( &sf_sigmask );
+    sigaddset( &sf_sigmask, SIGUSR2 );
+  #endif
+
+  while( bQuitSignal && atomic_load(&inst->running) ) {
+    /*pthread_mutex_lock(&inst->socks_mutex);
+    if(sf_socks==NULL)
+      pthread_cond_wait(&sf_socks_cond,&inst->socks_mutex);
+    pthread_mutex_unlock(&inst->socks_mutex);*/
+
+    #ifndef _WIN32
+      int nfds = epoll_pwait( inst->socks_epoll_fd, events, SF_MAX_EVENTS, 10000, &sf_sigmask );
+      #else
+      int nfds = epoll_wait( inst->socks_epoll_fd, events, SF_MAX_EVENTS, 1000 );
+    #endif
+
+    if ( nfds < 0 ) {
+      log_it( L_CRITICAL,"Can't run epoll_wait: %s", strerror(errno) );
+      #ifdef _WIN32
+        Sleep( 10000 );
+      #else
+        sleep( 10 );
+      #endif
+      if ( numfails ++ >= 3 ) {
+        log_it( L_NOTICE, "ch_sf_thread: exit" );
+        break;
+      }
+      continue;
+    }
+
+    if( nfds > 0 )
+      log_it( L_DEBUG,"Epolled %d fd", nfds );
+
+    int n;
+
+    for ( n = 0; n < nfds; ++ n ) {
+
+      // Epoll's reference keeps the object alive till the graveyard flush after this batch
+      ch_vpn_socket_proxy_t *sf = (ch_vpn_socket_proxy_t *)events[n].data.ptr;
+
+      if ( !sf ) // Stop request, running is off
+        continue;
+
+      int s = sf->sock;
+
+      // Channel stays valid while the mutex is held and socket isn't closed, see stream_sf_socket_close()
+      pthread_mutex_lock( &sf->mutex );
+
+      if ( atomic_load_explicit(&sf->closed, memory_order_acquire) || !atomic_load_explicit(&sf->polled, memory_order_acquire) ) {
+        pthread_mutex_unlock( &sf->mutex );
+        log_it( L_DEBUG, "Skip event for already closed sock_id %d", sf->id );
+        continue;
+      }
+
+      dap_stream_ch_t *ch = sf->ch;
+      in_addr_t client_addr = ch->stream->session->tun_client_addr.s_addr;
+
+      if ( events[n].events & EPOLLERR ) {
+
+          log_it(L_NOTICE,"Socket id %d has EPOLLERR flag on",s);
+          stream_sf_disconnect(sf);
+          stream_sf_ready_push( DAP_STREAM_CH_VPN(ch), &sf->out_src );
+          stream_sf_socket_ready_to_write( ch, true );
+          pthread_mutex_unlock(& (sf->mutex) );
+
+      } else if ( events[n].events & EPOLLIN ) {
+
+        size_t received = 0;
+        bool is_disconnected = false;
+        ssize_t ret;
+
+        if ( sf->pkt_out_size >= PROXY_PKT_BUFFER_SIZE - 1 ) {
+          log_it( L_WARNING, "Can't receive data, full of stack" );
+          pthread_mutex_unlock( &(sf->mutex) );
+          continue;
+        }
+
+        // Receive right into the framed packets, leave one slot for disconnect packet
+        while ( sf->pkt_out_size < PROXY_PKT_BUFFER_SIZE - 1 && received < PROXY_RECV_BUDGET ) {
+
+          ch_vpn_pkt_t *pout = vpn_pkt_pool_get( );
+
+          if ( !pout ) {
+            log_it( L_ERROR, "Can't allocate packet for sock_id %d", sf->id );
+            break;
+          }
+
+          ret = recv( sf->sock, (char *)pout->data, VPN_POOL_PKT_DATA_MAX, 0 );
+
+          if ( ret <= 0 ) {
+            vpn_pkt_pool_put( pout );
+            if ( ret < 0 && stream_sf_recv_would_block() )
+              break;
+            is_disconnected = true;
+            break;
+          }
+
+          memset( &pout->header, 0, sizeof(pout->header) );
+          pout->header.op_code = VPN_PACKET_OP_CODE_RECV;
+          pout->header.sock_id = sf->id;
+          pout->header.op_data.data_size = (uint32_t)ret;
+
+          VPN_CAPTURE_STREAM( DAP_STREAM_CH_VPN_CAPTURE_PROXY_IN, client_addr, htons((uint16_t)sf->id),
+                              sf->remote_addr.sin_addr.s_addr, sf->remote_addr.sin_port, pout->data, (size_t)ret );
+
+          stream_sf_pkt_out_push( sf, pout );
+          sf->bytes_recieved += ret;
+          received += ret;
+        }
+
+        if ( is_disconnected ) {
+          log_it( L_NOTICE, "Socket id %d returned error on recv() function - may be host has disconnected", s );
+          stream_sf_disconnect( sf );
+        }
+
+        if ( received || is_disconnected ) {
+          stream_sf_ready_push( DAP_STREAM_CH_VPN(ch), &sf->out_src );
+          stream_sf_socket_ready_to_write( ch, true );
+        }
+
+        pthread_mutex_unlock(& (sf->mutex) );
+      } // epoll in
+      else {
+        pthread_mutex_unlock( &sf->mutex );
+        log_it(L_WARNING,"Unprocessed flags 0x%08X",events[n].events);
+      }
+    } // for nfds
+
+    stream_sf_socks_graveyard_flush( inst );
+
+   //pthread_mutex_unlock(&inst->socks_mutex);
+  } // while
+
+  vpn_affinity_leave( &inst->socks_thread );
+  return 0;
+}
+
+
+/**
+ * @brief ch_sf_client_tun_recv Client mode: queue the host's packet from the leased address as VPN_SEND,
+ *        ch_sf_packet_out() takes it through the same lanes, AQM and DRR as the server's downstream
+ * @param shard
+ * @param iph
+ * @param data
+ * @param data_size
+ */
+static void ch_sf_client_tun_recv( vpn_tun_shard_t *shard, const struct iphdr *iph, const uint8_t *data, uint32_t data_size )
+{
+  dap_stream_ch_vpn_inst_t *inst = shard->inst;
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  in_addr_t saddr = iph->saddr;
+
+  pthread_mutex_lock( &inst->clients_mutex );
+  HASH_FIND_INT( inst->clients, &saddr, raw_client );
+
+  if ( raw_client ) {
+
+    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)malloc( sizeof(pkt_out->header) + data_size );
+
+    if ( pkt_out ) {
+      memset( &pkt_out->header, 0, sizeof(pkt_out->header) );
+      pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_SEND;
+      pkt_out->header.sock_id = (int32_t)shard->tun.fd;
+      pkt_out->header.op_data.data_size = data_size;
+
+      memcpy( pkt_out->data, data, data_size );
+
+      int enqueue_ret = ch_sf_raw_enqueue( raw_client->ch, pkt_out );
+
+      if ( enqueue_ret > 0 )
+        stream_sf_socket_ready_to_write( raw_client->ch, true );
+      else if ( enqueue_ret < 0 )
+        free( pkt_out );
+    }
+  }
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+}
+
+/**
+ * @brief ch_sf_tun_recv Pass IP packet read from the shard's tun/tap to the client it's leased to
+ * @param shard
+ * @param data NAT rewrites it in place
+ * @param data_size
+ */
+static void ch_sf_tun_recv( vpn_tun_shard_t *shard, uint8_t *data, uint32_t data_size )
+{
+  dap_stream_ch_vpn_inst_t *inst = shard->inst;
+
+  if ( data_size < sizeof(struct iphdr) )
+    return;
+
+  struct iphdr *iph = (struct iphdr* ) data;
+  struct in_addr in_daddr;
+
+  // Client mode: everything the host sends through the tunnel goes upstream on the leased channel
+  if ( inst->client_mode ) {
+    ch_sf_client_tun_recv( shard, iph, data, data_size );
+    return;
+  }
+
+  // Reply to the masqueraded client, no flow means it's not ours
+  if ( inst->nat && iph->daddr == inst->nat_config.nat_addr && !vpn_nat_in(inst->nat, data, data_size) )
+    return;
+
+  // Learn the resolver's answer and copy it to the queries waiting for the same one
+  if ( inst->dns )
+    vpn_dns_response( inst->dns, data, data_size );
+
+  in_daddr.s_addr = iph->daddr;
+
+  //log_it(L_DEBUG,"Read IP packet from tun/tap interface daddr=%s total_size = %u", inet_ntoa(in_daddr), data_size);
+
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  pthread_mutex_lock( &inst->clients_mutex );
+  HASH_FIND_INT( inst->clients, &in_daddr.s_addr, raw_client );
+
+  if ( raw_client ) { // Is present in hash table such destination address
+
+    ch_vpn_pkt_t *pkt_out = (ch_vpn_pkt_t *)calloc( 1, sizeof(pkt_out->header) + data_size );
+
+    pkt_out->header.op_code = VPN_PACKET_OP_CODE_VPN_RECV;
+    pkt_out->header.sock_id = (int32_t)shard->tun.fd;
+    pkt_out->header.op_data.data_size = data_size;
+
+    memcpy( pkt_out->data, data, data_size );
+
+    VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_TUN_IN, 0, iph->daddr, data, data_size );
+
+    int enqueue_ret = ch_sf_raw_enqueue( raw_client->ch, pkt_out );
+
+    if ( enqueue_ret > 0 )
+      stream_sf_socket_ready_to_write( raw_client->ch, true );
+    else if ( enqueue_ret < 0 ) {
+      VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_DOWN_DROP, VPN_CAPTURE_DROP_QUEUE, iph->daddr, data, data_size );
+      free( pkt_out );
+    }
+  }
+  else {
+      // log_it(L_DEBUG,"No remote client for income IP packet with addr %s",inet_ntoa(in_daddr));
+  }
+
+  pthread_mutex_unlock(& inst->clients_mutex );
+}
+
+/**
+ * @brief ch_sf_thread_raw Tun/tap thread of the shard: drains the backend in batches, the channels' workers
+ *        write to the tun/tap themselves
+ * @param arg Shard
+ * @return
+ */
+void *ch_sf_thread_raw( void *arg )
+{
+  vpn_tun_shard_t *shard = (vpn_tun_shard_t *)arg;
+  dap_stream_ch_vpn_inst_t *inst = shard->inst;
+
+  if ( shard->tun.fd == -1 ) {
+    log_it( L_CRITICAL,"Tun/tap file descriptor is not initialized" );
+    return NULL;
+  }
+
+  // Placed before the read buffers are taken so they come from the thread's memory node
+  char thread_name[ 32 ];
+  snprintf( thread_name, sizeof(thread_name), "Raw thread of shard %u", shard->index );
+  vpn_affinity_apply( &shard->raw_thread, &inst->thread_config[DAP_STREAM_CH_VPN_THREAD_RAW], (int)shard->index, thread_name );
+
+  vpn_tun_pkt_t pkts[ VPN_TUN_BATCH ];
+  uint8_t *pkts_buf = (uint8_t *)malloc( (size_t)VPN_TUN_BATCH * VPN_TUN_PKT_MAX );
+
+  if ( !pkts_buf ) {
+    log_it( L_CRITICAL, "Can't allocate tun/tap read buffers" );
+    vpn_affinity_leave( &shard->raw_thread );
+    return NULL;
+  }
+
+  log_it( L_INFO,"Tun/tap thread of shard %u starts with MTU = %u, %u packets per read", shard->index, shard->tun.mtu, VPN_TUN_BATCH );
+
+  #ifndef _WIN32
+    int tun_wakeup = (int)vpn_tun_wakeup( &shard->tun );
+    fd_set fds_read, fds_read_active;
+
+    FD_ZERO( &fds_read );
+    FD_SET( tun_wakeup, &fds_read );
+    FD_SET( inst->stop_wake[0], &fds_read );
+  #else
+
+    HANDLE events[2];
+    int num_events = 2;
+
+    events[0] = (HANDLE)vpn_tun_wakeup( &shard->tun );
+    events[1] = inst->hTerminateEvent;
+
+  #endif
+
+  /// Main cycle
+  do {
+
+    #ifndef _WIN32
+      fds_read_active = fds_read;
+      int ret = select( FD_SETSIZE, &fds_read_active, NULL, NULL, NULL );
+    #else
+      int ret = WaitForMultipleObjects( num_events, events, FALSE, INFINITE );
+    #endif
+
+    if ( ret <= 0 ) {
+      log_it( L_CRITICAL, "Select returned %d", ret );
+      break;
+    }
+
+    #ifndef _WIN32
+      if ( FD_ISSET(inst->stop_wake[0], &fds_read_active) )
+        break;
+    #endif
+
+    #ifndef _WIN32
+      if ( FD_ISSET(tun_wakeup, &fds_read_active) ) {
+    #else
+      if ( ret == WAIT_OBJECT_0 ) {
+    #endif
+
+      for ( uint32_t i = 0; i < VPN_TUN_BATCH; i ++ ) {
+        pkts[i].data = pkts_buf + (size_t)i * VPN_TUN_PKT_MAX;
+        pkts[i].size = VPN_TUN_PKT_MAX;
+      }
+
+      int read_count = vpn_tun_read_batch( &shard->tun, pkts, VPN_TUN_BATCH );
+
+      if ( read_count < 0 ) {
+        log_it( L_CRITICAL, "Tun/tap read returned '%s' error", strerror(errno) ) ;
+        break;
+      }
+
+      if ( read_count ) {
+        atomic_fetch_add_explicit( &shard->rx_batches, 1, memory_order_relaxed );
+        atomic_fetch_add_explicit( &shard->rx_packets, (uint64_t)read_count, memory_order_relaxed );
+      }
+
+      for ( int i = 0; i < read_count; i ++ ) {
+        atomic_fetch_add_explicit( &shard->rx_bytes, pkts[i].size, memory_order_relaxed );
+        ch_sf_tun_recv( shard, pkts[i].data, pkts[i].size );
+      }
+
+    } // fds_read_active
+    #ifdef _WIN32
+      else if ( ret == WAIT_OBJECT_0 + 1 ) break;
+    #endif
+
+  } while( bQuitSignal && atomic_load(&inst->running) );
+
+  log_it( L_NOTICE, "Raw sockets listen thread is stopped" );
+
+  free( pkts_buf );
+
+  ch_sf_tun_destroy( shard );
+  vpn_affinity_leave( &shard->raw_thread );
+  return NULL;
+}
+
+
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_quantum Set deficit round-robin quanta for channel's outbound sources
+ * @param inst
+ * @param raw_quantum Bytes of raw VPN traffic per turn
+ * @param proxy_quantum Bytes per turn for every proxied socket
+ */
+void dap_stream_ch_vpn_inst_set_quantum( dap_stream_ch_vpn_inst_t *inst, uint32_t raw_quantum, uint32_t proxy_quantum )
+{
+  inst->out_quantum_raw   = raw_quantum ? raw_quantum : VPN_OUT_QUANTUM_RAW;
+  inst->out_quantum_proxy = proxy_quantum ? proxy_quantum : VPN_OUT_QUANTUM_PROXY;
+}
+
+/**
+ * @brief ch_sf_lane_drain Write lane's packets into the stream while they fit into the raw source's deficit
+ * @param ch
+ * @param rl
+ * @param src
+ * @param now
+ * @param is_throttled Set if the client's downstream rate limit is exhausted
+ * @return 0 if the lane is empty, 1 if the deficit or the rate limit stopped it, -1 if the stream buffer is full
+ */
+static int ch_sf_lane_drain( dap_stream_ch_t *ch, vpn_raw_lane_t *rl, vpn_out_source_t *src, uint64_t now, bool *is_throttled )
+{
+  // Bulk drain: producer's index is read once, consumer's index is published once
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+  dap_stream_ch_vpn_inst_t *inst = sf->inst;
+  vpn_pkt_spsc_t *q = &rl->q;
+  size_t head = atomic_load_explicit( &q->head, memory_order_relaxed );
+  size_t tail = atomic_load_explicit( &q->tail, memory_order_acquire );
+  int ret = 0;
+
+  while ( head != tail ) {
+
+    ch_vpn_pkt_t *pout = q->pkts[head & VPN_RAW_PKT_BUFFER_MASK];
+    size_t pout_size = pout->header.op_data.data_size + sizeof(pout->header);
+    uint64_t sojourn = now - q->ts[head & VPN_RAW_PKT_BUFFER_MASK];
+
+    if ( pout_size > src->deficit ) {
+      ret = 1;
+      break;
+    }
+
+    atomic_store_explicit( &rl->sojourn_last_ns, sojourn, memory_order_relaxed );
+    atomic_store_explicit( &sf->raw_sojourn_last_ns, sojourn, memory_order_relaxed );
+
+    // Head drop (or mark) while the standing queue delay is above target
+    if ( vpn_codel_should_drop(&rl->codel, &inst->codel_params, now, sojourn, tail - head <= 1) ) {
+
+      if ( !inst->codel_params.ecn || !vpn_ecn_mark(pout->data, pout->header.op_data.data_size) ) {
+        vpn_counter_inc( &rl->codel_drops );
+        VPN_CAPTURE( DAP_STREAM_CH_VPN_CAPTURE_DOWN_DROP, VPN_CAPTURE_DROP_AQM, ch->stream->session->tun_client_addr.s_addr,
+                     pout->data, pout->header.op_data.data_size );
+        head ++;
+        free( pout );
+        continue;
+      }
+
+      vpn_counter_inc( &rl->codel_marks );
+    }
+
+    if ( !vpn_tbf_consume(&sf->down_tbf, now, pout->header.op_data.data_size) ) {
+      vpn_counter_inc( &sf->down_throttled );
+      *is_throttled = true;
+      ret = 1;
+      break;
+    }
+
+    if ( !dap_stream_ch_pkt_write(ch, 'd', pout, pout_size) ) {
+      vpn_tbf_refund( &sf->down_tbf, pout->header.op_data.data_size ); // Packet stays for the next drain
+      ret = -1;
+      break;
+    }
+
+    src->deficit -= pout_size;
+    head ++;
+    free( pout );
+  }
+
+  atomic_store_explicit( &q->head, head, memory_order_release );
+
+  if ( head == tail )
+    vpn_codel_on_empty( &rl->codel );
+
+  return ret;
+}
+
+/**
+ * @brief ch_sf_out_drain Write source's packets into the stream while they fit into the source's deficit
+ * @param ch
+ * @param src
+ * @param is_empty Set if no packets left in the source
+ * @param is_throttled Set if the client's downstream rate limit is exhausted
+ * @return false if the stream buffer is full
+ */
+static bool ch_sf_out_drain( dap_stream_ch_t *ch, vpn_out_source_t *src, bool *is_empty, bool *is_throttled )
+{
+  bool ret = true;
+
+  *is_throttled = false;
+
+  if ( src->type == VPN_OUT_SOURCE_RAW ) {
+
+    // Lanes in strict priority order, the lower one is served only when the higher ones are empty
+    dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+    uint64_t now = vpn_clock_ns( );
+    int lane;
+
+    for ( lane = 0; lane < VPN_LANES; lane ++ ) {
+
+      int lane_ret = ch_sf_lane_drain( ch, &sf->raw_lanes[lane], src, now, is_throttled );
+
+      if ( lane_ret < 0 )
+        ret = false;
+      if ( lane_ret )
+        break;
+    }
+
+    *is_empty = ( lane == VPN_LANES );
+
+    return ret;
+  }
+
+  ch_vpn_socket_proxy_t *sf_sock = VPN_OUT_SOURCE_SOCK( src );
+
+  pthread_mutex_lock( &sf_sock->mutex );
+
+  while ( sf_sock->pkt_out_size ) {
+
+    ch_vpn_pkt_t *pout = sf_sock->pkt_out[sf_sock->pkt_out_rindex];
+    size_t pout_size = pout->header.op_data.data_size + sizeof(pout->header);
+
+    if ( pout_size > src->deficit )
+      break;
+
+    if ( !dap_stream_ch_pkt_write(ch, 'd', pout, pout_size) ) {
+      ret = false;
+      break;
+    }
+
+    src->deficit -= pout_size;
+    sf_sock->pkt_out[sf_sock->pkt_out_rindex] = NULL;
+    sf_sock->pkt_out_rindex = (sf_sock->pkt_out_rindex + 1) % PROXY_PKT_BUFFER_SIZE;
+    sf_sock->pkt_out_size --;
+
+    vpn_pkt_pool_put( pout );
+  }
+
+  *is_empty = (sf_sock->pkt_out_size == 0);
+
+  pthread_mutex_unlock( &sf_sock->mutex );
+
+  return ret;
+}
+
+/**
+ * @brief stream_sf_packet_out Packet Out Ch callback
+ * @param ch
+ * @param arg
+ */
+void ch_sf_packet_out( dap_stream_ch_t *ch , void *arg )
+{
+  dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( ch );
+  vpn_out_source_t *src;
+  bool isSmthOut = false;
+  bool signalToBreak = false;
+
+  if ( !sf )
+    return;
+
+  // Requests coming from now on must notify again
+  atomic_store( &sf->dirty, false );
+
+  ch_sf_up_backlog_flush( ch );
+
+  // Deficit round-robin over raw VPN queue and proxy sockets with pending packets
+  while ( !signalToBreak && (src = stream_sf_ready_pop(sf)) != NULL ) {
+
+    ch_vpn_socket_proxy_t *cur = NULL;
+    bool is_empty, is_throttled;
+    uint32_t deficit;
+
+    if ( src->type == VPN_OUT_SOURCE_PROXY ) {
+      cur = VPN_OUT_SOURCE_SOCK( src );
+      if ( atomic_load(&cur->closed) ) {
+        stream_sf_socket_unref( cur );
+        continue;
+      }
+    }
+
+    if ( !src->resume )
+      src->deficit += (src->type == VPN_OUT_SOURCE_RAW) ? sf->inst->out_quantum_raw : sf->inst->out_quantum_proxy;
+    src->resume = false;
+    deficit = src->deficit;
+
+    if ( !ch_sf_out_drain(ch, src, &is_empty, &is_throttled) ) {
+      log_it(L_WARNING, "Buffer is overflowed, breaking cycle to let the upper level cycle drop data to the output socket");
+      signalToBreak = true;
+      src->resume = true;
+    }
+
+    if ( is_throttled && !signalToBreak ) {
+      // Parked with raw_scheduled kept set, the shaper puts it back when tokens are there
+      if ( src->deficit != deficit )
+        isSmthOut = true;
+      src->deficit = 0;
+      ch_sf_shaper_wake( sf, vpn_tbf_wait_ns(&sf->down_tbf), true );
+      continue;
+    }
+
+    isSmthOut = true;
+
+    if ( !is_empty ) {
+      stream_sf_ready_return( sf, src, signalToBreak );
+      continue;
+    }
+
+    src->deficit = 0;
+
+    if ( src->type == VPN_OUT_SOURCE_RAW ) {
+      // Unschedule, then recheck to not lose the packet enqueued in between
+      atomic_store( &sf->raw_scheduled, false );
+      atomic_thread_fence( memory_order_seq_cst );
+      if ( !ch_sf_raw_lanes_empty(sf) && !atomic_exchange(&sf->raw_scheduled, true) )
+        stream_sf_ready_return( sf, src, false );
+      continue;
+    }
+
+    if ( cur ) {
+      pthread_mutex_lock( &cur->mutex );
+      bool to_delete = cur->signal_to_delete && !cur->pkt_out_size;
+      pthread_mutex_unlock( &cur->mutex );
+
+      if ( to_delete ) {
+        log_it( L_NOTICE,"Socket id %d got signal to be deleted", cur->id );
+        stream_sf_socket_close( ch, cur );
+      }
+    }
+
+    stream_sf_out_source_release( src );
+  }
+
+  if ( isSmthOut ) {
+    // Stay writable, no need for the producers to notify till the next call
+    atomic_store( &sf->dirty, true );
+    ch->ready_to_write = true;
+    ch->stream->conn_http->state_write=DAP_HTTP_CLIENT_STATE_DATA;
+    dap_client_remote_ready_to_write( ch->stream->conn, true );
+    return;
+  }
+
+  ch->ready_to_write = false;
+  dap_client_remote_ready_to_write( ch->stream->conn, false );
+
+  // Producer could notify before we switched writing off, restore it then
+  atomic_thread_fence( memory_order_seq_cst );
+  if ( atomic_load(&sf->dirty) ) {
+    ch->ready_to_write = true;
+    ch->stream->conn_http->state_write=DAP_HTTP_CLIENT_STATE_DATA;
+    dap_client_remote_ready_to_write( ch->stream->conn, true );
+  }
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_codel Tune AQM of the clients' downstream queues
+ * @param inst
+ * @param target_us Acceptable standing queue delay, 0 switches AQM off
+ * @param interval_us Time the delay must stay above target before dropping starts
+ * @param ecn Mark ECN capable packets instead of dropping them
+ */
+void dap_stream_ch_vpn_inst_set_codel( dap_stream_ch_vpn_inst_t *inst, uint32_t target_us, uint32_t interval_us, bool ecn )
+{
+  inst->codel_params.target_ns   = target_us * 1000ull;
+  inst->codel_params.interval_ns = ( interval_us ? interval_us : VPN_CODEL_INTERVAL_US ) * 1000ull;
+  inst->codel_params.ecn         = ecn;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_client_stats Fill counters of the client's downstream queue
+ * @param inst
+ * @param addr Leased client address, network byte order
+ * @param stats
+ * @return 0 if ok, -1 if there is no such client
+ */
+int dap_stream_ch_vpn_inst_get_client_stats( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, dap_stream_ch_vpn_client_stats_t *stats )
+{
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  in_addr_t client_addr = addr;
+  int ret = -1;
+
+  memset( stats, 0, sizeof(*stats) );
+
+  pthread_mutex_lock( &inst->clients_mutex );
+
+  HASH_FIND_INT( inst->clients, &client_addr, raw_client );
+
+  if ( raw_client ) {
+    dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( raw_client->ch );
+
+    for ( int lane = 0; lane < VPN_LANES; lane ++ ) {
+      vpn_raw_lane_t *rl = &sf->raw_lanes[lane];
+      dap_stream_ch_vpn_lane_stats_t *ls = &stats->lanes[lane];
+      size_t head = atomic_load_explicit( &rl->q.head, memory_order_relaxed );
+      size_t tail = atomic_load_explicit( &rl->q.tail, memory_order_relaxed );
+
+      ls->queue_len   = (uint32_t)( tail - head );
+      ls->enqueued    = atomic_load_explicit( &rl->enqueued, memory_order_relaxed );
+      ls->queue_drops = atomic_load_explicit( &rl->drops, memory_order_relaxed );
+      ls->codel_drops = atomic_load_explicit( &rl->codel_drops, memory_order_relaxed );
+      ls->codel_marks = atomic_load_explicit( &rl->codel_marks, memory_order_relaxed );
+      ls->sojourn_last_us = atomic_load_explicit( &rl->sojourn_last_ns, memory_order_relaxed ) / 1000;
+
+      stats->queue_len   += ls->queue_len;
+      stats->queue_drops += ls->queue_drops;
+      stats->codel_drops += ls->codel_drops;
+      stats->codel_marks += ls->codel_marks;
+    }
+
+    stats->sojourn_last_us = atomic_load_explicit( &sf->raw_sojourn_last_ns, memory_order_relaxed ) / 1000;
+    stats->up_shaped      = atomic_load_explicit( &sf->up_shaped, memory_order_relaxed );
+    stats->up_dropped     = atomic_load_explicit( &sf->up_dropped, memory_order_relaxed );
+    stats->down_throttled = atomic_load_explicit( &sf->down_throttled, memory_order_relaxed );
+
+    for ( int reason = 0; reason < DAP_STREAM_CH_VPN_REJECT_REASONS; reason ++ )
+      stats->rejects[reason] = atomic_load_explicit( &sf->rejects[reason], memory_order_relaxed );
+    ret = 0;
+  }
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+
+  return ret;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_hairpin Choose how packets between two of our clients are passed
+ * @param inst
+ * @param policy
+ */
+void dap_stream_ch_vpn_inst_set_hairpin( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_hairpin_t policy )
+{
+  inst->hairpin_policy = policy;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_nat Masquerade clients behind the address with the built-in NAT
+ *        instead of the host's iptables. Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param config NULL switches NAT off
+ * @return 0 if ok, -1 if the instance is started already
+ */
+int dap_stream_ch_vpn_inst_set_nat( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_nat_config_t *config )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "NAT can't be changed after the instance is started" );
+    return -1;
+  }
+
+  inst->nat_enabled = ( config != NULL );
+  if ( config )
+    inst->nat_config = *config;
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_nat_stats Fill flow table counters
+ * @param inst
+ * @param stats
+ * @return 0 if ok, -1 if NAT is off
+ */
+int dap_stream_ch_vpn_inst_get_nat_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_nat_stats_t *stats )
+{
+  memset( stats, 0, sizeof(*stats) );
+
+  if ( !inst->nat )
+    return -1;
+
+  vpn_nat_get_stats( inst->nat, stats );
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_tun_backend Choose what carries the clients' IP traffic.
+ *        Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param backend
+ * @return 0 if ok, -1 if the instance is started already or the backend is not supported here
+ */
+int dap_stream_ch_vpn_inst_set_tun_backend( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_tun_backend_t backend )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "Tun/tap backend can't be changed after the instance is started" );
+    return -1;
+  }
+
+  switch ( backend ) {
+    case DAP_STREAM_CH_VPN_TUN_KERNEL:
+      inst->tun_ops = &vpn_tun_kernel_ops;
+      return 0;
+  #ifndef _WIN32
+    case DAP_STREAM_CH_VPN_TUN_LOOPBACK:
+      inst->tun_ops = &vpn_tun_loopback_ops;
+      return 0;
+  #endif
+    default:
+      log_it( L_ERROR, "Tun/tap backend %d is not supported", backend );
+      return -1;
+  }
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_tun_link Link settings of the kernel tun/tap interface. Must be called before
+ *        dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param mtu 0 keeps the default
+ * @param txqlen Interface's transmit queue, packets, 0 keeps the default
+ * @return 0 if ok, -1 if the instance is started already
+ */
+int dap_stream_ch_vpn_inst_set_tun_link( dap_stream_ch_vpn_inst_t *inst, uint32_t mtu, uint32_t txqlen )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "Tun/tap link can't be changed after the instance is started" );
+    return -1;
+  }
+
+  inst->tun_mtu = mtu;
+  inst->tun_txqlen = txqlen;
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_tun_shards Split the VPN network between count tun/tap interfaces, each
+ *        with an equal slice of the addresses and its own raw thread. Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param count Power of two up to DAP_STREAM_CH_VPN_TUN_SHARDS_MAX, 1 for the single tun/tap
+ * @return 0 if ok, -1 if the instance is started already or the count is not supported
+ */
+int dap_stream_ch_vpn_inst_set_tun_shards( dap_stream_ch_vpn_inst_t *inst, uint32_t count )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "Tun/tap shards can't be changed after the instance is started" );
+    return -1;
+  }
+
+  if ( !count || count > DAP_STREAM_CH_VPN_TUN_SHARDS_MAX || (count & (count - 1)) ) {
+    log_it( L_ERROR, "Tun/tap shards count %u is not a power of two up to %u", count, DAP_STREAM_CH_VPN_TUN_SHARDS_MAX );
+    return -1;
+  }
+
+  #ifdef _WIN32
+    if ( count > 1 ) {
+      log_it( L_ERROR, "TAP-Windows gives one adapter, tun/tap can't be sharded" );
+      return -1;
+    }
+  #endif
+
+  return ch_sf_shards_alloc( inst, count );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_loopback_fd Network's end of the loopback backend. IP packets written
+ *        into it go to the clients, the ones clients send are read from it
+ * @param inst
+ * @return Descriptor of the first shard or -1 if the loopback backend is not running
+ */
+int dap_stream_ch_vpn_inst_get_loopback_fd( dap_stream_ch_vpn_inst_t *inst )
+{
+  return dap_stream_ch_vpn_inst_get_shard_loopback_fd( inst, 0 );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_shard_loopback_fd Network's end of the shard's loopback backend
+ * @param inst
+ * @param shard
+ * @return Descriptor or -1 if the loopback backend is not running or there is no such shard
+ */
+int dap_stream_ch_vpn_inst_get_shard_loopback_fd( dap_stream_ch_vpn_inst_t *inst, uint32_t shard )
+{
+  #ifndef _WIN32
+    return shard < inst->shards_count ? vpn_tun_loopback_peer( &inst->shards[shard].tun ) : -1;
+  #else
+    return -1;
+  #endif
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_shard_stats Load of the instance's tun/tap shards
+ * @param inst
+ * @param stats Array of count
+ * @param count
+ * @return Shards of the instance, the stats are filled for the first count of them
+ */
+uint32_t dap_stream_ch_vpn_inst_get_shard_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_shard_stats_t *stats, uint32_t count )
+{
+  pthread_mutex_lock( &inst->clients_mutex );
+
+  for ( uint32_t i = 0; i < inst->shards_count && i < count; i ++ ) {
+    vpn_tun_shard_t *shard = &inst->shards[i];
+    dap_stream_ch_vpn_shard_stats_t *st = &stats[i];
+
+    memset( st, 0, sizeof(*st) );
+    dap_snprintf( st->ifname, sizeof(st->ifname), "%s", shard->tun.ifname );
+
+    // Client mode leases nothing
+    if ( !inst->client_mode ) {
+      st->gateway    = shard->addr_host.s_addr;
+      st->addr_first = htonl( ntohl(shard->addr_host.s_addr) + 1 );
+      st->addr_last  = shard->addr_end.s_addr;
+      st->leases     = shard->leases;
+      st->addr_free  = ntohl( shard->addr_end.s_addr ) - ntohl( shard->addr_last.s_addr ) + shard->addr_released;
+    }
+
+    st->rx_packets = atomic_load_explicit( &shard->rx_packets, memory_order_relaxed );
+    st->rx_bytes   = atomic_load_explicit( &shard->rx_bytes, memory_order_relaxed );
+    st->rx_batches = atomic_load_explicit( &shard->rx_batches, memory_order_relaxed );
+    st->tx_packets = atomic_load_explicit( &shard->tx_packets, memory_order_relaxed );
+    st->tx_bytes   = atomic_load_explicit( &shard->tx_bytes, memory_order_relaxed );
+    st->tx_errors  = atomic_load_explicit( &shard->tx_errors, memory_order_relaxed );
+  }
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+
+  return inst->shards_count;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_thread_config Pin the threads of the kind to CPUs and a memory node and set
+ *        their scheduling class. Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param thread Kind of the threads, raw ones take the CPUs of the set in turn by shard
+ * @param config NULL leaves the threads where the system puts them
+ * @return 0 if ok, -1 if the instance is started already or the config is not valid
+ */
+int dap_stream_ch_vpn_inst_set_thread_config( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_thread_t thread,
+                                              const dap_stream_ch_vpn_thread_config_t *config )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "Thread placement can't be changed after the instance is started" );
+    return -1;
+  }
+
+  if ( (unsigned)thread >= DAP_STREAM_CH_VPN_THREADS ) {
+    log_it( L_ERROR, "Unknown thread kind %d", (int)thread );
+    return -1;
+  }
+
+  if ( config && (unsigned)config->sched > DAP_STREAM_CH_VPN_SCHED_RR ) {
+    log_it( L_ERROR, "Unknown scheduling class %d", (int)config->sched );
+    return -1;
+  }
+
+  dap_stream_ch_vpn_thread_config_t copy = { 0 };
+
+  if ( config && vpn_affinity_config_copy(&copy, config) ) {
+    log_it( L_CRITICAL, "Can't allocate the thread config" );
+    return -1;
+  }
+
+  vpn_affinity_config_free( &inst->thread_config[thread] );
+  inst->thread_config[ thread ] = copy;
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_threads Where the instance's threads run: which CPU serves which shard's tun/tap
+ * @param inst
+ * @param info Array of count, raw threads in shard order, then the proxied sockets and the shaper ones
+ * @param count
+ * @return Threads of the instance, the info is filled for the first count of them
+ */
+uint32_t dap_stream_ch_vpn_inst_get_threads( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_thread_info_t *info, uint32_t count )
+{
+  uint32_t total = inst->shards_count + 2;
+
+  for ( uint32_t i = 0; i < total && i < count; i ++ ) {
+
+    vpn_affinity_thread_t *thread;
+
+    memset( &info[i], 0, sizeof(info[i]) );
+
+    if ( i < inst->shards_count ) {
+      thread = &inst->shards[ i ].raw_thread;
+      info[ i ].thread = DAP_STREAM_CH_VPN_THREAD_RAW;
+      info[ i ].shard = i;
+    }
+    else if ( i == inst->shards_count ) {
+      thread = &inst->socks_thread;
+      info[ i ].thread = DAP_STREAM_CH_VPN_THREAD_SOCKS;
+    }
+    else {
+      thread = &inst->shaper_thread;
+      info[ i ].thread = DAP_STREAM_CH_VPN_THREAD_SHAPER;
+    }
+
+    vpn_affinity_query( thread, &info[i] );
+  }
+
+  return total;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_dns_cache Answer clients' repeated DNS queries from the cache and send
+ *        the same queries in flight upstream once. Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param config NULL switches the cache off
+ * @return 0 if ok, -1 if the instance is started already
+ */
+int dap_stream_ch_vpn_inst_set_dns_cache( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_dns_config_t *config )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "DNS cache can't be changed after the instance is started" );
+    return -1;
+  }
+
+  inst->dns_enabled = ( config != NULL );
+  if ( config )
+    inst->dns_config = *config;
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_dns_stats Fill DNS cache counters
+ * @param inst
+ * @param stats
+ * @return 0 if ok, -1 if the cache is off
+ */
+int dap_stream_ch_vpn_inst_get_dns_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_dns_stats_t *stats )
+{
+  memset( stats, 0, sizeof(*stats) );
+
+  if ( !inst->dns )
+    return -1;
+
+  vpn_dns_get_stats( inst->dns, stats );
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_acl Replace destination ACL policies. The new table is compiled aside
+ *        and swapped in, the data path is never paused
+ * @param inst
+ * @param policies Policy with index i gets id i + 1, NULL lifts all the restrictions
+ * @param policies_count
+ * @return 0 if ok, -1 if the policies can't be compiled, the old ones stay then
+ */
+int dap_stream_ch_vpn_inst_set_acl( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count )
+{
+  vpn_acl_t *acl = NULL;
+
+  if ( policies && policies_count && !(acl = vpn_acl_build(policies, policies_count)) )
+    return -1;
+
+  // Sequentially consistent, the lookups count themselves and then load the table
+  vpn_acl_retire( atomic_exchange(&inst->acl, acl) );
+  vpn_acl_reclaim( false );
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_client_acl Restrict client's destinations with the policy,
+ *        may be called from the lease callback
+ * @param inst
+ * @param addr Leased client address, network byte order
+ * @param policy_id 0 for unrestricted
+ * @return 0 if ok, -1 if there is no such client
+ */
+int dap_stream_ch_vpn_inst_set_client_acl( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, uint32_t policy_id )
+{
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  in_addr_t client_addr = addr;
+  int ret = -1;
+
+  pthread_mutex_lock( &inst->clients_mutex );
+
+  HASH_FIND_INT( inst->clients, &client_addr, raw_client );
+
+  if ( raw_client ) {
+    atomic_store_explicit( &DAP_STREAM_CH_VPN(raw_client->ch)->acl_policy, policy_id, memory_order_relaxed );
+    ret = 0;
+  }
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+
+  return ret;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_client Configure the client mode. Must be called before dap_stream_ch_vpn_inst_start()
+ * @param inst
+ * @param config
+ * @return 0 if ok, -1 if the instance is started already
+ */
+int dap_stream_ch_vpn_inst_set_client( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_client_config_t *config )
+{
+  if ( inst->started ) {
+    log_it( L_ERROR, "Client mode can't be configured after the instance is started" );
+    return -1;
+  }
+
+  inst->client_config = *config;
+
+  // Caller's string may be gone by the lease
+  if ( config->mask ) {
+    dap_snprintf( inst->client_mask, sizeof(inst->client_mask), "%s", config->mask );
+    inst->client_config.mask = inst->client_mask;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_client_request Client mode: ask the server for the address, the tun comes up with
+ *        the reply and the host's packets from the address go through the channel
+ * @param ch Channel 's' of the stream to the server
+ * @return 0 if ok, -1 if the module is not in the client mode or the stream buffer is full
+ */
+int dap_stream_ch_vpn_client_request( dap_stream_ch_t *ch )
+{
+  dap_stream_ch_vpn_inst_t *inst = dap_stream_ch_vpn_get_inst( ch );
+  ch_vpn_pkt_t pkt_out;
+
+  if ( !inst || !inst->client_mode ) {
+    log_it( L_ERROR, "Address can be requested in the client mode only" );
+    return -1;
+  }
+
+  memset( &pkt_out, 0, sizeof(pkt_out) );
+  pkt_out.header.op_code = VPN_PACKET_OP_CODE_VPN_ADDR_REQUEST;
+
+  if ( !dap_stream_ch_pkt_write(ch, 'd', &pkt_out, sizeof(pkt_out.header)) )
+    return -1;
+
+  stream_sf_socket_ready_to_write( ch, true );
+
+  return 0;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_default_rate Rate limits applied to every newly leased address
+ * @param inst
+ * @param rate
+ */
+void dap_stream_ch_vpn_inst_set_default_rate( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_rate_t *rate )
+{
+  if ( rate )
+    inst->rate_default = *rate;
+  else
+    memset( &inst->rate_default, 0, sizeof(inst->rate_default) );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_lease_callback Let the application pick rate limits per lease
+ * @param inst
+ * @param callback
+ */
+void dap_stream_ch_vpn_inst_set_lease_callback( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_lease_callback_t callback )
+{
+  inst->lease_callback = callback;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_set_client_rate Change rate limits of the connected client
+ * @param inst
+ * @param addr Leased client address, network byte order
+ * @param rate
+ * @return 0 if ok, -1 if there is no such client
+ */
+int dap_stream_ch_vpn_inst_set_client_rate( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, const dap_stream_ch_vpn_rate_t *rate )
+{
+  dap_stream_ch_vpn_remote_single_t *raw_client = NULL;
+  in_addr_t client_addr = addr;
+  int ret = -1;
+
+  pthread_mutex_lock( &inst->clients_mutex );
+
+  HASH_FIND_INT( inst->clients, &client_addr, raw_client );
+
+  if ( raw_client ) {
+    dap_stream_ch_vpn_t *sf = DAP_STREAM_CH_VPN( raw_client->ch );
+
+    vpn_tbf_set( &sf->up_tbf, rate->up_bps, rate->burst_bytes );
+    vpn_tbf_set( &sf->down_tbf, rate->down_bps, rate->burst_bytes );
+    ret = 0;
+  }
+
+  pthread_mutex_unlock( &inst->clients_mutex );
+
+  return ret;
+}
+
+/**
+ * @brief dap_stream_ch_vpn_capture_start Copy the packets seen inside the module into the shared memory ring
+ *        in pcap format, for dap_stream_ch_vpn_capture_reader. Running capture is restarted with the new config
+ * @param config NULL for the defaults
+ * @return 0 if ok, -1 if the ring can't be made
+ */
+int dap_stream_ch_vpn_capture_start( const dap_stream_ch_vpn_capture_config_t *config )
+{
+  dap_stream_ch_vpn_capture_config_t defaults = { 0 };
+
+  return vpn_capture_start( config ? config : &defaults );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_capture_stop Switch the capture off, the reader gets what's left in the ring
+ */
+void dap_stream_ch_vpn_capture_stop( void )
+{
+  vpn_capture_stop( );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_get_capture_stats Fill capture counters
+ * @param stats
+ */
+void dap_stream_ch_vpn_get_capture_stats( dap_stream_ch_vpn_capture_stats_t *stats )
+{
+  vpn_capture_get_stats( stats );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_inst_get_stats Fill instance's counters
+ * @param inst
+ * @param stats
+ */
+void dap_stream_ch_vpn_inst_get_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_stats_t *stats )
+{
+  memset( stats, 0, sizeof(*stats) );
+
+  stats->notify_issued    = atomic_load_explicit( &inst->notify_issued, memory_order_relaxed );
+  stats->notify_coalesced = atomic_load_explicit( &inst->notify_coalesced, memory_order_relaxed );
+  stats->hairpin_forwarded = atomic_load_explicit( &inst->hairpin_forwarded, memory_order_relaxed );
+  stats->hairpin_denied    = atomic_load_explicit( &inst->hairpin_denied, memory_order_relaxed );
+  stats->hairpin_dropped   = atomic_load_explicit( &inst->hairpin_dropped, memory_order_relaxed );
+
+  for ( int reason = 0; reason < DAP_STREAM_CH_VPN_REJECT_REASONS; reason ++ )
+    stats->rejects[reason] = atomic_load_explicit( &inst->rejects[reason], memory_order_relaxed );
+}
+
+/**
+ * @brief vpn_inst_default_get Instance of the calls without one, made by the first setting or by init
+ * @return NULL if out of memory
+ */
+static dap_stream_ch_vpn_inst_t *vpn_inst_default_get( void )
+{
+  dap_stream_ch_vpn_inst_t *inst = atomic_load( &vpn_inst_default );
+
+  if ( inst )
+    return inst;
+
+  pthread_mutex_lock( &vpn_inst_default_mutex );
+
+  if ( !(inst = atomic_load(&vpn_inst_default)) ) {
+    inst = dap_stream_ch_vpn_inst_new( 's' );
+    atomic_store( &vpn_inst_default, inst );
+  }
+
+  pthread_mutex_unlock( &vpn_inst_default_mutex );
+
+  return inst;
+}
+
+/**
+ * @brief vpn_inst_default_find Instance of the calls without one if it's there, the queries don't make it
+ * @return NULL before the first setting or init and after deinit
+ */
+static inline dap_stream_ch_vpn_inst_t *vpn_inst_default_find( void )
+{
+  return atomic_load( &vpn_inst_default );
+}
+
+/**
+ * @brief dap_stream_ch_vpn_init Init actions for VPN stream channel, the default instance
+ * @param vpn_addr Zero if only client mode. Address if the node shares its local VPN
+ * @param vpn_mask Zero if only client mode. Mask if the node shares its local VPN
+ * @return 0 if everything is okay, lesser then zero if errors
+ */
+int dap_stream_ch_vpn_init( const char *vpn_addr, const char *vpn_mask )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_start( inst, vpn_addr, vpn_mask ) : -1;
+}
+
+/**
+ * @brief ch_sf_deinit
+ */
+void dap_stream_ch_vpn_deinit( )
+{
+  vpn_capture_stop( );
+
+  pthread_mutex_lock( &vpn_inst_default_mutex );
+  dap_stream_ch_vpn_inst_t *inst = atomic_exchange( &vpn_inst_default, NULL );
+  pthread_mutex_unlock( &vpn_inst_default_mutex );
+
+  dap_stream_ch_vpn_inst_delete( inst );
+}
+
+int dap_stream_ch_vpn_set_client( const dap_stream_ch_vpn_client_config_t *config )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_client( inst, config ) : -1;
+}
+
+void dap_stream_ch_vpn_set_quantum( uint32_t raw_quantum, uint32_t proxy_quantum )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_set_quantum( inst, raw_quantum, proxy_quantum );
+}
+
+void dap_stream_ch_vpn_set_codel( uint32_t target_us, uint32_t interval_us, bool ecn )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_set_codel( inst, target_us, interval_us, ecn );
+}
+
+void dap_stream_ch_vpn_set_hairpin( dap_stream_ch_vpn_hairpin_t policy )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_set_hairpin( inst, policy );
+}
+
+int dap_stream_ch_vpn_set_acl( const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_acl( inst, policies, policies_count ) : -1;
+}
+
+int dap_stream_ch_vpn_set_client_acl( uint32_t addr, uint32_t policy_id )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_client_acl( inst, addr, policy_id ) : -1;
+}
+
+void dap_stream_ch_vpn_set_default_rate( const dap_stream_ch_vpn_rate_t *rate )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_set_default_rate( inst, rate );
+}
+
+void dap_stream_ch_vpn_set_lease_callback( dap_stream_ch_vpn_lease_callback_t callback )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_set_lease_callback( inst, callback );
+}
+
+int dap_stream_ch_vpn_set_client_rate( uint32_t addr, const dap_stream_ch_vpn_rate_t *rate )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_client_rate( inst, addr, rate ) : -1;
+}
+
+int dap_stream_ch_vpn_set_nat( const dap_stream_ch_vpn_nat_config_t *config )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_nat( inst, config ) : -1;
+}
+
+int dap_stream_ch_vpn_get_nat_stats( dap_stream_ch_vpn_nat_stats_t *stats )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  if ( inst )
+    return dap_stream_ch_vpn_inst_get_nat_stats( inst, stats );
+
+  memset( stats, 0, sizeof(*stats) );
+  return -1;
+}
+
+int dap_stream_ch_vpn_set_tun_backend( dap_stream_ch_vpn_tun_backend_t backend )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_tun_backend( inst, backend ) : -1;
+}
+
+int dap_stream_ch_vpn_set_tun_link( uint32_t mtu, uint32_t txqlen )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_tun_link( inst, mtu, txqlen ) : -1;
+}
+
+int dap_stream_ch_vpn_get_loopback_fd( void )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  return inst ? dap_stream_ch_vpn_inst_get_loopback_fd( inst ) : -1;
+}
+
+int dap_stream_ch_vpn_set_tun_shards( uint32_t count )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_tun_shards( inst, count ) : -1;
+}
+
+uint32_t dap_stream_ch_vpn_get_shard_stats( dap_stream_ch_vpn_shard_stats_t *stats, uint32_t count )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  return inst ? dap_stream_ch_vpn_inst_get_shard_stats( inst, stats, count ) : 0;
+}
+
+int dap_stream_ch_vpn_set_thread_config( dap_stream_ch_vpn_thread_t thread, const dap_stream_ch_vpn_thread_config_t *config )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_thread_config( inst, thread, config ) : -1;
+}
+
+uint32_t dap_stream_ch_vpn_get_threads( dap_stream_ch_vpn_thread_info_t *info, uint32_t count )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  return inst ? dap_stream_ch_vpn_inst_get_threads( inst, info, count ) : 0;
+}
+
+int dap_stream_ch_vpn_set_dns_cache( const dap_stream_ch_vpn_dns_config_t *config )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_get( );
+
+  return inst ? dap_stream_ch_vpn_inst_set_dns_cache( inst, config ) : -1;
+}
+
+int dap_stream_ch_vpn_get_dns_stats( dap_stream_ch_vpn_dns_stats_t *stats )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  if ( inst )
+    return dap_stream_ch_vpn_inst_get_dns_stats( inst, stats );
+
+  memset( stats, 0, sizeof(*stats) );
+  return -1;
+}
+
+void dap_stream_ch_vpn_get_stats( dap_stream_ch_vpn_stats_t *stats )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  if ( inst )
+    dap_stream_ch_vpn_inst_get_stats( inst, stats );
+  else
+    memset( stats, 0, sizeof(*stats) );
+}
+
+int dap_stream_ch_vpn_get_client_stats( uint32_t addr, dap_stream_ch_vpn_client_stats_t *stats )
+{
+  dap_stream_ch_vpn_inst_t *inst = vpn_inst_default_find( );
+
+  if ( inst )
+    return dap_stream_ch_vpn_inst_get_client_stats( inst, addr, stats );
+
+  memset( stats, 0, sizeof(*stats) );
+  return -1;
 }
@@ -1,7 +1,384 @@
 #ifndef _STREAM_SF_H_
 #define _STREAM_SF_H_
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Why client's VPN_SEND packet was refused, checked in this order
+typedef enum dap_stream_ch_vpn_reject {
+
+  DAP_STREAM_CH_VPN_REJECT_NONE = 0,
+  DAP_STREAM_CH_VPN_REJECT_TRUNCATED, // Shorter than IPv4 header or than the channel packet says
+  DAP_STREAM_CH_VPN_REJECT_VERSION,   // Not IPv4
+  DAP_STREAM_CH_VPN_REJECT_IHL,       // Header length is out of the packet
+  DAP_STREAM_CH_VPN_REJECT_LENGTH,    // tot_len doesn't match the packet size
+  DAP_STREAM_CH_VPN_REJECT_SADDR,     // Source is not the client's leased address
+  DAP_STREAM_CH_VPN_REJECT_ACL,       // Destination is not allowed by the client's policy
+
+  DAP_STREAM_CH_VPN_REJECT_REASONS
+
+} dap_stream_ch_vpn_reject_t;
+
+typedef struct dap_stream_ch_vpn_stats {
+
+  uint64_t notify_issued;    // Ready to write notifications sent to the client connections
+  uint64_t notify_coalesced; // Notifications skipped because the channel was already flagged
+  uint64_t hairpin_forwarded; // Client to client packets passed by the fast path
+  uint64_t hairpin_denied;    // Client to client packets dropped by the policy
+  uint64_t hairpin_dropped;   // Client to client packets lost to no memory or the peer's full queue
+
+  uint64_t rejects[ DAP_STREAM_CH_VPN_REJECT_REASONS ]; // Upstream packets of all the clients refused, by reason
+
+} dap_stream_ch_vpn_stats_t;
+
+// Downstream priority lanes: interactive, default, bulk
+#define DAP_STREAM_CH_VPN_LANES 3
+
+typedef struct dap_stream_ch_vpn_lane_stats {
+
+  uint32_t queue_len;       // Packets waiting in the lane
+  uint64_t enqueued;        // Packets classified into the lane
+  uint64_t queue_drops;     // Dropped because the lane was full
+  uint64_t codel_drops;     // Dropped by AQM
+  uint64_t codel_marks;     // ECN marked by AQM instead of drop
+  uint64_t sojourn_last_us; // Queue delay of the last packet dequeued from the lane
+
+} dap_stream_ch_vpn_lane_stats_t;
+
+typedef struct dap_stream_ch_vpn_client_stats {
+
+  uint32_t queue_len;       // Packets waiting in the client's downstream lanes
+  uint64_t queue_drops;     // Dropped because the lane was full
+  uint64_t codel_drops;     // Dropped by AQM
+  uint64_t codel_marks;     // ECN marked by AQM instead of drop
+  uint64_t sojourn_last_us; // Queue delay of the last dequeued packet, any lane
+  uint64_t up_shaped;       // Upstream packets delayed by the rate limit
+  uint64_t up_dropped;      // Upstream packets dropped because the shaping backlog was full
+  uint64_t down_throttled;  // Times the downstream queue stalled on the rate limit
+
+  dap_stream_ch_vpn_lane_stats_t lanes[ DAP_STREAM_CH_VPN_LANES ]; // Fields above sum these up
+
+  uint64_t rejects[ DAP_STREAM_CH_VPN_REJECT_REASONS ]; // Upstream packets refused, by reason
+
+} dap_stream_ch_vpn_client_stats_t;
+
+// How packets between two leased addresses are passed
+typedef enum dap_stream_ch_vpn_hairpin {
+
+  DAP_STREAM_CH_VPN_HAIRPIN_FAST = 0, // Straight into the destination client's queue
+  DAP_STREAM_CH_VPN_HAIRPIN_KERNEL,   // Through the tun/tap interface, host's firewall sees them
+  DAP_STREAM_CH_VPN_HAIRPIN_DENY      // Inter-client traffic is dropped
+
+} dap_stream_ch_vpn_hairpin_t;
+
+typedef struct dap_stream_ch_vpn_rate {
+
+  uint64_t up_bps;      // Client to network, bits per second, 0 is unlimited
+  uint64_t down_bps;    // Network to client, bits per second, 0 is unlimited
+  uint64_t burst_bytes; // Bucket depth, 0 picks 50 ms of the rate
+
+} dap_stream_ch_vpn_rate_t;
+
+struct dap_stream_ch;
+
+// Called on address lease with the default rate in *rate, may change it for the client
+typedef void (*dap_stream_ch_vpn_lease_callback_t)( struct dap_stream_ch *ch, uint32_t addr, dap_stream_ch_vpn_rate_t *rate );
+
+typedef struct dap_stream_ch_vpn_nat_config {
+
+  uint32_t nat_addr;            // Network byte order, clients are masqueraded behind it, routed to the tun/tap
+  uint16_t port_min;            // Host byte order, 0 for defaults
+  uint16_t port_max;
+  uint16_t ports_per_client;    // Size of the port block every client gets
+  uint32_t max_flows;
+
+  // Idle timeouts, seconds, 0 for defaults
+  uint32_t timeout_tcp;
+  uint32_t timeout_tcp_closing; // After FIN or RST
+  uint32_t timeout_udp;
+  uint32_t timeout_icmp;
+
+} dap_stream_ch_vpn_nat_config_t;
+
+typedef struct dap_stream_ch_vpn_nat_stats {
+
+  uint32_t flows;           // Flows in the table
+  uint32_t flows_max;
+  uint32_t clients;         // Clients holding a port block
+  uint32_t clients_max;     // Port blocks in the range
+
+  uint64_t lookups;         // Flow table lookups, hit rate is hits / lookups
+  uint64_t hits;
+  uint64_t created;
+  uint64_t evicted;         // Expired by idle timeout
+  uint64_t table_full;      // New flow refused, no room in the table
+  uint64_t ports_exhausted; // New flow refused, client's port block is used up
+  uint64_t no_flow;         // Inbound packets to the NAT address matching no flow
+  uint64_t unsupported;     // Protocols and fragments that can't be translated
+
+} dap_stream_ch_vpn_nat_stats_t;
+
+typedef struct dap_stream_ch_vpn_acl_rule {
+
+  uint32_t prefix;     // Network byte order
+  uint8_t  prefix_len;
+  bool     allow;
+
+} dap_stream_ch_vpn_acl_rule_t;
+
+// Longest matching rule decides, default_allow if none matches
+typedef struct dap_stream_ch_vpn_acl_policy {
+
+  const dap_stream_ch_vpn_acl_rule_t *rules;
+  size_t rules_count;
+  bool default_allow;
+
+} dap_stream_ch_vpn_acl_policy_t;
+
+typedef enum dap_stream_ch_vpn_tun_backend {
+
+  DAP_STREAM_CH_VPN_TUN_KERNEL = 0, // /dev/net/tun, TAP-Windows
+  DAP_STREAM_CH_VPN_TUN_LOOPBACK    // Socket pair inside the process, no root and no interface needed
+
+} dap_stream_ch_vpn_tun_backend_t;
+
+// Tun/tap interfaces one instance may split its VPN network between
+#define DAP_STREAM_CH_VPN_TUN_SHARDS_MAX 16
+
+// One of the tun/tap interfaces of the instance, addresses are network byte order
+typedef struct dap_stream_ch_vpn_shard_stats {
+
+  char ifname[ 64 ];   // Kernel interface, empty for the other backends
+  uint32_t gateway;    // Shard's own address, its clients' gateway
+  uint32_t addr_first; // Slice of the VPN network the shard leases from
+  uint32_t addr_last;
+  uint32_t leases;     // Addresses leased, a new lease goes to the shard with the fewest
+  uint32_t addr_free;  // Addresses left to lease, the released ones included
+
+  uint64_t rx_packets; // Read from the tun/tap for the clients
+  uint64_t rx_bytes;
+  uint64_t rx_batches; // Reads that got packets, rx_packets / rx_batches is the mean batch
+  uint64_t tx_packets; // Clients' packets written to the tun/tap
+  uint64_t tx_bytes;
+  uint64_t tx_errors;
+
+} dap_stream_ch_vpn_shard_stats_t;
+
+// DNS answer cache in front of the resolver the clients use, through the tunnel
+typedef struct dap_stream_ch_vpn_dns_config {
+
+  uint32_t resolver_addr;  // Network byte order, queries to it are looked up in the cache
+  uint16_t resolver_port;  // Host byte order, 53 if zero
+  uint32_t max_entries;    // Answers kept, 4096 if zero
+  uint32_t ttl_min;        // Seconds, answer TTL is clamped to [ttl_min, ttl_max], 0 TTL is not cached
+  uint32_t ttl_max;        // 86400 if zero
+  uint32_t ttl_negative;   // NXDOMAIN and NODATA without SOA, 30 if zero
+
+} dap_stream_ch_vpn_dns_config_t;
+
+typedef struct dap_stream_ch_vpn_dns_stats {
+
+  uint32_t entries;
+  uint32_t entries_max;
+  uint32_t pending;          // Queries in flight to the resolver
+
+  uint64_t queries;          // Hit rate is hits / queries
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t coalesced;        // Misses joined to the same query in flight instead of going upstream
+  uint64_t expired;
+  uint64_t inserted;
+  uint64_t evicted;          // Pushed out of the full cache, least recently used first
+  uint64_t uncacheable;      // Errors, truncated and zero TTL answers
+  uint64_t responses;        // Answers seen from the resolver
+  uint64_t unsolicited;      // Answers to no query forwarded, passed to the client but not cached
+  uint64_t upstream_answers; // Answers matched to the query, mean upstream RTT is upstream_rtt_us / upstream_answers
+  uint64_t upstream_rtt_us;
+  uint64_t saved_us;         // Upstream RTT the hits didn't wait for
+
+} dap_stream_ch_vpn_dns_stats_t;
+
+// Where the capture tap sees the packet
+typedef enum dap_stream_ch_vpn_capture_point {
+
+  DAP_STREAM_CH_VPN_CAPTURE_VPN_SEND = 0, // Client's packet accepted upstream
+  DAP_STREAM_CH_VPN_CAPTURE_REJECT,       // Client's packet refused, reason is dap_stream_ch_vpn_reject_t
+  DAP_STREAM_CH_VPN_CAPTURE_UP_DROP,      // Upstream packet dropped by the shaping backlog
+  DAP_STREAM_CH_VPN_CAPTURE_TUN_IN,       // Packet from the tun/tap for the client
+  DAP_STREAM_CH_VPN_CAPTURE_DOWN_DROP,    // Downstream packet dropped by the full lane or AQM
+  DAP_STREAM_CH_VPN_CAPTURE_PROXY_OUT,    // Client's bytes sent to the proxied socket, framed as UDP
+  DAP_STREAM_CH_VPN_CAPTURE_PROXY_IN,     // Bytes of the proxied socket for the client, framed as UDP
+
+  DAP_STREAM_CH_VPN_CAPTURE_POINTS
+
+} dap_stream_ch_vpn_capture_point_t;
+
+// Packets go in pcap format into the shared memory ring, dap_stream_ch_vpn_capture_reader takes them out
+typedef struct dap_stream_ch_vpn_capture_config {
+
+  const char *shm_name;  // POSIX shared memory object, "/dap_stream_ch_vpn_capture" if NULL
+  uint32_t ring_size;    // Bytes, rounded up to the power of two, 4 MB if zero
+  uint32_t snaplen;      // Bytes of the packet kept, whole packet if zero
+  uint32_t addr;         // Lease address to capture, network byte order, all of them if zero
+  uint32_t points;       // Mask of 1 << dap_stream_ch_vpn_capture_point_t, all of them if zero
+
+} dap_stream_ch_vpn_capture_config_t;
+
+typedef struct dap_stream_ch_vpn_capture_stats {
+
+  bool running;
+  uint64_t captured;   // Records put into the ring
+  uint64_t ring_full;  // Records lost, the reader lags behind or there is none
+
+} dap_stream_ch_vpn_capture_stats_t;
+
+// Client mode: what the server leased, addresses are network byte order
+typedef struct dap_stream_ch_vpn_client_lease {
+
+  uint32_t addr;      // Tun's own address, the server accepts packets from it only
+  uint32_t gateway;   // Server's end of the tunnel
+  const char *ifname; // Kernel interface the tunnel is on, empty for the other backends
+
+} dap_stream_ch_vpn_client_lease_t;
+
+// Called when the address is leased and the tun is up, on the channel's worker thread
+typedef void (*dap_stream_ch_vpn_client_callback_t)( struct dap_stream_ch *ch, const dap_stream_ch_vpn_client_lease_t *lease );
+
+typedef struct dap_stream_ch_vpn_client_config {
+
+  const char *mask; // VPN network mask put on the tun, point to point link to the gateway if NULL
+  dap_stream_ch_vpn_client_callback_t callback;
+
+} dap_stream_ch_vpn_client_config_t;
+
+// Threads the instance makes
+typedef enum dap_stream_ch_vpn_thread {
+
+  DAP_STREAM_CH_VPN_THREAD_RAW = 0, // Tun/tap reads and writes, one per shard
+  DAP_STREAM_CH_VPN_THREAD_SOCKS,   // Epoll loop of the proxied sockets
+  DAP_STREAM_CH_VPN_THREAD_SHAPER,  // Wakes up the rate limited channels
+
+  DAP_STREAM_CH_VPN_THREADS
+
+} dap_stream_ch_vpn_thread_t;
+
+typedef enum dap_stream_ch_vpn_sched {
+
+  DAP_STREAM_CH_VPN_SCHED_OTHER = 0, // Time sharing, priority is the nice value
+  DAP_STREAM_CH_VPN_SCHED_FIFO,      // Realtime, priority 1..99, needs CAP_SYS_NICE
+  DAP_STREAM_CH_VPN_SCHED_RR         // Realtime with time slices among the same priority
+
+} dap_stream_ch_vpn_sched_t;
+
+// Where the thread runs and what memory it takes. Settings the system refuses are logged and skipped
+typedef struct dap_stream_ch_vpn_thread_config {
+
+  const uint32_t *cpus; // CPUs to run on, any if NULL. Raw thread of shard n gets cpus[n % cpus_count] alone
+  size_t cpus_count;
+  bool numa_bind;       // Allocate from numa_node first, the node's CPUs are taken if cpus is NULL. Linux only
+  uint32_t numa_node;
+  dap_stream_ch_vpn_sched_t sched;
+  int32_t priority;
+
+} dap_stream_ch_vpn_thread_config_t;
+
+// Placement of the running thread, as the kernel has it
+typedef struct dap_stream_ch_vpn_thread_info {
+
+  dap_stream_ch_vpn_thread_t thread;
+  uint32_t shard;     // Raw thread's shard, 0 for the rest
+  int32_t tid;        // Kernel thread id, 0 if the thread is not running
+  int32_t cpu;        // CPU it ran on last, -1 if unknown
+  char cpus[ 128 ];   // Affinity as the CPU list, "0-3,8"
+  int32_t numa_node;  // Memory node the allocations prefer, -1 for any
+  dap_stream_ch_vpn_sched_t sched;
+  int32_t priority;
+
+} dap_stream_ch_vpn_thread_info_t;
+
+// One VPN network: its tun/tap, addresses, threads, settings and counters, served on its own stream channel id.
+// Instances of the process don't share anything but the capture tap
+typedef struct dap_stream_ch_vpn_inst dap_stream_ch_vpn_inst_t;
+
+dap_stream_ch_vpn_inst_t *dap_stream_ch_vpn_inst_new( uint8_t ch_id );
+int  dap_stream_ch_vpn_inst_start( dap_stream_ch_vpn_inst_t *inst, const char *vpn_addr, const char *vpn_mask );
+void dap_stream_ch_vpn_inst_delete( dap_stream_ch_vpn_inst_t *inst );
+dap_stream_ch_vpn_inst_t *dap_stream_ch_vpn_get_inst( struct dap_stream_ch *ch );
+
+int  dap_stream_ch_vpn_inst_set_client( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_client_config_t *config );
+
+void dap_stream_ch_vpn_inst_set_quantum( dap_stream_ch_vpn_inst_t *inst, uint32_t raw_quantum, uint32_t proxy_quantum );
+void dap_stream_ch_vpn_inst_set_codel( dap_stream_ch_vpn_inst_t *inst, uint32_t target_us, uint32_t interval_us, bool ecn );
+
+void dap_stream_ch_vpn_inst_set_hairpin( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_hairpin_t policy );
+int  dap_stream_ch_vpn_inst_set_acl( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count );
+int  dap_stream_ch_vpn_inst_set_client_acl( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, uint32_t policy_id );
+
+void dap_stream_ch_vpn_inst_set_default_rate( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_rate_t *rate );
+void dap_stream_ch_vpn_inst_set_lease_callback( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_lease_callback_t callback );
+int  dap_stream_ch_vpn_inst_set_client_rate( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, const dap_stream_ch_vpn_rate_t *rate );
+
+int  dap_stream_ch_vpn_inst_set_nat( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_nat_config_t *config );
+int  dap_stream_ch_vpn_inst_get_nat_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_nat_stats_t *stats );
+
+int  dap_stream_ch_vpn_inst_set_tun_backend( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_tun_backend_t backend );
+int  dap_stream_ch_vpn_inst_set_tun_link( dap_stream_ch_vpn_inst_t *inst, uint32_t mtu, uint32_t txqlen );
+int  dap_stream_ch_vpn_inst_get_loopback_fd( dap_stream_ch_vpn_inst_t *inst );
+
+int  dap_stream_ch_vpn_inst_set_tun_shards( dap_stream_ch_vpn_inst_t *inst, uint32_t count );
+int  dap_stream_ch_vpn_inst_get_shard_loopback_fd( dap_stream_ch_vpn_inst_t *inst, uint32_t shard );
+uint32_t dap_stream_ch_vpn_inst_get_shard_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_shard_stats_t *stats, uint32_t count );
+
+int  dap_stream_ch_vpn_inst_set_thread_config( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_thread_t thread,
+                                               const dap_stream_ch_vpn_thread_config_t *config );
+uint32_t dap_stream_ch_vpn_inst_get_threads( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_thread_info_t *info, uint32_t count );
+
+int  dap_stream_ch_vpn_inst_set_dns_cache( dap_stream_ch_vpn_inst_t *inst, const dap_stream_ch_vpn_dns_config_t *config );
+int  dap_stream_ch_vpn_inst_get_dns_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_dns_stats_t *stats );
+
+void dap_stream_ch_vpn_inst_get_stats( dap_stream_ch_vpn_inst_t *inst, dap_stream_ch_vpn_stats_t *stats );
+int  dap_stream_ch_vpn_inst_get_client_stats( dap_stream_ch_vpn_inst_t *inst, uint32_t addr, dap_stream_ch_vpn_client_stats_t *stats );
+
+// Calls without the instance go to the default one, on channel 's'
 int  dap_stream_ch_vpn_init( const char* vpn_addr, const char *vpn_mask );
 void dap_stream_ch_vpn_deinit( );
 
+int  dap_stream_ch_vpn_set_client( const dap_stream_ch_vpn_client_config_t *config );
+int  dap_stream_ch_vpn_client_request( struct dap_stream_ch *ch );
+
+void dap_stream_ch_vpn_set_quantum( uint32_t raw_quantum, uint32_t proxy_quantum );
+void dap_stream_ch_vpn_set_codel( uint32_t target_us, uint32_t interval_us, bool ecn );
+
+void dap_stream_ch_vpn_set_hairpin( dap_stream_ch_vpn_hairpin_t policy );
+int  dap_stream_ch_vpn_set_acl( const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count );
+int  dap_stream_ch_vpn_set_client_acl( uint32_t addr, uint32_t policy_id );
+
+void dap_stream_ch_vpn_set_default_rate( const dap_stream_ch_vpn_rate_t *rate );
+void dap_stream_ch_vpn_set_lease_callback( dap_stream_ch_vpn_lease_callback_t callback );
+int  dap_stream_ch_vpn_set_client_rate( uint32_t addr, const dap_stream_ch_vpn_rate_t *rate );
+
+int  dap_stream_ch_vpn_set_nat( const dap_stream_ch_vpn_nat_config_t *config );
+int  dap_stream_ch_vpn_get_nat_stats( dap_stream_ch_vpn_nat_stats_t *stats );
+
+int  dap_stream_ch_vpn_set_tun_backend( dap_stream_ch_vpn_tun_backend_t backend );
+int  dap_stream_ch_vpn_set_tun_link( uint32_t mtu, uint32_t txqlen );
+int  dap_stream_ch_vpn_get_loopback_fd( void );
+
+int  dap_stream_ch_vpn_set_tun_shards( uint32_t count );
+uint32_t dap_stream_ch_vpn_get_shard_stats( dap_stream_ch_vpn_shard_stats_t *stats, uint32_t count );
+
+int  dap_stream_ch_vpn_set_thread_config( dap_stream_ch_vpn_thread_t thread, const dap_stream_ch_vpn_thread_config_t *config );
+uint32_t dap_stream_ch_vpn_get_threads( dap_stream_ch_vpn_thread_info_t *info, uint32_t count );
+
+int  dap_stream_ch_vpn_set_dns_cache( const dap_stream_ch_vpn_dns_config_t *config );
+int  dap_stream_ch_vpn_get_dns_stats( dap_stream_ch_vpn_dns_stats_t *stats );
+
+int  dap_stream_ch_vpn_capture_start( const dap_stream_ch_vpn_capture_config_t *config );
+void dap_stream_ch_vpn_capture_stop( void );
+void dap_stream_ch_vpn_get_capture_stats( dap_stream_ch_vpn_capture_stats_t *stats );
+
+void dap_stream_ch_vpn_get_stats( dap_stream_ch_vpn_stats_t *stats );
+int  dap_stream_ch_vpn_get_client_stats( uint32_t addr, dap_stream_ch_vpn_client_stats_t *stats );
+
 #endif
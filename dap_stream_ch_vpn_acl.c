@@ -0,0 +1,327 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_acl.h"
+
+#define LOG_TAG "stream_ch_vpn_acl"
+
+typedef struct vpn_acl_prefix {
+
+  uint32_t addr; // Host byte order, masked
+  uint8_t  len;
+
+} vpn_acl_prefix_t;
+
+typedef struct vpn_acl_retired {
+
+  vpn_acl_t *acl;
+  uint64_t flips; // vpn_acl_flips when it was retired, two more flips and no lookup can have it
+  struct vpn_acl_retired *next;
+
+} vpn_acl_retired_t;
+
+static pthread_mutex_t vpn_acl_retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vpn_acl_retired_t *vpn_acl_retired = NULL;
+static uint64_t vpn_acl_flips = 0;
+
+atomic_uint vpn_acl_phase = 0;
+vpn_acl_readers_t vpn_acl_readers[ 2 ];
+
+static inline uint32_t acl_mask( uint8_t len )
+{
+  return len ? 0xffffffffu << (32 - len) : 0;
+}
+
+static inline vpn_acl_prefix_t acl_prefix( const dap_stream_ch_vpn_acl_rule_t *rule )
+{
+  vpn_acl_prefix_t prefix;
+  uint8_t len = rule->prefix_len > 32 ? 32 : rule->prefix_len;
+
+  prefix.addr = ntohl( rule->prefix ) & acl_mask( len );
+  prefix.len = len;
+
+  return prefix;
+}
+
+// Shorter prefixes go first, so the longer ones overwrite them in the table
+static int acl_prefix_cmp( const void *a, const void *b )
+{
+  const vpn_acl_prefix_t *pa = a, *pb = b;
+
+  if ( pa->len != pb->len )
+    return pa->len < pb->len ? -1 : 1;
+  if ( pa->addr != pb->addr )
+    return pa->addr < pb->addr ? -1 : 1;
+
+  return 0;
+}
+
+static bool acl_insert( vpn_acl_t *acl, const vpn_acl_prefix_t *prefix, uint16_t cls, uint32_t *tbl8_capacity )
+{
+  if ( prefix->len <= 24 ) {
+
+    uint32_t start = prefix->addr >> 8;
+    uint32_t count = 1u << (24 - prefix->len);
+
+    for ( uint32_t i = start; i < start + count; i ++ ) {
+      uint16_t e = acl->tbl24[i];
+      if ( e & VPN_ACL_EXT_FLAG ) {
+        uint16_t *group = acl->tbl8 + (uint32_t)(e & ~VPN_ACL_EXT_FLAG) * VPN_ACL_TBL8_SIZE;
+        for ( uint32_t j = 0; j < VPN_ACL_TBL8_SIZE; j ++ )
+          group[j] = cls;
+      }
+      else
+        acl->tbl24[i] = cls;
+    }
+
+    return true;
+  }
+
+  uint32_t idx = prefix->addr >> 8;
+  uint16_t e = acl->tbl24[idx];
+
+  if ( !(e & VPN_ACL_EXT_FLAG) ) {
+
+    if ( acl->tbl8_groups >= VPN_ACL_CLASSES_MAX )
+      return false;
+
+    if ( acl->tbl8_groups == *tbl8_capacity ) {
+      uint32_t capacity = *tbl8_capacity ? *tbl8_capacity * 2 : 16;
+      uint16_t *tbl8 = realloc( acl->tbl8, (size_t)capacity * VPN_ACL_TBL8_SIZE * sizeof(uint16_t) );
+      if ( !tbl8 )
+        return false;
+      acl->tbl8 = tbl8;
+      *tbl8_capacity = capacity;
+    }
+
+    // Group inherits what the /24 had
+    uint16_t *group = acl->tbl8 + acl->tbl8_groups * VPN_ACL_TBL8_SIZE;
+    for ( uint32_t j = 0; j < VPN_ACL_TBL8_SIZE; j ++ )
+      group[j] = e;
+
+    e = (uint16_t)( VPN_ACL_EXT_FLAG | acl->tbl8_groups ++ );
+    acl->tbl24[idx] = e;
+  }
+
+  uint16_t *group = acl->tbl8 + (uint32_t)(e & ~VPN_ACL_EXT_FLAG) * VPN_ACL_TBL8_SIZE;
+  uint32_t start = prefix->addr & 0xff;
+  uint32_t count = 1u << (32 - prefix->len);
+
+  for ( uint32_t j = start; j < start + count; j ++ )
+    group[j] = cls;
+
+  return true;
+}
+
+/**
+ * @brief acl_verdict Verdict of the policy for addresses whose longest match among all the prefixes is this one
+ * @param policy
+ * @param prefix NULL for the addresses matching nothing
+ * @return 1 to pass
+ */
+static uint8_t acl_verdict( const dap_stream_ch_vpn_acl_policy_t *policy, const vpn_acl_prefix_t *prefix )
+{
+  uint8_t verdict = policy->default_allow;
+  int best_len = -1;
+
+  if ( !prefix )
+    return verdict;
+
+  // Longest rule of the policy covering the prefix, the earlier one wins among the equal
+  for ( size_t i = 0; i < policy->rules_count; i ++ ) {
+    vpn_acl_prefix_t rule = acl_prefix( &policy->rules[i] );
+    if ( rule.len <= prefix->len && (prefix->addr & acl_mask(rule.len)) == rule.addr && rule.len > best_len ) {
+      best_len = rule.len;
+      verdict = policy->rules[i].allow;
+    }
+  }
+
+  return verdict;
+}
+
+/**
+ * @brief vpn_acl_build Compile the policies into the lookup table
+ * @param policies Policy with index i gets id i + 1
+ * @param policies_count
+ * @return NULL on error
+ */
+vpn_acl_t *vpn_acl_build( const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count )
+{
+  vpn_acl_t *acl = calloc( 1, sizeof(vpn_acl_t) );
+  vpn_acl_prefix_t *prefixes = NULL;
+  size_t prefixes_count = 0, rules_count = 0;
+  uint32_t tbl8_capacity = 0;
+
+  if ( !acl )
+    return NULL;
+
+  for ( size_t p = 0; p < policies_count; p ++ )
+    rules_count += policies[p].rules_count;
+
+  if ( rules_count ) {
+    prefixes = malloc( rules_count * sizeof(vpn_acl_prefix_t) );
+    if ( !prefixes )
+      goto error;
+  }
+
+  for ( size_t p = 0; p < policies_count; p ++ ) {
+    for ( size_t i = 0; i < policies[p].rules_count; i ++ )
+      prefixes[prefixes_count ++] = acl_prefix( &policies[p].rules[i] );
+  }
+
+  if ( prefixes_count ) {
+    size_t unique = 1;
+
+    qsort( prefixes, prefixes_count, sizeof(vpn_acl_prefix_t), acl_prefix_cmp );
+    for ( size_t i = 1; i < prefixes_count; i ++ ) {
+      if ( acl_prefix_cmp(&prefixes[i], &prefixes[unique - 1]) )
+        prefixes[unique ++] = prefixes[i];
+    }
+    prefixes_count = unique;
+  }
+
+  if ( prefixes_count >= VPN_ACL_CLASSES_MAX ) {
+    log_it( L_ERROR, "Too many distinct prefixes in ACL: %zu", prefixes_count );
+    goto error;
+  }
+
+  acl->classes = (uint32_t)prefixes_count + 1;
+  acl->policies = (uint32_t)policies_count;
+  acl->tbl24 = calloc( VPN_ACL_TBL24_SIZE, sizeof(uint16_t) );
+  acl->verdicts = malloc( policies_count * acl->classes + 1 );
+
+  if ( !acl->tbl24 || !acl->verdicts )
+    goto error;
+
+  for ( size_t i = 0; i < prefixes_count; i ++ ) {
+    if ( !acl_insert(acl, &prefixes[i], (uint16_t)(i + 1), &tbl8_capacity) ) {
+      log_it( L_ERROR, "ACL table is out of /24 extension groups" );
+      goto error;
+    }
+  }
+
+  for ( size_t p = 0; p < policies_count; p ++ ) {
+    uint8_t *row = acl->verdicts + p * acl->classes;
+    row[0] = acl_verdict( &policies[p], NULL );
+    for ( size_t i = 0; i < prefixes_count; i ++ )
+      row[i + 1] = acl_verdict( &policies[p], &prefixes[i] );
+  }
+
+  free( prefixes );
+
+  log_it( L_INFO, "ACL compiled: %u policies, %u prefixes, %u /24 extensions", acl->policies, acl->classes - 1, acl->tbl8_groups );
+
+  return acl;
+
+error:
+  free( prefixes );
+  vpn_acl_free( acl );
+
+  return NULL;
+}
+
+void vpn_acl_free( vpn_acl_t *acl )
+{
+  if ( !acl )
+    return;
+
+  free( acl->tbl24 );
+  free( acl->tbl8 );
+  free( acl->verdicts );
+  free( acl );
+}
+
+/**
+ * @brief vpn_acl_retire Put the replaced table aside till no lookup can be running over it,
+ *        must be called after the table is swapped out
+ * @param acl
+ */
+void vpn_acl_retire( vpn_acl_t *acl )
+{
+  vpn_acl_retired_t *retired;
+
+  if ( !acl )
+    return;
+
+  retired = malloc( sizeof(vpn_acl_retired_t) );
+  if ( !retired ) {
+    log_it( L_WARNING, "Can't retire ACL table, it's leaked" );
+    return;
+  }
+
+  retired->acl = acl;
+
+  pthread_mutex_lock( &vpn_acl_retired_mutex );
+  retired->flips = vpn_acl_flips;
+  retired->next = vpn_acl_retired;
+  vpn_acl_retired = retired;
+  pthread_mutex_unlock( &vpn_acl_retired_mutex );
+}
+
+/**
+ * @brief vpn_acl_reclaim Free the tables no lookup can be running over. Lookup that may have loaded the table
+ *        counted itself in one of the two phases before, the table is free once both counters were seen at zero
+ *        after it was retired. Phase flips when the idle counter is drained, so the busy one gets no new lookups
+ *        and drains too. Never waits, the tables still in use are freed by one of the next calls
+ * @param all Free everything, data path must be stopped
+ */
+void vpn_acl_reclaim( bool all )
+{
+  pthread_mutex_lock( &vpn_acl_retired_mutex );
+
+  for ( int i = 0; i < 2 && vpn_acl_retired && !all; i ++ ) {
+
+    unsigned phase = atomic_load( &vpn_acl_phase );
+
+    if ( atomic_load(&vpn_acl_readers[(phase & 1) ^ 1].count) )
+      break;
+
+    atomic_store( &vpn_acl_phase, phase + 1 );
+    vpn_acl_flips ++;
+  }
+
+  vpn_acl_retired_t **cur = &vpn_acl_retired;
+
+  while ( *cur ) {
+    vpn_acl_retired_t *retired = *cur;
+
+    if ( all || vpn_acl_flips - retired->flips >= 2 ) {
+      *cur = retired->next;
+      vpn_acl_free( retired->acl );
+      free( retired );
+    }
+    else
+      cur = &retired->next;
+  }
+
+  pthread_mutex_unlock( &vpn_acl_retired_mutex );
+}
@@ -0,0 +1,115 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_ACL_H_
+#define _STREAM_SF_ACL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "dap_stream_ch_vpn.h"
+
+#define VPN_ACL_TBL24_SIZE   ( 1u << 24 )
+#define VPN_ACL_TBL8_SIZE    256
+#define VPN_ACL_EXT_FLAG     0x8000 // tbl24 entry points to the tbl8 group
+#define VPN_ACL_CLASSES_MAX  0x7fff
+
+#define VPN_ACL_CACHE_LINE_SIZE  64
+
+/**
+  * @struct vpn_acl
+  * @brief DIR-24-8 table over the prefixes of all the policies. Lookup gives the class,
+  *        that is the longest matching prefix, verdict of every policy is precomputed for every class
+  *
+  **/
+typedef struct vpn_acl {
+
+  uint16_t *tbl24;
+  uint16_t *tbl8;
+  uint32_t tbl8_groups;
+
+  uint32_t classes;  // Prefixes plus the class 0 when nothing matched
+  uint32_t policies; // Policy ids 1 .. policies
+
+  uint8_t *verdicts; // [policy][class], 1 to pass
+
+} vpn_acl_t;
+
+vpn_acl_t *vpn_acl_build( const dap_stream_ch_vpn_acl_policy_t *policies, size_t policies_count );
+void vpn_acl_free( vpn_acl_t *acl );
+
+// Lookups in flight by the phase they started in, on their own cache lines
+typedef struct vpn_acl_readers {
+
+  atomic_uint_fast32_t count;
+  uint8_t padding[ VPN_ACL_CACHE_LINE_SIZE - sizeof(atomic_uint_fast32_t) ];
+
+} vpn_acl_readers_t;
+
+extern atomic_uint vpn_acl_phase;
+extern vpn_acl_readers_t vpn_acl_readers[ 2 ];
+
+void vpn_acl_retire( vpn_acl_t *acl );
+void vpn_acl_reclaim( bool all );
+
+/**
+ * @brief vpn_acl_read_lock Start the lookup, tables retired from now on are not freed till it's done.
+ *        The table pointer must be loaded after it
+ * @return Phase for vpn_acl_read_unlock()
+ */
+static inline unsigned vpn_acl_read_lock( void )
+{
+  unsigned phase = atomic_load( &vpn_acl_phase ) & 1;
+
+  atomic_fetch_add( &vpn_acl_readers[phase].count, 1 );
+
+  return phase;
+}
+
+static inline void vpn_acl_read_unlock( unsigned phase )
+{
+  atomic_fetch_sub_explicit( &vpn_acl_readers[phase].count, 1, memory_order_release );
+}
+
+/**
+ * @brief vpn_acl_allow Check the destination against the policy
+ * @param acl
+ * @param policy Policy id, from 1
+ * @param daddr Network byte order
+ * @return True to pass
+ */
+static inline bool vpn_acl_allow( const vpn_acl_t *acl, uint32_t policy, uint32_t daddr )
+{
+  uint32_t addr = ( (uint32_t)((const uint8_t *)&daddr)[0] << 24 ) | ( (uint32_t)((const uint8_t *)&daddr)[1] << 16 ) |
+                  ( (uint32_t)((const uint8_t *)&daddr)[2] << 8 ) | ((const uint8_t *)&daddr)[3];
+  uint16_t cls = acl->tbl24[ addr >> 8 ];
+
+  if ( cls & VPN_ACL_EXT_FLAG )
+    cls = acl->tbl8[ (uint32_t)(cls & ~VPN_ACL_EXT_FLAG) * VPN_ACL_TBL8_SIZE + (addr & 0xff) ];
+
+  if ( policy > acl->policies )
+    return false;
+
+  return acl->verdicts[ (policy - 1) * acl->classes + cls ];
+}
+
+#endif
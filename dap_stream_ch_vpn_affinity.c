@@ -0,0 +1,453 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_setaffinity(), CPU_SET()
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <linux/mempolicy.h>
+#else
+#include <windows.h>
+#endif
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_affinity.h"
+
+#define LOG_TAG "stream_ch_vpn_affinity"
+
+static const char *vpn_affinity_sched_names[] = { "other", "fifo", "rr" };
+
+// Config with a scheduling class the names don't cover is not applied at all
+static bool vpn_affinity_config_valid( const dap_stream_ch_vpn_thread_config_t *config, const char *name )
+{
+  if ( (unsigned)config->sched <= DAP_STREAM_CH_VPN_SCHED_RR )
+    return true;
+
+  log_it( L_ERROR, "%s: unknown scheduling class %d, placement is not applied", name, (int)config->sched );
+
+  return false;
+}
+
+// CPU list of the mask as the kernel prints it, "0-3,8"
+static void vpn_affinity_cpulist_print( const uint64_t *mask, size_t bits, char *buf, size_t size )
+{
+  size_t len = 0;
+
+  buf[ 0 ] = 0;
+
+  for ( size_t i = 0; i < bits; i ++ ) {
+
+    if ( !(mask[i / 64] & (1ULL << (i % 64))) )
+      continue;
+
+    size_t last = i;
+    while ( last + 1 < bits && (mask[(last + 1) / 64] & (1ULL << ((last + 1) % 64))) )
+      last ++;
+
+    int n = ( last == i ) ? snprintf( buf + len, size - len, "%s%zu", len ? "," : "", i )
+                          : snprintf( buf + len, size - len, "%s%zu-%zu", len ? "," : "", i, last );
+    if ( n < 0 || (size_t)n >= size - len ) {
+      buf[ len ] = 0; // List is cut at the last whole range
+      return;
+    }
+
+    len += (size_t)n;
+    i = last;
+  }
+}
+
+int vpn_affinity_config_copy( dap_stream_ch_vpn_thread_config_t *dst, const dap_stream_ch_vpn_thread_config_t *src )
+{
+  *dst = *src;
+  dst->cpus = NULL;
+  dst->cpus_count = 0;
+
+  if ( !src->cpus || !src->cpus_count )
+    return 0;
+
+  uint32_t *cpus = malloc( src->cpus_count * sizeof(uint32_t) );
+  if ( !cpus )
+    return -1;
+
+  memcpy( cpus, src->cpus, src->cpus_count * sizeof(uint32_t) );
+  dst->cpus = cpus;
+  dst->cpus_count = src->cpus_count;
+
+  return 0;
+}
+
+void vpn_affinity_config_free( dap_stream_ch_vpn_thread_config_t *config )
+{
+  free( (void *)config->cpus );
+  memset( config, 0, sizeof(*config) );
+}
+
+void vpn_affinity_leave( vpn_affinity_thread_t *thread )
+{
+  atomic_store( &thread->tid, 0 );
+}
+
+#ifndef _WIN32
+
+// CPUs of the memory node from sysfs, 0 if there is no such node
+static size_t vpn_affinity_node_cpus( uint32_t node, uint32_t *cpus, size_t max )
+{
+  char path[ 64 ], list[ 1024 ];
+  size_t count = 0;
+
+  snprintf( path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node );
+
+  FILE *f = fopen( path, "r" );
+  if ( !f )
+    return 0;
+
+  if ( !fgets(list, sizeof(list), f) )
+    list[ 0 ] = 0;
+  fclose( f );
+
+  for ( char *p = list; *p && *p != '\n' && count < max; ) {
+
+    char *end;
+    unsigned long first = strtoul( p, &end, 10 ), last = first;
+
+    if ( end == p )
+      break;
+    if ( *end == '-' ) {
+      p = end + 1;
+      last = strtoul( p, &end, 10 );
+    }
+
+    for ( unsigned long cpu = first; cpu <= last && count < max; cpu ++ )
+      cpus[ count ++ ] = (uint32_t)cpu;
+
+    p = ( *end == ',' ) ? end + 1 : end;
+  }
+
+  return count;
+}
+
+static void vpn_affinity_set_print( const cpu_set_t *set, char *buf, size_t size )
+{
+  uint64_t mask[ CPU_SETSIZE / 64 ] = { 0 };
+
+  for ( size_t i = 0; i < CPU_SETSIZE; i ++ )
+    if ( CPU_ISSET(i, set) )
+      mask[ i / 64 ] |= 1ULL << ( i % 64 );
+
+  vpn_affinity_cpulist_print( mask, CPU_SETSIZE, buf, size );
+}
+
+// Field 39 of the task's stat, the CPU it was scheduled on last
+static int32_t vpn_affinity_last_cpu( pid_t tid )
+{
+  char path[ 64 ], stat[ 1024 ];
+
+  snprintf( path, sizeof(path), "/proc/self/task/%d/stat", (int)tid );
+
+  FILE *f = fopen( path, "r" );
+  if ( !f )
+    return -1;
+
+  size_t len = fread( stat, 1, sizeof(stat) - 1, f );
+  fclose( f );
+  stat[ len ] = 0;
+
+  // Thread's name may have spaces and parens, fields are counted past the last ')'
+  char *p = strrchr( stat, ')' );
+  if ( !p )
+    return -1;
+
+  for ( int field = 2; field < 39 && p; field ++ )
+    p = strchr( p + 1, ' ' );
+
+  return p ? (int32_t)strtol( p + 1, NULL, 10 ) : -1;
+}
+
+int vpn_affinity_apply( vpn_affinity_thread_t *thread, const dap_stream_ch_vpn_thread_config_t *config, int slot, const char *name )
+{
+  pid_t tid = (pid_t)syscall( SYS_gettid );
+  int ret = 0;
+
+  thread->numa_node = -1;
+  thread->sched = DAP_STREAM_CH_VPN_SCHED_OTHER;
+  thread->priority = 0;
+
+  if ( config && !vpn_affinity_config_valid(config, name) ) {
+    config = NULL;
+    ret = -1;
+  }
+
+  if ( config ) {
+
+    uint32_t cpus[ VPN_AFFINITY_CPUS_MAX ];
+    size_t count = 0;
+
+    if ( config->cpus && config->cpus_count ) {
+      for ( size_t i = 0; i < config->cpus_count && count < VPN_AFFINITY_CPUS_MAX; i ++ ) {
+        if ( config->cpus[i] < CPU_SETSIZE )
+          cpus[ count ++ ] = config->cpus[ i ];
+        else
+          log_it( L_WARNING, "%s: CPU %u is out of range, skipped", name, config->cpus[i] );
+      }
+    }
+    else if ( config->numa_bind ) {
+      count = vpn_affinity_node_cpus( config->numa_node, cpus, VPN_AFFINITY_CPUS_MAX );
+      if ( !count )
+        log_it( L_WARNING, "%s: no CPUs of memory node %u are known", name, config->numa_node );
+    }
+
+    if ( count ) {
+
+      cpu_set_t set;
+      CPU_ZERO( &set );
+
+      if ( slot >= 0 )
+        CPU_SET( cpus[(size_t)slot % count], &set );
+      else
+        for ( size_t i = 0; i < count; i ++ )
+          CPU_SET( cpus[i], &set );
+
+      if ( sched_setaffinity(tid, sizeof(set), &set) ) {
+        log_it( L_WARNING, "%s: can't set the CPU affinity: %s", name, strerror(errno) );
+        ret = -1;
+      }
+    }
+
+    if ( config->numa_bind ) {
+
+      unsigned long nodes[ VPN_AFFINITY_NODES_MAX / (8 * sizeof(unsigned long)) + 1 ] = { 0 };
+
+      if ( config->numa_node >= VPN_AFFINITY_NODES_MAX ) {
+        log_it( L_WARNING, "%s: memory node %u is out of range", name, config->numa_node );
+        ret = -1;
+      }
+      else {
+        nodes[ config->numa_node / (8 * sizeof(unsigned long)) ] |= 1UL << ( config->numa_node % (8 * sizeof(unsigned long)) );
+
+        // Preferred, not bound: when the node runs out the pages come from the others instead of the OOM killer
+        if ( syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, VPN_AFFINITY_NODES_MAX + 1) ) {
+          log_it( L_WARNING, "%s: can't prefer memory node %u: %s", name, config->numa_node, strerror(errno) );
+          ret = -1;
+        }
+        else
+          thread->numa_node = (int32_t)config->numa_node;
+      }
+    }
+
+    if ( config->sched == DAP_STREAM_CH_VPN_SCHED_FIFO || config->sched == DAP_STREAM_CH_VPN_SCHED_RR ) {
+
+      int policy = ( config->sched == DAP_STREAM_CH_VPN_SCHED_FIFO ) ? SCHED_FIFO : SCHED_RR;
+      struct sched_param param = { .sched_priority = config->priority };
+      int err = pthread_setschedparam( pthread_self(), policy, &param );
+
+      if ( err ) {
+        log_it( L_WARNING, "%s: can't set %s priority %d: %s", name, vpn_affinity_sched_names[config->sched], config->priority, strerror(err) );
+        ret = -1;
+      }
+      else {
+        thread->sched = config->sched;
+        thread->priority = config->priority;
+      }
+    }
+    else if ( config->priority ) {
+      if ( setpriority(PRIO_PROCESS, (id_t)tid, config->priority) ) {
+        log_it( L_WARNING, "%s: can't set nice %d: %s", name, config->priority, strerror(errno) );
+        ret = -1;
+      }
+      else
+        thread->priority = config->priority;
+    }
+  }
+
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  if ( sched_getaffinity(tid, sizeof(set), &set) )
+    thread->cpus[ 0 ] = 0;
+  else
+    vpn_affinity_set_print( &set, thread->cpus, sizeof(thread->cpus) );
+
+  log_it( L_NOTICE, "%s (tid %d) runs on CPUs %s, memory node %d, %s priority %d", name, (int)tid,
+          thread->cpus[0] ? thread->cpus : "?", thread->numa_node, vpn_affinity_sched_names[thread->sched], thread->priority );
+
+  atomic_store( &thread->tid, (int)tid );
+
+  return ret;
+}
+
+void vpn_affinity_query( vpn_affinity_thread_t *thread, dap_stream_ch_vpn_thread_info_t *info )
+{
+  pid_t tid = (pid_t)atomic_load( &thread->tid );
+
+  info->tid = (int32_t)tid;
+  info->cpu = -1;
+  info->cpus[ 0 ] = 0;
+  info->numa_node = -1;
+  info->sched = DAP_STREAM_CH_VPN_SCHED_OTHER;
+  info->priority = 0;
+
+  if ( !tid )
+    return;
+
+  // What the thread took itself, overridden below by what the kernel says if it's still there
+  info->numa_node = thread->numa_node;
+  info->sched = thread->sched;
+  info->priority = thread->priority;
+  strncpy( info->cpus, thread->cpus, sizeof(info->cpus) - 1 );
+  info->cpus[ sizeof(info->cpus) - 1 ] = 0;
+
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  if ( !sched_getaffinity(tid, sizeof(set), &set) )
+    vpn_affinity_set_print( &set, info->cpus, sizeof(info->cpus) );
+
+  int policy = sched_getscheduler( tid );
+  if ( policy == SCHED_FIFO || policy == SCHED_RR ) {
+    struct sched_param param;
+    if ( !sched_getparam(tid, &param) ) {
+      info->sched = ( policy == SCHED_FIFO ) ? DAP_STREAM_CH_VPN_SCHED_FIFO : DAP_STREAM_CH_VPN_SCHED_RR;
+      info->priority = param.sched_priority;
+    }
+  }
+  else if ( policy >= 0 ) {
+    errno = 0;
+    int nice = getpriority( PRIO_PROCESS, (id_t)tid );
+    if ( !errno ) {
+      info->sched = DAP_STREAM_CH_VPN_SCHED_OTHER;
+      info->priority = nice;
+    }
+  }
+
+  info->cpu = vpn_affinity_last_cpu( tid );
+}
+
+#else
+
+// No memory policy and no realtime classes, affinity covers the first 64 CPUs of the thread's group
+
+int vpn_affinity_apply( vpn_affinity_thread_t *thread, const dap_stream_ch_vpn_thread_config_t *config, int slot, const char *name )
+{
+  DWORD_PTR mask = 0;
+  int ret = 0;
+
+  thread->numa_node = -1;
+  thread->sched = DAP_STREAM_CH_VPN_SCHED_OTHER;
+  thread->priority = 0;
+  thread->cpus[ 0 ] = 0;
+
+  if ( config && !vpn_affinity_config_valid(config, name) ) {
+    config = NULL;
+    ret = -1;
+  }
+
+  if ( config ) {
+
+    uint32_t cpus[ 64 ];
+    size_t count = 0;
+
+    for ( size_t i = 0; config->cpus && i < config->cpus_count; i ++ ) {
+      if ( config->cpus[i] < 64 )
+        cpus[ count ++ ] = config->cpus[ i ];
+      else
+        log_it( L_WARNING, "%s: CPU %u is out of range, skipped", name, config->cpus[i] );
+      if ( count == 64 )
+        break;
+    }
+
+    if ( count ) {
+
+      if ( slot >= 0 )
+        mask = (DWORD_PTR)1 << cpus[ (size_t)slot % count ];
+      else
+        for ( size_t i = 0; i < count; i ++ )
+          mask |= (DWORD_PTR)1 << cpus[ i ];
+
+      if ( !SetThreadAffinityMask(GetCurrentThread(), mask) ) {
+        log_it( L_WARNING, "%s: can't set the CPU affinity, error %lu", name, GetLastError() );
+        mask = 0;
+        ret = -1;
+      }
+    }
+
+    if ( config->numa_bind ) {
+      log_it( L_WARNING, "%s: memory node placement is not supported", name );
+      ret = -1;
+    }
+
+    int prio = THREAD_PRIORITY_NORMAL;
+    if ( config->sched != DAP_STREAM_CH_VPN_SCHED_OTHER )
+      prio = THREAD_PRIORITY_TIME_CRITICAL;
+    else if ( config->priority < 0 )
+      prio = THREAD_PRIORITY_ABOVE_NORMAL;
+    else if ( config->priority > 0 )
+      prio = THREAD_PRIORITY_BELOW_NORMAL;
+
+    if ( prio != THREAD_PRIORITY_NORMAL ) {
+      if ( !SetThreadPriority(GetCurrentThread(), prio) ) {
+        log_it( L_WARNING, "%s: can't set the priority, error %lu", name, GetLastError() );
+        ret = -1;
+      }
+      else {
+        thread->sched = config->sched;
+        thread->priority = config->priority;
+      }
+    }
+  }
+
+  if ( mask ) {
+    uint64_t bits = (uint64_t)mask;
+    vpn_affinity_cpulist_print( &bits, 64, thread->cpus, sizeof(thread->cpus) );
+  }
+
+  log_it( L_NOTICE, "%s runs on CPUs %s, %s priority %d", name, thread->cpus[0] ? thread->cpus : "any",
+          vpn_affinity_sched_names[thread->sched], thread->priority );
+
+  atomic_store( &thread->tid, (int)GetCurrentThreadId() );
+
+  return ret;
+}
+
+void vpn_affinity_query( vpn_affinity_thread_t *thread, dap_stream_ch_vpn_thread_info_t *info )
+{
+  info->tid = (int32_t)atomic_load( &thread->tid );
+  info->cpu = -1;
+  info->numa_node = -1;
+  info->sched = info->tid ? thread->sched : DAP_STREAM_CH_VPN_SCHED_OTHER;
+  info->priority = info->tid ? thread->priority : 0;
+
+  strncpy( info->cpus, info->tid ? thread->cpus : "", sizeof(info->cpus) - 1 );
+  info->cpus[ sizeof(info->cpus) - 1 ] = 0;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_AFFINITY_H_
+#define _STREAM_SF_AFFINITY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "dap_stream_ch_vpn.h"
+
+#define VPN_AFFINITY_CPUS_MAX   1024 // CPUs of one set, the rest are skipped
+#define VPN_AFFINITY_NODES_MAX  64
+
+// Placement one of the instance's threads has got, written by the thread itself
+typedef struct vpn_affinity_thread {
+
+  atomic_int tid;    // Kernel thread id, 0 till the thread is placed and after it's done
+  int32_t numa_node; // Memory node the allocations prefer, -1 for any
+  dap_stream_ch_vpn_sched_t sched;
+  int32_t priority;
+  char cpus[ 128 ];  // Affinity taken, as the CPU list
+
+} vpn_affinity_thread_t;
+
+// Put the calling thread on the CPUs, memory node and scheduling class of the config and log where it is.
+// slot >= 0 pins it to one CPU of the set, threads of the same kind take them in turn. 0 if every setting took
+int  vpn_affinity_apply( vpn_affinity_thread_t *thread, const dap_stream_ch_vpn_thread_config_t *config, int slot, const char *name );
+
+// Thread is about to exit, it's not reported as running anymore
+void vpn_affinity_leave( vpn_affinity_thread_t *thread );
+
+// Placement of the thread as the kernel has it now, thread and shard fields are left to the caller
+void vpn_affinity_query( vpn_affinity_thread_t *thread, dap_stream_ch_vpn_thread_info_t *info );
+
+// Deep copy, the CPU list is owned by dst. -1 if out of memory
+int  vpn_affinity_config_copy( dap_stream_ch_vpn_thread_config_t *dst, const dap_stream_ch_vpn_thread_config_t *src );
+void vpn_affinity_config_free( dap_stream_ch_vpn_thread_config_t *config );
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_capture.h"
+
+#define LOG_TAG "stream_ch_vpn_capture"
+
+_Static_assert( offsetof(vpn_capture_ring_t, head) == 64 && offsetof(vpn_capture_ring_t, data) == 192,
+                "Capture ring layout is shared with the reader" );
+_Static_assert( sizeof(vpn_capture_rec_t) == 32, "Capture record layout is shared with the reader" );
+
+atomic_bool vpn_capture_enabled = false;
+
+static pthread_mutex_t vpn_capture_mutex = PTHREAD_MUTEX_INITIALIZER;  // Start and stop
+static atomic_flag vpn_capture_write_lock = ATOMIC_FLAG_INIT;          // Writers, and stop against them
+
+static vpn_capture_ring_t *vpn_capture_map = NULL;
+static size_t vpn_capture_map_size = 0;
+static char vpn_capture_shm_name[ 256 ];
+
+static uint32_t vpn_capture_snaplen;
+static uint32_t vpn_capture_addr;
+static uint32_t vpn_capture_points;
+
+static atomic_uint_fast64_t vpn_capture_captured;
+static atomic_uint_fast64_t vpn_capture_ring_full;
+
+static inline void vpn_capture_lock( void )
+{
+  while ( atomic_flag_test_and_set_explicit(&vpn_capture_write_lock, memory_order_acquire) )
+    ;
+}
+
+static inline void vpn_capture_unlock( void )
+{
+  atomic_flag_clear_explicit( &vpn_capture_write_lock, memory_order_release );
+}
+
+/**
+ * @brief vpn_capture_start Create the shared memory ring and switch the capture points on, running capture is
+ *        restarted with the new config
+ * @param config
+ * @return 0 if ok
+ */
+int vpn_capture_start( const dap_stream_ch_vpn_capture_config_t *config )
+{
+#ifndef _WIN32
+  const char *name = ( config->shm_name && config->shm_name[0] ) ? config->shm_name : VPN_CAPTURE_SHM_NAME;
+  uint64_t size = VPN_CAPTURE_RING_SIZE_MIN;
+  vpn_capture_ring_t *ring;
+  int fd;
+
+  while ( size < config->ring_size && size < VPN_CAPTURE_RING_SIZE_MAX )
+    size <<= 1;
+
+  if ( !config->ring_size )
+    size = VPN_CAPTURE_RING_SIZE;
+
+  vpn_capture_stop( );
+
+  pthread_mutex_lock( &vpn_capture_mutex );
+
+  // Reader of the previous capture keeps its mapping, this one is new
+  shm_unlink( name );
+
+  if ( (fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0 ) {
+    log_it( L_ERROR, "Can't create capture ring %s: '%s'", name, strerror(errno) );
+    pthread_mutex_unlock( &vpn_capture_mutex );
+    return -1;
+  }
+
+  vpn_capture_map_size = sizeof(vpn_capture_ring_t) + size;
+
+  if ( ftruncate(fd, (off_t)vpn_capture_map_size) < 0 ||
+       (ring = mmap(NULL, vpn_capture_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+    log_it( L_ERROR, "Can't map capture ring %s: '%s'", name, strerror(errno) );
+    close( fd );
+    shm_unlink( name );
+    pthread_mutex_unlock( &vpn_capture_mutex );
+    return -1;
+  }
+
+  close( fd );
+
+  vpn_capture_snaplen = config->snaplen ? config->snaplen : UINT16_MAX;
+  vpn_capture_addr = config->addr;
+  vpn_capture_points = config->points ? config->points : ( 1u << DAP_STREAM_CH_VPN_CAPTURE_POINTS ) - 1;
+
+  ring->size = size;
+  ring->pcap.magic = VPN_CAPTURE_PCAP_MAGIC;
+  ring->pcap.version_major = 2;
+  ring->pcap.version_minor = 4;
+  ring->pcap.snaplen = vpn_capture_snaplen;
+  ring->pcap.linktype = VPN_CAPTURE_LINKTYPE;
+  atomic_init( &ring->closed, 0 );
+  atomic_init( &ring->head, 0 );
+  atomic_init( &ring->tail, 0 );
+  ring->version = VPN_CAPTURE_VERSION;
+
+  // Magic goes last, the reader checks it first
+  atomic_thread_fence( memory_order_release );
+  ring->magic = VPN_CAPTURE_MAGIC;
+
+  dap_snprintf( vpn_capture_shm_name, sizeof(vpn_capture_shm_name), "%s", name );
+  atomic_store( &vpn_capture_captured, 0 );
+  atomic_store( &vpn_capture_ring_full, 0 );
+
+  vpn_capture_lock( );
+  vpn_capture_map = ring;
+  vpn_capture_unlock( );
+
+  atomic_store( &vpn_capture_enabled, true );
+
+  pthread_mutex_unlock( &vpn_capture_mutex );
+
+  log_it( L_NOTICE, "Capture to %s is on, ring %llu bytes, snaplen %u", name, (unsigned long long)size, vpn_capture_snaplen );
+
+  return 0;
+#else
+  (void)config;
+  log_it( L_ERROR, "Capture ring is not supported on this platform" );
+  return -1;
+#endif
+}
+
+/**
+ * @brief vpn_capture_stop Switch the capture points off and let the reader finish
+ */
+void vpn_capture_stop( void )
+{
+#ifndef _WIN32
+  vpn_capture_ring_t *ring;
+
+  pthread_mutex_lock( &vpn_capture_mutex );
+
+  atomic_store( &vpn_capture_enabled, false );
+
+  // Writers that passed the branch already are done after this
+  vpn_capture_lock( );
+  ring = vpn_capture_map;
+  vpn_capture_map = NULL;
+  vpn_capture_unlock( );
+
+  if ( ring ) {
+    atomic_store_explicit( &ring->closed, 1, memory_order_release );
+    munmap( ring, vpn_capture_map_size );
+    shm_unlink( vpn_capture_shm_name );
+
+    log_it( L_NOTICE, "Capture to %s is off, %llu records, %llu lost on the full ring", vpn_capture_shm_name,
+            (unsigned long long)atomic_load(&vpn_capture_captured), (unsigned long long)atomic_load(&vpn_capture_ring_full) );
+  }
+
+  pthread_mutex_unlock( &vpn_capture_mutex );
+#endif
+}
+
+void vpn_capture_get_stats( dap_stream_ch_vpn_capture_stats_t *stats )
+{
+  stats->running = atomic_load( &vpn_capture_enabled );
+  stats->captured = atomic_load( &vpn_capture_captured );
+  stats->ring_full = atomic_load( &vpn_capture_ring_full );
+}
+
+/**
+ * @brief vpn_capture_write Put the record of prefix and data together into the ring
+ * @param point
+ * @param reason
+ * @param addr
+ * @param prefix Synthesized headers, may be NULL
+ * @param prefix_size
+ * @param data
+ * @param size
+ */
+static void vpn_capture_write( uint8_t point, uint8_t reason, uint32_t addr, const void *prefix, size_t prefix_size,
+                               const void *data, size_t size )
+{
+  size_t len = prefix_size + size;
+  size_t caplen = len < vpn_capture_snaplen ? len : vpn_capture_snaplen;
+  size_t rec_len = VPN_CAPTURE_REC_ALIGN( sizeof(vpn_capture_rec_t) + caplen );
+  struct timespec ts;
+
+  if ( !(vpn_capture_points & (1u << point)) || (vpn_capture_addr && addr != vpn_capture_addr) )
+    return;
+
+  clock_gettime( CLOCK_REALTIME, &ts );
+
+  vpn_capture_lock( );
+
+  vpn_capture_ring_t *ring = vpn_capture_map;
+
+  if ( !ring ) {
+    vpn_capture_unlock( );
+    return;
+  }
+
+  uint64_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+  uint64_t tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+  uint64_t off = head & ( ring->size - 1 );
+  uint64_t to_end = ring->size - off;
+  uint64_t skip = to_end < rec_len ? to_end : 0;
+
+  if ( rec_len > ring->size || head + skip + rec_len - tail > ring->size ) {
+    vpn_capture_unlock( );
+    atomic_fetch_add_explicit( &vpn_capture_ring_full, 1, memory_order_relaxed );
+    return;
+  }
+
+  // Reader skips the tail shorter than the record header by itself
+  if ( skip ) {
+    if ( skip >= sizeof(vpn_capture_rec_t) ) {
+      vpn_capture_rec_t *pad = (vpn_capture_rec_t *)( ring->data + off );
+      pad->rec_len = (uint32_t)skip;
+      pad->point = VPN_CAPTURE_PAD;
+    }
+    head += skip;
+    off = 0;
+  }
+
+  vpn_capture_rec_t *rec = (vpn_capture_rec_t *)( ring->data + off );
+  size_t prefix_cap = prefix_size < caplen ? prefix_size : caplen;
+
+  rec->rec_len = (uint32_t)rec_len;
+  rec->point = point;
+  rec->reason = reason;
+  rec->padding1 = 0;
+  rec->addr = addr;
+  rec->padding2 = 0;
+  rec->pcap.ts_sec = (uint32_t)ts.tv_sec;
+  rec->pcap.ts_nsec = (uint32_t)ts.tv_nsec;
+  rec->pcap.caplen = (uint32_t)caplen;
+  rec->pcap.len = (uint32_t)len;
+
+  if ( prefix_cap )
+    memcpy( rec->data, prefix, prefix_cap );
+  if ( caplen > prefix_cap )
+    memcpy( rec->data + prefix_cap, data, caplen - prefix_cap );
+
+  atomic_store_explicit( &ring->head, head + rec_len, memory_order_release );
+
+  vpn_capture_unlock( );
+
+  atomic_fetch_add_explicit( &vpn_capture_captured, 1, memory_order_relaxed );
+}
+
+/**
+ * @brief vpn_capture_packet Capture the IPv4 packet, call it through VPN_CAPTURE()
+ * @param point
+ * @param reason
+ * @param addr Lease address the packet belongs to, network byte order
+ * @param data
+ * @param size
+ */
+void vpn_capture_packet( uint8_t point, uint8_t reason, uint32_t addr, const void *data, size_t size )
+{
+  vpn_capture_write( point, reason, addr, NULL, 0, data, size );
+}
+
+/**
+ * @brief vpn_capture_stream Capture proxied stream's bytes as the UDP datagram between the client and the
+ *        remote end, call it through VPN_CAPTURE_STREAM()
+ * @param point PROXY_OUT goes from the client, PROXY_IN to it
+ * @param client_addr Network byte order, lease address or 0
+ * @param client_port Network byte order
+ * @param remote_addr Network byte order
+ * @param remote_port Network byte order
+ * @param data
+ * @param size
+ */
+void vpn_capture_stream( uint8_t point, uint32_t client_addr, uint16_t client_port,
+                         uint32_t remote_addr, uint16_t remote_port, const void *data, size_t size )
+{
+  bool out = ( point == DAP_STREAM_CH_VPN_CAPTURE_PROXY_OUT );
+  uint32_t saddr = out ? client_addr : remote_addr, daddr = out ? remote_addr : client_addr;
+  uint16_t sport = out ? client_port : remote_port, dport = out ? remote_port : client_port;
+  size_t tot_len = 28 + size > UINT16_MAX ? UINT16_MAX : 28 + size;
+  uint8_t hdr[ 28 ] = { 0x45 };
+  uint32_t sum = 0;
+
+  if ( !(vpn_capture_points & (1u << point)) || (vpn_capture_addr && client_addr != vpn_capture_addr) )
+    return;
+
+  hdr[2] = (uint8_t)( tot_len >> 8 );
+  hdr[3] = (uint8_t)tot_len;
+  hdr[8] = 64;
+  hdr[9] = 17;
+  memcpy( hdr + 12, &saddr, 4 );
+  memcpy( hdr + 16, &daddr, 4 );
+
+  for ( int i = 0; i < 20; i += 2 )
+    sum += (uint32_t)( (hdr[i] << 8) | hdr[i + 1] );
+  while ( sum >> 16 )
+    sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+  hdr[10] = (uint8_t)( ~sum >> 8 );
+  hdr[11] = (uint8_t)~sum;
+
+  // No UDP checksum
+  memcpy( hdr + 20, &sport, 2 );
+  memcpy( hdr + 22, &dport, 2 );
+  hdr[24] = (uint8_t)( (tot_len - 20) >> 8 );
+  hdr[25] = (uint8_t)( tot_len - 20 );
+
+  vpn_capture_write( point, 0, client_addr, hdr, sizeof(hdr), data, tot_len - sizeof(hdr) );
+}
@@ -0,0 +1,145 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_CAPTURE_H_
+#define _STREAM_SF_CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "dap_stream_ch_vpn.h"
+
+// Ring layout is shared with the reader process, it's bumped on any change of it
+#define VPN_CAPTURE_MAGIC         0x43505644 // "DVPC"
+#define VPN_CAPTURE_VERSION       1
+
+#define VPN_CAPTURE_SHM_NAME      "/dap_stream_ch_vpn_capture"
+#define VPN_CAPTURE_RING_SIZE     ( 4 * 1024 * 1024 )
+#define VPN_CAPTURE_RING_SIZE_MIN ( 64 * 1024 )
+#define VPN_CAPTURE_RING_SIZE_MAX ( 1024 * 1024 * 1024 )
+#define VPN_CAPTURE_LINKTYPE      101        // LINKTYPE_RAW, IPv4 right away
+#define VPN_CAPTURE_PCAP_MAGIC    0xa1b23c4d // Nanosecond timestamps
+
+// Filler up to the end of the ring, record doesn't wrap around
+#define VPN_CAPTURE_PAD           0xff
+
+// Reasons of UP_DROP and DOWN_DROP records
+#define VPN_CAPTURE_DROP_BACKLOG  1 // Shaping backlog is full
+#define VPN_CAPTURE_DROP_QUEUE    3 // Client's lane is full
+#define VPN_CAPTURE_DROP_AQM      4 // Dropped by CoDel
+
+typedef struct vpn_capture_pcap_hdr {
+
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t  thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+
+} vpn_capture_pcap_hdr_t;
+
+typedef struct vpn_capture_pcap_rec {
+
+  uint32_t ts_sec;
+  uint32_t ts_nsec;
+  uint32_t caplen;
+  uint32_t len;
+
+} vpn_capture_pcap_rec_t;
+
+/**
+  * @struct vpn_capture_rec
+  * @brief Record of the ring: tap's own header, then the pcap record as it goes into the file
+  *
+  **/
+typedef struct vpn_capture_rec {
+
+  uint32_t rec_len;  // Whole record, padded to 8 bytes
+  uint8_t  point;    // dap_stream_ch_vpn_capture_point_t or VPN_CAPTURE_PAD
+  uint8_t  reason;   // dap_stream_ch_vpn_reject_t of REJECT, VPN_CAPTURE_DROP_* of the drops
+  uint16_t padding1;
+  uint32_t addr;     // Lease address the packet belongs to, network byte order, 0 if none
+  uint32_t padding2;
+
+  vpn_capture_pcap_rec_t pcap;
+  uint8_t data[];
+
+} vpn_capture_rec_t;
+
+/**
+  * @struct vpn_capture_ring
+  * @brief Header of the shared memory object. Single reader: writers move head, the reader moves tail,
+  *        records that don't fit between them are lost and counted, the writers never wait
+  *
+  **/
+typedef struct vpn_capture_ring {
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;             // Bytes of data, power of two
+  vpn_capture_pcap_hdr_t pcap;
+  _Atomic uint32_t closed;   // Writer is gone, the reader drains what's left and quits
+  uint8_t padding1[ 64 - 44 ];
+
+  _Atomic uint64_t head;
+  uint8_t padding2[ 64 - sizeof(uint64_t) ];
+
+  _Atomic uint64_t tail;
+  uint8_t padding3[ 64 - sizeof(uint64_t) ];
+
+  uint8_t data[];
+
+} vpn_capture_ring_t;
+
+#define VPN_CAPTURE_REC_ALIGN( a ) ( ((a) + 7) & ~(size_t)7 )
+
+#ifndef VPN_CAPTURE_READER
+
+extern atomic_bool vpn_capture_enabled;
+
+// Capture point, costs one branch while the capture is off
+#define VPN_CAPTURE( point, reason, addr, data, size ) \
+  do { \
+    if ( __builtin_expect(atomic_load_explicit(&vpn_capture_enabled, memory_order_relaxed), 0) ) \
+      vpn_capture_packet( (point), (reason), (addr), (data), (size) ); \
+  } while ( 0 )
+
+// Proxied stream's bytes, addresses and ports are network byte order
+#define VPN_CAPTURE_STREAM( point, client_addr, client_port, remote_addr, remote_port, data, size ) \
+  do { \
+    if ( __builtin_expect(atomic_load_explicit(&vpn_capture_enabled, memory_order_relaxed), 0) ) \
+      vpn_capture_stream( (point), (client_addr), (client_port), (remote_addr), (remote_port), (data), (size) ); \
+  } while ( 0 )
+
+int  vpn_capture_start( const dap_stream_ch_vpn_capture_config_t *config );
+void vpn_capture_stop( void );
+void vpn_capture_get_stats( dap_stream_ch_vpn_capture_stats_t *stats );
+
+void vpn_capture_packet( uint8_t point, uint8_t reason, uint32_t addr, const void *data, size_t size );
+void vpn_capture_stream( uint8_t point, uint32_t client_addr, uint16_t client_port,
+                         uint32_t remote_addr, uint16_t remote_port, const void *data, size_t size );
+
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_CLOCK_H_
+#define _STREAM_SF_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define VPN_CLOCK_NS_PER_SEC 1000000000ull
+
+/**
+ * @brief vpn_clock_ns Monotonic clock all the channel's modules take their timestamps from
+ * @return Nanoseconds
+ */
+static inline uint64_t vpn_clock_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (uint64_t)ts.tv_sec * VPN_CLOCK_NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief vpn_clock_sec Monotonic clock with the second resolution
+ * @return Seconds
+ */
+static inline uint64_t vpn_clock_sec( void )
+{
+  return vpn_clock_ns( ) / VPN_CLOCK_NS_PER_SEC;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "dap_stream_ch_vpn_codel.h"
+
+#define ECN_MASK    0x03
+#define ECN_NOT_ECT 0x00
+#define ECN_CE      0x03
+
+static uint64_t isqrt64( uint64_t x )
+{
+  uint64_t r = 0, bit = 1ull << 62;
+
+  while ( bit > x )
+    bit >>= 2;
+
+  while ( bit ) {
+    if ( x >= r + bit ) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    }
+    else
+      r >>= 1;
+    bit >>= 2;
+  }
+
+  return r;
+}
+
+// interval / sqrt(count), interval^2 fits 64 bits for any sane interval (up to 4 seconds)
+static inline uint64_t codel_control_law( const vpn_codel_params_t *params, uint64_t t, uint32_t count )
+{
+  return t + isqrt64( params->interval_ns * params->interval_ns / count );
+}
+
+/**
+ * @brief vpn_codel_should_drop Run CoDel for the packet at the head of the queue
+ * @param codel
+ * @param params
+ * @param now
+ * @param sojourn Time the packet spent in the queue
+ * @param backlog_small True if the queue holds no more than about one MTU
+ * @return True if the packet must be dropped (or ECN marked)
+ */
+bool vpn_codel_should_drop( vpn_codel_t *codel, const vpn_codel_params_t *params, uint64_t now,
+                            uint64_t sojourn, bool backlog_small )
+{
+  bool ok_to_drop = false;
+
+  if ( !params->target_ns )
+    return false;
+
+  if ( sojourn < params->target_ns || backlog_small ) {
+    codel->first_above_time = 0;
+  }
+  else if ( !codel->first_above_time ) {
+    codel->first_above_time = now + params->interval_ns;
+  }
+  else if ( now >= codel->first_above_time ) {
+    ok_to_drop = true;
+  }
+
+  if ( codel->dropping ) {
+
+    if ( !ok_to_drop ) {
+      codel->dropping = false;
+      return false;
+    }
+
+    if ( now >= codel->drop_next ) {
+      codel->count ++;
+      codel->drop_next = codel_control_law( params, codel->drop_next, codel->count );
+      return true;
+    }
+
+    return false;
+  }
+
+  if ( !ok_to_drop )
+    return false;
+
+  // Enter dropping state, restart close to the previous drop rate if we left it recently
+  uint32_t delta = codel->count - codel->lastcount;
+
+  codel->dropping = true;
+  codel->count = ( delta > 1 && now - codel->drop_next < 16 * params->interval_ns ) ? delta : 1;
+  codel->drop_next = codel_control_law( params, now, codel->count );
+  codel->lastcount = codel->count;
+
+  return true;
+}
+
+/**
+ * @brief vpn_codel_on_empty Queue is drained, leave dropping state
+ * @param codel
+ */
+void vpn_codel_on_empty( vpn_codel_t *codel )
+{
+  codel->first_above_time = 0;
+  codel->dropping = false;
+}
+
+/**
+ * @brief vpn_ecn_mark Set Congestion Experienced on ECN capable IPv4 or IPv6 packet
+ * @param ip_pkt
+ * @param ip_pkt_size
+ * @return False if the packet is not ECN capable, caller drops it then
+ */
+bool vpn_ecn_mark( uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  if ( ip_pkt_size < 20 )
+    return false;
+
+  switch ( ip_pkt[0] >> 4 ) {
+
+    case 4: {
+      uint8_t tos = ip_pkt[1];
+
+      if ( (tos & ECN_MASK) == ECN_NOT_ECT )
+        return false;
+      if ( (tos & ECN_MASK) == ECN_CE )
+        return true;
+
+      // Incremental checksum update (RFC 1624): HC' = ~(~HC + ~m + m')
+      uint16_t old_word = (uint16_t)( (ip_pkt[0] << 8) | tos );
+      uint16_t new_word = (uint16_t)( old_word | ECN_CE );
+      uint32_t sum = (uint16_t)~( (ip_pkt[10] << 8) | ip_pkt[11] );
+
+      sum += (uint16_t)~old_word;
+      sum += new_word;
+      sum = (sum & 0xffff) + (sum >> 16);
+      sum = (sum & 0xffff) + (sum >> 16);
+      sum = (uint16_t)~sum;
+
+      ip_pkt[1] = (uint8_t)( tos | ECN_CE );
+      ip_pkt[10] = (uint8_t)( sum >> 8 );
+      ip_pkt[11] = (uint8_t)( sum & 0xff );
+
+      return true;
+    }
+
+    case 6: {
+      if ( ip_pkt_size < 40 )
+        return false;
+
+      // Traffic class is split between the first two bytes
+      uint8_t ecn = (ip_pkt[1] >> 4) & ECN_MASK;
+
+      if ( ecn == ECN_NOT_ECT )
+        return false;
+
+      ip_pkt[1] |= (uint8_t)( ECN_CE << 4 );
+
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
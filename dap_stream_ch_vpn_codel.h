@@ -0,0 +1,65 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_CODEL_H_
+#define _STREAM_SF_CODEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VPN_CODEL_TARGET_US    5000
+#define VPN_CODEL_INTERVAL_US  100000
+
+/**
+  * @struct vpn_codel_params
+  * @brief CoDel (RFC 8289) settings, target_ns == 0 switches AQM off
+  *
+  **/
+typedef struct vpn_codel_params {
+
+  uint64_t target_ns;
+  uint64_t interval_ns;
+  bool ecn; // Mark ECN capable packets instead of dropping them
+
+} vpn_codel_params_t;
+
+/**
+  * @struct vpn_codel
+  * @brief CoDel state of one queue, used only by the queue's consumer
+  *
+  **/
+typedef struct vpn_codel {
+
+  uint64_t first_above_time;
+  uint64_t drop_next;
+  uint32_t count;
+  uint32_t lastcount;
+  bool dropping;
+
+} vpn_codel_t;
+
+bool vpn_codel_should_drop( vpn_codel_t *codel, const vpn_codel_params_t *params, uint64_t now,
+                            uint64_t sojourn, bool backlog_small );
+void vpn_codel_on_empty( vpn_codel_t *codel );
+
+bool vpn_ecn_mark( uint8_t *ip_pkt, size_t ip_pkt_size );
+
+#endif
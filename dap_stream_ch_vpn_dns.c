@@ -0,0 +1,768 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include "uthash.h"
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_dns.h"
+#include "dap_stream_ch_vpn_clock.h"
+
+#define LOG_TAG "stream_ch_vpn_dns"
+
+#define IP_PROTO_UDP      17
+#define IPV4_HDR_SIZE     20
+#define UDP_HDR_SIZE      8
+
+#define DNS_HDR_SIZE      12
+#define DNS_NAME_MAX      255
+#define DNS_KEY_MAX       ( DNS_NAME_MAX + 5 ) // Name, type, class and flags
+#define DNS_MSG_MAX       4096
+#define DNS_TTLS_MAX      64
+#define DNS_WAITERS_MAX   32
+
+#define DNS_TYPE_SOA      6
+#define DNS_TYPE_OPT      41
+
+#define DNS_RCODE_NOERROR   0
+#define DNS_RCODE_NXDOMAIN  3
+
+#define DNS_KEY_FLAG_RD    0x01
+#define DNS_KEY_FLAG_CD    0x02
+#define DNS_KEY_FLAG_EDNS  0x04
+
+typedef struct vpn_dns_entry {
+
+  uint8_t key[ DNS_KEY_MAX ]; // Name in lower case
+  uint16_t key_len;
+
+  uint8_t *msg;
+  uint16_t msg_size;
+
+  uint16_t ttl_offsets[ DNS_TTLS_MAX ];
+  uint32_t ttls[ DNS_TTLS_MAX ];
+  uint32_t ttls_count;
+
+  uint64_t inserted_at;
+  uint64_t expires_at;
+  uint64_t rtt_ns; // Upstream latency the answer cost, every hit saves it
+
+  struct vpn_dns_entry *lru_prev, *lru_next;
+
+  UT_hash_handle hh;
+
+} vpn_dns_entry_t;
+
+typedef struct vpn_dns_waiter {
+
+  uint32_t addr;
+  uint16_t port; // Network byte order
+  uint16_t id;   // Network byte order
+
+} vpn_dns_waiter_t;
+
+typedef struct vpn_dns_pending {
+
+  uint8_t key[ DNS_KEY_MAX ]; // Name as is, answer's question must match every waiter's one
+  uint16_t key_len;
+
+  uint64_t sent_at;
+  vpn_dns_waiter_t sent;      // Query that went upstream, the only answer taken is the one to it
+
+  vpn_dns_waiter_t waiters[ DNS_WAITERS_MAX ];
+  uint32_t waiters_count;
+
+  UT_hash_handle hh;
+
+} vpn_dns_pending_t;
+
+struct vpn_dns_cache {
+
+  pthread_mutex_t mutex;
+
+  dap_stream_ch_vpn_dns_config_t config;
+  vpn_dns_deliver_t deliver;
+  void *deliver_arg;
+
+  vpn_dns_entry_t *entries;
+  vpn_dns_entry_t *lru_head; // Most recently used
+  vpn_dns_entry_t *lru_tail;
+  uint32_t entries_count;
+
+  vpn_dns_pending_t *pending;
+  uint32_t pending_count;
+
+  dap_stream_ch_vpn_dns_stats_t stats;
+};
+
+/**
+  * @struct vpn_dns_msg
+  * @brief DNS message found in the UDP packet
+  *
+  **/
+typedef struct vpn_dns_msg {
+
+  const uint8_t *data;
+  size_t size;
+
+  uint32_t saddr, daddr; // Network byte order
+  uint16_t sport, dport;
+
+  uint8_t key[ DNS_KEY_MAX ];
+  uint16_t key_len;
+  uint16_t qname_len;
+  size_t question_end;
+
+} vpn_dns_msg_t;
+
+static inline uint16_t dns_get16( const uint8_t *p )
+{
+  return (uint16_t)( (p[0] << 8) | p[1] );
+}
+
+static inline uint32_t dns_get32( const uint8_t *p )
+{
+  return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) | ( (uint32_t)p[2] << 8 ) | p[3];
+}
+
+static inline void dns_put32( uint8_t *p, uint32_t v )
+{
+  p[0] = (uint8_t)( v >> 24 );
+  p[1] = (uint8_t)( v >> 16 );
+  p[2] = (uint8_t)( v >> 8 );
+  p[3] = (uint8_t)v;
+}
+
+/**
+ * @brief dns_udp_parse Find DNS message in IPv4/UDP packet and parse its only question into the key
+ * @param ip_pkt
+ * @param ip_pkt_size
+ * @param msg
+ * @param lower Lower case the name in the key
+ * @return False if it's not a well formed single question DNS message
+ */
+static bool dns_udp_parse( const uint8_t *ip_pkt, size_t ip_pkt_size, vpn_dns_msg_t *msg, bool lower )
+{
+  size_t ihl, off;
+  uint16_t len = 0;
+
+  if ( ip_pkt_size < IPV4_HDR_SIZE || (ip_pkt[0] >> 4) != 4 || ip_pkt[9] != IP_PROTO_UDP )
+    return false;
+
+  ihl = (size_t)( ip_pkt[0] & 0x0f ) * 4;
+  if ( ihl < IPV4_HDR_SIZE || ihl + UDP_HDR_SIZE + DNS_HDR_SIZE > ip_pkt_size || (((ip_pkt[6] & 0x3f) << 8) | ip_pkt[7]) )
+    return false;
+
+  memcpy( &msg->saddr, ip_pkt + 12, 4 );
+  memcpy( &msg->daddr, ip_pkt + 16, 4 );
+  memcpy( &msg->sport, ip_pkt + ihl, 2 );
+  memcpy( &msg->dport, ip_pkt + ihl + 2, 2 );
+
+  msg->data = ip_pkt + ihl + UDP_HDR_SIZE;
+  msg->size = ip_pkt_size - ihl - UDP_HDR_SIZE;
+
+  if ( dns_get16(msg->data + 4) != 1 ) // QDCOUNT
+    return false;
+
+  // Question name, compression is not expected there
+  for ( off = DNS_HDR_SIZE; ; ) {
+
+    if ( off >= msg->size )
+      return false;
+
+    uint8_t label = msg->data[off];
+
+    if ( !label ) {
+      msg->key[len ++] = 0;
+      off ++;
+      break;
+    }
+
+    if ( label > 63 || off + 1 + label > msg->size || len + 1 + label >= DNS_NAME_MAX )
+      return false;
+
+    msg->key[len ++] = label;
+    for ( uint8_t i = 0; i < label; i ++ ) {
+      uint8_t c = msg->data[off + 1 + i];
+      msg->key[len ++] = ( lower && c >= 'A' && c <= 'Z' ) ? (uint8_t)( c + ('a' - 'A') ) : c;
+    }
+
+    off += 1 + label;
+  }
+
+  if ( off + 4 > msg->size )
+    return false;
+
+  msg->qname_len = len;
+  memcpy( msg->key + len, msg->data + off, 4 ); // QTYPE, QCLASS
+  msg->key_len = len + 4;
+  msg->question_end = off + 4;
+
+  return true;
+}
+
+static bool dns_skip_name( const uint8_t *data, size_t size, size_t *off )
+{
+  while ( *off < size ) {
+
+    uint8_t label = data[*off];
+
+    if ( !label ) {
+      (*off) ++;
+      return true;
+    }
+
+    if ( (label & 0xc0) == 0xc0 ) {
+      *off += 2;
+      return *off <= size;
+    }
+
+    if ( label & 0xc0 )
+      return false;
+
+    *off += 1 + label;
+  }
+
+  return false;
+}
+
+/**
+ * @brief dns_key_flags Finish the key with the bits that change the answer
+ * @param msg
+ * @param has_edns
+ */
+static inline void dns_key_flags( vpn_dns_msg_t *msg, bool has_edns )
+{
+  uint8_t flags = 0;
+
+  if ( msg->data[2] & 0x01 )
+    flags |= DNS_KEY_FLAG_RD;
+  if ( msg->data[3] & 0x10 )
+    flags |= DNS_KEY_FLAG_CD;
+  if ( has_edns )
+    flags |= DNS_KEY_FLAG_EDNS;
+
+  msg->key[msg->key_len ++] = flags;
+}
+
+static uint16_t ip_csum( const uint8_t *data, size_t len, uint32_t sum )
+{
+  size_t i;
+
+  for ( i = 0; i + 1 < len; i += 2 )
+    sum += (uint32_t)( (data[i] << 8) | data[i + 1] );
+  if ( i < len )
+    sum += (uint32_t)data[i] << 8;
+
+  while ( sum >> 16 )
+    sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+  return (uint16_t)~sum;
+}
+
+/**
+ * @brief dns_build_reply Wrap DNS message into IPv4/UDP packet from the resolver to the client
+ * @param pkt Buffer of IPV4_HDR_SIZE + UDP_HDR_SIZE + msg_size bytes, DNS message is at the right place already
+ * @param msg_size
+ * @param resolver_addr
+ * @param resolver_port
+ * @param client_addr
+ * @param client_port
+ */
+static void dns_build_reply( uint8_t *pkt, size_t msg_size, uint32_t resolver_addr, uint16_t resolver_port,
+                             uint32_t client_addr, uint16_t client_port )
+{
+  uint8_t *udp = pkt + IPV4_HDR_SIZE;
+  uint16_t tot_len = (uint16_t)( IPV4_HDR_SIZE + UDP_HDR_SIZE + msg_size );
+  uint16_t udp_len = (uint16_t)( UDP_HDR_SIZE + msg_size );
+  uint16_t csum;
+
+  memset( pkt, 0, IPV4_HDR_SIZE + UDP_HDR_SIZE );
+
+  pkt[0] = 0x45;
+  pkt[2] = (uint8_t)( tot_len >> 8 );
+  pkt[3] = (uint8_t)tot_len;
+  pkt[6] = 0x40; // DF
+  pkt[8] = 64;
+  pkt[9] = IP_PROTO_UDP;
+  memcpy( pkt + 12, &resolver_addr, 4 );
+  memcpy( pkt + 16, &client_addr, 4 );
+
+  csum = ip_csum( pkt, IPV4_HDR_SIZE, 0 );
+  pkt[10] = (uint8_t)( csum >> 8 );
+  pkt[11] = (uint8_t)csum;
+
+  memcpy( udp, &resolver_port, 2 );
+  memcpy( udp + 2, &client_port, 2 );
+  udp[4] = (uint8_t)( udp_len >> 8 );
+  udp[5] = (uint8_t)udp_len;
+
+  // Pseudo header: addresses, protocol, UDP length
+  uint32_t sum = dns_get16( pkt + 12 ) + dns_get16( pkt + 14 ) + dns_get16( pkt + 16 ) + dns_get16( pkt + 18 ) +
+                 IP_PROTO_UDP + udp_len;
+
+  csum = ip_csum( udp, udp_len, sum );
+  if ( !csum )
+    csum = 0xffff;
+  udp[6] = (uint8_t)( csum >> 8 );
+  udp[7] = (uint8_t)csum;
+}
+
+static void dns_lru_unlink( vpn_dns_cache_t *cache, vpn_dns_entry_t *entry )
+{
+  if ( entry->lru_prev )
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if ( entry->lru_next )
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void dns_lru_push( vpn_dns_cache_t *cache, vpn_dns_entry_t *entry )
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+
+  if ( cache->lru_head )
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+
+  cache->lru_head = entry;
+}
+
+static void dns_entry_free( vpn_dns_cache_t *cache, vpn_dns_entry_t *entry )
+{
+  HASH_DEL( cache->entries, entry );
+  dns_lru_unlink( cache, entry );
+  cache->entries_count --;
+
+  free( entry->msg );
+  free( entry );
+}
+
+/**
+ * @brief vpn_dns_new Create DNS answer cache
+ * @param config Zero fields are replaced with defaults
+ * @param deliver
+ * @param deliver_arg Passed to deliver as is
+ * @return NULL on error
+ */
+vpn_dns_cache_t *vpn_dns_new( const dap_stream_ch_vpn_dns_config_t *config, vpn_dns_deliver_t deliver, void *deliver_arg )
+{
+  vpn_dns_cache_t *cache = calloc( 1, sizeof(vpn_dns_cache_t) );
+
+  if ( !cache )
+    return NULL;
+
+  cache->config = *config;
+  cache->deliver = deliver;
+  cache->deliver_arg = deliver_arg;
+
+  if ( !cache->config.resolver_port )
+    cache->config.resolver_port = VPN_DNS_PORT;
+  if ( !cache->config.max_entries )
+    cache->config.max_entries = VPN_DNS_ENTRIES_MAX;
+  if ( !cache->config.ttl_max )
+    cache->config.ttl_max = VPN_DNS_TTL_MAX;
+  if ( !cache->config.ttl_negative )
+    cache->config.ttl_negative = VPN_DNS_TTL_NEGATIVE;
+
+  pthread_mutex_init( &cache->mutex, NULL );
+
+  return cache;
+}
+
+void vpn_dns_delete( vpn_dns_cache_t *cache )
+{
+  vpn_dns_pending_t *pending, *tmp;
+
+  if ( !cache )
+    return;
+
+  while ( cache->lru_head )
+    dns_entry_free( cache, cache->lru_head );
+
+  HASH_ITER( hh, cache->pending, pending, tmp ) {
+    HASH_DEL( cache->pending, pending );
+    free( pending );
+  }
+
+  pthread_mutex_destroy( &cache->mutex );
+  free( cache );
+}
+
+/**
+ * @brief dns_pending_sweep Forget the queries whose answer never came
+ * @param cache
+ * @param now
+ */
+static void dns_pending_sweep( vpn_dns_cache_t *cache, uint64_t now )
+{
+  vpn_dns_pending_t *pending, *tmp;
+
+  HASH_ITER( hh, cache->pending, pending, tmp ) {
+    if ( now - pending->sent_at >= VPN_DNS_PENDING_TIMEOUT * 1000000000ull ) {
+      HASH_DEL( cache->pending, pending );
+      cache->pending_count --;
+      free( pending );
+    }
+  }
+}
+
+/**
+ * @brief vpn_dns_query Look at client's packet, answer it from the cache or join the same query in flight
+ * @param cache
+ * @param ip_pkt Valid IPv4 packet from the client
+ * @param ip_pkt_size
+ * @return What to do with the packet
+ */
+vpn_dns_verdict_t vpn_dns_query( vpn_dns_cache_t *cache, const uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  vpn_dns_msg_t msg;
+  vpn_dns_entry_t *entry = NULL;
+  vpn_dns_pending_t *pending = NULL;
+  uint8_t exact_key[ DNS_KEY_MAX ];
+  uint64_t now;
+  bool has_edns = false;
+
+  // Cheap filter before any parsing
+  if ( ip_pkt_size < IPV4_HDR_SIZE + UDP_HDR_SIZE + DNS_HDR_SIZE || ip_pkt[9] != IP_PROTO_UDP ||
+       memcmp(ip_pkt + 16, &cache->config.resolver_addr, 4) )
+    return VPN_DNS_PASS;
+
+  if ( !dns_udp_parse(ip_pkt, ip_pkt_size, &msg, false) || msg.dport != htons(cache->config.resolver_port) )
+    return VPN_DNS_PASS;
+
+  // Standard query without answers, possibly with OPT in additional
+  if ( (msg.data[2] & 0x80) || ((msg.data[2] >> 3) & 0x0f) || dns_get16(msg.data + 6) || dns_get16(msg.data + 8) )
+    return VPN_DNS_PASS;
+
+  if ( dns_get16(msg.data + 10) ) {
+    size_t off = msg.question_end;
+    has_edns = dns_skip_name( msg.data, msg.size, &off ) && off + 2 <= msg.size && dns_get16( msg.data + off ) == DNS_TYPE_OPT;
+  }
+
+  dns_key_flags( &msg, has_edns );
+
+  memcpy( exact_key, msg.key, msg.key_len );
+  for ( uint16_t i = 0; i < msg.qname_len; i ++ ) {
+    if ( msg.key[i] >= 'A' && msg.key[i] <= 'Z' )
+      msg.key[i] = (uint8_t)( msg.key[i] + ('a' - 'A') );
+  }
+
+  now = vpn_clock_ns( );
+
+  pthread_mutex_lock( &cache->mutex );
+
+  cache->stats.queries ++;
+
+  HASH_FIND( hh, cache->entries, msg.key, msg.key_len, entry );
+
+  if ( entry && entry->expires_at <= now ) {
+    dns_entry_free( cache, entry );
+    cache->stats.expired ++;
+    entry = NULL;
+  }
+
+  if ( entry ) {
+
+    size_t pkt_size = IPV4_HDR_SIZE + UDP_HDR_SIZE + entry->msg_size;
+    uint8_t *pkt = malloc( pkt_size );
+
+    if ( !pkt ) {
+      pthread_mutex_unlock( &cache->mutex );
+      return VPN_DNS_FORWARD;
+    }
+
+    uint8_t *reply = pkt + IPV4_HDR_SIZE + UDP_HDR_SIZE;
+    size_t reply_size = entry->msg_size;
+    uint32_t elapsed = (uint32_t)( (now - entry->inserted_at) / 1000000000ull );
+
+    memcpy( reply, entry->msg, entry->msg_size );
+    memcpy( reply, msg.data, 2 );                                   // Query's id
+    memcpy( reply + DNS_HDR_SIZE, msg.data + DNS_HDR_SIZE, msg.qname_len ); // and name case
+
+    for ( uint32_t i = 0; i < entry->ttls_count; i ++ )
+      dns_put32( reply + entry->ttl_offsets[i], entry->ttls[i] > elapsed ? entry->ttls[i] - elapsed : 0 );
+
+    dns_lru_unlink( cache, entry );
+    dns_lru_push( cache, entry );
+
+    cache->stats.hits ++;
+    cache->stats.saved_us += entry->rtt_ns / 1000;
+
+    pthread_mutex_unlock( &cache->mutex );
+
+    dns_build_reply( pkt, reply_size, msg.daddr, msg.dport, msg.saddr, msg.sport );
+    cache->deliver( cache->deliver_arg, msg.saddr, pkt, pkt_size );
+    free( pkt );
+
+    return VPN_DNS_ANSWERED;
+  }
+
+  cache->stats.misses ++;
+
+  HASH_FIND( hh, cache->pending, exact_key, msg.key_len, pending );
+
+  if ( pending && now - pending->sent_at < VPN_DNS_PENDING_TIMEOUT * 1000000000ull &&
+       pending->waiters_count < DNS_WAITERS_MAX ) {
+
+    vpn_dns_waiter_t *waiter = &pending->waiters[ pending->waiters_count ++ ];
+
+    waiter->addr = msg.saddr;
+    waiter->port = msg.sport;
+    memcpy( &waiter->id, msg.data, 2 );
+
+    cache->stats.coalesced ++;
+
+    pthread_mutex_unlock( &cache->mutex );
+
+    return VPN_DNS_COALESCED;
+  }
+
+  // This one goes upstream, the same queries wait for its answer
+  if ( !pending ) {
+
+    if ( cache->pending_count >= cache->config.max_entries )
+      dns_pending_sweep( cache, now );
+
+    if ( cache->pending_count < cache->config.max_entries && (pending = calloc(1, sizeof(vpn_dns_pending_t))) ) {
+      memcpy( pending->key, exact_key, msg.key_len );
+      pending->key_len = msg.key_len;
+      HASH_ADD_KEYPTR( hh, cache->pending, pending->key, pending->key_len, pending );
+      cache->pending_count ++;
+    }
+  }
+
+  else if ( now - pending->sent_at >= VPN_DNS_PENDING_TIMEOUT * 1000000000ull )
+    pending->waiters_count = 0; // Their answer is lost, they retry on their own
+  else
+    pending = NULL;           // No room for one more waiter, don't disturb the ones waiting
+
+  if ( pending ) {
+    pending->sent_at = now;
+    pending->sent.addr = msg.saddr;
+    pending->sent.port = msg.sport;
+    memcpy( &pending->sent.id, msg.data, 2 );
+  }
+
+  pthread_mutex_unlock( &cache->mutex );
+
+  return VPN_DNS_FORWARD;
+}
+
+/**
+ * @brief vpn_dns_response Learn the resolver's answer going to the client and pass it to the coalesced queries.
+ *        Only the answer to the query forwarded is taken: same question, client's address and port and the id
+ * @param cache
+ * @param ip_pkt IPv4 packet going to the client, delivered to it as usual
+ * @param ip_pkt_size
+ */
+void vpn_dns_response( vpn_dns_cache_t *cache, const uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  vpn_dns_msg_t msg;
+  vpn_dns_pending_t *pending = NULL;
+  vpn_dns_entry_t *entry = NULL;
+  vpn_dns_waiter_t waiters[ DNS_WAITERS_MAX ];
+  uint32_t waiters_count = 0;
+  uint16_t ttl_offsets[ DNS_TTLS_MAX ];
+  uint32_t ttls[ DNS_TTLS_MAX ];
+  uint32_t ttls_count = 0, ttl_min = UINT32_MAX, ttl_soa = UINT32_MAX;
+  uint64_t now, rtt_ns = 0;
+  bool has_edns = false, cacheable;
+
+  if ( ip_pkt_size < IPV4_HDR_SIZE + UDP_HDR_SIZE + DNS_HDR_SIZE || ip_pkt[9] != IP_PROTO_UDP ||
+       memcmp(ip_pkt + 12, &cache->config.resolver_addr, 4) )
+    return;
+
+  if ( !dns_udp_parse(ip_pkt, ip_pkt_size, &msg, false) || msg.sport != htons(cache->config.resolver_port) ||
+       !(msg.data[2] & 0x80) )
+    return;
+
+  uint16_t an = dns_get16( msg.data + 6 ), ns = dns_get16( msg.data + 8 ), ar = dns_get16( msg.data + 10 );
+  uint8_t rcode = msg.data[3] & 0x0f;
+  size_t off = msg.question_end;
+
+  // Not truncated standard query answers, positive or negative
+  cacheable = !( msg.data[2] & 0x02 ) && !( (msg.data[2] >> 3) & 0x0f ) &&
+              ( rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN ) && msg.size <= DNS_MSG_MAX;
+
+  for ( uint32_t i = 0; i < (uint32_t)an + ns + ar; i ++ ) {
+
+    if ( !dns_skip_name(msg.data, msg.size, &off) || off + 10 > msg.size )
+      return;
+
+    uint16_t type = dns_get16( msg.data + off );
+    uint32_t ttl = dns_get32( msg.data + off + 4 );
+    uint16_t rdlen = dns_get16( msg.data + off + 8 );
+
+    if ( off + 10 + rdlen > msg.size )
+      return;
+
+    // OPT keeps extended flags in the TTL field
+    if ( type == DNS_TYPE_OPT )
+      has_edns = true;
+    else if ( ttls_count == DNS_TTLS_MAX )
+      cacheable = false;
+    else {
+      ttl_offsets[ttls_count] = (uint16_t)( off + 4 );
+      ttls[ttls_count ++] = ttl;
+      if ( ttl < ttl_min )
+        ttl_min = ttl;
+
+      // Negative answer lives as long as SOA's minimum says (RFC 2308)
+      if ( i >= an && i < (uint32_t)an + ns && type == DNS_TYPE_SOA && rdlen >= 22 ) {
+        uint32_t soa_min = dns_get32( msg.data + off + 10 + rdlen - 4 );
+        ttl_soa = ttl < soa_min ? ttl : soa_min;
+      }
+    }
+
+    off += 10 + (size_t)rdlen;
+  }
+
+  uint32_t ttl = an ? ttl_min : ( ttl_soa != UINT32_MAX ? ttl_soa : cache->config.ttl_negative );
+
+  if ( ttl > cache->config.ttl_max )
+    ttl = cache->config.ttl_max;
+  if ( ttl < cache->config.ttl_min )
+    ttl = cache->config.ttl_min;
+  if ( !ttl )
+    cacheable = false;
+
+  dns_key_flags( &msg, has_edns );
+
+  now = vpn_clock_ns( );
+
+  pthread_mutex_lock( &cache->mutex );
+
+  cache->stats.responses ++;
+
+  HASH_FIND( hh, cache->pending, msg.key, msg.key_len, pending );
+
+  // Anyone able to send from the resolver's address would poison the cache shared by every client otherwise
+  if ( !pending || pending->sent.addr != msg.daddr || pending->sent.port != msg.dport || memcmp(&pending->sent.id, msg.data, 2) ) {
+    cache->stats.unsolicited ++;
+    pthread_mutex_unlock( &cache->mutex );
+    return;
+  }
+
+  rtt_ns = now - pending->sent_at;
+  waiters_count = pending->waiters_count;
+  memcpy( waiters, pending->waiters, waiters_count * sizeof(vpn_dns_waiter_t) );
+
+  HASH_DEL( cache->pending, pending );
+  cache->pending_count --;
+  free( pending );
+
+  cache->stats.upstream_rtt_us += rtt_ns / 1000;
+  cache->stats.upstream_answers ++;
+
+  for ( uint16_t i = 0; i < msg.qname_len; i ++ ) {
+    if ( msg.key[i] >= 'A' && msg.key[i] <= 'Z' )
+      msg.key[i] = (uint8_t)( msg.key[i] + ('a' - 'A') );
+  }
+
+  if ( cacheable ) {
+
+    HASH_FIND( hh, cache->entries, msg.key, msg.key_len, entry );
+    if ( entry )
+      dns_entry_free( cache, entry );
+
+    if ( cache->entries_count >= cache->config.max_entries ) {
+      dns_entry_free( cache, cache->lru_tail );
+      cache->stats.evicted ++;
+    }
+
+    entry = calloc( 1, sizeof(vpn_dns_entry_t) );
+
+    if ( entry && (entry->msg = malloc(msg.size)) ) {
+      memcpy( entry->key, msg.key, msg.key_len );
+      entry->key_len = msg.key_len;
+      memcpy( entry->msg, msg.data, msg.size );
+      entry->msg_size = (uint16_t)msg.size;
+      memcpy( entry->ttl_offsets, ttl_offsets, ttls_count * sizeof(uint16_t) );
+      memcpy( entry->ttls, ttls, ttls_count * sizeof(uint32_t) );
+      entry->ttls_count = ttls_count;
+      entry->inserted_at = now;
+      entry->expires_at = now + (uint64_t)ttl * 1000000000ull;
+      entry->rtt_ns = rtt_ns;
+
+      HASH_ADD_KEYPTR( hh, cache->entries, entry->key, entry->key_len, entry );
+      dns_lru_push( cache, entry );
+      cache->entries_count ++;
+      cache->stats.inserted ++;
+    }
+    else
+      free( entry );
+  }
+  else
+    cache->stats.uncacheable ++;
+
+  pthread_mutex_unlock( &cache->mutex );
+
+  if ( !waiters_count )
+    return;
+
+  size_t pkt_size = IPV4_HDR_SIZE + UDP_HDR_SIZE + msg.size;
+  uint8_t *pkt = malloc( pkt_size );
+
+  if ( !pkt )
+    return;
+
+  for ( uint32_t i = 0; i < waiters_count; i ++ ) {
+    memcpy( pkt + IPV4_HDR_SIZE + UDP_HDR_SIZE, msg.data, msg.size );
+    memcpy( pkt + IPV4_HDR_SIZE + UDP_HDR_SIZE, &waiters[i].id, 2 );
+    dns_build_reply( pkt, msg.size, msg.saddr, msg.sport, waiters[i].addr, waiters[i].port );
+    cache->deliver( cache->deliver_arg, waiters[i].addr, pkt, pkt_size );
+  }
+
+  free( pkt );
+}
+
+/**
+ * @brief vpn_dns_get_stats
+ * @param cache
+ * @param stats
+ */
+void vpn_dns_get_stats( vpn_dns_cache_t *cache, dap_stream_ch_vpn_dns_stats_t *stats )
+{
+  pthread_mutex_lock( &cache->mutex );
+
+  *stats = cache->stats;
+  stats->entries = cache->entries_count;
+  stats->entries_max = cache->config.max_entries;
+  stats->pending = cache->pending_count;
+
+  pthread_mutex_unlock( &cache->mutex );
+}
@@ -0,0 +1,59 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_DNS_H_
+#define _STREAM_SF_DNS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dap_stream_ch_vpn.h"
+
+#define VPN_DNS_PORT             53
+#define VPN_DNS_ENTRIES_MAX      4096
+#define VPN_DNS_TTL_MIN          0
+#define VPN_DNS_TTL_MAX          86400
+#define VPN_DNS_TTL_NEGATIVE     30
+#define VPN_DNS_PENDING_TIMEOUT  2 // Seconds a query waits for the answer, coalesced ones with it
+
+typedef struct vpn_dns_cache vpn_dns_cache_t;
+
+typedef enum vpn_dns_verdict {
+
+  VPN_DNS_PASS = 0,  // Not a query to the resolver
+  VPN_DNS_FORWARD,   // Miss, send it on
+  VPN_DNS_ANSWERED,  // Answer is delivered from the cache, drop the query
+  VPN_DNS_COALESCED  // Same query is in flight, its answer will be delivered, drop the query
+
+} vpn_dns_verdict_t;
+
+// Passes the IPv4 packet for the client, called without the cache lock held
+typedef void (*vpn_dns_deliver_t)( void *arg, uint32_t client_addr, const uint8_t *ip_pkt, size_t ip_pkt_size );
+
+vpn_dns_cache_t *vpn_dns_new( const dap_stream_ch_vpn_dns_config_t *config, vpn_dns_deliver_t deliver, void *deliver_arg );
+void vpn_dns_delete( vpn_dns_cache_t *cache );
+
+vpn_dns_verdict_t vpn_dns_query( vpn_dns_cache_t *cache, const uint8_t *ip_pkt, size_t ip_pkt_size );
+void vpn_dns_response( vpn_dns_cache_t *cache, const uint8_t *ip_pkt, size_t ip_pkt_size );
+
+void vpn_dns_get_stats( vpn_dns_cache_t *cache, dap_stream_ch_vpn_dns_stats_t *stats );
+
+#endif
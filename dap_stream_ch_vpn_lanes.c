@@ -0,0 +1,151 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dap_stream_ch_vpn_lanes.h"
+
+#define IP_PROTO_ICMP    1
+#define IP_PROTO_TCP     6
+#define IP_PROTO_UDP     17
+#define IP_PROTO_ICMPV6  58
+
+#define DSCP_LE    1
+#define DSCP_CS1   8
+#define DSCP_AF41  34
+#define DSCP_AF42  36
+#define DSCP_AF43  38
+#define DSCP_CS5   40
+#define DSCP_VA    44
+#define DSCP_EF    46
+#define DSCP_CS6   48
+#define DSCP_CS7   56
+
+#define PORT_DNS   53
+#define PORT_NTP   123
+
+static inline vpn_lane_t vpn_lane_by_dscp( uint8_t dscp )
+{
+  switch ( dscp ) {
+
+    case DSCP_LE:
+    case DSCP_CS1:
+      return VPN_LANE_BULK;
+
+    case DSCP_AF41: case DSCP_AF42: case DSCP_AF43:
+    case DSCP_CS5: case DSCP_VA: case DSCP_EF:
+    case DSCP_CS6: case DSCP_CS7:
+      return VPN_LANE_INTERACTIVE;
+
+    default:
+      return VPN_LANE_DEFAULT;
+  }
+}
+
+static inline uint16_t vpn_lane_port( const uint8_t *p )
+{
+  return (uint16_t)( (p[0] << 8) | p[1] );
+}
+
+/**
+ * @brief vpn_lane_classify Pick the downstream lane for the IP packet
+ * @param ip_pkt
+ * @param ip_pkt_size
+ * @return Lane, VPN_LANE_DEFAULT for anything not recognized
+ */
+vpn_lane_t vpn_lane_classify( const uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  const uint8_t *l4;
+  size_t l4_size;
+  uint8_t proto, dscp;
+  vpn_lane_t lane;
+
+  if ( ip_pkt_size < 20 )
+    return VPN_LANE_DEFAULT;
+
+  switch ( ip_pkt[0] >> 4 ) {
+
+    case 4: {
+      size_t ihl = (size_t)( ip_pkt[0] & 0x0f ) * 4;
+
+      dscp  = ip_pkt[1] >> 2;
+      proto = ip_pkt[9];
+
+      // No transport header in the non first fragments
+      if ( ihl < 20 || ihl > ip_pkt_size || (((ip_pkt[6] & 0x1f) << 8) | ip_pkt[7]) )
+        l4_size = 0;
+      else
+        l4_size = ip_pkt_size - ihl;
+
+      l4 = ip_pkt + ihl;
+      break;
+    }
+
+    case 6:
+      if ( ip_pkt_size < 40 )
+        return VPN_LANE_DEFAULT;
+
+      dscp  = (uint8_t)( ((ip_pkt[0] & 0x0f) << 2) | (ip_pkt[1] >> 6) );
+      proto = ip_pkt[6]; // Extension headers are not walked, such packets stay by DSCP
+      l4 = ip_pkt + 40;
+      l4_size = ip_pkt_size - 40;
+      break;
+
+    default:
+      return VPN_LANE_DEFAULT;
+  }
+
+  // Explicit marking wins, lower effort traffic stays low even if small
+  lane = vpn_lane_by_dscp( dscp );
+  if ( lane != VPN_LANE_DEFAULT )
+    return lane;
+
+  if ( ip_pkt_size <= VPN_LANE_SMALL_PKT_SIZE )
+    return VPN_LANE_INTERACTIVE;
+
+  switch ( proto ) {
+
+    case IP_PROTO_ICMP:
+    case IP_PROTO_ICMPV6:
+      return VPN_LANE_INTERACTIVE;
+
+    case IP_PROTO_UDP:
+      if ( l4_size >= 8 ) {
+        uint16_t sport = vpn_lane_port( l4 ), dport = vpn_lane_port( l4 + 2 );
+        if ( sport == PORT_DNS || dport == PORT_DNS || sport == PORT_NTP || dport == PORT_NTP )
+          return VPN_LANE_INTERACTIVE;
+      }
+      break;
+
+    case IP_PROTO_TCP:
+      if ( l4_size >= 20 ) {
+        size_t doff = (size_t)( l4[12] >> 4 ) * 4;
+
+        // Pure ACK and other control segments, options don't count as payload
+        if ( doff >= 20 && doff >= l4_size )
+          return VPN_LANE_INTERACTIVE;
+
+        uint16_t sport = vpn_lane_port( l4 ), dport = vpn_lane_port( l4 + 2 );
+        if ( sport == PORT_DNS || dport == PORT_DNS )
+          return VPN_LANE_INTERACTIVE;
+      }
+      break;
+  }
+
+  return VPN_LANE_DEFAULT;
+}
@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_LANES_H_
+#define _STREAM_SF_LANES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dap_stream_ch_vpn.h"
+
+/**
+  * @brief Downstream priority lanes of the client, served in strict priority order
+  *
+  **/
+typedef enum vpn_lane {
+
+  VPN_LANE_INTERACTIVE = 0, // Realtime DSCP, DNS/NTP, ICMP, TCP without payload, small packets
+  VPN_LANE_DEFAULT     = 1,
+  VPN_LANE_BULK        = 2, // Lower effort DSCP, may starve by definition
+
+  VPN_LANES = DAP_STREAM_CH_VPN_LANES
+
+} vpn_lane_t;
+
+// Packets up to this size are treated as interactive whatever they carry
+#define VPN_LANE_SMALL_PKT_SIZE  128
+
+vpn_lane_t vpn_lane_classify( const uint8_t *ip_pkt, size_t ip_pkt_size );
+
+#endif
@@ -0,0 +1,881 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include "uthash.h"
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_nat.h"
+#include "dap_stream_ch_vpn_clock.h"
+
+#define LOG_TAG "stream_ch_vpn_nat"
+
+#define IP_PROTO_ICMP  1
+#define IP_PROTO_TCP   6
+#define IP_PROTO_UDP   17
+
+#define ICMP_ECHO_REPLY     0
+#define ICMP_DEST_UNREACH   3
+#define ICMP_ECHO_REQUEST   8
+#define ICMP_TIME_EXCEEDED  11
+#define ICMP_PARAM_PROBLEM  12
+
+#define TCP_FLAG_FIN  0x01
+#define TCP_FLAG_SYN  0x02
+#define TCP_FLAG_RST  0x04
+
+// Timer wheel with one second tick, longer timeouts go round more than once
+#define VPN_NAT_WHEEL_SLOTS  1024
+#define VPN_NAT_WHEEL_MASK   ( VPN_NAT_WHEEL_SLOTS - 1 )
+
+/**
+  * @struct vpn_nat_key
+  * @brief 5-tuple as it's seen in the packet, addresses and ports in network byte order
+  *
+  **/
+typedef struct vpn_nat_key {
+
+  uint32_t saddr;
+  uint32_t daddr;
+  uint16_t sport; // ICMP echo id for both ports
+  uint16_t dport;
+  uint8_t  proto;
+  uint8_t  padding[3];
+
+} vpn_nat_key_t;
+
+struct vpn_nat_client;
+
+typedef struct vpn_nat_flow {
+
+  vpn_nat_key_t key_out; // Client to the world, before translation
+  vpn_nat_key_t key_in;  // World to the client, before translation
+
+  struct vpn_nat_client *client;
+  uint16_t nat_port; // Network byte order
+
+  uint64_t last_seen;
+  uint32_t timeout;
+  bool closing;          // TCP FIN or RST seen, the short timeout holds till a new SYN
+  uint64_t wheel_expire; // Tick of the slot the flow is in, may be earlier than its real expiration
+
+  struct vpn_nat_flow *wheel_prev, *wheel_next; // Also the free list
+  struct vpn_nat_flow *client_prev, *client_next;
+
+  UT_hash_handle hh_out;
+  UT_hash_handle hh_in;
+
+} vpn_nat_flow_t;
+
+typedef struct vpn_nat_client {
+
+  uint32_t addr;
+  uint32_t block;     // Client's range of ports
+  uint32_t flows_count;
+  uint32_t port_next; // Where the search of a free port starts, index in the block
+
+  vpn_nat_flow_t *flows;
+
+  UT_hash_handle hh;
+
+  uint64_t ports_used[]; // Bitmap over the block
+
+} vpn_nat_client_t;
+
+struct vpn_nat {
+
+  pthread_mutex_t mutex;
+
+  dap_stream_ch_vpn_nat_config_t config;
+
+  vpn_nat_flow_t *flows_pool;
+  vpn_nat_flow_t *flows_free;
+  vpn_nat_flow_t *flows_out; // Hash by key_out
+  vpn_nat_flow_t *flows_in;  // Hash by key_in
+  uint32_t flows_count;
+
+  vpn_nat_client_t *clients;
+  uint32_t clients_count;
+
+  uint32_t *blocks_free; // Stack of unused port blocks
+  uint32_t blocks_free_count;
+  uint32_t blocks_count;
+
+  vpn_nat_flow_t *wheel[ VPN_NAT_WHEEL_SLOTS ];
+  uint64_t wheel_now;
+
+  dap_stream_ch_vpn_nat_stats_t stats;
+};
+
+static inline uint16_t nat_load16( const uint8_t *p )
+{
+  uint16_t v;
+
+  memcpy( &v, p, sizeof(v) );
+
+  return v;
+}
+
+/**
+ * @brief nat_csum_replace Incremental Internet checksum update (RFC 1624, eqn. 3).
+ *        One's complement sum doesn't depend on byte order, so the words are taken as they lie in memory
+ * @param csum Checksum field
+ * @param old_data
+ * @param new_data
+ * @param len Even number of bytes
+ */
+static inline void nat_csum_replace( uint8_t *csum, const uint8_t *old_data, const uint8_t *new_data, size_t len )
+{
+  uint32_t sum = (uint16_t)~nat_load16( csum );
+
+  for ( size_t i = 0; i < len; i += 2 ) {
+    sum += (uint16_t)~nat_load16( old_data + i );
+    sum += nat_load16( new_data + i );
+  }
+
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (uint16_t)~sum;
+
+  memcpy( csum, &sum, 2 );
+}
+
+/**
+ * @brief nat_rewrite Replace the field and keep up to two checksums covering it valid
+ * @param field
+ * @param value
+ * @param len
+ * @param csum1 NULL if not needed
+ * @param csum2 NULL if not needed
+ */
+static inline void nat_rewrite( uint8_t *field, const void *value, size_t len, uint8_t *csum1, uint8_t *csum2 )
+{
+  if ( csum1 )
+    nat_csum_replace( csum1, field, value, len );
+  if ( csum2 )
+    nat_csum_replace( csum2, field, value, len );
+
+  memcpy( field, value, len );
+}
+
+static void nat_wheel_insert( vpn_nat_t *nat, vpn_nat_flow_t *flow )
+{
+  uint64_t expire = flow->last_seen + flow->timeout;
+
+  // Current tick's slot is passed already
+  if ( expire <= nat->wheel_now )
+    expire = nat->wheel_now + 1;
+
+  vpn_nat_flow_t **slot = &nat->wheel[ expire & VPN_NAT_WHEEL_MASK ];
+
+  flow->wheel_expire = expire;
+
+  flow->wheel_prev = NULL;
+  flow->wheel_next = *slot;
+  if ( *slot )
+    (*slot)->wheel_prev = flow;
+  *slot = flow;
+}
+
+static void nat_wheel_remove( vpn_nat_t *nat, vpn_nat_flow_t *flow )
+{
+  if ( flow->wheel_prev )
+    flow->wheel_prev->wheel_next = flow->wheel_next;
+  else
+    nat->wheel[ flow->wheel_expire & VPN_NAT_WHEEL_MASK ] = flow->wheel_next;
+
+  if ( flow->wheel_next )
+    flow->wheel_next->wheel_prev = flow->wheel_prev;
+}
+
+static vpn_nat_client_t *nat_client_get( vpn_nat_t *nat, uint32_t addr )
+{
+  vpn_nat_client_t *client = NULL;
+  uint32_t bitmap_words = ( nat->config.ports_per_client + 63 ) / 64;
+
+  HASH_FIND_INT( nat->clients, &addr, client );
+  if ( client )
+    return client;
+
+  if ( !nat->blocks_free_count )
+    return NULL;
+
+  client = calloc( 1, sizeof(vpn_nat_client_t) + bitmap_words * sizeof(uint64_t) );
+  if ( !client )
+    return NULL;
+
+  client->addr = addr;
+  client->block = nat->blocks_free[ -- nat->blocks_free_count ];
+
+  HASH_ADD_INT( nat->clients, addr, client );
+  nat->clients_count ++;
+
+  return client;
+}
+
+static void nat_client_free( vpn_nat_t *nat, vpn_nat_client_t *client )
+{
+  HASH_DEL( nat->clients, client );
+  nat->clients_count --;
+
+  nat->blocks_free[ nat->blocks_free_count ++ ] = client->block;
+  free( client );
+}
+
+/**
+ * @brief nat_port_alloc Take a free port from client's block
+ * @param nat
+ * @param client
+ * @return Port in network byte order, 0 if the block is exhausted
+ */
+static uint16_t nat_port_alloc( vpn_nat_t *nat, vpn_nat_client_t *client )
+{
+  uint32_t ports = nat->config.ports_per_client;
+
+  for ( uint32_t i = 0; i < ports; i ++ ) {
+
+    uint32_t idx = ( client->port_next + i ) % ports;
+
+    if ( client->ports_used[idx / 64] & (1ull << (idx % 64)) )
+      continue;
+
+    client->ports_used[idx / 64] |= 1ull << (idx % 64);
+    client->port_next = idx + 1;
+
+    return htons( (uint16_t)(nat->config.port_min + client->block * ports + idx) );
+  }
+
+  return 0;
+}
+
+static void nat_port_free( vpn_nat_t *nat, vpn_nat_client_t *client, uint16_t port )
+{
+  uint32_t idx = ntohs( port ) - nat->config.port_min - client->block * nat->config.ports_per_client;
+
+  client->ports_used[idx / 64] &= ~(1ull << (idx % 64));
+}
+
+/**
+ * @brief nat_flow_evict Forget the flow, it must be out of the wheel already
+ * @param nat
+ * @param flow
+ */
+static void nat_flow_evict( vpn_nat_t *nat, vpn_nat_flow_t *flow )
+{
+  vpn_nat_client_t *client = flow->client;
+
+  HASH_DELETE( hh_out, nat->flows_out, flow );
+  HASH_DELETE( hh_in, nat->flows_in, flow );
+
+  if ( flow->client_prev )
+    flow->client_prev->client_next = flow->client_next;
+  else
+    client->flows = flow->client_next;
+  if ( flow->client_next )
+    flow->client_next->client_prev = flow->client_prev;
+
+  nat_port_free( nat, client, flow->nat_port );
+  if ( -- client->flows_count == 0 )
+    nat_client_free( nat, client );
+
+  flow->wheel_next = nat->flows_free;
+  nat->flows_free = flow;
+  nat->flows_count --;
+}
+
+/**
+ * @brief nat_expire Turn the wheel up to now, evicting flows idle for longer than their timeout
+ * @param nat
+ * @param now Seconds
+ */
+static void nat_expire( vpn_nat_t *nat, uint64_t now )
+{
+  uint64_t ticks = now - nat->wheel_now;
+
+  if ( ticks > VPN_NAT_WHEEL_SLOTS )
+    ticks = VPN_NAT_WHEEL_SLOTS;
+
+  for ( uint64_t t = now - ticks + 1; t <= now; t ++ ) {
+
+    vpn_nat_flow_t *flow = nat->wheel[ t & VPN_NAT_WHEEL_MASK ];
+
+    // Detach the slot, the flows still alive are reinserted where their time comes
+    nat->wheel[ t & VPN_NAT_WHEEL_MASK ] = NULL;
+
+    while ( flow ) {
+
+      vpn_nat_flow_t *next = flow->wheel_next;
+
+      if ( flow->last_seen + flow->timeout <= now ) {
+        nat_flow_evict( nat, flow );
+        nat->stats.evicted ++;
+      }
+      else
+        nat_wheel_insert( nat, flow );
+
+      flow = next;
+    }
+  }
+
+  nat->wheel_now = now;
+}
+
+/**
+ * @brief nat_flow_timeout Idle timeout of the flow after the packet. TCP flow is closing from FIN or RST on,
+ *        the ACKs and retransmits that follow don't bring the long timeout back, only SYN of a new connection does
+ * @param nat
+ * @param flow
+ * @param l4
+ * @return Seconds
+ */
+static inline uint32_t nat_flow_timeout( vpn_nat_t *nat, vpn_nat_flow_t *flow, const uint8_t *l4 )
+{
+  switch ( flow->key_out.proto ) {
+    case IP_PROTO_TCP:
+      if ( l4[13] & (TCP_FLAG_FIN | TCP_FLAG_RST) )
+        flow->closing = true;
+      else if ( l4[13] & TCP_FLAG_SYN )
+        flow->closing = false;
+      return flow->closing ? nat->config.timeout_tcp_closing : nat->config.timeout_tcp;
+    case IP_PROTO_UDP:
+      return nat->config.timeout_udp;
+    default:
+      return nat->config.timeout_icmp;
+  }
+}
+
+static inline void nat_flow_touch( vpn_nat_t *nat, vpn_nat_flow_t *flow, uint64_t now, const uint8_t *l4 )
+{
+  uint32_t timeout = nat_flow_timeout( nat, flow, l4 );
+
+  flow->last_seen = now;
+  flow->timeout = timeout;
+
+  // Usually the slot is kept till the wheel comes to it and sees the flow is still alive,
+  // it's moved only when the timeout got shorter, on TCP FIN or RST
+  if ( now + timeout < flow->wheel_expire ) {
+    nat_wheel_remove( nat, flow );
+    nat_wheel_insert( nat, flow );
+  }
+}
+
+/**
+ * @brief vpn_nat_new Create NAT engine
+ * @param config Zero fields are replaced with defaults
+ * @return NULL on error
+ */
+vpn_nat_t *vpn_nat_new( const dap_stream_ch_vpn_nat_config_t *config )
+{
+  vpn_nat_t *nat = calloc( 1, sizeof(vpn_nat_t) );
+
+  if ( !nat )
+    return NULL;
+
+  nat->config = *config;
+
+  if ( !nat->config.port_min )
+    nat->config.port_min = VPN_NAT_PORT_MIN;
+  if ( !nat->config.port_max )
+    nat->config.port_max = VPN_NAT_PORT_MAX;
+  if ( !nat->config.ports_per_client )
+    nat->config.ports_per_client = VPN_NAT_PORTS_PER_CLIENT;
+  if ( !nat->config.max_flows )
+    nat->config.max_flows = VPN_NAT_FLOWS_MAX;
+  if ( !nat->config.timeout_tcp )
+    nat->config.timeout_tcp = VPN_NAT_TIMEOUT_TCP;
+  if ( !nat->config.timeout_tcp_closing )
+    nat->config.timeout_tcp_closing = VPN_NAT_TIMEOUT_TCP_CLOSING;
+  if ( !nat->config.timeout_udp )
+    nat->config.timeout_udp = VPN_NAT_TIMEOUT_UDP;
+  if ( !nat->config.timeout_icmp )
+    nat->config.timeout_icmp = VPN_NAT_TIMEOUT_ICMP;
+
+  if ( nat->config.port_max < nat->config.port_min ||
+       (uint32_t)nat->config.port_max - nat->config.port_min + 1 < nat->config.ports_per_client ) {
+    log_it( L_ERROR, "NAT port range %u-%u can't hold a block of %u ports",
+            nat->config.port_min, nat->config.port_max, nat->config.ports_per_client );
+    free( nat );
+    return NULL;
+  }
+
+  nat->blocks_count = ( (uint32_t)nat->config.port_max - nat->config.port_min + 1 ) / nat->config.ports_per_client;
+  nat->blocks_free = malloc( nat->blocks_count * sizeof(uint32_t) );
+  nat->flows_pool = calloc( nat->config.max_flows, sizeof(vpn_nat_flow_t) );
+
+  if ( !nat->blocks_free || !nat->flows_pool ) {
+    log_it( L_ERROR, "Can't allocate NAT table for %u flows", nat->config.max_flows );
+    free( nat->blocks_free );
+    free( nat->flows_pool );
+    free( nat );
+    return NULL;
+  }
+
+  // Lower blocks go first
+  for ( uint32_t i = 0; i < nat->blocks_count; i ++ )
+    nat->blocks_free[i] = nat->blocks_count - 1 - i;
+  nat->blocks_free_count = nat->blocks_count;
+
+  for ( uint32_t i = nat->config.max_flows; i > 0; i -- ) {
+    nat->flows_pool[i - 1].wheel_next = nat->flows_free;
+    nat->flows_free = &nat->flows_pool[i - 1];
+  }
+
+  nat->wheel_now = vpn_clock_sec( );
+
+  pthread_mutex_init( &nat->mutex, NULL );
+
+  return nat;
+}
+
+void vpn_nat_delete( vpn_nat_t *nat )
+{
+  vpn_nat_client_t *client, *tmp;
+
+  if ( !nat )
+    return;
+
+  HASH_CLEAR( hh_out, nat->flows_out );
+  HASH_CLEAR( hh_in, nat->flows_in );
+
+  HASH_ITER( hh, nat->clients, client, tmp ) {
+    HASH_DEL( nat->clients, client );
+    free( client );
+  }
+
+  pthread_mutex_destroy( &nat->mutex );
+
+  free( nat->flows_pool );
+  free( nat->blocks_free );
+  free( nat );
+}
+
+/**
+ * @brief nat_flow_create Bind client's 5-tuple to a port of the NAT address
+ * @param nat
+ * @param key_out
+ * @param now
+ * @param l4 Packet's transport header
+ * @return NULL if there is no room in the table or in the client's port block
+ */
+static vpn_nat_flow_t *nat_flow_create( vpn_nat_t *nat, const vpn_nat_key_t *key_out, uint64_t now, const uint8_t *l4 )
+{
+  vpn_nat_client_t *client;
+  vpn_nat_flow_t *flow = nat->flows_free;
+  uint16_t port;
+
+  if ( !flow ) {
+    nat->stats.table_full ++;
+    return NULL;
+  }
+
+  client = nat_client_get( nat, key_out->saddr );
+  if ( !client || !(port = nat_port_alloc(nat, client)) ) {
+    if ( client && !client->flows_count )
+      nat_client_free( nat, client );
+    nat->stats.ports_exhausted ++;
+    return NULL;
+  }
+
+  nat->flows_free = flow->wheel_next;
+  memset( flow, 0, sizeof(*flow) );
+
+  flow->key_out = *key_out;
+  flow->key_in.saddr = key_out->daddr;
+  flow->key_in.daddr = nat->config.nat_addr;
+  flow->key_in.sport = ( key_out->proto == IP_PROTO_ICMP ) ? port : key_out->dport;
+  flow->key_in.dport = port;
+  flow->key_in.proto = key_out->proto;
+  flow->nat_port = port;
+  flow->client = client;
+  flow->last_seen = now;
+  flow->timeout = nat_flow_timeout( nat, flow, l4 );
+
+  HASH_ADD( hh_out, nat->flows_out, key_out, sizeof(vpn_nat_key_t), flow );
+  HASH_ADD( hh_in, nat->flows_in, key_in, sizeof(vpn_nat_key_t), flow );
+
+  flow->client_next = client->flows;
+  if ( client->flows )
+    client->flows->client_prev = flow;
+  client->flows = flow;
+  client->flows_count ++;
+
+  nat_wheel_insert( nat, flow );
+
+  nat->flows_count ++;
+  nat->stats.created ++;
+
+  return flow;
+}
+
+/**
+ * @brief vpn_nat_out Translate client's packet to the NAT address in place
+ * @param nat
+ * @param ip_pkt Valid IPv4 packet
+ * @param ip_pkt_size
+ * @return False if the packet can't be translated and must be dropped
+ */
+bool vpn_nat_out( vpn_nat_t *nat, uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  size_t ihl = (size_t)( ip_pkt[0] & 0x0f ) * 4;
+  uint8_t proto = ip_pkt[9];
+  uint8_t *l4 = ip_pkt + ihl;
+  size_t l4_size = ip_pkt_size - ihl;
+  uint8_t *l4_csum, *port_field;
+  vpn_nat_key_t key;
+  vpn_nat_flow_t *flow = NULL;
+  uint64_t now = vpn_clock_sec( );
+
+  // Fragments after the first one carry no ports, only the source address changes
+  if ( ((ip_pkt[6] & 0x1f) << 8) | ip_pkt[7] ) {
+    nat_rewrite( ip_pkt + 12, &nat->config.nat_addr, 4, ip_pkt + 10, NULL );
+    return true;
+  }
+
+  memset( &key, 0, sizeof(key) );
+  memcpy( &key.saddr, ip_pkt + 12, 4 );
+  memcpy( &key.daddr, ip_pkt + 16, 4 );
+  key.proto = proto;
+
+  switch ( proto ) {
+
+    case IP_PROTO_TCP:
+      if ( l4_size < 20 )
+        goto unsupported;
+      memcpy( &key.sport, l4, 2 );
+      memcpy( &key.dport, l4 + 2, 2 );
+      port_field = l4;
+      l4_csum = l4 + 16;
+      break;
+
+    case IP_PROTO_UDP:
+      if ( l4_size < 8 )
+        goto unsupported;
+      memcpy( &key.sport, l4, 2 );
+      memcpy( &key.dport, l4 + 2, 2 );
+      port_field = l4;
+      l4_csum = nat_load16( l4 + 6 ) ? l4 + 6 : NULL; // Zero means no checksum
+      break;
+
+    case IP_PROTO_ICMP:
+      if ( l4_size < 8 || l4[0] != ICMP_ECHO_REQUEST )
+        goto unsupported;
+      memcpy( &key.sport, l4 + 4, 2 );
+      key.dport = key.sport;
+      port_field = l4 + 4;
+      l4_csum = l4 + 2;
+      break;
+
+    default:
+      goto unsupported;
+  }
+
+  pthread_mutex_lock( &nat->mutex );
+
+  nat_expire( nat, now );
+  nat->stats.lookups ++;
+
+  HASH_FIND( hh_out, nat->flows_out, &key, sizeof(key), flow );
+
+  if ( flow ) {
+    nat->stats.hits ++;
+    nat_flow_touch( nat, flow, now, l4 );
+  }
+  else
+    flow = nat_flow_create( nat, &key, now, l4 );
+
+  uint16_t nat_port = flow ? flow->nat_port : 0;
+
+  pthread_mutex_unlock( &nat->mutex );
+
+  if ( !flow )
+    return false;
+
+  // Pseudo header of TCP and UDP covers the address, ICMP checksum covers only the id
+  nat_rewrite( ip_pkt + 12, &nat->config.nat_addr, 4, ip_pkt + 10, proto == IP_PROTO_ICMP ? NULL : l4_csum );
+  nat_rewrite( port_field, &nat_port, 2, l4_csum, NULL );
+
+  if ( proto == IP_PROTO_UDP && l4_csum && !nat_load16(l4_csum) )
+    memset( l4_csum, 0xff, 2 );
+
+  return true;
+
+unsupported:
+  pthread_mutex_lock( &nat->mutex );
+  nat->stats.unsupported ++;
+  pthread_mutex_unlock( &nat->mutex );
+
+  return false;
+}
+
+/**
+ * @brief nat_in_icmp_error Translate ICMP error about the packet we translated before, inner header included
+ * @param nat
+ * @param ip_pkt
+ * @param icmp
+ * @param icmp_size
+ * @param now
+ * @return False if there is no flow for it
+ */
+static bool nat_in_icmp_error( vpn_nat_t *nat, uint8_t *ip_pkt, uint8_t *icmp, size_t icmp_size, uint64_t now )
+{
+  uint8_t *inner = icmp + 8;
+  size_t inner_ihl;
+  uint8_t *inner_l4, *port_field;
+  vpn_nat_key_t key;
+  vpn_nat_flow_t *flow = NULL;
+
+  if ( icmp_size < 8 + 20 )
+    return false;
+
+  inner_ihl = (size_t)( inner[0] & 0x0f ) * 4;
+  if ( inner_ihl < 20 || icmp_size < 8 + inner_ihl + 8 || memcmp(inner + 12, &nat->config.nat_addr, 4) )
+    return false;
+
+  inner_l4 = inner + inner_ihl;
+
+  // Inner packet went from us: reverse it to get the inbound key
+  memset( &key, 0, sizeof(key) );
+  memcpy( &key.saddr, inner + 16, 4 );
+  key.daddr = nat->config.nat_addr;
+  key.proto = inner[9];
+
+  switch ( key.proto ) {
+    case IP_PROTO_TCP:
+    case IP_PROTO_UDP:
+      memcpy( &key.sport, inner_l4 + 2, 2 );
+      memcpy( &key.dport, inner_l4, 2 );
+      port_field = inner_l4;
+      break;
+    case IP_PROTO_ICMP:
+      memcpy( &key.sport, inner_l4 + 4, 2 );
+      key.dport = key.sport;
+      port_field = inner_l4 + 4;
+      break;
+    default:
+      return false;
+  }
+
+  pthread_mutex_lock( &nat->mutex );
+
+  nat_expire( nat, now );
+  nat->stats.lookups ++;
+
+  HASH_FIND( hh_in, nat->flows_in, &key, sizeof(key), flow );
+
+  uint32_t client_addr = flow ? flow->key_out.saddr : 0;
+  uint16_t client_port = flow ? flow->key_out.sport : 0;
+
+  if ( flow )
+    nat->stats.hits ++;
+
+  pthread_mutex_unlock( &nat->mutex );
+
+  if ( !flow )
+    return false;
+
+  uint8_t inner_csum_old[2];
+  memcpy( inner_csum_old, inner + 10, 2 );
+
+  // Every changed word of the embedded packet is covered by the ICMP checksum too
+  nat_rewrite( ip_pkt + 16, &client_addr, 4, ip_pkt + 10, NULL );
+  nat_rewrite( inner + 12, &client_addr, 4, inner + 10, icmp + 2 );
+  nat_csum_replace( icmp + 2, inner_csum_old, inner + 10, 2 );
+  nat_rewrite( port_field, &client_port, 2, icmp + 2, NULL );
+
+  return true;
+}
+
+/**
+ * @brief vpn_nat_in Translate the packet addressed to the NAT address back to the client in place
+ * @param nat
+ * @param ip_pkt IPv4 packet with daddr equal to the NAT address
+ * @param ip_pkt_size
+ * @return False if there is no flow for the packet and it must be dropped
+ */
+bool vpn_nat_in( vpn_nat_t *nat, uint8_t *ip_pkt, size_t ip_pkt_size )
+{
+  size_t ihl;
+  uint8_t proto, *l4, *l4_csum, *port_field;
+  size_t l4_size;
+  vpn_nat_key_t key;
+  vpn_nat_flow_t *flow = NULL;
+  uint64_t now = vpn_clock_sec( );
+
+  if ( ip_pkt_size < 20 || (ip_pkt[0] >> 4) != 4 )
+    goto unsupported;
+
+  ihl = (size_t)( ip_pkt[0] & 0x0f ) * 4;
+  if ( ihl < 20 || ihl > ip_pkt_size )
+    goto unsupported;
+
+  // Fragments after the first one can't be matched to a flow without reassembly
+  if ( ((ip_pkt[6] & 0x1f) << 8) | ip_pkt[7] )
+    goto unsupported;
+
+  proto = ip_pkt[9];
+  l4 = ip_pkt + ihl;
+  l4_size = ip_pkt_size - ihl;
+
+  memset( &key, 0, sizeof(key) );
+  memcpy( &key.saddr, ip_pkt + 12, 4 );
+  memcpy( &key.daddr, ip_pkt + 16, 4 );
+  key.proto = proto;
+
+  switch ( proto ) {
+
+    case IP_PROTO_TCP:
+      if ( l4_size < 20 )
+        goto unsupported;
+      memcpy( &key.sport, l4, 2 );
+      memcpy( &key.dport, l4 + 2, 2 );
+      port_field = l4 + 2;
+      l4_csum = l4 + 16;
+      break;
+
+    case IP_PROTO_UDP:
+      if ( l4_size < 8 )
+        goto unsupported;
+      memcpy( &key.sport, l4, 2 );
+      memcpy( &key.dport, l4 + 2, 2 );
+      port_field = l4 + 2;
+      l4_csum = nat_load16( l4 + 6 ) ? l4 + 6 : NULL;
+      break;
+
+    case IP_PROTO_ICMP:
+      if ( l4_size < 8 )
+        goto unsupported;
+
+      if ( l4[0] == ICMP_DEST_UNREACH || l4[0] == ICMP_TIME_EXCEEDED || l4[0] == ICMP_PARAM_PROBLEM ) {
+        if ( nat_in_icmp_error(nat, ip_pkt, l4, l4_size, now) )
+          return true;
+        goto no_flow;
+      }
+
+      if ( l4[0] != ICMP_ECHO_REPLY )
+        goto unsupported;
+
+      memcpy( &key.sport, l4 + 4, 2 );
+      key.dport = key.sport;
+      port_field = l4 + 4;
+      l4_csum = l4 + 2;
+      break;
+
+    default:
+      goto unsupported;
+  }
+
+  pthread_mutex_lock( &nat->mutex );
+
+  nat_expire( nat, now );
+  nat->stats.lookups ++;
+
+  HASH_FIND( hh_in, nat->flows_in, &key, sizeof(key), flow );
+
+  if ( flow ) {
+    nat->stats.hits ++;
+    nat_flow_touch( nat, flow, now, l4 );
+  }
+
+  uint32_t client_addr = flow ? flow->key_out.saddr : 0;
+  uint16_t client_port = flow ? flow->key_out.sport : 0;
+
+  pthread_mutex_unlock( &nat->mutex );
+
+  if ( !flow )
+    goto no_flow;
+
+  nat_rewrite( ip_pkt + 16, &client_addr, 4, ip_pkt + 10, proto == IP_PROTO_ICMP ? NULL : l4_csum );
+  nat_rewrite( port_field, &client_port, 2, l4_csum, NULL );
+
+  if ( proto == IP_PROTO_UDP && l4_csum && !nat_load16(l4_csum) )
+    memset( l4_csum, 0xff, 2 );
+
+  return true;
+
+no_flow:
+  pthread_mutex_lock( &nat->mutex );
+  nat->stats.no_flow ++;
+  pthread_mutex_unlock( &nat->mutex );
+  return false;
+
+unsupported:
+  pthread_mutex_lock( &nat->mutex );
+  nat->stats.unsupported ++;
+  pthread_mutex_unlock( &nat->mutex );
+  return false;
+}
+
+/**
+ * @brief vpn_nat_client_release Drop all the flows of the client and return its ports
+ * @param nat
+ * @param client_addr Network byte order
+ */
+void vpn_nat_client_release( vpn_nat_t *nat, uint32_t client_addr )
+{
+  vpn_nat_client_t *client = NULL;
+
+  pthread_mutex_lock( &nat->mutex );
+
+  HASH_FIND_INT( nat->clients, &client_addr, client );
+
+  // Client record goes away with its last flow
+  while ( client ) {
+    vpn_nat_flow_t *flow = client->flows;
+    bool last = ( client->flows_count == 1 );
+
+    nat_wheel_remove( nat, flow );
+    nat_flow_evict( nat, flow );
+
+    if ( last )
+      break;
+  }
+
+  pthread_mutex_unlock( &nat->mutex );
+}
+
+/**
+ * @brief vpn_nat_get_stats
+ * @param nat
+ * @param stats
+ */
+void vpn_nat_get_stats( vpn_nat_t *nat, dap_stream_ch_vpn_nat_stats_t *stats )
+{
+  pthread_mutex_lock( &nat->mutex );
+
+  nat_expire( nat, vpn_clock_sec() );
+
+  *stats = nat->stats;
+  stats->flows = nat->flows_count;
+  stats->flows_max = nat->config.max_flows;
+  stats->clients = nat->clients_count;
+  stats->clients_max = nat->blocks_count;
+
+  pthread_mutex_unlock( &nat->mutex );
+}
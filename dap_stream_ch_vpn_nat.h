@@ -0,0 +1,52 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_NAT_H_
+#define _STREAM_SF_NAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dap_stream_ch_vpn.h"
+
+#define VPN_NAT_PORT_MIN          1024
+#define VPN_NAT_PORT_MAX          65535
+#define VPN_NAT_PORTS_PER_CLIENT  512
+#define VPN_NAT_FLOWS_MAX         65536
+
+// Idle timeouts, seconds (RFC 5382, RFC 4787, RFC 5508)
+#define VPN_NAT_TIMEOUT_TCP          7440
+#define VPN_NAT_TIMEOUT_TCP_CLOSING  10
+#define VPN_NAT_TIMEOUT_UDP          120
+#define VPN_NAT_TIMEOUT_ICMP         60
+
+typedef struct vpn_nat vpn_nat_t;
+
+vpn_nat_t *vpn_nat_new( const dap_stream_ch_vpn_nat_config_t *config );
+void vpn_nat_delete( vpn_nat_t *nat );
+
+bool vpn_nat_out( vpn_nat_t *nat, uint8_t *ip_pkt, size_t ip_pkt_size );
+bool vpn_nat_in( vpn_nat_t *nat, uint8_t *ip_pkt, size_t ip_pkt_size );
+
+void vpn_nat_client_release( vpn_nat_t *nat, uint32_t client_addr );
+void vpn_nat_get_stats( vpn_nat_t *nat, dap_stream_ch_vpn_nat_stats_t *stats );
+
+#endif
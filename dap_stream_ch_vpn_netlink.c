@@ -0,0 +1,380 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_netlink.h"
+
+#define LOG_TAG "stream_ch_vpn_netlink"
+
+#ifndef _WIN32
+
+#define VPN_NETLINK_ATTRS_SIZE 128
+#define VPN_NETLINK_RECV_SIZE  8192
+#define VPN_NETLINK_FLUSH_MAX  64   // Addresses taken down per dump
+
+typedef struct vpn_netlink_req {
+
+  struct nlmsghdr nh;
+
+  union {
+    struct ifinfomsg ifi;
+    struct ifaddrmsg ifa;
+    struct rtmsg     rt;
+  };
+
+  uint8_t attrs[ VPN_NETLINK_ATTRS_SIZE ];
+
+} vpn_netlink_req_t;
+
+static uint32_t vpn_netlink_seq = 0;
+
+static void vpn_netlink_attr_add( struct nlmsghdr *nh, uint16_t type, const void *data, size_t size )
+{
+  struct rtattr *rta = (struct rtattr *)( (uint8_t *)nh + NLMSG_ALIGN(nh->nlmsg_len) );
+
+  rta->rta_type = type;
+  rta->rta_len = (uint16_t)RTA_LENGTH( size );
+  memcpy( RTA_DATA(rta), data, size );
+
+  nh->nlmsg_len = NLMSG_ALIGN( nh->nlmsg_len ) + RTA_ALIGN( rta->rta_len );
+}
+
+static void vpn_netlink_req_init( vpn_netlink_req_t *req, uint16_t type, uint16_t flags, size_t body_size )
+{
+  memset( req, 0, sizeof(*req) );
+
+  req->nh.nlmsg_len = NLMSG_LENGTH( body_size );
+  req->nh.nlmsg_type = type;
+  req->nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  req->nh.nlmsg_seq = __atomic_add_fetch( &vpn_netlink_seq, 1, __ATOMIC_RELAXED );
+}
+
+static int vpn_netlink_open( void )
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+  int fd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+
+  if ( fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ) {
+    log_it( L_ERROR, "Can't open rtnetlink socket: '%s'", strerror(errno) );
+    if ( fd >= 0 )
+      close( fd );
+    return -1;
+  }
+
+  return fd;
+}
+
+static int vpn_netlink_send( int fd, struct nlmsghdr *nh )
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+  if ( sendto(fd, nh, nh->nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0 )
+    return -errno;
+
+  return 0;
+}
+
+/**
+ * @brief vpn_netlink_talk Send the request and wait for its acknowledgement
+ * @param fd
+ * @param nh
+ * @return 0 or negative errno of the kernel
+ */
+static int vpn_netlink_talk( int fd, struct nlmsghdr *nh )
+{
+  uint8_t buf[ VPN_NETLINK_RECV_SIZE ] __attribute__((aligned(NLMSG_ALIGNTO)));
+  int ret = vpn_netlink_send( fd, nh );
+
+  if ( ret )
+    return ret;
+
+  for ( ;; ) {
+    ssize_t len = recv( fd, buf, sizeof(buf), 0 );
+
+    if ( len < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      return -errno;
+    }
+
+    for ( struct nlmsghdr *rh = (struct nlmsghdr *)buf; NLMSG_OK(rh, (size_t)len); rh = NLMSG_NEXT(rh, len) ) {
+      if ( rh->nlmsg_seq != nh->nlmsg_seq )
+        continue;
+      if ( rh->nlmsg_type == NLMSG_ERROR )
+        return ((struct nlmsgerr *)NLMSG_DATA(rh))->error;
+      if ( rh->nlmsg_type == NLMSG_DONE )
+        return 0;
+    }
+  }
+}
+
+static int vpn_netlink_request( struct nlmsghdr *nh, const char *what, const char *ifname )
+{
+  int fd = vpn_netlink_open( );
+  int ret;
+
+  if ( fd < 0 )
+    return -1;
+
+  ret = vpn_netlink_talk( fd, nh );
+  close( fd );
+
+  if ( ret ) {
+    log_it( L_ERROR, "Can't %s of %s: '%s'", what, ifname, strerror(-ret) );
+    return -1;
+  }
+
+  return 0;
+}
+
+static int vpn_netlink_ifindex( const char *ifname )
+{
+  unsigned int index = if_nametoindex( ifname );
+
+  if ( !index )
+    log_it( L_ERROR, "No interface %s: '%s'", ifname, strerror(errno) );
+
+  return (int)index;
+}
+
+/**
+ * @brief vpn_netlink_link_up Bring the interface up, like "ip link set up mtu txqueuelen"
+ * @param ifname
+ * @param mtu 0 keeps the current one
+ * @param txqlen 0 keeps the current one
+ * @return 0 if ok
+ */
+int vpn_netlink_link_up( const char *ifname, uint32_t mtu, uint32_t txqlen )
+{
+  vpn_netlink_req_t req;
+  int index = vpn_netlink_ifindex( ifname );
+
+  if ( !index )
+    return -1;
+
+  vpn_netlink_req_init( &req, RTM_NEWLINK, 0, sizeof(req.ifi) );
+
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = index;
+  req.ifi.ifi_flags = IFF_UP;
+  req.ifi.ifi_change = IFF_UP;
+
+  if ( mtu )
+    vpn_netlink_attr_add( &req.nh, IFLA_MTU, &mtu, sizeof(mtu) );
+  if ( txqlen )
+    vpn_netlink_attr_add( &req.nh, IFLA_TXQLEN, &txqlen, sizeof(txqlen) );
+
+  return vpn_netlink_request( &req.nh, "bring up the link", ifname );
+}
+
+/**
+ * @brief vpn_netlink_addr_add Put IPv4 address on the interface, like "ip addr replace"
+ * @param ifname
+ * @param addr
+ * @param prefix_len
+ * @param peer Other end of the point to point link, 0 if none
+ * @return 0 if ok
+ */
+int vpn_netlink_addr_add( const char *ifname, uint32_t addr, uint8_t prefix_len, uint32_t peer )
+{
+  vpn_netlink_req_t req;
+  int index = vpn_netlink_ifindex( ifname );
+
+  if ( !index )
+    return -1;
+
+  vpn_netlink_req_init( &req, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, sizeof(req.ifa) );
+
+  req.ifa.ifa_family = AF_INET;
+  req.ifa.ifa_prefixlen = peer ? 32 : prefix_len;
+  req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+  req.ifa.ifa_index = (uint32_t)index;
+
+  vpn_netlink_attr_add( &req.nh, IFA_LOCAL, &addr, sizeof(addr) );
+  vpn_netlink_attr_add( &req.nh, IFA_ADDRESS, peer ? &peer : &addr, sizeof(addr) );
+
+  return vpn_netlink_request( &req.nh, "add the address", ifname );
+}
+
+/**
+ * @brief vpn_netlink_addr_flush Remove IPv4 addresses of the interface, like "ip addr flush"
+ * @param ifname
+ * @return 0 if ok
+ */
+int vpn_netlink_addr_flush( const char *ifname )
+{
+  uint8_t buf[ VPN_NETLINK_RECV_SIZE ] __attribute__((aligned(NLMSG_ALIGNTO)));
+  struct { uint32_t local, address; uint8_t prefix_len; } addrs[ VPN_NETLINK_FLUSH_MAX ];
+  size_t addrs_count = 0;
+  vpn_netlink_req_t req;
+  bool done = false;
+  int fd, ret = 0;
+  int index = vpn_netlink_ifindex( ifname );
+
+  if ( !index || (fd = vpn_netlink_open()) < 0 )
+    return -1;
+
+  // Dump is not filtered by the kernel, interface is matched here
+  vpn_netlink_req_init( &req, RTM_GETADDR, NLM_F_DUMP, sizeof(req.ifa) );
+  req.nh.nlmsg_flags &= ~NLM_F_ACK;
+  req.ifa.ifa_family = AF_INET;
+
+  if ( (ret = vpn_netlink_send(fd, &req.nh)) )
+    done = true;
+
+  while ( !done ) {
+    ssize_t len = recv( fd, buf, sizeof(buf), 0 );
+
+    if ( len < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      ret = -errno;
+      break;
+    }
+
+    for ( struct nlmsghdr *rh = (struct nlmsghdr *)buf; NLMSG_OK(rh, (size_t)len); rh = NLMSG_NEXT(rh, len) ) {
+
+      if ( rh->nlmsg_seq != req.nh.nlmsg_seq )
+        continue;
+
+      if ( rh->nlmsg_type == NLMSG_DONE || rh->nlmsg_type == NLMSG_ERROR ) {
+        if ( rh->nlmsg_type == NLMSG_ERROR )
+          ret = ((struct nlmsgerr *)NLMSG_DATA(rh))->error;
+        done = true;
+        break;
+      }
+
+      struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA( rh );
+      int attrs_len = (int)IFA_PAYLOAD( rh );
+
+      if ( rh->nlmsg_type != RTM_NEWADDR || ifa->ifa_index != (uint32_t)index || addrs_count == VPN_NETLINK_FLUSH_MAX )
+        continue;
+
+      addrs[addrs_count].local = addrs[addrs_count].address = 0;
+      addrs[addrs_count].prefix_len = ifa->ifa_prefixlen;
+
+      for ( struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, attrs_len); rta = RTA_NEXT(rta, attrs_len) ) {
+        if ( rta->rta_type == IFA_LOCAL )
+          memcpy( &addrs[addrs_count].local, RTA_DATA(rta), sizeof(uint32_t) );
+        else if ( rta->rta_type == IFA_ADDRESS )
+          memcpy( &addrs[addrs_count].address, RTA_DATA(rta), sizeof(uint32_t) );
+      }
+
+      addrs_count ++;
+    }
+  }
+
+  for ( size_t i = 0; !ret && i < addrs_count; i ++ ) {
+
+    vpn_netlink_req_init( &req, RTM_DELADDR, 0, sizeof(req.ifa) );
+
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_prefixlen = addrs[i].prefix_len;
+    req.ifa.ifa_index = (uint32_t)index;
+
+    vpn_netlink_attr_add( &req.nh, IFA_LOCAL, &addrs[i].local, sizeof(uint32_t) );
+    vpn_netlink_attr_add( &req.nh, IFA_ADDRESS, &addrs[i].address, sizeof(uint32_t) );
+
+    ret = vpn_netlink_talk( fd, &req.nh );
+  }
+
+  close( fd );
+
+  if ( ret ) {
+    log_it( L_ERROR, "Can't flush the addresses of %s: '%s'", ifname, strerror(-ret) );
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief vpn_netlink_route_add Route to the network through the interface, like "ip route replace dev"
+ * @param ifname
+ * @param dst
+ * @param prefix_len
+ * @return 0 if ok
+ */
+int vpn_netlink_route_add( const char *ifname, uint32_t dst, uint8_t prefix_len )
+{
+  vpn_netlink_req_t req;
+  int index = vpn_netlink_ifindex( ifname );
+
+  if ( !index )
+    return -1;
+
+  vpn_netlink_req_init( &req, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(req.rt) );
+
+  req.rt.rtm_family = AF_INET;
+  req.rt.rtm_dst_len = prefix_len;
+  req.rt.rtm_table = RT_TABLE_MAIN;
+  req.rt.rtm_protocol = RTPROT_BOOT;
+  req.rt.rtm_scope = RT_SCOPE_LINK;
+  req.rt.rtm_type = RTN_UNICAST;
+
+  vpn_netlink_attr_add( &req.nh, RTA_DST, &dst, sizeof(dst) );
+  vpn_netlink_attr_add( &req.nh, RTA_OIF, &index, sizeof(index) );
+
+  return vpn_netlink_request( &req.nh, "add the route", ifname );
+}
+
+#else
+
+// Kernel interface of TAP-Windows is configured by the driver, no ifname is reported for it
+
+int vpn_netlink_link_up( const char *ifname, uint32_t mtu, uint32_t txqlen )
+{
+  return -1;
+}
+
+int vpn_netlink_addr_add( const char *ifname, uint32_t addr, uint8_t prefix_len, uint32_t peer )
+{
+  return -1;
+}
+
+int vpn_netlink_addr_flush( const char *ifname )
+{
+  return -1;
+}
+
+int vpn_netlink_route_add( const char *ifname, uint32_t dst, uint8_t prefix_len )
+{
+  return -1;
+}
+
+#endif
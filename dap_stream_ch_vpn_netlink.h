@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_NETLINK_H_
+#define _STREAM_SF_NETLINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Interface configuration over rtnetlink, instead of running ip(8). Addresses are network byte order,
+// every call returns 0 if ok or -1 with the kernel's error logged
+
+// Bring the interface up, mtu and txqlen are set if not zero
+int vpn_netlink_link_up( const char *ifname, uint32_t mtu, uint32_t txqlen );
+
+// IPv4 address of the interface, peer makes it point to point, 0 for a subnet of prefix_len
+int vpn_netlink_addr_add( const char *ifname, uint32_t addr, uint8_t prefix_len, uint32_t peer );
+
+// Drop all IPv4 addresses of the interface
+int vpn_netlink_addr_flush( const char *ifname );
+
+// Route to dst/prefix_len through the interface, replaced if there is one
+int vpn_netlink_route_add( const char *ifname, uint32_t dst, uint8_t prefix_len );
+
+static inline uint8_t vpn_netlink_prefix_len( uint32_t mask )
+{
+  return (uint8_t)__builtin_popcount( mask );
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dap_stream_ch_vpn_shaper.h"
+
+// Burst when it's not set explicitly: 50 ms of traffic, but not less than few full size packets
+#define VPN_TBF_BURST_MS   50
+#define VPN_TBF_BURST_MIN  ( 16 * 1024 )
+
+/**
+ * @brief vpn_tbf_set Change the bucket's rate
+ * @param tbf
+ * @param rate_bps Bits per second, 0 is unlimited
+ * @param burst_bytes Bucket depth, 0 for default one
+ */
+void vpn_tbf_set( vpn_tbf_t *tbf, uint64_t rate_bps, uint64_t burst_bytes )
+{
+  uint64_t rate = rate_bps / 8;
+
+  // Below a byte per second is still a limit, 0 would lift it
+  if ( rate_bps && !rate )
+    rate = 1;
+
+  if ( !burst_bytes ) {
+    burst_bytes = rate * VPN_TBF_BURST_MS / 1000;
+    if ( burst_bytes < VPN_TBF_BURST_MIN )
+      burst_bytes = VPN_TBF_BURST_MIN;
+  }
+
+  atomic_store_explicit( &tbf->burst, burst_bytes, memory_order_relaxed );
+  atomic_store_explicit( &tbf->rate, rate, memory_order_relaxed );
+}
@@ -0,0 +1,109 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_SHAPER_H_
+#define _STREAM_SF_SHAPER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/**
+  * @struct vpn_tbf
+  * @brief Token bucket of one traffic direction. Tokens are spent only by the owner thread,
+  *        rate and burst may be changed from any thread
+  *
+  **/
+typedef struct vpn_tbf {
+
+  atomic_uint_fast64_t rate;  // Bytes per second, 0 is unlimited
+  atomic_uint_fast64_t burst; // Bucket depth, bytes
+
+  int64_t tokens;             // Goes below zero by the size of the last packet, it's paid back before the next one
+  uint64_t last_ns;
+
+} vpn_tbf_t;
+
+void vpn_tbf_set( vpn_tbf_t *tbf, uint64_t rate_bps, uint64_t burst_bytes );
+
+/**
+ * @brief vpn_tbf_consume Spend tokens for the packet
+ * @param tbf
+ * @param now Monotonic nanoseconds
+ * @param bytes
+ * @return False if the packet must wait, nothing is spent then
+ */
+static inline bool vpn_tbf_consume( vpn_tbf_t *tbf, uint64_t now, size_t bytes )
+{
+  uint64_t rate = atomic_load_explicit( &tbf->rate, memory_order_relaxed );
+
+  if ( !rate )
+    return true;
+
+  if ( tbf->tokens <= 0 ) {
+
+    uint64_t burst = atomic_load_explicit( &tbf->burst, memory_order_relaxed );
+    uint64_t elapsed = now - tbf->last_ns;
+
+    if ( elapsed > 1000000000ull )
+      elapsed = 1000000000ull;
+
+    tbf->tokens += (int64_t)( elapsed * rate / 1000000000ull );
+    if ( tbf->tokens > (int64_t)burst )
+      tbf->tokens = (int64_t)burst;
+    tbf->last_ns = now;
+
+    if ( tbf->tokens <= 0 )
+      return false;
+  }
+
+  tbf->tokens -= (int64_t)bytes;
+
+  return true;
+}
+
+/**
+ * @brief vpn_tbf_refund Give back tokens of the packet that wasn't sent after vpn_tbf_consume()
+ * @param tbf
+ * @param bytes
+ */
+static inline void vpn_tbf_refund( vpn_tbf_t *tbf, size_t bytes )
+{
+  if ( atomic_load_explicit(&tbf->rate, memory_order_relaxed) )
+    tbf->tokens += (int64_t)bytes;
+}
+
+/**
+ * @brief vpn_tbf_wait_ns Time till the bucket lets the next packet go
+ * @param tbf
+ * @return Nanoseconds
+ */
+static inline uint64_t vpn_tbf_wait_ns( vpn_tbf_t *tbf )
+{
+  uint64_t rate = atomic_load_explicit( &tbf->rate, memory_order_relaxed );
+
+  if ( !rate || tbf->tokens > 0 )
+    return 0;
+
+  return ( (uint64_t)(-tbf->tokens) + 1 ) * 1000000000ull / rate + 1;
+}
+
+#endif
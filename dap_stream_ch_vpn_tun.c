@@ -0,0 +1,651 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#else
+#include <winsock2.h>
+#include <windows.h>
+#include <pthread.h>
+#endif
+
+#include "dap_common.h"
+
+#include "dap_stream_ch_vpn_tun.h"
+
+#define LOG_TAG "stream_ch_vpn_tun"
+
+#ifndef _WIN32
+
+/**
+ * @brief tun_kernel_open Create /dev/net/tun interface. Addressing is up to the caller, it gets the interface name
+ * @param tun
+ * @param addr
+ * @param mask
+ * @return 0 if ok
+ */
+static int tun_kernel_open( vpn_tun_t *tun, const char *addr, const char *mask )
+{
+  struct ifreq ifr;
+  int fd, sock;
+
+  (void)addr;
+  (void)mask;
+
+  if ( (fd = open("/dev/net/tun", O_RDWR)) < 0 ) {
+    log_it( L_ERROR, "Opening /dev/net/tun error: '%s'", strerror(errno) );
+    return -1;
+  }
+
+  memset( &ifr, 0, sizeof(ifr) );
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+
+  if ( ioctl(fd, TUNSETIFF, (void *)&ifr) < 0 ) {
+    log_it( L_CRITICAL, "ioctl(TUNSETIFF) error: '%s' ", strerror(errno) );
+    close( fd );
+    return -1;
+  }
+
+  // Raw thread drains the device till EAGAIN on every wakeup
+  if ( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ) {
+    log_it( L_CRITICAL, "Can't switch tun/tap descriptor into the non-block mode: '%s'", strerror(errno) );
+    close( fd );
+    return -1;
+  }
+
+  tun->fd = fd;
+  dap_snprintf( tun->ifname, sizeof(tun->ifname), "%s", ifr.ifr_name );
+
+  if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) >= 0 ) {
+    if ( !ioctl(sock, SIOCGIFMTU, &ifr) && ifr.ifr_mtu > 0 )
+      tun->mtu = (uint32_t)ifr.ifr_mtu;
+    close( sock );
+  }
+
+  return 0;
+}
+
+static void tun_kernel_close( vpn_tun_t *tun )
+{
+  close( (int)tun->fd );
+  tun->fd = -1;
+}
+
+static int tun_kernel_read_batch( vpn_tun_t *tun, vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  uint32_t n;
+
+  for ( n = 0; n < count; n ++ ) {
+
+    ssize_t ret = read( (int)tun->fd, pkts[n].data, pkts[n].size );
+
+    if ( ret < 0 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        break;
+      return n ? (int)n : -1;
+    }
+
+    pkts[n].size = (uint32_t)ret;
+  }
+
+  return (int)n;
+}
+
+static int tun_kernel_write_batch( vpn_tun_t *tun, const vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  uint32_t n;
+
+  for ( n = 0; n < count; n ++ ) {
+    if ( write((int)tun->fd, pkts[n].data, pkts[n].size) < 0 )
+      return n ? (int)n : -1;
+  }
+
+  return (int)n;
+}
+
+static intptr_t tun_kernel_wakeup( vpn_tun_t *tun )
+{
+  return tun->fd;
+}
+
+#else
+
+#define _TAP_IOCTL(nr) CTL_CODE(FILE_DEVICE_UNKNOWN, nr, METHOD_BUFFERED, \
+      FILE_ANY_ACCESS)
+
+#define TAP_IOCTL_GET_MAC               _TAP_IOCTL(1)
+#define TAP_IOCTL_GET_VERSION           _TAP_IOCTL(2)
+#define TAP_IOCTL_GET_MTU               _TAP_IOCTL(3)
+#define TAP_IOCTL_GET_INFO              _TAP_IOCTL(4)
+#define TAP_IOCTL_CONFIG_POINT_TO_POINT _TAP_IOCTL(5)
+#define TAP_IOCTL_SET_MEDIA_STATUS      _TAP_IOCTL(6)
+#define TAP_IOCTL_CONFIG_DHCP_MASQ      _TAP_IOCTL(7)
+#define TAP_IOCTL_GET_LOG_LINE          _TAP_IOCTL(8)
+#define TAP_IOCTL_CONFIG_DHCP_SET_OPT   _TAP_IOCTL(9)
+#define TAP_IOCTL_CONFIG_TUN            _TAP_IOCTL(10)
+
+#define TAP_COMPONENT_ID "tap0901"
+
+#define DEVTEMPLATE "\\\\.\\Global\\%s.tap"
+
+#define NETDEV_GUID "{4D36E972-E325-11CE-BFC1-08002BE10318}"
+#define CONTROL_KEY "SYSTEM\\CurrentControlSet\\Control\\"
+
+#define ADAPTERS_KEY CONTROL_KEY "Class\\" NETDEV_GUID
+#define CONNECTIONS_KEY CONTROL_KEY "Network\\" NETDEV_GUID
+
+typedef intptr_t (tap_callback)( char *idxname, char *name, void *arg );
+
+typedef struct vpn_tun_tap {
+
+  vpn_tun_t *tun;
+  const char *addr;
+
+  OVERLAPPED read_overlap, write_overlap;
+  bool read_pending;
+  pthread_mutex_t write_mutex; // Clients' writers share the overlapped structure
+
+  uint8_t read_buf[ VPN_TUN_PKT_MAX ]; // Overlapped read lands here after read_batch() returned
+
+} vpn_tun_tap_t;
+
+static intptr_t SearchTapsWIN32( tap_callback *cb, void *arg, int all )
+{
+  LONG status;
+  HKEY adapters_key, hkey;
+  DWORD len, type;
+  char buf[40];
+//  wchar_t name[40];
+  char name[128];
+  char keyname[strlen(CONNECTIONS_KEY) + sizeof(buf) + 1 + strlen("\\Connection")];
+  int i = 0, found = 0;
+  intptr_t ret = -1;
+
+  status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, ADAPTERS_KEY, 0,
+             KEY_READ, &adapters_key );
+
+  if ( status ) {
+    log_it( L_ERROR,"Error accessing registry key for network adapters" );
+    return -1;
+  }
+
+  while ( 1 ) {
+
+    len = sizeof( buf );
+    status = RegEnumKeyExA( adapters_key, i++, buf, &len, NULL, NULL, NULL, NULL );
+    if ( status ) {
+      if ( status != ERROR_NO_MORE_ITEMS )
+        ret = -1;
+      break;
+    }
+
+    dap_snprintf( keyname, sizeof(keyname), "%s\\%s", ADAPTERS_KEY, buf );
+
+    status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hkey );
+    if ( status )
+      continue;
+
+    len = sizeof( buf) ;
+    status = RegQueryValueExA( hkey, "ComponentId", NULL, &type, (unsigned char *)buf, &len );
+    if ( status || type != REG_SZ || strcmp(buf, TAP_COMPONENT_ID) ) {
+      RegCloseKey( hkey );
+      continue;
+    }
+
+    len = sizeof( buf );
+    status = RegQueryValueExA( hkey, "NetCfgInstanceId", NULL, &type, (unsigned char *)buf, &len );
+    RegCloseKey( hkey );
+    if ( status || type != REG_SZ )
+      continue;
+
+    dap_snprintf( keyname, sizeof(keyname), "%s\\%s\\Connection", CONNECTIONS_KEY, buf );
+
+    status = RegOpenKeyExA( HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hkey );
+    if ( status )
+      continue;
+
+    len = sizeof( name );
+    status = RegQueryValueExW( hkey, L"Name", NULL, &type, (unsigned char *)name, &len );
+    RegCloseKey( hkey );
+    if ( status || type != REG_SZ )
+      continue;
+
+    ++ found;
+
+    ret = cb( buf, name, arg );
+
+    if ( !all )
+      break;
+  }
+
+  RegCloseKey( adapters_key );
+
+  if ( !found ) {
+    log_it( L_ERROR,"Not found Windows-TAP adapters. Is the driver installed?" );
+  }
+
+  return ret;
+}
+
+static intptr_t tun_create_WIN32( char *guid, char *name, void *arg )
+{
+  vpn_tun_tap_t *tap = (vpn_tun_tap_t *)arg;
+  char devname[80];
+  HANDLE tun_fd;
+  ULONG data[3];
+  uint8_t cdata[64];
+  DWORD len;
+
+  (void)name;
+
+  dap_snprintf( devname, sizeof(devname), DEVTEMPLATE, guid );
+
+  tun_fd = CreateFileA( devname, GENERIC_WRITE | GENERIC_READ, 0, 0,
+           OPEN_EXISTING, FILE_ATTRIBUTE_SYSTEM | FILE_FLAG_OVERLAPPED, 0 );
+
+  if (tun_fd == INVALID_HANDLE_VALUE) {
+    log_it( L_ERROR,"Failed to open %s", devname );
+    return -1;
+  }
+
+  log_it( L_INFO,"opened tun device %s", devname);
+
+  if ( !DeviceIoControl(tun_fd, TAP_IOCTL_GET_VERSION,
+           data, sizeof(&data), data, sizeof(data), &len, NULL)) {
+
+    log_it( L_ERROR,"Failed to obtain TAP driver version" );
+    CloseHandle( tun_fd );
+    return -1;
+  }
+  if ( data[0] < 9 || (data[0] == 9 && data[1] < 9) ) {
+    log_it( L_ERROR,"TAP-Windows driver v9.9 or greater is required (found %ld.%ld)", data[0], data[1] );
+    CloseHandle( tun_fd );
+    return -1;
+  }
+
+  log_it( L_INFO,"TAP Windows driver v%ld.%ld (%ld)", data[0], data[1], data[2] );
+
+  uint32_t  MTU;
+  if ( !DeviceIoControl(tun_fd, TAP_IOCTL_GET_MTU,
+           &MTU, sizeof(MTU), &MTU, sizeof(MTU), &len, NULL)) {
+
+    log_it( L_WARNING,"Failed to obtain TAP MTU" );
+  }
+  else
+    tap->tun->mtu = MTU;
+
+  log_it( L_INFO,"TAP-Windows MTU = %u ", tap->tun->mtu );
+
+  if ( !DeviceIoControl( tun_fd, TAP_IOCTL_GET_MAC,
+           cdata, sizeof(cdata), cdata, sizeof(cdata), &len, NULL) ) {
+
+    log_it( L_ERROR, "Failed to get MAC" );
+    CloseHandle( tun_fd );
+    return -1;
+  }
+
+  log_it( L_INFO,"TAP MAC addr %X-%X-%X-%X-%X-%X ", cdata[0], cdata[1], cdata[2], cdata[3], cdata[4], cdata[5] );
+
+  log_it( L_INFO, "l_vpn_addr = %s", tap->addr );
+
+  data[0] = inet_addr( tap->addr );
+  data[1] = 0;
+  data[2] = 0;
+
+  if ( !DeviceIoControl( tun_fd, TAP_IOCTL_CONFIG_TUN,
+           data, sizeof(data), data, sizeof(data), &len, NULL) ) {
+
+    log_it( L_ERROR, "Failed to set TAP IP addresses" );
+    CloseHandle( tun_fd );
+    return -1;
+  }
+
+  {
+  ULONG data;
+  DWORD len;
+
+  for ( data = 0; data <= 1; data ++ ) {
+    if ( !DeviceIoControl((HANDLE)tun_fd, TAP_IOCTL_SET_MEDIA_STATUS,
+          &data, sizeof(data), &data, sizeof(data), &len, NULL) ) {
+      log_it( L_ERROR, "Failed to set TAP media status" );
+      CloseHandle( tun_fd );
+      return -1;
+    }
+  }
+  }
+
+  return (intptr_t)tun_fd;
+}
+
+static int tun_kernel_open( vpn_tun_t *tun, const char *addr, const char *mask )
+{
+  vpn_tun_tap_t *tap = calloc( 1, sizeof(vpn_tun_tap_t) );
+
+  (void)mask;
+
+  if ( !tap )
+    return -1;
+
+  tap->tun = tun;
+  tap->addr = addr;
+
+  intptr_t fd = SearchTapsWIN32( tun_create_WIN32, tap, 0 );
+
+  if ( fd == -1 ) {
+    free( tap );
+    return -1;
+  }
+
+  tap->read_overlap.hEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+  pthread_mutex_init( &tap->write_mutex, NULL );
+
+  tun->fd = fd;
+  tun->priv = tap;
+
+  // First read_batch() starts the overlapped read
+  SetEvent( tap->read_overlap.hEvent );
+
+  return 0;
+}
+
+static void tun_kernel_close( vpn_tun_t *tun )
+{
+  vpn_tun_tap_t *tap = (vpn_tun_tap_t *)tun->priv;
+
+  CloseHandle( (HANDLE)tun->fd );
+  tun->fd = -1;
+
+  CloseHandle( tap->read_overlap.hEvent );
+  pthread_mutex_destroy( &tap->write_mutex );
+
+  free( tap );
+  tun->priv = NULL;
+}
+
+static int tun_kernel_read_batch( vpn_tun_t *tun, vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  vpn_tun_tap_t *tap = (vpn_tun_tap_t *)tun->priv;
+  uint32_t n = 0;
+  DWORD pkt_size;
+
+  while ( n < count ) {
+
+    if ( !tap->read_pending ) {
+
+      if ( !ReadFile((HANDLE)tun->fd, tap->read_buf, sizeof(tap->read_buf), &pkt_size, &tap->read_overlap) ) {
+
+        DWORD err = GetLastError( );
+
+        if ( err == ERROR_IO_PENDING ) {
+          tap->read_pending = true;
+          break;
+        }
+
+        if ( err == ERROR_OPERATION_ABORTED )
+          log_it( L_ERROR, "TAP device not active. Disconnecting." );
+        else
+          log_it( L_ERROR, "TAP device: read failed" );
+
+        return n ? (int)n : -1;
+      }
+    }
+    else if ( !GetOverlappedResult((HANDLE)tun->fd, &tap->read_overlap, &pkt_size, FALSE) ) {
+
+      if ( GetLastError() == ERROR_IO_INCOMPLETE )
+        break;
+
+      tap->read_pending = false;
+      log_it( L_ERROR, "TAP device: complete read failed" );
+      continue;
+    }
+    else
+      tap->read_pending = false;
+
+    if ( pkt_size > pkts[n].size )
+      pkt_size = pkts[n].size;
+
+    memcpy( pkts[n].data, tap->read_buf, pkt_size );
+    pkts[n ++].size = pkt_size;
+  }
+
+  // No read is in flight to signal the rest, wake the next wait by hand
+  if ( !tap->read_pending )
+    SetEvent( tap->read_overlap.hEvent );
+
+  return (int)n;
+}
+
+static int tun_tap_write( vpn_tun_t *tun, vpn_tun_tap_t *tap, const uint8_t *buffer, uint32_t size )
+{
+  DWORD pkt_size = 0;
+
+  if ( WriteFile((HANDLE)tun->fd, buffer, size, &pkt_size, &tap->write_overlap) )
+    return pkt_size;
+
+  if ( GetLastError() == ERROR_IO_PENDING &&
+       GetOverlappedResult((HANDLE)tun->fd, &tap->write_overlap, &pkt_size, TRUE) )
+    return pkt_size;
+
+  log_it( L_ERROR, "TAP device: Failed to write" );
+
+  return -1;
+}
+
+static int tun_kernel_write_batch( vpn_tun_t *tun, const vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  vpn_tun_tap_t *tap = (vpn_tun_tap_t *)tun->priv;
+  uint32_t n;
+
+  pthread_mutex_lock( &tap->write_mutex );
+
+  for ( n = 0; n < count; n ++ ) {
+    if ( tun_tap_write(tun, tap, pkts[n].data, pkts[n].size) < 0 )
+      break;
+  }
+
+  pthread_mutex_unlock( &tap->write_mutex );
+
+  return n ? (int)n : ( count ? -1 : 0 );
+}
+
+static intptr_t tun_kernel_wakeup( vpn_tun_t *tun )
+{
+  return (intptr_t)((vpn_tun_tap_t *)tun->priv)->read_overlap.hEvent;
+}
+
+#endif
+
+const vpn_tun_ops_t vpn_tun_kernel_ops = {
+
+  .name        = "kernel",
+  .open        = tun_kernel_open,
+  .close       = tun_kernel_close,
+  .read_batch  = tun_kernel_read_batch,
+  .write_batch = tun_kernel_write_batch,
+  .wakeup      = tun_kernel_wakeup
+};
+
+#ifndef _WIN32
+
+#define VPN_TUN_LOOPBACK_SOCKBUF  ( 4 * 1024 * 1024 )
+
+typedef struct vpn_tun_loopback {
+
+  int peer_fd;
+
+} vpn_tun_loopback_t;
+
+static int tun_loopback_open( vpn_tun_t *tun, const char *addr, const char *mask )
+{
+  vpn_tun_loopback_t *lo;
+  int sv[2], sockbuf = VPN_TUN_LOOPBACK_SOCKBUF;
+
+  (void)addr;
+  (void)mask;
+
+  if ( !(lo = calloc(1, sizeof(vpn_tun_loopback_t))) )
+    return -1;
+
+  // Datagram boundaries are packet boundaries
+  if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0 ) {
+    log_it( L_ERROR, "Loopback tun socketpair() error: '%s'", strerror(errno) );
+    free( lo );
+    return -1;
+  }
+
+  for ( int i = 0; i < 2; i ++ ) {
+    setsockopt( sv[i], SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf) );
+    setsockopt( sv[i], SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf) );
+  }
+
+  lo->peer_fd = sv[1];
+
+  tun->fd = sv[0];
+  tun->priv = lo;
+
+  log_it( L_NOTICE, "Loopback tun is up, peer descriptor %d", lo->peer_fd );
+
+  return 0;
+}
+
+static void tun_loopback_close( vpn_tun_t *tun )
+{
+  vpn_tun_loopback_t *lo = (vpn_tun_loopback_t *)tun->priv;
+
+  close( (int)tun->fd );
+  close( lo->peer_fd );
+  tun->fd = -1;
+
+  free( lo );
+  tun->priv = NULL;
+}
+
+static int tun_loopback_read_batch( vpn_tun_t *tun, vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  struct mmsghdr msgs[ VPN_TUN_BATCH ];
+  struct iovec iov[ VPN_TUN_BATCH ];
+
+  if ( count > VPN_TUN_BATCH )
+    count = VPN_TUN_BATCH;
+
+  memset( msgs, 0, count * sizeof(struct mmsghdr) );
+
+  for ( uint32_t i = 0; i < count; i ++ ) {
+    iov[i].iov_base = pkts[i].data;
+    iov[i].iov_len = pkts[i].size;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int ret = recvmmsg( (int)tun->fd, msgs, count, MSG_DONTWAIT, NULL );
+
+  if ( ret < 0 )
+    return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+
+  // Peer end is closed
+  if ( !ret || (ret == 1 && !msgs[0].msg_len) )
+    return -1;
+
+  for ( int i = 0; i < ret; i ++ )
+    pkts[i].size = msgs[i].msg_len;
+
+  return ret;
+}
+
+static int tun_loopback_write_batch( vpn_tun_t *tun, const vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  struct mmsghdr msgs[ VPN_TUN_BATCH ];
+  struct iovec iov[ VPN_TUN_BATCH ];
+  uint32_t sent = 0;
+
+  while ( sent < count ) {
+
+    uint32_t n = count - sent < VPN_TUN_BATCH ? count - sent : VPN_TUN_BATCH;
+
+    memset( msgs, 0, n * sizeof(struct mmsghdr) );
+
+    for ( uint32_t i = 0; i < n; i ++ ) {
+      iov[i].iov_base = pkts[sent + i].data;
+      iov[i].iov_len = pkts[sent + i].size;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Like the real device, drop rather than stall the client when the peer doesn't read
+    int ret = sendmmsg( (int)tun->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+    if ( ret <= 0 )
+      break;
+
+    sent += (uint32_t)ret;
+
+    if ( (uint32_t)ret < n )
+      break;
+  }
+
+  return sent ? (int)sent : ( count ? -1 : 0 );
+}
+
+static intptr_t tun_loopback_wakeup( vpn_tun_t *tun )
+{
+  return tun->fd;
+}
+
+/**
+ * @brief vpn_tun_loopback_peer The network's end of the loopback tun
+ * @param tun
+ * @return Descriptor or -1 if the tun is not open
+ */
+int vpn_tun_loopback_peer( vpn_tun_t *tun )
+{
+  if ( tun->ops != &vpn_tun_loopback_ops || !tun->priv )
+    return -1;
+
+  return ((vpn_tun_loopback_t *)tun->priv)->peer_fd;
+}
+
+const vpn_tun_ops_t vpn_tun_loopback_ops = {
+
+  .name        = "loopback",
+  .open        = tun_loopback_open,
+  .close       = tun_loopback_close,
+  .read_batch  = tun_loopback_read_batch,
+  .write_batch = tun_loopback_write_batch,
+  .wakeup      = tun_loopback_wakeup
+};
+
+#endif
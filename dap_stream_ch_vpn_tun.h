@@ -0,0 +1,135 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_TUN_H_
+#define _STREAM_SF_TUN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VPN_TUN_PKT_MAX      65535 // Read buffers hold any IP packet, whatever MTU is set on the interface later
+#define VPN_TUN_BATCH        32    // Packets taken from the device per wakeup
+#define VPN_TUN_MTU_DEFAULT  1500
+
+typedef struct vpn_tun vpn_tun_t;
+
+typedef struct vpn_tun_pkt {
+
+  uint8_t *data;
+  uint32_t size; // Buffer capacity on read, packet length after it
+
+} vpn_tun_pkt_t;
+
+/**
+  * @struct vpn_tun_ops
+  * @brief Backend of the tun/tap device. Reads are done by the raw thread only, writes come from any thread
+  *
+  **/
+typedef struct vpn_tun_ops {
+
+  const char *name;
+
+  // Bring the device up, addr and mask are the VPN network. 0 if ok
+  int  (*open)( vpn_tun_t *tun, const char *addr, const char *mask );
+  void (*close)( vpn_tun_t *tun );
+
+  // Never block. Packets read, 0 if there is nothing, -1 if the device is gone
+  int  (*read_batch)( vpn_tun_t *tun, vpn_tun_pkt_t *pkts, uint32_t count );
+
+  // Packets written, the rest are lost. -1 if the first one failed
+  int  (*write_batch)( vpn_tun_t *tun, const vpn_tun_pkt_t *pkts, uint32_t count );
+
+  // Descriptor (event handle on Windows) signalled when read_batch() has packets
+  intptr_t (*wakeup)( vpn_tun_t *tun );
+
+} vpn_tun_ops_t;
+
+struct vpn_tun {
+
+  const vpn_tun_ops_t *ops;
+
+  intptr_t fd;        // Device descriptor or handle, -1 if closed
+  char ifname[ 64 ];  // Kernel interface the caller has to configure, empty if there is none
+  uint32_t mtu;
+
+  void *priv;         // Backend's own state
+};
+
+extern const vpn_tun_ops_t vpn_tun_kernel_ops;
+
+#ifndef _WIN32
+// Socket pair inside the process. The peer end plays the network: what's written into it is read
+// from the tun, what clients send comes out of it. No privileges needed
+extern const vpn_tun_ops_t vpn_tun_loopback_ops;
+
+int vpn_tun_loopback_peer( vpn_tun_t *tun );
+#endif
+
+static inline void vpn_tun_init( vpn_tun_t *tun, const vpn_tun_ops_t *ops )
+{
+  tun->ops = ops;
+  tun->fd = -1;
+  tun->ifname[0] = 0;
+  tun->mtu = VPN_TUN_MTU_DEFAULT;
+  tun->priv = NULL;
+}
+
+static inline int vpn_tun_open( vpn_tun_t *tun, const char *addr, const char *mask )
+{
+  return tun->ops->open( tun, addr, mask );
+}
+
+static inline void vpn_tun_close( vpn_tun_t *tun )
+{
+  if ( tun->fd != -1 )
+    tun->ops->close( tun );
+}
+
+static inline int vpn_tun_read_batch( vpn_tun_t *tun, vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  return tun->ops->read_batch( tun, pkts, count );
+}
+
+static inline int vpn_tun_write_batch( vpn_tun_t *tun, const vpn_tun_pkt_t *pkts, uint32_t count )
+{
+  return tun->ops->write_batch( tun, pkts, count );
+}
+
+/**
+ * @brief vpn_tun_write Write the single packet
+ * @param tun
+ * @param data
+ * @param size
+ * @return Bytes written or -1
+ */
+static inline int vpn_tun_write( vpn_tun_t *tun, const uint8_t *data, uint32_t size )
+{
+  vpn_tun_pkt_t pkt = { .data = (uint8_t *)data, .size = size };
+
+  return tun->ops->write_batch( tun, &pkt, 1 ) == 1 ? (int)size : -1;
+}
+
+static inline intptr_t vpn_tun_wakeup( vpn_tun_t *tun )
+{
+  return tun->ops->wakeup( tun );
+}
+
+#endif
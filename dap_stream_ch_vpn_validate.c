@@ -0,0 +1,70 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "dap_stream_ch_vpn_validate.h"
+
+#define IPV4_HDR_MIN  20
+
+/**
+ * @brief vpn_ip_validate_batch Check IPv4 headers of client's packets before they leave the channel.
+ *        Every packet is checked for all the reasons at once, the first failed one in the enum order wins
+ * @param pkts
+ * @param sizes Bytes of every packet as they came in the channel
+ * @param count
+ * @param leased_addr Client's address, network byte order, source of the every packet must match it
+ * @param verdicts DAP_STREAM_CH_VPN_REJECT_NONE or the reason, one per packet
+ * @return Number of valid packets
+ */
+size_t vpn_ip_validate_batch( const uint8_t *const *pkts, const uint32_t *sizes, size_t count,
+                              uint32_t leased_addr, uint8_t *verdicts )
+{
+  size_t valid = 0;
+
+  for ( size_t i = 0; i < count; i ++ ) {
+
+    const uint8_t *p = pkts[i];
+    uint32_t size = sizes[i];
+    uint8_t verdict;
+
+    if ( size < IPV4_HDR_MIN ) {
+      verdicts[i] = DAP_STREAM_CH_VPN_REJECT_TRUNCATED;
+      continue;
+    }
+
+    uint32_t ihl = (uint32_t)( p[0] & 0x0f ) * 4;
+    uint32_t tot_len = (uint32_t)( (p[2] << 8) | p[3] );
+    uint32_t saddr;
+
+    memcpy( &saddr, p + 12, sizeof(saddr) );
+
+    // Branch free chain, the earliest failed check is reported
+    verdict = (uint8_t)( saddr != leased_addr ? DAP_STREAM_CH_VPN_REJECT_SADDR : DAP_STREAM_CH_VPN_REJECT_NONE );
+    verdict = (uint8_t)( tot_len != size ? DAP_STREAM_CH_VPN_REJECT_LENGTH : verdict );
+    verdict = (uint8_t)( ihl < IPV4_HDR_MIN || ihl > size ? DAP_STREAM_CH_VPN_REJECT_IHL : verdict );
+    verdict = (uint8_t)( (p[0] >> 4) != 4 ? DAP_STREAM_CH_VPN_REJECT_VERSION : verdict );
+
+    verdicts[i] = verdict;
+    valid += ( verdict == DAP_STREAM_CH_VPN_REJECT_NONE );
+  }
+
+  return valid;
+}
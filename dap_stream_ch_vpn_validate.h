@@ -0,0 +1,32 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STREAM_SF_VALIDATE_H_
+#define _STREAM_SF_VALIDATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dap_stream_ch_vpn.h"
+
+size_t vpn_ip_validate_batch( const uint8_t *const *pkts, const uint32_t *sizes, size_t count,
+                              uint32_t leased_addr, uint8_t *verdicts );
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ Copyright (c) 2017-2019 (c) Project "DeM Labs Inc" https://github.com/demlabsinc
+  All rights reserved.
+
+ This file is part of DAP (Deus Applications Prototypes) the open source project
+
+    DAP (Deus Applicaions Prototypes) is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    DAP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with any DAP based project.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Takes the packets out of the capture ring of dap_stream_ch_vpn_capture_start() and writes them as a pcap
+ * file, "-w - | wireshark -k -i -" works, or as text lines. Needs nothing of libdap, builds on its own:
+ *
+ *   cc -I.. dap_stream_ch_vpn_capture_reader.c -o dap_stream_ch_vpn_capture_reader -lrt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define VPN_CAPTURE_READER
+#include "dap_stream_ch_vpn_capture.h"
+
+#define READER_POLL_NS  1000000 // Empty ring is looked at again in 1 ms
+
+static const char *s_point_names[ DAP_STREAM_CH_VPN_CAPTURE_POINTS ] = {
+  "vpn_send", "reject", "up_drop", "tun_in", "down_drop", "proxy_out", "proxy_in"
+};
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void reader_signal( int sig )
+{
+  (void)sig;
+  s_stop = 1;
+}
+
+static int reader_points_parse( char *str, uint32_t *points )
+{
+  for ( char *tok = strtok(str, ","); tok; tok = strtok(NULL, ",") ) {
+    uint32_t i;
+
+    for ( i = 0; i < DAP_STREAM_CH_VPN_CAPTURE_POINTS && strcmp(tok, s_point_names[i]); i ++ )
+      ;
+
+    if ( i == DAP_STREAM_CH_VPN_CAPTURE_POINTS )
+      return -1;
+
+    *points |= 1u << i;
+  }
+
+  return 0;
+}
+
+static void reader_text( FILE *out, const vpn_capture_rec_t *rec )
+{
+  char src[ INET_ADDRSTRLEN ] = "-", dst[ INET_ADDRSTRLEN ] = "-", addr[ INET_ADDRSTRLEN ] = "-";
+  const uint8_t *ip = rec->data;
+  uint8_t proto = 0;
+
+  if ( rec->pcap.caplen >= 20 && (ip[0] >> 4) == 4 ) {
+    inet_ntop( AF_INET, ip + 12, src, sizeof(src) );
+    inet_ntop( AF_INET, ip + 16, dst, sizeof(dst) );
+    proto = ip[ 9 ];
+  }
+
+  if ( rec->addr )
+    inet_ntop( AF_INET, &rec->addr, addr, sizeof(addr) );
+
+  fprintf( out, "%u.%09u %-9s reason %u client %s %s > %s proto %u len %u\n", rec->pcap.ts_sec, rec->pcap.ts_nsec,
+           rec->point < DAP_STREAM_CH_VPN_CAPTURE_POINTS ? s_point_names[rec->point] : "?", rec->reason,
+           addr, src, dst, proto, rec->pcap.len );
+}
+
+static void reader_usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s [-n shm_name] [-w file] [-p points] [-a addr] [-c count] [-t]\n"
+                   "  -n  shared memory object, %s by default\n"
+                   "  -w  pcap output, stdout by default\n"
+                   "  -p  comma separated points of", name, VPN_CAPTURE_SHM_NAME );
+
+  for ( uint32_t i = 0; i < DAP_STREAM_CH_VPN_CAPTURE_POINTS; i ++ )
+    fprintf( stderr, " %s", s_point_names[i] );
+
+  fprintf( stderr, ", all of them by default\n"
+                   "  -a  lease address of the client, all of them by default\n"
+                   "  -c  quit after that many packets\n"
+                   "  -t  text lines instead of pcap\n" );
+}
+
+int main( int argc, char **argv )
+{
+  const char *name = VPN_CAPTURE_SHM_NAME, *out_path = NULL;
+  uint32_t points = 0, addr = 0;
+  uint64_t count = 0, written = 0;
+  bool text = false;
+  FILE *out = stdout;
+  struct in_addr in;
+  struct stat st;
+  vpn_capture_ring_t *ring;
+  int opt, fd;
+
+  while ( (opt = getopt(argc, argv, "n:w:p:a:c:th")) != -1 ) {
+    switch ( opt ) {
+      case 'n': name = optarg; break;
+      case 'w': out_path = strcmp( optarg, "-" ) ? optarg : NULL; break;
+      case 'p':
+        if ( reader_points_parse(optarg, &points) ) {
+          fprintf( stderr, "Bad capture points %s\n", optarg );
+          return 1;
+        }
+      break;
+      case 'a':
+        if ( !inet_aton(optarg, &in) ) {
+          fprintf( stderr, "Bad address %s\n", optarg );
+          return 1;
+        }
+        addr = in.s_addr;
+      break;
+      case 'c': count = strtoull( optarg, NULL, 10 ); break;
+      case 't': text = true; break;
+      default:
+        reader_usage( argv[0] );
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if ( optind != argc ) {
+    reader_usage( argv[0] );
+    return 1;
+  }
+
+  errno = 0;
+
+  if ( (fd = shm_open(name, O_RDWR, 0)) < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(vpn_capture_ring_t) ||
+       (ring = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+    fprintf( stderr, "Can't open the capture ring %s: %s\n", name, errno ? strerror(errno) : "too short" );
+    return 1;
+  }
+
+  close( fd );
+
+  // Magic is written last by the writer
+  uint32_t magic = ring->magic;
+  atomic_thread_fence( memory_order_acquire );
+
+  if ( magic != VPN_CAPTURE_MAGIC || ring->version != VPN_CAPTURE_VERSION || ring->size > (uint64_t)st.st_size - sizeof(vpn_capture_ring_t) ) {
+    fprintf( stderr, "%s is not a capture ring of version %u\n", name, VPN_CAPTURE_VERSION );
+    return 1;
+  }
+
+  if ( out_path && !(out = fopen(out_path, "w")) ) {
+    fprintf( stderr, "Can't open %s: %s\n", out_path, strerror(errno) );
+    return 1;
+  }
+
+  signal( SIGINT, reader_signal );
+  signal( SIGTERM, reader_signal );
+  signal( SIGPIPE, reader_signal );
+
+  if ( !text )
+    fwrite( &ring->pcap, sizeof(ring->pcap), 1, out );
+
+  uint64_t size = ring->size, mask = size - 1;
+  uint64_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+
+  while ( !s_stop && (!count || written < count) ) {
+    // Closed flag goes first: what's published before it is drained on the last pass
+    bool closed = atomic_load_explicit( &ring->closed, memory_order_acquire );
+    uint64_t head = atomic_load_explicit( &ring->head, memory_order_acquire );
+
+    if ( head == tail ) {
+      if ( closed )
+        break;
+
+      nanosleep( &(struct timespec){ 0, READER_POLL_NS }, NULL );
+      continue;
+    }
+
+    while ( tail != head && (!count || written < count) ) {
+      uint64_t off = tail & mask;
+
+      // Too short for a record, the writer skipped it
+      if ( size - off < sizeof(vpn_capture_rec_t) ) {
+        tail += size - off;
+        continue;
+      }
+
+      const vpn_capture_rec_t *rec = (const vpn_capture_rec_t *)( ring->data + off );
+
+      if ( rec->rec_len < sizeof(vpn_capture_rec_t) || rec->rec_len > size - off ) {
+        fprintf( stderr, "Capture ring is corrupted at %llu\n", (unsigned long long)tail );
+        s_stop = 1;
+        break;
+      }
+
+      if ( rec->point != VPN_CAPTURE_PAD && (!points || (points & (1u << rec->point))) &&
+           (!addr || rec->addr == addr) ) {
+        if ( text )
+          reader_text( out, rec );
+        else
+          fwrite( &rec->pcap, sizeof(rec->pcap) + rec->pcap.caplen, 1, out );
+
+        written ++;
+      }
+
+      tail += rec->rec_len;
+    }
+
+    atomic_store_explicit( &ring->tail, tail, memory_order_release );
+    fflush( out );
+  }
+
+  fflush( out );
+
+  if ( out != stdout )
+    fclose( out );
+
+  fprintf( stderr, "%llu packets\n", (unsigned long long)written );
+
+  munmap( ring, (size_t)st.st_size );
+
+  return 0;
+}